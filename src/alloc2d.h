@@ -2,7 +2,35 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#pragma once
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+// alignment (in bytes) of arrays meant to be streamed through vector loops
+#define ALLOC_ALIGN 64
+// round a number of doubles up so that each array fills whole cache lines
+#define ALIGNED_DOUBLES(n) ((((n)+7)/8)*8)
+
+inline static void* mallocAligned(size_t s) {
+  void* p = nullptr;
+  if (posix_memalign(&p, ALLOC_ALIGN, s)) {
+    fprintf(stderr, "unable to allocate %d aligned bytes\n", (int)s);
+    abort();
+  }
+  return p;
+}
+
+// grows an aligned array, keeping the first oldS bytes
+inline static void* reallocAligned(void* old, size_t oldS, size_t s) {
+  void* p = mallocAligned(s);
+  if (old) {
+    memcpy(p, old, oldS<s ? oldS : s);
+    free(old);
+  }
+  return p;
+}
 
 inline static void** malloc2D(int rows, int cols, size_t s) {
   void* raw = malloc(s*rows*cols);
@@ -35,7 +35,7 @@ double** AverageRatio::getRatioStatistics() {
   getBlockCovariance();
   for (int i=0; i<nData; i++) {
     ratioStats[i][AVG_CUR] = mostRecent[i]/mostRecent[nData-1];
-    ratioStats[i][AVG_AVG] = blockSum[i] / blockSum[nData-1];
+    ratioStats[i][AVG_AVG] = (blockSum[i] + extraSum[i]) / (blockSum[nData-1] + extraSum[nData-1]);
     if (blockCount == 1) {
       for (int i=0; i<nData; i++) {
         ratioStats[i][AVG_ERR] = NAN;
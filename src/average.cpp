@@ -9,7 +9,7 @@
 #include "alloc2d.h"
 
 Average::Average(int n, long bs, long mBC, bool doCov) : nData(n), defaultBlockSize(bs), blockSize(bs), blockCount(0),
-                               maxBlockCount(mBC), blockCountdown(bs), doCovariance(doCov) {
+                               maxBlockCount(mBC), blockCountdown(bs), doCovariance(doCov), extraCount(0) {
   unset();
   if (nData>0) reset();
 }
@@ -24,6 +24,7 @@ void Average::dispose() {
   free(blockSum);
   free(blockSum2);
   free(correlationSum);
+  free(extraSum);
   if (maxBlockCount>0) free2D((void**)blockSums);
   else {
     free(prevBlockSum);
@@ -43,6 +44,7 @@ void Average::unset() {
   blockSum = nullptr;
   blockSum2 = nullptr;
   correlationSum = nullptr;
+  extraSum = nullptr;
   blockSums = nullptr;
   stats = nullptr;
   blockCovariance = nullptr;
@@ -81,6 +83,8 @@ void Average::reset() {
   blockCount = 0;
   blockSize = defaultBlockSize;
   blockCountdown = blockSize;
+  extraCount = 0;
+  segmentStart.assign(1, 0);
   if (nData==0) {
     // we can't allocate 0-size arrays, so just leave them as nullptr
     // at some point nData will be positive, reset will be called again
@@ -92,8 +96,9 @@ void Average::reset() {
   blockSum = (double*)realloc(blockSum, nData*sizeof(double));
   blockSum2 = (double*)realloc(blockSum2, nData*sizeof(double));
   correlationSum = (double*)realloc(correlationSum, nData*sizeof(double));
+  extraSum = (double*)realloc(extraSum, nData*sizeof(double));
   for (int i=0; i<nData; i++) {
-    currentBlockSum[i] = blockSum[i] = blockSum2[i] = correlationSum[i] = 0;
+    currentBlockSum[i] = blockSum[i] = blockSum2[i] = correlationSum[i] = extraSum[i] = 0;
   }
   if (maxBlockCount>0) {
     if (maxBlockCount%2==1 || maxBlockCount < 4) {
@@ -124,42 +129,115 @@ void Average::addData(double *x) {
     currentBlockSum[i] += x[i];
   }
   if (--blockCountdown == 0) {
-    if (doCovariance) {
-      double blockSizeSq = ((double)blockSize)*((double)blockSize);
-      for (int i=0; i<nData; i++) {
-        for (int j=0; j<=i; j++) {
-          double ijx = currentBlockSum[i]*currentBlockSum[j]/blockSizeSq;
-          blockCovSum[i][j] += ijx;
-        }
-      }
+    processBlock(currentBlockSum);
+    for (int i=0; i<nData; i++) currentBlockSum[i] = 0;
+    blockCountdown = blockSize;
+
+    if (blockCount == maxBlockCount) {
+      collapseBlocks();
     }
+  }
+  // we don't push our data
+}
+
+// adds a completed block, given the sum of its data.  sums is overwritten.
+void Average::processBlock(double *sums) {
+  if (doCovariance) {
+    double blockSizeSq = ((double)blockSize)*((double)blockSize);
     for (int i=0; i<nData; i++) {
-      blockSum[i] += currentBlockSum[i];
-      currentBlockSum[i] /= blockSize;
-      if (maxBlockCount > 0) {
-        if (blockCount>0) correlationSum[i] += blockSums[i][blockCount-1] * currentBlockSum[i];
-        blockSums[i][blockCount] = currentBlockSum[i];
-      }
-      else {
-        if (blockCount>0) correlationSum[i] += prevBlockSum[i] * currentBlockSum[i];
-        else firstBlockSum[i] = currentBlockSum[i];
-        prevBlockSum[i] = currentBlockSum[i];
+      for (int j=0; j<=i; j++) {
+        double ijx = sums[i]*sums[j]/blockSizeSq;
+        blockCovSum[i][j] += ijx;
       }
-      blockSum2[i] += currentBlockSum[i] * currentBlockSum[i];
-      currentBlockSum[i] = 0;
     }
-    blockCount++;
-    blockCountdown = blockSize;
+  }
+  for (int i=0; i<nData; i++) {
+    blockSum[i] += sums[i];
+    sums[i] /= blockSize;
+    if (maxBlockCount > 0) {
+      if (blockCount>segmentStart.back()) correlationSum[i] += blockSums[i][blockCount-1] * sums[i];
+      blockSums[i][blockCount] = sums[i];
+    }
+    else {
+      if (blockCount>0) correlationSum[i] += prevBlockSum[i] * sums[i];
+      else firstBlockSum[i] = sums[i];
+      prevBlockSum[i] = sums[i];
+    }
+    blockSum2[i] += sums[i] * sums[i];
+  }
+  blockCount++;
+}
 
+void Average::mergeBlocks(Average &other) {
+  if (other.nData != nData || other.maxBlockCount <= 0 || maxBlockCount <= 0) {
+    fprintf(stderr, "can only merge blocks between Averages with the same data that keep their blocks\n");
+    abort();
+  }
+  if (other.blockSize > blockSize) {
+    if (blockCount > 0) {
+      fprintf(stderr, "can't merge blocks larger than ours\n");
+      abort();
+    }
+    blockSize = blockCountdown = other.blockSize;
+  }
+  if (blockSize % other.blockSize != 0) {
+    fprintf(stderr, "block sizes %ld and %ld are incompatible\n", blockSize, other.blockSize);
+    abort();
+  }
+  if (blockCount > segmentStart.back()) segmentStart.push_back(blockCount);
+  double sums[nData];
+  // our block size can grow as we go, if we collapse
+  long j = 0;
+  for (long m=blockSize/other.blockSize; j+m<=other.blockCount; j+=m, m=blockSize/other.blockSize) {
+    for (int i=0; i<nData; i++) {
+      sums[i] = 0;
+      for (long k=j; k<j+m; k++) sums[i] += other.blockSums[i][k];
+      sums[i] *= other.blockSize;
+    }
+    processBlock(sums);
     if (blockCount == maxBlockCount) {
       collapseBlocks();
     }
   }
-  // we don't push our data
+  for (int i=0; i<nData; i++) {
+    double x = other.extraSum[i] + other.currentBlockSum[i];
+    for (long k=j; k<other.blockCount; k++) x += other.blockSums[i][k]*other.blockSize;
+    extraSum[i] += x;
+    mostRecent[i] = other.mostRecent[i];
+  }
+  extraCount += other.extraCount + (other.blockSize - other.blockCountdown) + (other.blockCount - j)*other.blockSize;
 }
 
+// pairs of blocks within each segment become one block.  an odd block at
+// the end of a segment can't be paired; it still counts toward the averages.
 void Average::collapseBlocks() {
-  blockCount /= 2;
+  const long numSegments = segmentStart.size();
+  vector<long> newStart;
+  long newCount = 0;
+  for (long s=0; s<numSegments; s++) {
+    long j0 = segmentStart[s];
+    long j1 = s+1<numSegments ? segmentStart[s+1] : blockCount;
+    if ((j1-j0)%2 == 1) {
+      j1--;
+      for (int i=0; i<nData; i++) {
+        double x = blockSums[i][j1]*blockSize;
+        blockSum[i] -= x;
+        extraSum[i] += x;
+      }
+      extraCount += blockSize;
+    }
+    if (j1 == j0) continue;
+    newStart.push_back(newCount);
+    for (long j=j0; j<j1; j+=2) {
+      for (int i=0; i<nData; i++) {
+        blockSums[i][newCount] = (blockSums[i][j] + blockSums[i][j+1]) / 2;
+      }
+      newCount++;
+    }
+  }
+  if (newStart.empty()) newStart.push_back(0);
+  segmentStart = newStart;
+  blockCount = newCount;
   for (int i=0; i<nData; i++) {
     blockSum2[i] = 0;
     correlationSum[i] = 0;
@@ -169,10 +247,11 @@ void Average::collapseBlocks() {
         blockCovSum[i][k] = 0;
       }
     }
-    for (int j=0; j<blockCount; j++) {
-      blockSums[i][j] = (blockSums[i][2*j] + blockSums[i][2*j+1]) / 2;
+    long s = 0;
+    for (long j=0; j<blockCount; j++) {
+      if (s+1 < (long)segmentStart.size() && j == segmentStart[s+1]) s++;
       blockSum2[i] += blockSums[i][j] * blockSums[i][j];
-      if (j>0) {
+      if (j>segmentStart[s]) {
         correlationSum[i] += blockSums[i][j-1] * blockSums[i][j];
       }
       if (doCovariance) {
@@ -181,7 +260,7 @@ void Average::collapseBlocks() {
         }
       }
     }
-    for (int j=blockCount; j<maxBlockCount; j++) {
+    for (long j=blockCount; j<maxBlockCount; j++) {
       blockSums[i][j] = 0;
     }
   }
@@ -197,16 +276,21 @@ double** Average::getStatistics() {
     }
     return stats;
   }
+  const double blockSamples = blockSize*blockCount;
+  const long numSegments = segmentStart.size();
   for (int i=0; i<nData; i++) {
     stats[i][AVG_CUR] = mostRecent[i];
-    stats[i][AVG_AVG] = blockSum[i] / (blockSize*blockCount);
+    // the block statistics use only the blocks; samples outside of them
+    // still count toward the average (and shrink the error)
+    const double blockAvg = blockSum[i] / blockSamples;
+    stats[i][AVG_AVG] = (blockSum[i] + extraSum[i]) / (blockSamples + extraCount);
     if (blockCount == 1) {
       for (int i=0; i<nData; i++) {
         stats[i][AVG_ERR] = stats[i][AVG_ACOR] = NAN;
       }
       continue;
     }
-    stats[i][AVG_ERR] = blockSum2[i] / blockCount - stats[i][AVG_AVG]*stats[i][AVG_AVG];
+    stats[i][AVG_ERR] = blockSum2[i] / blockCount - blockAvg*blockAvg;
     if (stats[i][AVG_ERR]<0) stats[i][AVG_ERR] = 0;
     if (stats[i][AVG_ERR] == 0) {
       stats[i][AVG_ACOR] = 0;
@@ -214,14 +298,20 @@ double** Average::getStatistics() {
     else {
       double bc;
       if (maxBlockCount>0) {
-        bc = (((2 * blockSum[i] / blockSize - blockSums[i][0] - blockSums[i][blockCount-1]) * stats[i][AVG_AVG] - correlationSum[i]) / (1-blockCount) + stats[i][AVG_AVG]*stats[i][AVG_AVG]) / stats[i][AVG_ERR];
+        // neighboring blocks within each segment
+        double ends = 0;
+        for (long s=0; s<numSegments; s++) {
+          long j1 = s+1<numSegments ? segmentStart[s+1] : blockCount;
+          ends += blockSums[i][segmentStart[s]] + blockSums[i][j1-1];
+        }
+        bc = (((2 * blockSum[i] / blockSize - ends) * blockAvg - correlationSum[i]) / (numSegments-blockCount) + blockAvg*blockAvg) / stats[i][AVG_ERR];
       }
       else {
-        bc = (((2 * blockSum[i] / blockSize - firstBlockSum[i] - prevBlockSum[i]) * stats[i][AVG_AVG] - correlationSum[i]) / (1-blockCount) + stats[i][AVG_AVG]*stats[i][AVG_AVG]) / stats[i][AVG_ERR];
+        bc = (((2 * blockSum[i] / blockSize - firstBlockSum[i] - prevBlockSum[i]) * blockAvg - correlationSum[i]) / (1-blockCount) + blockAvg*blockAvg) / stats[i][AVG_ERR];
       }
       stats[i][AVG_ACOR] = (isnan(bc) || bc <= -1 || bc >= 1) ? 0 : bc;
     }
-    stats[i][AVG_ERR] = sqrt(stats[i][AVG_ERR]/(blockCount-1));
+    stats[i][AVG_ERR] = sqrt(stats[i][AVG_ERR]/(blockCount-1) * blockSamples/(blockSamples + extraCount));
   }
   return stats;
 }
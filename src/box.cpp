@@ -9,8 +9,11 @@
 #include "alloc2d.h"
 #include "box.h"
 
-Box::Box(SpeciesList &sl) : positions(nullptr), velocities(nullptr), knownNumSpecies(sl.size()), numAtomsBySpecies(nullptr), maxNumAtomsBySpecies(nullptr), speciesNumAtoms(nullptr), numMoleculesBySpecies(nullptr), maxNumMoleculesBySpecies(nullptr), firstAtom(nullptr), atomTypes(nullptr), speciesList(sl) {
-  for (int i=0; i<3; i++) boxSize[i] = 0;
+Box::Box(SpeciesList &sl) : positions(nullptr), velocities(nullptr), soa(false), soaCapacity(0), knownNumSpecies(sl.size()), numAtoms(0), maxNumAtoms(0), numAtomsBySpecies(nullptr), maxNumAtomsBySpecies(nullptr), speciesNumAtoms(nullptr), numMoleculesBySpecies(nullptr), maxNumMoleculesBySpecies(nullptr), firstAtom(nullptr), atomTypes(nullptr), allAtomPositions(nullptr), allAtomVelocities(nullptr), allAtomTypes(nullptr), allAtomSpecies(nullptr), allAtomMolecule(nullptr), allAtomFirstAtom(nullptr), atomIDs(nullptr), speciesList(sl) {
+  for (int i=0; i<3; i++) {
+    boxSize[i] = 0;
+    soaPositions[i] = soaVelocities[i] = nullptr;
+  }
 
   int ss = knownNumSpecies;
   numAtomsBySpecies = new int[ss];
@@ -25,7 +28,7 @@ Box::Box(SpeciesList &sl) : positions(nullptr), velocities(nullptr), knownNumSpe
   for (int i=0; i<ss; i++) {
     positions[i] = nullptr;
     if (velocities) velocities[i] = nullptr;
-    numMoleculesBySpecies[i] = numAtomsBySpecies[i] = maxNumMoleculesBySpecies[i] = 0;
+    numMoleculesBySpecies[i] = numAtomsBySpecies[i] = maxNumMoleculesBySpecies[i] = maxNumAtomsBySpecies[i] = 0;
     atomTypes[i] = firstAtom[i] = nullptr;
     speciesNumAtoms[i] = speciesList.get(i)->getNumAtoms();
   }
@@ -33,6 +36,17 @@ Box::Box(SpeciesList &sl) : positions(nullptr), velocities(nullptr), knownNumSpe
 }
 
 Box::~Box() {
+  for (int k=0; k<3; k++) {
+    free(soaPositions[k]);
+    free(soaVelocities[k]);
+  }
+  free(allAtomPositions);
+  free(allAtomVelocities);
+  free(allAtomTypes);
+  free(allAtomSpecies);
+  free(allAtomMolecule);
+  free(allAtomFirstAtom);
+  free(atomIDs);
   if (knownNumSpecies==0) return;
   delete[] numAtomsBySpecies;
   delete[] numMoleculesBySpecies;
@@ -128,7 +142,8 @@ void Box::setNumMolecules(int iSpecies, int n) {
   Species* s = speciesList.get(iSpecies);
   int sna = s->getNumAtoms();
   int na = n*sna;
-  if (n>maxNumMoleculesBySpecies[iSpecies]) {
+  bool reallocated = n>maxNumMoleculesBySpecies[iSpecies];
+  if (reallocated) {
     if (velocities) velocities[iSpecies] = (double**)realloc2D((void**)velocities[iSpecies], na, 3, sizeof(double));
     positions[iSpecies] = (double**)realloc2D((void**)positions[iSpecies], na, 3, sizeof(double));
     firstAtom[iSpecies] = (int*)realloc(firstAtom[iSpecies], n*sizeof(int));
@@ -142,16 +157,20 @@ void Box::setNumMolecules(int iSpecies, int n) {
     maxNumMoleculesBySpecies[iSpecies] = n;
     maxNumAtomsBySpecies[iSpecies] = na;
   }
-  int fa = 0;
-  for (int jSpecies=0; jSpecies<knownNumSpecies; jSpecies++) {
-    if (jSpecies<iSpecies) {
-      fa += numAtomsBySpecies[jSpecies];
-      continue;
-    }
-    int iStart = jSpecies==iSpecies ? numMoleculesBySpecies[iSpecies] : 0;
-    fa += iStart;
-    for (int i=iStart; i<n; i++) {
-      firstAtom[iSpecies][i] = fa + i*sna;
+  int oldNumMolecules = numMoleculesBySpecies[iSpecies];
+  if (n != oldNumMolecules) {
+    // atoms of later species shift, so their first atoms shift as well
+    int fa = 0;
+    for (int jSpecies=0; jSpecies<knownNumSpecies; jSpecies++) {
+      int jNumMolecules = jSpecies==iSpecies ? n : numMoleculesBySpecies[jSpecies];
+      int jna = speciesNumAtoms[jSpecies];
+      if (jSpecies>=iSpecies) {
+        int iStart = jSpecies==iSpecies ? oldNumMolecules : 0;
+        for (int i=iStart; i<jNumMolecules; i++) {
+          firstAtom[jSpecies][i] = fa + i*jna;
+        }
+      }
+      fa += jNumMolecules*jna;
     }
   }
   for (int iMolecule=numMoleculesBySpecies[iSpecies]; iMolecule<n; iMolecule++) {
@@ -162,22 +181,44 @@ void Box::setNumMolecules(int iSpecies, int n) {
       rj[0] = jPos[0]; rj[1] = jPos[1]; rj[2] = jPos[2];
     }
   }
+  int oldNumAtoms = numAtomsBySpecies[iSpecies];
+  if (na != oldNumAtoms) {
+    free(atomIDs);
+    atomIDs = nullptr;
+  }
   numMoleculesBySpecies[iSpecies] = n;
   numAtomsBySpecies[iSpecies] = na;
+  numAtoms += na - oldNumAtoms;
+  // refresh the per-atom tables from the first atom that could have changed
+  updateAtomTables(iSpecies, reallocated ? 0 : (oldNumAtoms<na ? oldNumAtoms : na));
 }
 
-double* Box::getAtomVelocity(int i) {
-  int idx = i, iSpecies = 0;
-  for ( ; iSpecies<knownNumSpecies-1 && idx >= maxNumAtomsBySpecies[iSpecies]; iSpecies++) {
-    idx -= maxNumAtomsBySpecies[iSpecies];
+void Box::updateAtomTables(int iSpecies, int iStartAtom) {
+  if (numAtoms > maxNumAtoms) {
+    maxNumAtoms = numAtoms;
+    allAtomPositions = (double**)realloc(allAtomPositions, maxNumAtoms*sizeof(double*));
+    allAtomVelocities = (double**)realloc(allAtomVelocities, maxNumAtoms*sizeof(double*));
+    allAtomTypes = (int*)realloc(allAtomTypes, maxNumAtoms*sizeof(int));
+    allAtomSpecies = (int*)realloc(allAtomSpecies, maxNumAtoms*sizeof(int));
+    allAtomMolecule = (int*)realloc(allAtomMolecule, maxNumAtoms*sizeof(int));
+    allAtomFirstAtom = (int*)realloc(allAtomFirstAtom, maxNumAtoms*sizeof(int));
   }
-#ifdef DEBUG
-  if (idx>=maxNumAtomsBySpecies[iSpecies]) {
-    printf("getAtomVecloities oops i %d is more atoms than I have\n", i);
-    abort();
+  int fa = 0;
+  for (int jSpecies=0; jSpecies<iSpecies; jSpecies++) fa += numAtomsBySpecies[jSpecies];
+  for (int jSpecies=iSpecies; jSpecies<knownNumSpecies; jSpecies++) {
+    int jna = speciesNumAtoms[jSpecies];
+    for (int i=(jSpecies==iSpecies ? iStartAtom : 0); i<numAtomsBySpecies[jSpecies]; i++) {
+      int iAtom = fa + i;
+      int iMolecule = i/jna;
+      allAtomPositions[iAtom] = positions[jSpecies][i];
+      allAtomVelocities[iAtom] = velocities ? velocities[jSpecies][i] : nullptr;
+      allAtomTypes[iAtom] = atomTypes[jSpecies][i];
+      allAtomSpecies[iAtom] = jSpecies;
+      allAtomMolecule[iAtom] = iMolecule;
+      allAtomFirstAtom[iAtom] = fa + iMolecule*jna;
+    }
+    fa += numAtomsBySpecies[jSpecies];
   }
-#endif
-  return velocities[0][i];
 }
 
 int Box::getGlobalMoleculeIndex(int iSpecies, int iMoleculeInSpecies) {
@@ -194,21 +235,6 @@ int Box::getGlobalMoleculeIndex(int iSpecies, int iMoleculeInSpecies) {
   return t + iMoleculeInSpecies;
 }
 
-void Box::getMoleculeInfoAtom(int iAtom, int &iMolecule, int &iSpecies, int &iFirstAtom) {
-#ifdef DEBUG
-  if (iAtom>=getNumAtoms()) {
-    printf("getMoleculeInfoAtom oops i %d is more atoms than I have\n", iAtom);
-    abort();
-  }
-#endif
-  iSpecies = 0;
-  for ( ; iSpecies<knownNumSpecies-1 && iAtom >= numAtomsBySpecies[iSpecies]; iSpecies++) {
-    iAtom -= numAtomsBySpecies[iSpecies];
-  }
-  iMolecule = iAtom/speciesNumAtoms[iSpecies];
-  iFirstAtom = firstAtom[iSpecies][iMolecule];
-}
-
 void Box::getMoleculeInfo(int iMolecule, int &iSpecies, int &iMoleculeInSpecies, int &fa, int &la) {
   iMoleculeInSpecies = iMolecule;
   iSpecies = 0;
@@ -237,6 +263,11 @@ void Box::nearestImage(double *dr) {
   }
 }
 
+void Box::nearestImage(const double *dr, double *drOut) {
+  for (int i=0; i<3; i++) drOut[i] = dr[i];
+  nearestImage(drOut);
+}
+
 const bool* Box::getPeriodic() {
   return periodic;
 }
@@ -262,5 +293,103 @@ void Box::enableVelocities() {
     int na = maxNumMoleculesBySpecies[i]*speciesList.get(i)->getNumAtoms();
     velocities[i] = (double**)malloc2D(na, 3, sizeof(double));
   }
+  updateAtomTables(0, 0);
 }
 
+
+void Box::enableSoA() {
+  soa = true;
+  packSoA();
+}
+
+void Box::packSoA() {
+  if (!soa) return;
+  int n = getNumAtoms();
+  if (n > soaCapacity || (velocities && !soaVelocities[0])) {
+    // pad so that vector loops can run past the last atom
+    int padded = ALIGNED_DOUBLES(n);
+    for (int k=0; k<3; k++) {
+      free(soaPositions[k]);
+      soaPositions[k] = (double*)mallocAligned(padded*sizeof(double));
+      for (int i=n; i<padded; i++) soaPositions[k][i] = 0;
+      if (velocities) {
+        free(soaVelocities[k]);
+        soaVelocities[k] = (double*)mallocAligned(padded*sizeof(double));
+        for (int i=n; i<padded; i++) soaVelocities[k][i] = 0;
+      }
+    }
+    soaCapacity = padded;
+  }
+  for (int i=0; i<n; i++) {
+    double* ri = getAtomPosition(i);
+    soaPositions[0][i] = ri[0];
+    soaPositions[1][i] = ri[1];
+    soaPositions[2][i] = ri[2];
+  }
+  if (!velocities) return;
+  for (int i=0; i<n; i++) {
+    double* vi = getAtomVelocity(i);
+    soaVelocities[0][i] = vi[0];
+    soaVelocities[1][i] = vi[1];
+    soaVelocities[2][i] = vi[2];
+  }
+}
+
+void Box::unpackSoA() {
+  if (!soa) return;
+  int n = getNumAtoms();
+  for (int i=0; i<n; i++) {
+    double* ri = getAtomPosition(i);
+    ri[0] = soaPositions[0][i];
+    ri[1] = soaPositions[1][i];
+    ri[2] = soaPositions[2][i];
+  }
+  if (!velocities) return;
+  for (int i=0; i<n; i++) {
+    double* vi = getAtomVelocity(i);
+    vi[0] = soaVelocities[0][i];
+    vi[1] = soaVelocities[1][i];
+    vi[2] = soaVelocities[2][i];
+  }
+}
+
+void Box::permuteAtoms(const int* oldIndex) {
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    int jAtom = oldIndex[iAtom];
+    if (jAtom == iAtom) continue;
+    int iSpecies = allAtomSpecies[iAtom];
+    if (allAtomSpecies[jAtom] != iSpecies || speciesNumAtoms[iSpecies] != 1) {
+      fprintf(stderr, "can't move atom %d to %d\n", jAtom, iAtom);
+      abort();
+    }
+  }
+  if (!atomIDs) {
+    atomIDs = (int*)malloc(maxNumAtoms*sizeof(int));
+    for (int iAtom=0; iAtom<numAtoms; iAtom++) atomIDs[iAtom] = iAtom;
+  }
+  double** tmp = (double**)malloc2D(numAtoms, 3, sizeof(double));
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double* rj = allAtomPositions[oldIndex[iAtom]];
+    for (int k=0; k<3; k++) tmp[iAtom][k] = rj[k];
+  }
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double* ri = allAtomPositions[iAtom];
+    for (int k=0; k<3; k++) ri[k] = tmp[iAtom][k];
+  }
+  if (velocities) {
+    for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+      double* vj = allAtomVelocities[oldIndex[iAtom]];
+      for (int k=0; k<3; k++) tmp[iAtom][k] = vj[k];
+    }
+    for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+      double* vi = allAtomVelocities[iAtom];
+      for (int k=0; k<3; k++) vi[k] = tmp[iAtom][k];
+    }
+  }
+  free2D((void**)tmp);
+  int* ids = (int*)malloc(maxNumAtoms*sizeof(int));
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) ids[iAtom] = atomIDs[oldIndex[iAtom]];
+  free(atomIDs);
+  atomIDs = ids;
+  packSoA();
+}
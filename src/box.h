@@ -17,13 +17,25 @@ class Box {
     bool periodic[3];
 
     double ***positions, ***velocities;
+    // optional structure-of-arrays copy of coordinates and velocities,
+    // contiguous across species and 64-byte aligned
+    bool soa;
+    int soaCapacity;
+    double *soaPositions[3], *soaVelocities[3];
 
     const int knownNumSpecies;
+    int numAtoms, maxNumAtoms;
     int *numAtomsBySpecies, *maxNumAtomsBySpecies, *speciesNumAtoms;
     int *numMoleculesBySpecies, *maxNumMoleculesBySpecies;
     int **firstAtom, **moleculeIdx;
     int **atomTypes;
+    // flat tables indexed by global atom index
+    double **allAtomPositions, **allAtomVelocities;
+    int *allAtomTypes, *allAtomSpecies, *allAtomMolecule, *allAtomFirstAtom;
+    // original index of each atom once atoms have been permuted (else nullptr)
+    int *atomIDs;
     void boxSizeUpdated();
+    void updateAtomTables(int iSpecies, int iStartAtom);
 
     SpeciesList &speciesList;
 
@@ -39,49 +51,73 @@ class Box {
       return s;
     }
     inline int getNumMolecules(int iSpecies) { return numMoleculesBySpecies[iSpecies]; }
-    int getNumAtoms() {
-      int s = 0;
-      for (int i=0; i<knownNumSpecies; i++) s += numAtomsBySpecies[i];
-      return s;
-    }
+    int getNumAtoms() { return numAtoms; }
     double* getAtomPosition(int i) {
-      int idx = i, iSpecies = 0;
-      for ( ; iSpecies<knownNumSpecies-1 && idx >= maxNumAtomsBySpecies[iSpecies]; iSpecies++) {
-        idx -= maxNumAtomsBySpecies[iSpecies];
-      }
 #ifdef DEBUG
-      if (idx>=numAtomsBySpecies[iSpecies]) {
+      if (i>=numAtoms) {
         printf("getAtomPosition oops i %d is more atoms than I have\n", i);
         abort();
       }
 #endif
-      return positions[iSpecies][idx];
+      return allAtomPositions[i];
     }
     int getAtomType(int i) {
-      int idx = i, iSpecies = 0;
-      for ( ; iSpecies<knownNumSpecies-1 && idx >= maxNumAtomsBySpecies[iSpecies]; iSpecies++) {
-        idx -= maxNumAtomsBySpecies[iSpecies];
-      }
 #ifdef DEBUG
-      if (idx>=numAtomsBySpecies[iSpecies]) {
+      if (i>=numAtoms) {
         printf("gAT oops i %d is more atoms than I have\n", i);
         abort();
       }
 #endif
-      return atomTypes[iSpecies][idx];
+      return allAtomTypes[i];
     }
+    // types of all atoms, indexed by global atom index
+    const int* getAtomTypes() { return allAtomTypes; }
     int getFirstAtom(int iSpecies, int iMoleculeInSpecies) { return firstAtom[iSpecies][iMoleculeInSpecies]; }
     int getGlobalMoleculeIndex(int iSpecies, int iMoleculeInSpecies);
     void nearestImage(double *dr);
+    // nearest image of dr, returned in drOut
+    void nearestImage(const double *dr, double *drOut);
     void initCoordinates();
     void setBoxSize(double x, double y, double z);
     void setNumMolecules(int iSpecies, int numMolecules);
-    double* getAtomVelocity(int iAtom);
+    double* getAtomVelocity(int iAtom) {
+#ifdef DEBUG
+      if (iAtom>=numAtoms || !velocities) {
+        printf("getAtomVelocity oops i %d is more atoms than I have\n", iAtom);
+        abort();
+      }
+#endif
+      return allAtomVelocities[iAtom];
+    }
     void enableVelocities();
     void getAtomInfo(int iMolecule, int iSpecies);
     // gives species index, first and last atom indicies for molecule with global index iMolecule
     void getMoleculeInfo(int iMolecule, int &iSpecies, int &iMoleculeInSpecies, int &firstAtom, int &lastAtom);
-    void getMoleculeInfoAtom(int iAtom, int &iMolecule, int &iSpecies, int &firstAtom);
+    void getMoleculeInfoAtom(int iAtom, int &iMolecule, int &iSpecies, int &iFirstAtom) {
+#ifdef DEBUG
+      if (iAtom>=numAtoms) {
+        printf("getMoleculeInfoAtom oops i %d is more atoms than I have\n", iAtom);
+        abort();
+      }
+#endif
+      iMolecule = allAtomMolecule[iAtom];
+      iSpecies = allAtomSpecies[iAtom];
+      iFirstAtom = allAtomFirstAtom[iAtom];
+    }
     const bool* getPeriodic();
     void setPeriodic(const bool* newPeriodic);
+    // the per-atom arrays remain authoritative; the SoA arrays are refreshed
+    // by packSoA and copied back by unpackSoA
+    void enableSoA();
+    bool isSoA() {return soa;}
+    double** getPositionsSoA() {return soaPositions;}
+    double** getVelocitiesSoA() {return soaVelocities;}
+    void packSoA();
+    void unpackSoA();
+    // moves atom oldIndex[i] to index i.  only atoms of single-atom
+    // molecules can move, and only within their species.
+    void permuteAtoms(const int* oldIndex);
+    // index the atom had before any permutation.  inserting or removing
+    // molecules starts a new numbering.
+    int getAtomID(int iAtom) { return atomIDs ? atomIDs[iAtom] : iAtom; }
 };
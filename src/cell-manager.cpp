@@ -4,8 +4,9 @@
 
 #include "potential-master.h"
 #include "alloc2d.h"
+#include "thread-pool.h"
 
-CellManager::CellManager(const SpeciesList &sl, Box& b, int cRange) : box(b), speciesList(sl), cellRange(cRange), range(0), rawBoxOffsets(nullptr) {
+CellManager::CellManager(const SpeciesList &sl, Box& b, int cRange) : box(b), speciesList(sl), cellRange(cRange), range(0), rawBoxOffsets(nullptr), numRawBoxOffsets(0), zeroBoxOffset(0), halo(false) {
 }
 
 CellManager::~CellManager() {
@@ -63,9 +64,11 @@ void CellManager::init() {
     if (periodic[i]) numCells[i] += cellRange*2;
     totalCells *= numCells[i];
   }
-  cellLastAtom.resize(totalCells);
+  cellStart.resize(totalCells+1);
+  cellEnd.resize(totalCells);
   wrapMap.resize(totalCells);
   boxOffsets.resize(totalCells);
+  boxOffsetIndex.resize(totalCells);
 
   cellOffsets.resize(0);
   int dCell = 0;
@@ -130,6 +133,7 @@ void CellManager::init() {
         rawBoxOffsets[idx][0] = ix*bs[0];
         rawBoxOffsets[idx][1] = iy*bs[1];
         rawBoxOffsets[idx][2] = iz*bs[2];
+        if (ix==0 && iy==0 && iz==0) zeroBoxOffset = idx;
       }
     }
   }
@@ -146,14 +150,58 @@ void CellManager::init() {
         int iMap = i_cell(ix, iy, iz);
         int dCell = i_cell(x2, y2, z2);
         wrapMap[iMap] = dCell;
-        boxOffsets[iMap] = rawBoxOffsets[(xbo+xboRange)*ny*nz+(ybo+yboRange)*nz+(zbo+zboRange)];
+        boxOffsetIndex[iMap] = (xbo+xboRange)*ny*nz+(ybo+yboRange)*nz+(zbo+zboRange);
+        boxOffsets[iMap] = rawBoxOffsets[boxOffsetIndex[iMap]];
       }
     }
   }
 
+  // Z-order of the cells, interleaving the bits of the cell indices
+  vector<pair<uint64_t,int> > keys(totalCells);
+  for (int ix=0; ix<numCells[0]; ix++) {
+    for (int iy=0; iy<numCells[1]; iy++) {
+      for (int iz=0; iz<numCells[2]; iz++) {
+        uint64_t key = 0;
+        for (int b=0; b<21; b++) {
+          key |= ((uint64_t)((ix>>b)&1)) << (3*b+2);
+          key |= ((uint64_t)((iy>>b)&1)) << (3*b+1);
+          key |= ((uint64_t)((iz>>b)&1)) << (3*b);
+        }
+        int iCell = i_cell(ix, iy, iz);
+        keys[iCell] = make_pair(key, iCell);
+      }
+    }
+  }
+  sort(keys.begin(), keys.end());
+  cellOrder.resize(totalCells);
+  for (int i=0; i<totalCells; i++) cellOrder[i] = keys[i].second;
+
   assignCells();
 }
 
+void CellManager::mortonOrder(vector<int> &oldIndex) {
+  const int numAtoms = box.getNumAtoms();
+  oldIndex.resize(numAtoms);
+  int iStart = 0;
+  for (int iSpecies=0; iSpecies<speciesList.size(); iSpecies++) {
+    const int speciesAtoms = speciesList.get(iSpecies)->getNumAtoms();
+    const int iEnd = iStart + box.getNumMolecules(iSpecies)*speciesAtoms;
+    if (speciesAtoms > 1) {
+      for (int iAtom=iStart; iAtom<iEnd; iAtom++) oldIndex[iAtom] = iAtom;
+    }
+    else {
+      int i = iStart;
+      for (vector<int>::iterator it = cellOrder.begin(); it!=cellOrder.end(); it++) {
+        for (int s=cellStart[*it]; s<cellEnd[*it]; s++) {
+          const int jAtom = cellAtoms[s];
+          if (jAtom >= iStart && jAtom < iEnd) oldIndex[i++] = jAtom;
+        }
+      }
+    }
+    iStart = iEnd;
+  }
+}
+
 void CellManager::assignCells() {
   const double *bs = box.getBoxSize();
   if (bs[0]*bs[1]*bs[2] == 0) {
@@ -166,45 +214,162 @@ void CellManager::assignCells() {
   }
 
   const int numAtoms = box.getNumAtoms();
-  cellNextAtom.resize(numAtoms);
   atomCell.resize(numAtoms);
   for (int i=0; i<3; i++) boxHalf[i] = 0.5*bs[i];
   jump[0] = numCells[1]*numCells[2];
   jump[1] = numCells[2];
   jump[2] = 1;
-  fill(cellLastAtom.begin(), cellLastAtom.end(), -1);
-  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-    int cellNum = 0;
-    double *r = box.getAtomPosition(iAtom);
-    for (int i=0; i<3; i++) {
-      double x = (r[i] + boxHalf[i])/bs[i];
-      int y = ((int)(cellRange + x*(numCells[i]-2*cellRange)));
-      if (y==numCells[i]-cellRange) y--;
-      else if (y==cellRange-1) y++;
-      cellNum += y*jump[i];
+  ThreadPool& pool = ThreadPool::get();
+  const int nt = pool.getNumThreads();
+  pool.run(nt, [&](int t) {
+    const int i0 = ThreadPool::taskStart(numAtoms, t, nt), i1 = ThreadPool::taskStart(numAtoms, t+1, nt);
+    for (int iAtom=i0; iAtom<i1; iAtom++) {
+      int cellNum = 0;
+      double *r = box.getAtomPosition(iAtom);
+      for (int i=0; i<3; i++) {
+        double x = (r[i] + boxHalf[i])/bs[i];
+        int y = ((int)(cellRange + x*(numCells[i]-2*cellRange)));
+        if (y==numCells[i]-cellRange) y--;
+        else if (y==cellRange-1) y++;
+        cellNum += y*jump[i];
+      }
+      atomCell[iAtom] = cellNum;
+    }
+  });
+  sortCells();
+  if (halo) clearGhosts();
+}
+
+// counting sort of the atoms by atomCell into cellAtoms.  each cell inside
+// the box gets some free slots after its atoms so that atoms can move in
+// without another sort.
+void CellManager::sortCells() {
+  const int numAtoms = box.getNumAtoms();
+  const int totalCells = wrapMap.size();
+  ThreadPool& pool = ThreadPool::get();
+  const int nt = pool.getNumThreads();
+  taskCellCount.resize(nt);
+  taskCellOffset.resize(nt);
+  // each task counts its block of atoms in each cell
+  pool.run(nt, [&](int t) {
+    vector<int> &count = taskCellCount[t];
+    count.assign(totalCells, 0);
+    const int i0 = ThreadPool::taskStart(numAtoms, t, nt), i1 = ThreadPool::taskStart(numAtoms, t+1, nt);
+    for (int iAtom=i0; iAtom<i1; iAtom++) {
+      if (atomCell[iAtom] > -1) count[atomCell[iAtom]]++;
+    }
+  });
+  // each task then lays out a block of cells, first finding how much
+  // room its block needs
+  pool.run(nt, [&](int t) {
+    const int c0 = ThreadPool::taskStart(totalCells, t, nt), c1 = ThreadPool::taskStart(totalCells, t+1, nt);
+    int s = 0;
+    for (int iCell=c0; iCell<c1; iCell++) {
+      int n = 0;
+      for (int u=0; u<nt; u++) n += taskCellCount[u][iCell];
+      s += n;
+      // cells in the padding never hold atoms
+      if (wrapMap[iCell] == iCell) s += 2 + n/4;
+    }
+    taskCellOffset[t] = s;
+  });
+  int s = 0;
+  for (int t=0; t<nt; t++) {
+    int n = taskCellOffset[t];
+    taskCellOffset[t] = s;
+    s += n;
+  }
+  cellStart[totalCells] = s;
+  cellAtoms.resize(s);
+  atomSlot.resize(numAtoms);
+  pool.run(nt, [&](int t) {
+    const int c0 = ThreadPool::taskStart(totalCells, t, nt), c1 = ThreadPool::taskStart(totalCells, t+1, nt);
+    int s = taskCellOffset[t];
+    for (int iCell=c0; iCell<c1; iCell++) {
+      cellStart[iCell] = s;
+      // atoms from task u go after those from the tasks before it
+      for (int u=0; u<nt; u++) {
+        int n = taskCellCount[u][iCell];
+        taskCellCount[u][iCell] = s;
+        s += n;
+      }
+      cellEnd[iCell] = s;
+      if (wrapMap[iCell] == iCell) s += 2 + (s-cellStart[iCell])/4;
+    }
+  });
+  // so that each cell holds its atoms in order
+  pool.run(nt, [&](int t) {
+    vector<int> &next = taskCellCount[t];
+    const int i0 = ThreadPool::taskStart(numAtoms, t, nt), i1 = ThreadPool::taskStart(numAtoms, t+1, nt);
+    for (int iAtom=i0; iAtom<i1; iAtom++) {
+      const int iCell = atomCell[iAtom];
+      if (iCell < 0) {
+        atomSlot[iAtom] = -1;
+        continue;
+      }
+      atomSlot[iAtom] = next[iCell];
+      cellAtoms[next[iCell]++] = iAtom;
+    }
+  });
+}
+
+void CellManager::setHalo(bool doHalo) {
+  halo = doHalo;
+  clearGhosts();
+}
+
+void CellManager::clearGhosts() {
+  ghostAtom.resize(0);
+  ghostImage.resize(0);
+  if (!halo) return;
+  atomGhost.resize(box.getNumAtoms()*numRawBoxOffsets);
+  fill(atomGhost.begin(), atomGhost.end(), -1);
+}
+
+int CellManager::ghostIndex(int iAtom, int image) {
+  const int numAtoms = box.getNumAtoms();
+  if (image == zeroBoxOffset) return iAtom;
+  int &g = atomGhost[iAtom*numRawBoxOffsets + image];
+  if (g < 0) {
+    g = ghostAtom.size();
+    ghostAtom.push_back(iAtom);
+    ghostImage.push_back(image);
+  }
+  return numAtoms + g;
+}
+
+void CellManager::copyGhosts(double** x, int numAtoms) {
+  const int numGhosts = ghostAtom.size();
+  for (int k=0; k<3; k++) {
+    double* xk = x[k];
+    double* gk = xk + numAtoms;
+    for (int g=0; g<numGhosts; g++) {
+      gk[g] = xk[ghostAtom[g]] + rawBoxOffsets[ghostImage[g]][k];
     }
-    atomCell[iAtom] = cellNum;
-    cellNextAtom[iAtom] = cellLastAtom[cellNum];
-    cellLastAtom[cellNum] = iAtom;
+  }
+}
+
+void CellManager::foldGhosts(double** f, double* u, int numAtoms) {
+  const int numGhosts = ghostAtom.size();
+  for (int g=0; g<numGhosts; g++) {
+    const int iAtom = ghostAtom[g];
+    u[iAtom] += u[numAtoms+g];
+    if (!f) continue;
+    for (int k=0; k<3; k++) f[k][iAtom] += f[k][numAtoms+g];
   }
 }
 
 void CellManager::removeAtom(int iAtom) {
   int oldCell = atomCell[iAtom];
   if (oldCell>-1) {
-    // delete from old cell
-    int j = cellLastAtom[oldCell];
-    if (j == iAtom) {
-      cellLastAtom[oldCell] = cellNextAtom[iAtom];
-    }
-    else {
-      while (cellNextAtom[j] != iAtom) {
-        j = cellNextAtom[j];
-      }
-      cellNextAtom[j] = cellNextAtom[iAtom];
-    }
+    // fill the hole with the last atom in the cell
+    int last = cellAtoms[--cellEnd[oldCell]];
+    cellAtoms[atomSlot[iAtom]] = last;
+    atomSlot[last] = atomSlot[iAtom];
+    atomCell[iAtom] = atomSlot[iAtom] = -1;
   }
 }
+
 void CellManager::updateAtom(int iAtom) {
   int cellNum = 0;
   const double *bs = box.getBoxSize();
@@ -220,23 +385,16 @@ void CellManager::updateAtom(int iAtom) {
   int oldCell = atomCell[iAtom];
   // check if existing assignment is right
   if (cellNum == oldCell) return;
-  if (oldCell>-1) {
-    // delete from old cell
-    int j = cellLastAtom[oldCell];
-    if (j == iAtom) {
-      cellLastAtom[oldCell] = cellNextAtom[iAtom];
-    }
-    else {
-      while (cellNextAtom[j] != iAtom) {
-        j = cellNextAtom[j];
-      }
-      cellNextAtom[j] = cellNextAtom[iAtom];
-    }
-  }
+  removeAtom(iAtom);
 
   atomCell[iAtom] = cellNum;
-  cellNextAtom[iAtom] = cellLastAtom[cellNum];
-  cellLastAtom[cellNum] = iAtom;
+  if (cellEnd[cellNum] == cellStart[cellNum+1]) {
+    // no room left in the new cell
+    sortCells();
+    return;
+  }
+  atomSlot[iAtom] = cellEnd[cellNum];
+  cellAtoms[cellEnd[cellNum]++] = iAtom;
 }
 
 void CellManager::removeMolecule(int iSpecies, int iMolecule) {
@@ -264,19 +422,9 @@ void CellManager::removeMolecule(int iSpecies, int iMolecule) {
 
 void CellManager::moveAtomIndex(int oldIndex, int newIndex) {
   if (oldIndex==newIndex) return;
-  int cell = atomCell[oldIndex];
-  //printf("%d was in %d\n", oldIndex, cell);
-  atomCell[newIndex] = cell;
-  cellNextAtom[newIndex] = cellNextAtom[oldIndex];
-  //printf("%d now points to %d\n", newIndex, cellNextAtom[newIndex]);
-  if (cell==-1) return;
-  int j = cellLastAtom[cell];
-  if (j == oldIndex) {
-    cellLastAtom[cell] = newIndex;
-    return;
-  }
-  while (cellNextAtom[j] != oldIndex) j = cellNextAtom[j];
-  cellNextAtom[j] = newIndex;
+  atomCell[newIndex] = atomCell[oldIndex];
+  atomSlot[newIndex] = atomSlot[oldIndex];
+  if (atomSlot[newIndex] > -1) cellAtoms[atomSlot[newIndex]] = newIndex;
 }
 
 void CellManager::newMolecule(int iSpecies) {
@@ -287,15 +435,14 @@ void CellManager::newMolecule(int iSpecies) {
   int speciesAtoms = speciesList.get(iSpecies)->getNumAtoms();
   int lastAtom = firstAtom + speciesAtoms - 1;
   int numAtoms = box.getNumAtoms();
-  cellNextAtom.resize(numAtoms);
   atomCell.resize(numAtoms);
+  atomSlot.resize(numAtoms);
   // first we have to shift uAtoms for all species>iSpecies
   for (int jAtom=numAtoms-1; jAtom>=firstAtom+speciesAtoms; jAtom--) {
-    moveAtomIndex(jAtom, jAtom-speciesAtoms);
+    moveAtomIndex(jAtom-speciesAtoms, jAtom);
   }
   for (int jAtom=lastAtom; jAtom>=firstAtom; jAtom--) {
-    cellNextAtom[jAtom] = -1;
-    atomCell[jAtom] = -1;
+    atomCell[jAtom] = atomSlot[jAtom] = -1;
     updateAtom(jAtom);
   }
 #ifdef DEBUG
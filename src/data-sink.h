@@ -39,8 +39,16 @@ class Average : public DataSink {
     double **blockCovariance;
     double **blockCovSum;
     const bool doCovariance;
+    // samples that count toward the averages but aren't in a complete block
+    // (left over from merging or collapsing), and their sum
+    long extraCount;
+    double *extraSum;
+    // first block of each run of blocks from one source (one for each merged
+    // Average); blocks from different sources aren't correlated
+    vector<long> segmentStart;
 
     void collapseBlocks();
+    void processBlock(double *sums);
 
     void dispose();
     void unset();
@@ -59,6 +67,14 @@ class Average : public DataSink {
     void setNumData(int newNumData);
     int getNumData();
     virtual void reset();
+    // appends the completed blocks of other (which has the same data; both
+    // keep their blocks) to ours, as a separate run of blocks that isn't
+    // correlated with the others.  smaller blocks are combined to our size;
+    // those that don't fill a block, and other's unfinished block, count
+    // toward the averages but not the block statistics.  we take the
+    // other's block size if it's bigger, which can only happen before we
+    // have blocks.
+    void mergeBlocks(Average &other);
 };
 
 // also computes ratio of each quantity with the last quantity
@@ -0,0 +1,397 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "domain-decomposition.h"
+#include "potential-master.h"
+#include "box.h"
+#include "species.h"
+#include "thread-pool.h"
+
+DomainDecomposition::DomainCallback::DomainCallback() : uTot(0), virialTot(0), f(nullptr) {
+  callFinished = true;
+}
+
+void DomainDecomposition::DomainCallback::allComputeFinished(double u, double virial, double** force) {
+  uTot = u;
+  virialTot = virial;
+  f = force;
+}
+
+DomainDecomposition::DomainDecomposition(Box& b, PotentialMasterList& p, int n) : box(b), potentialMaster(p), numDomains(n), rank(0), pinning(false), slabWidth(0), haloWidth(0), numAtoms(0), numOwned(0), lowerFd(-1), upperFd(-1) {
+  domainCallbackVec.push_back(&domainCallback);
+  checkSupported();
+}
+
+void DomainDecomposition::checkSupported() {
+  SpeciesList& speciesList = box.getSpeciesList();
+  // one species of single atoms also rules out bonded potentials
+  if (speciesList.size() != 1 || speciesList.get(0)->getNumAtoms() != 1) {
+    fprintf(stderr, "domain decomposition needs a single species of single atoms\n");
+    abort();
+  }
+  // the structure factor would need every atom, and ghost densities aren't
+  // exchanged
+  if (potentialMaster.getDoEwald()) {
+    fprintf(stderr, "domain decomposition can't handle Ewald sums\n");
+    abort();
+  }
+  if (potentialMaster.getDoEmbed()) {
+    fprintf(stderr, "domain decomposition can't handle embedding potentials\n");
+    abort();
+  }
+}
+
+DomainDecomposition::~DomainDecomposition() {
+  if (lowerFd >= 0) close(lowerFd);
+  if (upperFd >= 0) close(upperFd);
+  for (vector<int>::iterator it = sumFds.begin(); it!=sumFds.end(); it++) close(*it);
+  for (vector<pid_t>::iterator it = children.begin(); it!=children.end(); it++) {
+    waitpid(*it, nullptr, 0);
+  }
+}
+
+void DomainDecomposition::setPinning(bool pin) {
+  pinning = pin;
+}
+
+int DomainDecomposition::domainOf(double x) {
+  const double L = box.getBoxSize()[0];
+  int d = (int)((x + 0.5*L)/slabWidth);
+  if (d < 0) return 0;
+  if (d >= numDomains) return numDomains-1;
+  return d;
+}
+
+// affinity is only available on Linux; elsewhere this does nothing
+void DomainDecomposition::pinProcess() {
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  vector<int> cpus;
+  for (int c=0; c<CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+  }
+  if (cpus.empty()) return;
+  const int nc = cpus.size();
+  int c0 = ThreadPool::taskStart(nc, rank, numDomains), c1 = ThreadPool::taskStart(nc, rank+1, numDomains);
+  // more domains than CPUs; share them
+  if (c1 == c0) c1 = (c0 = rank%nc) + 1;
+  cpu_set_t mine;
+  CPU_ZERO(&mine);
+  for (int c=c0; c<c1; c++) CPU_SET(cpus[c], &mine);
+  sched_setaffinity(0, sizeof(mine), &mine);
+#endif
+}
+
+int DomainDecomposition::start() {
+  if (numDomains < 2) {
+    fprintf(stderr, "domain decomposition needs at least 2 domains\n");
+    abort();
+  }
+  // charges may have been set since we were constructed
+  checkSupported();
+  if (ThreadPool::get().getNumThreads() > 1) {
+    fprintf(stderr, "start domains before starting threads\n");
+    abort();
+  }
+  slabWidth = box.getBoxSize()[0]/numDomains;
+  haloWidth = potentialMaster.getRange();
+  // ghosts come only from the neighbor above, and can't be in range through
+  // the far side of the box
+  if (slabWidth < haloWidth || (numDomains-1)*slabWidth < 2*haloWidth) {
+    fprintf(stderr, "domains too thin (%f) for neighbor range %f\n", slabWidth, haloWidth);
+    abort();
+  }
+  // the long-range correction would need the whole box
+  potentialMaster.setDoTruncationCorrection(false);
+  numAtoms = box.getNumAtoms();
+
+  // ring[k] connects domain k (end 0) to domain k+1 (end 1); sums[k]
+  // connects domain 0 (end 0) with domain k (end 1)
+  vector<int> ring(2*numDomains), sums(2*numDomains, -1);
+  for (int k=0; k<numDomains; k++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, &ring[2*k]) != 0 || (k>0 && socketpair(AF_UNIX, SOCK_STREAM, 0, &sums[2*k]) != 0)) {
+      perror("socketpair");
+      abort();
+    }
+  }
+  // don't let buffered output get written by every process
+  fflush(stdout);
+  fflush(stderr);
+  for (int k=1; k<numDomains; k++) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      abort();
+    }
+    if (pid == 0) {
+      rank = k;
+      children.clear();
+      break;
+    }
+    children.push_back(pid);
+  }
+  upperFd = ring[2*rank];
+  lowerFd = ring[2*((rank+numDomains-1)%numDomains)+1];
+  for (int i=0; i<2*numDomains; i++) {
+    if (ring[i] != upperFd && ring[i] != lowerFd) close(ring[i]);
+    if (sums[i] < 0) continue;
+    const int k = i/2;
+    if (rank == 0 && i%2 == 0) sumFds.push_back(sums[i]);
+    else if (rank == k && i%2 == 1) sumFds.push_back(sums[i]);
+    else close(sums[i]);
+  }
+  fcntl(upperFd, F_SETFL, fcntl(upperFd, F_GETFL) | O_NONBLOCK);
+  fcntl(lowerFd, F_SETFL, fcntl(lowerFd, F_GETFL) | O_NONBLOCK);
+  if (pinning) pinProcess();
+
+  // we still have the whole box; keep only our atoms (at the front)
+  numOwned = 0;
+  atomIDs.clear();
+  double** f = potentialMaster.getForces();
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double *ri = box.getAtomPosition(iAtom);
+    box.nearestImage(ri);
+    if (domainOf(ri[0]) != rank) continue;
+    double *rj = box.getAtomPosition(numOwned);
+    double *vi = box.getAtomVelocity(iAtom), *vj = box.getAtomVelocity(numOwned);
+    for (int k=0; k<3; k++) {
+      rj[k] = ri[k];
+      vj[k] = vi[k];
+      if (f) f[numOwned][k] = f[iAtom][k];
+    }
+    atomIDs.push_back(box.getAtomID(iAtom));
+    numOwned++;
+  }
+  reset();
+  return rank;
+}
+
+// sends out to outFd while receiving from inFd (both non-blocking), each
+// as a size followed by the data, so that all domains can send at once.
+void DomainDecomposition::exchange(int outFd, const vector<double> &out, int inFd, vector<double> &in) {
+  long outSize = out.size(), inSize = 0;
+  const size_t header = sizeof(long);
+  size_t outDone = 0, inDone = 0;
+  const size_t outTotal = header + outSize*sizeof(double);
+  size_t inTotal = header;
+  while (outDone < outTotal || inDone < inTotal) {
+    struct pollfd fds[2];
+    int nfds = 0;
+    if (outDone < outTotal) {
+      fds[nfds].fd = outFd;
+      fds[nfds++].events = POLLOUT;
+    }
+    if (inDone < inTotal) {
+      fds[nfds].fd = inFd;
+      fds[nfds++].events = POLLIN;
+    }
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      abort();
+    }
+    if (outDone < outTotal) {
+      const char *src = outDone < header ? (const char*)&outSize + outDone : (const char*)out.data() + (outDone-header);
+      const size_t len = outDone < header ? header-outDone : outTotal-outDone;
+      ssize_t n = send(outFd, src, len, MSG_NOSIGNAL);
+      if (n > 0) outDone += n;
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        fprintf(stderr, "domain %d lost a neighbor\n", rank);
+        abort();
+      }
+    }
+    if (inDone < inTotal) {
+      char *dst = inDone < header ? (char*)&inSize + inDone : (char*)in.data() + (inDone-header);
+      const size_t len = inDone < header ? header-inDone : inTotal-inDone;
+      ssize_t n = recv(inFd, dst, len, 0);
+      if (n > 0) {
+        inDone += n;
+        if (inDone == header) {
+          in.resize(inSize);
+          inTotal += inSize*sizeof(double);
+        }
+      }
+      else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        fprintf(stderr, "domain %d lost a neighbor\n", rank);
+        abort();
+      }
+    }
+  }
+}
+
+// reads or writes all of buf on a blocking socket
+static void transfer(int fd, double *buf, int n, bool doWrite) {
+  char *p = (char*)buf;
+  size_t left = n*sizeof(double);
+  while (left > 0) {
+    ssize_t m = doWrite ? send(fd, p, left, MSG_NOSIGNAL) : recv(fd, p, left, 0);
+    if (m <= 0) {
+      if (m < 0 && errno == EINTR) continue;
+      fprintf(stderr, "lost a domain\n");
+      abort();
+    }
+    p += m;
+    left -= m;
+  }
+}
+
+void DomainDecomposition::sum(double* x, int n) {
+  if (rank > 0) {
+    transfer(sumFds[0], x, n, true);
+    transfer(sumFds[0], x, n, false);
+    return;
+  }
+  // add up in order of rank so that every run gives the same sum
+  double y[n];
+  for (vector<int>::iterator it = sumFds.begin(); it!=sumFds.end(); it++) {
+    transfer(*it, y, n, false);
+    for (int i=0; i<n; i++) x[i] += y[i];
+  }
+  for (vector<int>::iterator it = sumFds.begin(); it!=sumFds.end(); it++) {
+    transfer(*it, x, n, true);
+  }
+}
+
+double DomainDecomposition::sum(double x) {
+  sum(&x, 1);
+  return x;
+}
+
+void DomainDecomposition::reset() {
+  const int lower = (rank+numDomains-1)%numDomains, upper = (rank+1)%numDomains;
+  // MD integrators need the forces on our atoms to carry on
+  double** f = potentialMaster.getForces();
+  const double zero[3] = {0,0,0};
+  // atoms that left our slab go to the neighbor they went to
+  owned.clear();
+  outLower.clear();
+  outUpper.clear();
+  for (int iAtom=0; iAtom<numOwned; iAtom++) {
+    double *ri = box.getAtomPosition(iAtom);
+    box.nearestImage(ri);
+    const int d = domainOf(ri[0]);
+    vector<double> *dest = &owned;
+    if (d == upper) dest = &outUpper;
+    else if (d == lower) dest = &outLower;
+    else if (d != rank) {
+      fprintf(stderr, "atom %d moved past a whole domain\n", atomIDs[iAtom]);
+      abort();
+    }
+    double *vi = box.getAtomVelocity(iAtom);
+    const double *fi = f ? f[iAtom] : zero;
+    dest->push_back(atomIDs[iAtom]);
+    dest->insert(dest->end(), ri, ri+3);
+    dest->insert(dest->end(), vi, vi+3);
+    dest->insert(dest->end(), fi, fi+3);
+  }
+  exchange(lowerFd, outLower, upperFd, inUpper);
+  exchange(upperFd, outUpper, lowerFd, inLower);
+  owned.insert(owned.end(), inUpper.begin(), inUpper.end());
+  owned.insert(owned.end(), inLower.begin(), inLower.end());
+  numOwned = owned.size()/10;
+
+  // our atoms near our lower face are ghosts for the lower neighbor
+  const double lo = -0.5*box.getBoxSize()[0] + rank*slabWidth;
+  sendAtoms.clear();
+  outLower.clear();
+  for (int iAtom=0; iAtom<numOwned; iAtom++) {
+    const double *rec = &owned[10*iAtom];
+    if (rec[1] - lo >= haloWidth) continue;
+    sendAtoms.push_back(iAtom);
+    outLower.insert(outLower.end(), rec, rec+4);
+  }
+  exchange(lowerFd, outLower, upperFd, inUpper);
+  const int numGhosts = inUpper.size()/4;
+
+  box.setNumMolecules(0, numOwned+numGhosts);
+  potentialMaster.atomsReplaced(numOwned);
+  f = potentialMaster.getForces();
+  atomIDs.resize(numOwned+numGhosts);
+  for (int iAtom=0; iAtom<numOwned; iAtom++) {
+    const double *rec = &owned[10*iAtom];
+    atomIDs[iAtom] = (int)rec[0];
+    double *ri = box.getAtomPosition(iAtom);
+    double *vi = box.getAtomVelocity(iAtom);
+    for (int k=0; k<3; k++) {
+      ri[k] = rec[1+k];
+      vi[k] = rec[4+k];
+      if (f) f[iAtom][k] = rec[7+k];
+    }
+  }
+  for (int i=0; i<numGhosts; i++) {
+    const double *rec = &inUpper[4*i];
+    atomIDs[numOwned+i] = (int)rec[0];
+    double *ri = box.getAtomPosition(numOwned+i);
+    double *vi = box.getAtomVelocity(numOwned+i);
+    for (int k=0; k<3; k++) {
+      ri[k] = rec[1+k];
+      vi[k] = 0;
+    }
+  }
+  potentialMaster.reset();
+}
+
+void DomainDecomposition::checkUpdateNbrs() {
+  // all domains have to move atoms at the same time
+  if (sum(potentialMaster.needsNbrUpdate() ? 1 : 0) > 0) reset();
+}
+
+void DomainDecomposition::computeAll(vector<PotentialCallback*> &callbacks) {
+  // ghosts take the current positions of their atoms
+  outLower.clear();
+  for (vector<int>::iterator it = sendAtoms.begin(); it!=sendAtoms.end(); it++) {
+    double *ri = box.getAtomPosition(*it);
+    outLower.insert(outLower.end(), ri, ri+3);
+  }
+  exchange(lowerFd, outLower, upperFd, inUpper);
+  const int numGhosts = box.getNumAtoms() - numOwned;
+  if ((int)inUpper.size() != 3*numGhosts) {
+    fprintf(stderr, "domain %d expected %d ghosts but got %d\n", rank, numGhosts, (int)inUpper.size()/3);
+    abort();
+  }
+  for (int i=0; i<numGhosts; i++) {
+    double *ri = box.getAtomPosition(numOwned+i);
+    for (int k=0; k<3; k++) ri[k] = inUpper[3*i+k];
+  }
+
+  domainCallback.takesForces = false;
+  for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
+    if ((*it)->callPair) {
+      fprintf(stderr, "pair callbacks can't be used with domains\n");
+      abort();
+    }
+    if ((*it)->takesForces) domainCallback.takesForces = true;
+  }
+  potentialMaster.computeAll(domainCallbackVec);
+  double** f = domainCallback.f;
+  if (domainCallback.takesForces) {
+    // forces on our ghosts belong to the neighbor above
+    outUpper.resize(3*numGhosts);
+    for (int i=0; i<numGhosts; i++) {
+      for (int k=0; k<3; k++) outUpper[3*i+k] = f[numOwned+i][k];
+    }
+    exchange(upperFd, outUpper, lowerFd, inLower);
+    const int numSend = sendAtoms.size();
+    for (int i=0; i<numSend; i++) {
+      for (int k=0; k<3; k++) f[sendAtoms[i]][k] += inLower[3*i+k];
+    }
+  }
+  double uv[2] = {domainCallback.uTot, domainCallback.virialTot};
+  sum(uv, 2);
+  for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
+    if ((*it)->callFinished) (*it)->allComputeFinished(uv[0], uv[1], f);
+  }
+}
@@ -0,0 +1,96 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <vector>
+#include <sys/types.h>
+#include "potential-callback.h"
+
+using namespace std;
+
+class Box;
+class PotentialMasterList;
+
+/**
+ * Splits the box into slabs along x, each owned by its own process on this
+ * host.  Set up the whole system as usual (one single-atom species, a
+ * PotentialMasterList and an MD integrator), then call start(), which
+ * forks one process per slab and returns its rank.  Each process then
+ * keeps only the atoms in its slab, plus ghost copies of the atoms within
+ * the neighbor range above its upper face, and runs the same main program
+ * from there; the integrator needs setDomainDecomposition.
+ *
+ * Each domain handles the pairs between its own atoms and those with its
+ * ghosts.  Ghost positions come from the upper neighbor before each force
+ * calculation and the forces on them go back afterwards.  Atoms move to a
+ * new domain when the neighbor lists are rebuilt.  Energy and virial are
+ * summed over the domains before callbacks see them, but the callbacks
+ * see only the domain's own box (and pair callbacks can't be used).
+ * Neighbors talk over Unix sockets.
+ *
+ * Only this is supported, and anything else aborts (when constructed and
+ * again in start()): a single species of single atoms (so no molecules or
+ * bonded potentials), pair potentials without Ewald sums or embedding,
+ * slabs along x only, and ghosts taken only from the upper neighbor (so
+ * each slab must be at least the neighbor range thick).
+ */
+class DomainDecomposition {
+  protected:
+    class DomainCallback : public PotentialCallback {
+      public:
+        double uTot, virialTot;
+        double** f;
+        DomainCallback();
+        virtual void allComputeFinished(double uTot, double virialTot, double** f);
+    };
+    Box& box;
+    PotentialMasterList& potentialMaster;
+    const int numDomains;
+    int rank;
+    bool pinning;
+    double slabWidth, haloWidth;
+    // atoms in all domains, and those owned by this one
+    int numAtoms, numOwned;
+    // original index of our atoms, then of our ghosts
+    vector<int> atomIDs;
+    // our atoms that the lower neighbor has as ghosts
+    vector<int> sendAtoms;
+    // sockets to our neighbors, and for sums (to each other domain from
+    // domain 0, or to domain 0)
+    int lowerFd, upperFd;
+    vector<int> sumFds;
+    vector<pid_t> children;
+    vector<double> outLower, outUpper, inLower, inUpper, owned;
+    DomainCallback domainCallback;
+    vector<PotentialCallback*> domainCallbackVec;
+
+    int domainOf(double x);
+    void exchange(int outFd, const vector<double> &out, int inFd, vector<double> &in);
+    void pinProcess();
+    // aborts for systems we can't divide
+    void checkSupported();
+  public:
+    DomainDecomposition(Box& box, PotentialMasterList& potentialMaster, int numDomains);
+    ~DomainDecomposition();
+    // give each domain its share of the CPUs we can run on
+    void setPinning(bool pin);
+    // forks the other domains and returns our rank.  the thread pool (if
+    // used) should be started afterwards.
+    int start();
+    int getRank() {return rank;}
+    int getNumDomains() {return numDomains;}
+    int getNumAtoms() {return numAtoms;}
+    int getNumOwnedAtoms() {return numOwned;}
+    // original index of atom iAtom in the undivided box
+    int getAtomID(int iAtom) {return atomIDs[iAtom];}
+    // replaces x with its sum over all domains
+    void sum(double* x, int n);
+    double sum(double x);
+    // moves atoms to the domains they are now in, sends out ghosts and
+    // rebuilds the neighbor lists
+    void reset();
+    void checkUpdateNbrs();
+    void computeAll(vector<PotentialCallback*> &callbacks);
+};
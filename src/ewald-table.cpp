@@ -0,0 +1,147 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "ewald-table.h"
+#include "alloc2d.h"
+
+using namespace std;
+
+// largest table we'll build (4MB of spline coefficients)
+#define EWALD_TABLE_MAX_INTERVALS (1<<17)
+
+EwaldTable::EwaldTable(double a, double rMin, double rMax, int t, double re) : alpha(a), type(t), relErr(re), degree(t==EWALD_TABLE_SPLINE ? 3 : EWALD_CHEBYSHEV_DEGREE), numIntervals(0), error(0), coeff(nullptr) {
+  if (type != EWALD_TABLE_SPLINE && type != EWALD_TABLE_CHEBYSHEV) {
+    fprintf(stderr, "unknown Ewald table type %d\n", type);
+    abort();
+  }
+  if (rMin <= 0 || rMax <= rMin || relErr <= 0) {
+    fprintf(stderr, "Ewald table needs 0 < rMin < rMax and relErr > 0\n");
+    abort();
+  }
+  r2Min = rMin*rMin;
+  r2Max = rMax*rMax;
+  // double the intervals until we're accurate enough.  once roundoff
+  // dominates, more intervals stop helping; then keep the best table
+  for (int n=16; ; n*=2) {
+    build(n);
+    double e = maxError();
+    if (n>16 && e > 0.5*error) {
+      if (e > error) build(n/2);
+      else error = e;
+      break;
+    }
+    error = e;
+    if (error <= relErr || n >= EWALD_TABLE_MAX_INTERVALS) break;
+  }
+}
+
+EwaldTable::~EwaldTable() {
+  free(coeff);
+}
+
+void EwaldTable::build(int n) {
+  numIntervals = n;
+  h = (r2Max - r2Min)/n;
+  invH = 1/h;
+  free(coeff);
+  coeff = (double*)mallocAligned(n*(degree+1)*sizeof(double));
+  double u, du, d2u;
+  if (type == EWALD_TABLE_SPLINE) {
+    // clamped spline: exact dg/dr2 = du/(2 r2) at both ends
+    vector<double> y(n+1), m(n+1), c(n+1);
+    for (int i=0; i<=n; i++) {
+      exact(alpha, r2Min + i*h, y[i], du, d2u);
+    }
+    exact(alpha, r2Min, u, du, d2u);
+    double dy0 = du/(2*r2Min);
+    exact(alpha, r2Max, u, du, d2u);
+    double dyn = du/(2*r2Max);
+    // tridiagonal system for the second derivatives m, solved in place
+    // (c holds the modified super-diagonal)
+    double b = 2;
+    c[0] = 1/b;
+    m[0] = 6/h*((y[1]-y[0])/h - dy0)/b;
+    for (int i=1; i<=n; i++) {
+      double rhs = i<n ? 6/(h*h)*(y[i+1] - 2*y[i] + y[i-1]) : 6/h*(dyn - (y[n]-y[n-1])/h);
+      double diag = i<n ? 4 : 2;
+      b = diag - c[i-1];
+      c[i] = 1/b;
+      m[i] = (rhs - m[i-1])/b;
+    }
+    for (int i=n-1; i>=0; i--) m[i] -= c[i]*m[i+1];
+    for (int i=0; i<n; i++) {
+      double* ci = coeff + i*4;
+      ci[0] = y[i];
+      ci[1] = (y[i+1]-y[i]) - h*h*(2*m[i] + m[i+1])/6;
+      ci[2] = h*h*m[i]/2;
+      ci[3] = h*h*(m[i+1] - m[i])/6;
+    }
+    return;
+  }
+  // Chebyshev interpolation on each interval, converted to powers of t
+  const int np = degree+1;
+  vector<double> f(np), a(np), b(np), tj(np), tjm1(np), tjp1(np);
+  for (int i=0; i<n; i++) {
+    for (int k=0; k<np; k++) {
+      double x = cos(M_PI*(k+0.5)/np);
+      exact(alpha, r2Min + (i + 0.5*(x+1))*h, f[k], du, d2u);
+    }
+    for (int j=0; j<np; j++) {
+      double s = 0;
+      for (int k=0; k<np; k++) s += f[k]*cos(M_PI*j*(k+0.5)/np);
+      a[j] = s*2/np;
+    }
+    a[0] *= 0.5;
+    // b = sum_j a_j T_j(x), in powers of x
+    for (int k=0; k<np; k++) b[k] = tj[k] = tjm1[k] = 0;
+    tjm1[0] = 1;
+    tj[1] = 1;
+    b[0] = a[0];
+    b[1] = a[1];
+    for (int j=2; j<np; j++) {
+      for (int k=0; k<np; k++) {
+        tjp1[k] = (k>0 ? 2*tj[k-1] : 0) - tjm1[k];
+      }
+      for (int k=0; k<np; k++) {
+        tjm1[k] = tj[k];
+        tj[k] = tjp1[k];
+        b[k] += a[j]*tj[k];
+      }
+    }
+    // x = 2t-1
+    double* ci = coeff + i*np;
+    for (int k=0; k<np; k++) {
+      double s = 0, binom = 1;
+      for (int j=k; j<np; j++) {
+        s += b[j]*binom*((j-k)%2 ? -1 : 1);
+        binom = binom*(j+1)/(j+1-k);
+      }
+      ci[k] = s*pow(2, k);
+    }
+  }
+}
+
+double EwaldTable::maxError() {
+  double maxErr = 0;
+  for (int i=0; i<=numIntervals; i++) {
+    for (int k=0; k<16; k++) {
+      double r2 = r2Min + (i + k/16.0)*h;
+      if (i==numIntervals) {
+        // the top edge of the last interval
+        if (k>0) break;
+        r2 = r2Max*(1-1e-15);
+      }
+      double u, du, d2u, ut, dut, d2ut;
+      exact(alpha, r2, u, du, d2u);
+      u012(r2, ut, dut, d2ut);
+      double eu = fabs(ut-u)/fabs(u), edu = fabs(dut-du)/fabs(du);
+      if (eu > maxErr) maxErr = eu;
+      if (edu > maxErr) maxErr = edu;
+    }
+  }
+  return maxErr;
+}
@@ -0,0 +1,116 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <math.h>
+#include "util.h"
+
+#define EWALD_TABLE_SPLINE 0
+#define EWALD_TABLE_CHEBYSHEV 1
+
+// polynomial degree of each Chebyshev piece
+#define EWALD_CHEBYSHEV_DEGREE 5
+
+/**
+ * Tabulated real-space Ewald kernel g(r) = erfc(alpha r)/r, as a piecewise
+ * polynomial in r^2 on uniform intervals from rMin^2 to rMax^2.  Pieces are
+ * either a clamped cubic spline (continuous through the second derivative)
+ * or Chebyshev interpolants of degree EWALD_CHEBYSHEV_DEGREE (fewer
+ * intervals, but only continuous to within the tolerance).  The number of
+ * intervals is doubled until u and du are within relErr of the exact kernel;
+ * d2u comes from the same polynomial, so it is consistent with du but less
+ * accurate.  Roundoff limits either kind to roughly 1e-10; for a tighter
+ * relErr the most accurate table is kept, and getError() reports what was
+ * reached.  Outside the table the exact kernel is used.
+ *
+ * One table can be shared by every Ewald pair potential with the same alpha;
+ * the charges only scale the result.  This is the runtime alternative to
+ * building with FAST_ERFC.
+ */
+class EwaldTable {
+  protected:
+    const double alpha;
+    const int type;
+    const double relErr;
+    const int degree;
+    double r2Min, r2Max, h, invH;
+    int numIntervals;
+    double error;
+    // degree+1 coefficients per interval, in t = (r2-r2Min)/h - i
+    double* coeff;
+    void build(int n);
+    double maxError();
+
+    template<int d>
+    inline void poly012(int i, double t, double &p, double &dp, double &d2p) const {
+      const double* c = coeff + i*(d+1);
+      p = c[d];
+      dp = 0;
+      d2p = 0;
+      for (int k=d-1; k>=0; k--) {
+        d2p = d2p*t + dp;
+        dp = dp*t + p;
+        p = p*t + c[k];
+      }
+      d2p *= 2;
+    }
+
+    template<int d>
+    inline double poly(int i, double t) const {
+      const double* c = coeff + i*(d+1);
+      double p = c[d];
+      for (int k=d-1; k>=0; k--) p = p*t + c[k];
+      return p;
+    }
+
+  public:
+    EwaldTable(double alpha, double rMin, double rMax, int type, double relErr);
+    ~EwaldTable();
+    double getAlpha() const {return alpha;}
+    int getType() const {return type;}
+    int getNumIntervals() const {return numIntervals;}
+    // largest relative error in u and du (may exceed the requested relErr)
+    double getError() const {return error;}
+
+    // exact kernel: u = erfc(alpha r)/r, du = r du/dr, d2u = r^2 d2u/dr2
+    static inline void exact(const double alpha, const double r2, double &u, double &du, double &d2u) {
+      double r = sqrt(r2);
+      u = erfc(alpha*r)/r;
+      double dexp = (2.0/sqrt(M_PI)) * exp(-alpha*alpha*r2) * alpha;
+      du = -dexp - u;
+      d2u = 2*dexp*(1 + alpha*alpha*r2) + 2*u;
+    }
+
+    inline double u(const double r2) const {
+      if (r2 < r2Min || r2 >= r2Max) {
+        double r = sqrt(r2);
+        return erfc(alpha*r)/r;
+      }
+      double x = (r2-r2Min)*invH;
+      int i = (int)x;
+      // x can round up to numIntervals just below r2Max
+      if (i==numIntervals) i--;
+      if (degree==3) return poly<3>(i, x-i);
+      return poly<EWALD_CHEBYSHEV_DEGREE>(i, x-i);
+    }
+
+    inline void u012(const double r2, double &u, double &du, double &d2u) const {
+      if (r2 < r2Min || r2 >= r2Max) {
+        exact(alpha, r2, u, du, d2u);
+        return;
+      }
+      double x = (r2-r2Min)*invH;
+      int i = (int)x;
+      // x can round up to numIntervals just below r2Max
+      if (i==numIntervals) i--;
+      double dp, d2p;
+      if (degree==3) poly012<3>(i, x-i, u, dp, d2p);
+      else poly012<EWALD_CHEBYSHEV_DEGREE>(i, x-i, u, dp, d2p);
+      // dg/dr2 = dp/h, and r d/dr = 2 r2 d/dr2
+      double x1 = 2*r2*invH*dp;
+      du = x1;
+      d2u = x1 + 4*r2*r2*invH*invH*d2p;
+    }
+};
@@ -0,0 +1,153 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "fft.h"
+
+FFT::FFT(int nn) : n(nn) {
+  if (n<1) {
+    fprintf(stderr, "FFT size must be positive\n");
+    abort();
+  }
+  int m = n;
+  for (int p=2; m>1; p++) {
+    while (m%p==0) {
+      factors.push_back(p);
+      m /= p;
+    }
+  }
+  int maxFactor = 1;
+  for (int i=0; i<(int)factors.size(); i++) {
+    if (factors[i]>maxFactor) maxFactor = factors[i];
+  }
+  scratch.resize(maxFactor);
+  twiddle.resize(n);
+  for (int j=0; j<n; j++) {
+    double t = -2*M_PI*j/n;
+    twiddle[j] = complex<double>(cos(t), sin(t));
+  }
+}
+
+void FFT::recurse(const complex<double>* in, complex<double>* out, int m, int stride, int iFactor, bool inverse) {
+  if (m==1) {
+    out[0] = in[0];
+    return;
+  }
+  const int p = factors[iFactor];
+  const int mm = m/p;
+  // transform each of the p decimated subsequences into consecutive chunks of out
+  for (int q=0; q<p; q++) {
+    recurse(in+q*stride, out+q*mm, mm, stride*p, iFactor+1, inverse);
+  }
+  // then combine them with p-point DFTs
+  const int tStep = n/m, pStep = n/p;
+  complex<double>* t = scratch.data();
+  for (int k=0; k<mm; k++) {
+    t[0] = out[k];
+    for (int q=1; q<p; q++) {
+      complex<double> w = twiddle[q*k*tStep];
+      if (inverse) w = conj(w);
+      t[q] = out[q*mm+k] * w;
+    }
+    if (p==2) {
+      out[k] = t[0] + t[1];
+      out[mm+k] = t[0] - t[1];
+      continue;
+    }
+    for (int s=0; s<p; s++) {
+      complex<double> sum = t[0];
+      for (int q=1; q<p; q++) {
+        complex<double> w = twiddle[((q*s)%p)*pStep];
+        if (inverse) w = conj(w);
+        sum += t[q] * w;
+      }
+      out[s*mm+k] = sum;
+    }
+  }
+}
+
+void FFT::transform(const complex<double>* in, int stride, complex<double>* out, bool inverse) {
+  recurse(in, out, n, stride, 0, inverse);
+}
+
+FFT3D::FFT3D(int n0, int n1, int n2) : fft0(n0), fft1(n1), fft2h(n2/2) {
+  if (n2%2 != 0) {
+    fprintf(stderr, "FFT3D needs an even size for the last dimension\n");
+    abort();
+  }
+  n[0] = n0;
+  n[1] = n1;
+  n[2] = n2;
+  n2c = n2/2+1;
+  twiddle2.resize(n2c);
+  for (int k=0; k<n2c; k++) {
+    double t = -2*M_PI*k/n2;
+    twiddle2[k] = complex<double>(cos(t), sin(t));
+  }
+  int nMax = n0>n1 ? n0 : n1;
+  if (n2c>nMax) nMax = n2c;
+  line.resize(nMax);
+  lineOut.resize(nMax);
+}
+
+void FFT3D::forward(const double* in, complex<double>* out) {
+  const int h = n[2]/2;
+  // real lines along 2, packed as half-length complex: z[j] = x[2j] + i x[2j+1]
+  for (int i01=0; i01<n[0]*n[1]; i01++) {
+    const double* x = in + i01*n[2];
+    for (int j=0; j<h; j++) line[j] = complex<double>(x[2*j], x[2*j+1]);
+    fft2h.transform(line.data(), 1, lineOut.data(), false);
+    complex<double>* X = out + i01*n2c;
+    for (int k=0; k<=h; k++) {
+      complex<double> zk = lineOut[k%h], zc = conj(lineOut[(h-k)%h]);
+      complex<double> e = 0.5*(zk + zc);
+      complex<double> o = complex<double>(0,-0.5)*(zk - zc);
+      X[k] = e + twiddle2[k]*o;
+    }
+  }
+  for (int i0=0; i0<n[0]; i0++) {
+    for (int k2=0; k2<n2c; k2++) {
+      complex<double>* X = out + i0*n[1]*n2c + k2;
+      fft1.transform(X, n2c, lineOut.data(), false);
+      for (int i1=0; i1<n[1]; i1++) X[i1*n2c] = lineOut[i1];
+    }
+  }
+  for (int i12=0; i12<n[1]*n2c; i12++) {
+    complex<double>* X = out + i12;
+    fft0.transform(X, n[1]*n2c, lineOut.data(), false);
+    for (int i0=0; i0<n[0]; i0++) X[i0*n[1]*n2c] = lineOut[i0];
+  }
+}
+
+void FFT3D::inverse(complex<double>* in, double* out) {
+  const int h = n[2]/2;
+  for (int i12=0; i12<n[1]*n2c; i12++) {
+    complex<double>* X = in + i12;
+    fft0.transform(X, n[1]*n2c, lineOut.data(), true);
+    for (int i0=0; i0<n[0]; i0++) X[i0*n[1]*n2c] = lineOut[i0];
+  }
+  for (int i0=0; i0<n[0]; i0++) {
+    for (int k2=0; k2<n2c; k2++) {
+      complex<double>* X = in + i0*n[1]*n2c + k2;
+      fft1.transform(X, n2c, lineOut.data(), true);
+      for (int i1=0; i1<n[1]; i1++) X[i1*n2c] = lineOut[i1];
+    }
+  }
+  // unpack the Hermitian half into even/odd sums and do a half-length transform
+  for (int i01=0; i01<n[0]*n[1]; i01++) {
+    const complex<double>* X = in + i01*n2c;
+    for (int k=0; k<h; k++) {
+      complex<double> xc = conj(X[h-k]);
+      line[k] = (X[k] + xc) + complex<double>(0,1)*(X[k] - xc)*conj(twiddle2[k]);
+    }
+    fft2h.transform(line.data(), 1, lineOut.data(), true);
+    double* x = out + i01*n[2];
+    for (int j=0; j<h; j++) {
+      x[2*j] = lineOut[j].real();
+      x[2*j+1] = lineOut[j].imag();
+    }
+  }
+}
@@ -0,0 +1,53 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <vector>
+#include <complex>
+
+using namespace std;
+
+/**
+ * Unnormalized 1D complex FFT of any length, by mixed-radix decimation in
+ * time.  Small factors (2,3,5) are cheap; a large prime factor falls back to
+ * an O(n^2) DFT for that stage.
+ */
+class FFT {
+  protected:
+    const int n;
+    vector<int> factors;
+    // exp(-2 pi i j/n)
+    vector<complex<double>> twiddle;
+    vector<complex<double>> scratch;
+    void recurse(const complex<double>* in, complex<double>* out, int m, int stride, int iFactor, bool inverse);
+
+  public:
+    FFT(int n);
+    ~FFT() {}
+    int getSize() {return n;}
+    // out[k] = sum_j in[j*stride] exp(-+2 pi i j k/n); out is contiguous
+    void transform(const complex<double>* in, int stride, complex<double>* out, bool inverse);
+};
+
+/**
+ * Real-to-complex 3D FFT for an n0 x n1 x n2 mesh (n2 even).  The real mesh
+ * is indexed (i0*n1 + i1)*n2 + i2 and the half-spectrum
+ * (k0*n1 + k1)*(n2/2+1) + k2.  Neither direction is normalized.
+ */
+class FFT3D {
+  protected:
+    int n[3], n2c;
+    FFT fft0, fft1, fft2h;
+    // exp(-2 pi i k/n2), for the real <-> half-length complex packing
+    vector<complex<double>> twiddle2;
+    vector<complex<double>> line, lineOut;
+
+  public:
+    FFT3D(int n0, int n1, int n2);
+    ~FFT3D() {}
+    void forward(const double* in, complex<double>* out);
+    // destroys in
+    void inverse(complex<double>* in, double* out);
+};
@@ -0,0 +1,104 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <algorithm>
+#include "integrator.h"
+#include "move-gibbs.h"
+#include "thread-pool.h"
+
+IntegratorGibbs::IntegratorGibbs(PotentialMaster& pm, Random& r, Integrator& i0, Integrator& i1) : Integrator(pm), random(r), boxSteps(1), pMoveSum(0), lastMove(nullptr) {
+  callFinished = false;
+  boxIntegrators[0] = &i0;
+  boxIntegrators[1] = &i1;
+}
+
+IntegratorGibbs::~IntegratorGibbs() {}
+
+void IntegratorGibbs::setBoxSteps(int steps) {
+  boxSteps = steps;
+}
+
+void IntegratorGibbs::addMove(MCMoveGibbs* move, double prob) {
+  moves.push_back(move);
+  moveProbabilities.push_back(prob);
+  pMoveSum += prob;
+}
+
+void IntegratorGibbs::doStep() {
+  stepCount++;
+  for (vector<IntegratorListener*>::iterator it = listenersStepStarted.begin(); it!=listenersStepStarted.end(); it++) {
+    (*it)->stepStarted();
+  }
+  // the boxes share nothing they modify, so they can run concurrently
+  ThreadPool::get().run(2, [&](int i) {
+    boxIntegrators[i]->setTemperature(temperature);
+    boxIntegrators[i]->doSteps(boxSteps);
+  });
+
+  MCMoveGibbs* m = nullptr;
+  int nm = moves.size();
+  if (nm>1) {
+    double r = random.nextDouble32()*pMoveSum;
+    double s = 0;
+    for (int i=0; i<nm; i++) {
+      s += moveProbabilities[i];
+      if (s >= r) {
+        m = moves[i];
+        break;
+      }
+    }
+  }
+  else if (nm==1) {
+    m = moves[0];
+  }
+  lastMove = m;
+  if (m) {
+    bool success = m->doTrial();
+    double chi = success ? m->getChi(temperature) : 0;
+    if (chi==0 || (chi<1 && chi<random.nextDouble())) {
+      m->rejectNotify();
+      for (vector<IntegratorListener*>::iterator it = listenersMoveRejected.begin(); it!=listenersMoveRejected.end(); it++) {
+        (*it)->moveRejected(*m, chi);
+      }
+    }
+    else {
+      m->acceptNotify();
+      for (int i=0; i<2; i++) {
+        boxIntegrators[i]->addEnergy(m->energyChange(i));
+      }
+      for (vector<IntegratorListener*>::iterator it = listenersMoveAccepted.begin(); it!=listenersMoveAccepted.end(); it++) {
+        (*it)->moveAccepted(*m, chi);
+      }
+    }
+  }
+  energy = boxIntegrators[0]->getPotentialEnergy() + boxIntegrators[1]->getPotentialEnergy();
+  for (vector<IntegratorListener*>::iterator it = listenersStepFinished.begin(); it!=listenersStepFinished.end(); it++) {
+    (*it)->stepFinished();
+  }
+}
+
+void IntegratorGibbs::reset() {
+  ThreadPool::get().run(2, [&](int i) {
+    boxIntegrators[i]->reset();
+  });
+  energy = boxIntegrators[0]->getPotentialEnergy() + boxIntegrators[1]->getPotentialEnergy();
+}
+
+void IntegratorGibbs::addListener(IntegratorListener* listener) {
+  Integrator::addListener(listener);
+  if (listener->callAccept) listenersMoveAccepted.push_back(listener);
+  if (listener->callReject) listenersMoveRejected.push_back(listener);
+}
+
+void IntegratorGibbs::removeListener(IntegratorListener* listener) {
+  Integrator::removeListener(listener);
+  if (listener->callAccept) {
+    std::vector<IntegratorListener*>::iterator it = find (listenersMoveAccepted.begin(), listenersMoveAccepted.end(), listener);
+    if (it != listenersMoveAccepted.end()) listenersMoveAccepted.erase(it);
+  }
+  if (listener->callReject) {
+    std::vector<IntegratorListener*>::iterator it = find (listenersMoveRejected.begin(), listenersMoveRejected.end(), listener);
+    if (it != listenersMoveRejected.end()) listenersMoveRejected.erase(it);
+  }
+}
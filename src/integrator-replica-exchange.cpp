@@ -0,0 +1,69 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <math.h>
+#include "integrator.h"
+#include "thread-pool.h"
+
+IntegratorReplicaExchange::IntegratorReplicaExchange(PotentialMaster& pm, Random& r) : Integrator(pm), random(r), swapInterval(100), swapParity(0) {
+  callFinished = false;
+}
+
+IntegratorReplicaExchange::~IntegratorReplicaExchange() {}
+
+void IntegratorReplicaExchange::addReplica(Integrator* integrator, double T) {
+  if (temperatures.size() > 0 && T <= temperatures.back()) {
+    fprintf(stderr, "replicas need to be added in order of increasing temperature\n");
+    abort();
+  }
+  integrator->setTemperature(T);
+  replicaAt.push_back(replicas.size());
+  replicas.push_back(integrator);
+  temperatures.push_back(T);
+  if (replicas.size() > 1) {
+    numSwapTrials.push_back(0);
+    numSwapAccepted.push_back(0);
+  }
+}
+
+void IntegratorReplicaExchange::setSwapInterval(int steps) {
+  swapInterval = steps;
+}
+
+double IntegratorReplicaExchange::getSwapAcceptance(int i) {
+  if (numSwapTrials[i]==0) return 0;
+  return ((double)numSwapAccepted[i])/numSwapTrials[i];
+}
+
+void IntegratorReplicaExchange::doStep() {
+  stepCount++;
+  for (vector<IntegratorListener*>::iterator it = listenersStepStarted.begin(); it!=listenersStepStarted.end(); it++) {
+    (*it)->stepStarted();
+  }
+  const int n = replicas.size();
+  ThreadPool::get().run(n, [&](int i) {
+    replicas[i]->doSteps(swapInterval);
+  });
+  for (int i=swapParity; i<n-1; i+=2) {
+    Integrator* a = replicas[replicaAt[i]];
+    Integrator* b = replicas[replicaAt[i+1]];
+    double x = (1/temperatures[i] - 1/temperatures[i+1])*(a->getPotentialEnergy() - b->getPotentialEnergy());
+    numSwapTrials[i]++;
+    if (x < 0 && exp(x) < random.nextDouble()) continue;
+    a->exchangeTemperature(temperatures[i+1]);
+    b->exchangeTemperature(temperatures[i]);
+    std::swap(replicaAt[i], replicaAt[i+1]);
+    numSwapAccepted[i]++;
+  }
+  swapParity = 1 - swapParity;
+  for (vector<IntegratorListener*>::iterator it = listenersStepFinished.begin(); it!=listenersStepFinished.end(); it++) {
+    (*it)->stepFinished();
+  }
+}
+
+void IntegratorReplicaExchange::reset() {
+  ThreadPool::get().run(replicas.size(), [&](int i) {
+    replicas[i]->reset();
+  });
+}
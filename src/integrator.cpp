@@ -32,6 +32,10 @@ double Integrator::getTemperature() {
   return temperature;
 }
 
+void Integrator::exchangeTemperature(double T) {
+  setTemperature(T);
+}
+
 void Integrator::reset() {
   potentialMaster.computeAll(selfPotentialCallbackVec);
 }
@@ -12,7 +12,9 @@
 using namespace std;
 
 class AtomInfo;
+class DomainDecomposition;
 class MCMove;
+class MCMoveGibbs;
 class PotentialMaster;
 class Box;
 
@@ -50,8 +52,13 @@ class Integrator : public PotentialCallback {
     long getStepCount();
     void setTemperature(double temperature);
     double getTemperature();
+    // switches to a new temperature in a replica exchange, keeping the
+    // configuration
+    virtual void exchangeTemperature(double newTemperature);
     virtual void reset();
     double getPotentialEnergy();
+    // for changes to the energy made by something driving this integrator
+    void addEnergy(double du) {energy += du;}
     virtual void addListener(IntegratorListener* listener);
     virtual void removeListener(IntegratorListener* listener);
     virtual void allComputeFinished(double uTot, double virialTot, double** f);
@@ -71,6 +78,7 @@ class IntegratorMC : public Integrator {
     void addMove(MCMove* move, double probability);
     void removeMove(MCMove* move);
     virtual void doStep();
+    virtual void reset();
     void setTuning(bool doTuning);
     MCMove* getLastMove();
     virtual void addListener(IntegratorListener* listener);
@@ -99,8 +107,15 @@ class IntegratorMD : public Integrator {
     int nbrCheckInterval, nbrCheckCountdown;
     vector<struct PotentialCallbackInfo> allPotentialCallbacks;
     double kineticEnergy;
+    DomainDecomposition* domains;
 
     virtual void computeForces();
+    void checkUpdateNbrs();
+    // atoms we move (those of our domain, if any) and the total
+    int numMovingAtoms();
+    int numTotalAtoms();
+    // sum of x over the domains
+    double sumDomains(double x);
   public:
     IntegratorMD(AtomInfo& atomInfo, PotentialMaster& potentialMaster, Random& random, Box& box);
     virtual ~IntegratorMD();
@@ -108,9 +123,14 @@ class IntegratorMD : public Integrator {
     void setTimeStep(double tStep);
     double getTimeStep();
     void setNbrCheckInterval(int interval);
+    // move only the atoms of this process's domain, with forces, energy
+    // and kinetic energy for the whole system
+    void setDomainDecomposition(DomainDecomposition* domains);
     virtual void allComputeFinished(double uTot, double virialTot, double** f);
     virtual void doStep() = 0;
     virtual void reset();
+    // also scales the velocities to the new temperature
+    virtual void exchangeTemperature(double newTemperature);
     void addPotentialCallback(PotentialCallback* callback, int interval=1);
     double getKineticEnergy();
     double** getForces();
@@ -184,3 +204,80 @@ class IntegratorMulti : public Integrator {
     virtual void doStep() = 0;
     virtual void reset();
 };
+
+/**
+ * Replica exchange (parallel tempering).  Each replica is a complete
+ * system (Box, PotentialMaster and integrator, with its own Random) that
+ * can share the SpeciesList and potentials with the others; those are only
+ * read while the replicas run (molecule COMs go to per-call buffers), but
+ * moves, meters and listeners must not be shared.  Each step
+ * advances all replicas by the swap interval, concurrently on the
+ * ThreadPool, and then tries to swap the temperatures of neighboring
+ * pairs, alternating between the even and odd pairs.  Replicas keep their
+ * configurations; a swap just exchanges their temperatures.
+ */
+class IntegratorReplicaExchange : public Integrator {
+  protected:
+    Random& random;
+    vector<Integrator*> replicas;
+    // increasing temperatures, and the replica at each one
+    vector<double> temperatures;
+    vector<int> replicaAt;
+    int swapInterval;
+    int swapParity;
+    // swaps between temperatures i and i+1
+    vector<long> numSwapTrials, numSwapAccepted;
+
+  public:
+    IntegratorReplicaExchange(PotentialMaster& potentialMasterDummy, Random& random);
+    virtual ~IntegratorReplicaExchange();
+    // replicas need to be added in order of increasing temperature
+    void addReplica(Integrator* integrator, double temperature);
+    void setSwapInterval(int steps);
+    int getNumReplicas() {return replicas.size();}
+    double getReplicaTemperature(int iTemperature) {return temperatures[iTemperature];}
+    // the replica currently at temperature iTemperature
+    Integrator* getReplicaAt(int iTemperature) {return replicas[replicaAt[iTemperature]];}
+    long getNumSwapTrials(int iTemperature) {return numSwapTrials[iTemperature];}
+    // acceptance of swaps between temperatures iTemperature and iTemperature+1
+    double getSwapAcceptance(int iTemperature);
+    virtual void doStep();
+    virtual void reset();
+};
+
+/**
+ * Gibbs ensemble with two boxes.  Each box has its own IntegratorMC (with
+ * its own PotentialMaster, normally a PotentialMasterCell, and its own
+ * Random) holding the moves within that box.  Each step advances both box
+ * integrators by the box step count, concurrently on the ThreadPool, and
+ * then does one trial of a move involving both boxes (MCMoveGibbsTransfer
+ * or MCMoveGibbsVolume), chosen by probability.  The temperature set here
+ * is passed on to the box integrators.  The boxes share their species
+ * (molecular ones included), which the box moves and potential masters
+ * only read; each box needs its own moves and listeners.
+ */
+class IntegratorGibbs : public Integrator {
+  protected:
+    Random& random;
+    Integrator* boxIntegrators[2];
+    int boxSteps;
+    vector<MCMoveGibbs*> moves;
+    vector<double> moveProbabilities;
+    double pMoveSum;
+    MCMoveGibbs* lastMove;
+    vector<IntegratorListener*> listenersMoveAccepted, listenersMoveRejected;
+
+  public:
+    IntegratorGibbs(PotentialMaster& potentialMasterDummy, Random& random, Integrator& integrator0, Integrator& integrator1);
+    virtual ~IntegratorGibbs();
+    // trials in each box between moves involving both boxes
+    void setBoxSteps(int steps);
+    void addMove(MCMoveGibbs* move, double probability);
+    Integrator* getBoxIntegrator(int iBox) {return boxIntegrators[iBox];}
+    double getBoxEnergy(int iBox) {return boxIntegrators[iBox]->getPotentialEnergy();}
+    MCMoveGibbs* getLastMove() {return lastMove;}
+    virtual void doStep();
+    virtual void reset();
+    virtual void addListener(IntegratorListener* listener);
+    virtual void removeListener(IntegratorListener* listener);
+};
@@ -31,6 +31,13 @@ void IntegratorMC::removeMove(MCMove* move) {
   abort();
 }
 
+void IntegratorMC::reset() {
+  Integrator::reset();
+  // moves add single-molecule energies from the direct Ewald sum, so start
+  // from that rather than from the mesh
+  if (potentialMaster.getPMEOrder() > 0) energy = potentialMaster.uTotalFromAtoms();
+}
+
 void IntegratorMC::setTuning(bool doTune) {
   for (vector<MCMove*>::iterator it = moves.begin(); it!=moves.end(); it++) {
     (*it)->tunable = doTune;
@@ -18,14 +18,14 @@ IntegratorMDVelocityVerlet::~IntegratorMDVelocityVerlet(){}
 
 void IntegratorMDVelocityVerlet::doStep() {
   if (nbrCheckCountdown==0) {
-    static_cast<PotentialMasterList&>(potentialMaster).checkUpdateNbrs();
+    checkUpdateNbrs();
     nbrCheckCountdown = nbrCheckInterval;
   }
   stepCount++;
   for (vector<IntegratorListener*>::iterator it = listenersStepStarted.begin(); it!=listenersStepStarted.end(); it++) {
     (*it)->stepStarted();
   }
-  int n = box.getNumAtoms();
+  int n = numMovingAtoms();
   for (int iAtom=0; iAtom<n; iAtom++) {
     int iType = box.getAtomType(iAtom);
     double rMass = 1.0/atomInfo.getMass(iType);
@@ -57,6 +57,7 @@ void IntegratorMDVelocityVerlet::doStep() {
       kineticEnergy += 0.5*mass*vi[j]*vi[j];
     }
   }
+  kineticEnergy = sumDomains(kineticEnergy);
   for (vector<IntegratorListener*>::iterator it = listenersStepFinished.begin(); it!=listenersStepFinished.end(); it++) {
     (*it)->stepFinished();
   }
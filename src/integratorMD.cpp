@@ -4,8 +4,9 @@
 
 #include "integrator.h"
 #include "potential-master.h"
+#include "domain-decomposition.h"
 
-IntegratorMD::IntegratorMD(AtomInfo& ai, PotentialMaster& p, Random& r, Box& b) : Integrator(p), atomInfo(ai), random(r), box(b), forces(NULL), tStep(0.01), thermostat(THERMOSTAT_NONE), nbrCheckInterval(-1), nbrCheckCountdown(-1) {
+IntegratorMD::IntegratorMD(AtomInfo& ai, PotentialMaster& p, Random& r, Box& b) : Integrator(p), atomInfo(ai), random(r), box(b), forces(NULL), tStep(0.01), thermostat(THERMOSTAT_NONE), nbrCheckInterval(-1), nbrCheckCountdown(-1), domains(nullptr) {
   takesForces = true;
 }
 
@@ -15,6 +16,31 @@ void IntegratorMD::setNbrCheckInterval(int i) {
   nbrCheckInterval = nbrCheckCountdown = i;
 }
 
+void IntegratorMD::setDomainDecomposition(DomainDecomposition* dd) {
+  domains = dd;
+}
+
+int IntegratorMD::numMovingAtoms() {
+  return domains ? domains->getNumOwnedAtoms() : box.getNumAtoms();
+}
+
+int IntegratorMD::numTotalAtoms() {
+  return domains ? domains->getNumAtoms() : box.getNumAtoms();
+}
+
+double IntegratorMD::sumDomains(double x) {
+  return domains ? domains->sum(x) : x;
+}
+
+void IntegratorMD::checkUpdateNbrs() {
+  if (domains) {
+    // atoms may have moved between domains, along with their forces
+    domains->checkUpdateNbrs();
+    forces = potentialMaster.getForces();
+  }
+  else static_cast<PotentialMasterList&>(potentialMaster).checkUpdateNbrs();
+}
+
 void IntegratorMD::allComputeFinished(double uTotNew, double virialTotNew, double **f) {
   energy = uTotNew;
   forces = f;
@@ -39,7 +65,7 @@ void IntegratorMD::randomizeVelocity(int iAtom) {
 void IntegratorMD::randomizeVelocities(bool zeroMomentum) {
   double momentum[3] = {0};
   double totalMass = 0;
-  int numAtoms = box.getNumAtoms();
+  int numAtoms = numMovingAtoms();
   double sqrtTM[atomInfo.getNumTypes()], imass[atomInfo.getNumTypes()];
   for (int i=0; i<atomInfo.getNumTypes(); i++) {
     imass[i] = atomInfo.getMass(i);
@@ -62,8 +88,9 @@ void IntegratorMD::randomizeVelocities(bool zeroMomentum) {
   }
   if (zeroMomentum) {
     kineticEnergy = 0;
+    totalMass = sumDomains(totalMass);
     for (int j=0; j<3; j++ ){
-      momentum[j] /= totalMass;
+      momentum[j] = sumDomains(momentum[j])/totalMass;
     }
     for (int iAtom=0; iAtom<numAtoms; iAtom++) {
       int iType = box.getAtomType(iAtom);
@@ -74,17 +101,25 @@ void IntegratorMD::randomizeVelocities(bool zeroMomentum) {
       }
     }
   }
+  kineticEnergy = sumDomains(kineticEnergy);
 }
 
 void IntegratorMD::reset() {
-  if (nbrCheckInterval>0) {
-    static_cast<PotentialMasterList&>(potentialMaster).reset();
+  if (domains) {
+    domains->reset();
     nbrCheckCountdown = nbrCheckInterval;
+    domains->computeAll(selfPotentialCallbackVec);
+  }
+  else {
+    if (nbrCheckInterval>0) {
+      static_cast<PotentialMasterList&>(potentialMaster).reset();
+      nbrCheckCountdown = nbrCheckInterval;
+    }
+    Integrator::reset();
   }
-  Integrator::reset();
 
   kineticEnergy = 0;
-  int numAtoms = box.getNumAtoms();
+  int numAtoms = numMovingAtoms();
   double imass[atomInfo.getNumTypes()];
   for (int i=0; i<atomInfo.getNumTypes(); i++) {
     imass[i] = atomInfo.getMass(i);
@@ -96,6 +131,18 @@ void IntegratorMD::reset() {
       kineticEnergy += 0.5*imass[iType]*vi[j]*vi[j];
     }
   }
+  kineticEnergy = sumDomains(kineticEnergy);
+}
+
+void IntegratorMD::exchangeTemperature(double T) {
+  double scale = sqrt(T/temperature);
+  int numAtoms = numMovingAtoms();
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double* vi = box.getAtomVelocity(iAtom);
+    for (int j=0; j<3; j++) vi[j] *= scale;
+  }
+  kineticEnergy *= T/temperature;
+  setTemperature(T);
 }
 
 double IntegratorMD::getKineticEnergy() {
@@ -107,6 +154,8 @@ void IntegratorMD::addPotentialCallback(PotentialCallback* callback, int interva
   pci.pcb = callback;
   pci.interval = pci.countdown = interval;
   allPotentialCallbacks.push_back(pci);
+  // before any neighbor update can reorder the atoms
+  if (callback->callPermute) potentialMaster.addPermutationCallback(callback);
 }
 
 void IntegratorMD::computeForces() {
@@ -120,7 +169,8 @@ void IntegratorMD::computeForces() {
       selfPotentialCallbackVec.push_back((*it).pcb);
     }
   }
-  potentialMaster.computeAll(selfPotentialCallbackVec);
+  if (domains) domains->computeAll(selfPotentialCallbackVec);
+  else potentialMaster.computeAll(selfPotentialCallbackVec);
 }
 
 double** IntegratorMD::getForces() {
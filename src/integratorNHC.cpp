@@ -33,6 +33,10 @@ void IntegratorNHC::setTemperature(double newTemperature) {
 }
 
 void IntegratorNHC::doStep() {
+  if (nbrCheckCountdown==0) {
+    checkUpdateNbrs();
+    nbrCheckCountdown = nbrCheckInterval;
+  }
   stepCount++;
   for (vector<IntegratorListener*>::iterator it = listenersStepStarted.begin(); it!=listenersStepStarted.end(); it++) {
     (*it)->stepStarted();
@@ -70,7 +74,7 @@ void IntegratorNHC::doStep() {
 }
 
 void IntegratorNHC::propagatorU1(double dt) {
-  int n = box.getNumAtoms();
+  int n = numMovingAtoms();
   for (int iAtom=0; iAtom<n; iAtom++) {
     double* ri = box.getAtomPosition(iAtom);
     double* vi = box.getAtomVelocity(iAtom);
@@ -81,7 +85,7 @@ void IntegratorNHC::propagatorU1(double dt) {
 }
 
 void IntegratorNHC::propagatorU2(double dt) {
-  int n = box.getNumAtoms();
+  int n = numMovingAtoms();
   kineticEnergy = 0;
   for (int iAtom=0; iAtom<n; iAtom++) {
     int iType = box.getAtomType(iAtom);
@@ -92,10 +96,11 @@ void IntegratorNHC::propagatorU2(double dt) {
       kineticEnergy += 0.5*mass*vi[j]*vi[j];
     }
   }
+  kineticEnergy = sumDomains(kineticEnergy);
 }
 
 void IntegratorNHC::propagatorU3(double dt) {
-  int n = box.getNumAtoms();
+  int n = numMovingAtoms();
   double fac = exp(-dt*etaP[0]/q[0]);
   //printf("fac %e  %e %e\n", fac, etaP[0], q[0]);
   kineticEnergy = 0;
@@ -108,13 +113,14 @@ void IntegratorNHC::propagatorU3(double dt) {
       kineticEnergy += 0.5*mass*vi[j]*vi[j];
     }
   }
+  kineticEnergy = sumDomains(kineticEnergy);
   for (int i=0; i<numChains; i++) {
     eta[i] += dt*etaP[i]/q[i];
   }
 }
 
 void IntegratorNHC::propagatorU4(double dt, int direction) {
-  double g = 3*(box.getNumAtoms()-1);
+  double g = 3*(numTotalAtoms()-1);
   //printf("%f %f\n", temperature, kineticEnergy*2/g);
   for (int i=0; i<numChains; i++) {
     int ic = direction == 1 ? i : (numChains-i-1);
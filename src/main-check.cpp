@@ -0,0 +1,416 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <math.h>
+
+#include "potential-master.h"
+#include "integrator.h"
+#include "potential.h"
+#include "move.h"
+#include "move-gibbs.h"
+#include "box.h"
+#include "meter.h"
+#include "data-sink.h"
+#include "random.h"
+#include "ewald-table.h"
+#include "pair-kernel.h"
+#include "thread-pool.h"
+
+/**
+ * Regression checks: each optimized path is compared against the plain
+ * (scalar, direct) result it replaces.  Exits non-zero if any diverge.
+ */
+
+class PotentialCallbackCapture : public PotentialCallback {
+  public:
+    int numAtoms;
+    double u, virial;
+    vector<double> f;
+    PotentialCallbackCapture(int n) : numAtoms(n), u(0), virial(0) {
+      callFinished = true;
+      takesForces = true;
+    }
+    void allComputeFinished(double uTot, double virialTot, double** force) {
+      u = uTot;
+      virial = virialTot;
+      f.assign(force[0], force[0]+3*numAtoms);
+    }
+};
+
+bool report(const char* what, double err, double tol) {
+  bool bad = !(err <= tol);
+  printf("%-40s err %-12g %s\n", what, err, bad ? "FAIL" : "ok");
+  return bad;
+}
+
+double maxDiff(const vector<double>& a, const vector<double>& b) {
+  double d = 0;
+  for (size_t i=0; i<a.size(); i++) d = fmax(d, fabs(a[i]-b[i]));
+  return d;
+}
+
+void jiggle(Box& box, Random& random, double amount) {
+  for (int i=0; i<box.getNumAtoms(); i++) {
+    double* r = box.getAtomPosition(i);
+    for (int k=0; k<3; k++) r[k] += amount*(random.nextDouble()-0.5);
+    box.nearestImage(r);
+  }
+}
+
+void setupCharges(PotentialMaster& pm, Potential& p) {
+  for (int i=0; i<2; i++) {
+    for (int j=0; j<2; j++) pm.setPairPotential(i, j, &p);
+  }
+  pm.setCharge(0, 1);
+  pm.setCharge(1, -1);
+  pm.setDoTruncationCorrection(false);
+}
+
+double energyForces(PotentialMaster& pm, int numAtoms, vector<double>& f) {
+  PotentialCallbackCapture pcc(numAtoms);
+  vector<PotentialCallback*> callbacks;
+  callbacks.push_back(&pcc);
+  pm.computeAll(callbacks);
+  f = pcc.f;
+  return pcc.u;
+}
+
+// energy from a fresh plain PotentialMaster
+double directEnergy(SpeciesList& speciesList, Box& box, Potential& p) {
+  PotentialMaster pm(speciesList, box, false);
+  pm.setPairPotential(0, 0, &p);
+  pm.setDoTruncationCorrection(false);
+  PotentialCallbackEnergy pce;
+  vector<PotentialCallback*> callbacks;
+  callbacks.push_back(&pce);
+  pm.computeAll(callbacks);
+  return pce.getData()[0];
+}
+
+// PME energy and forces against direct Ewald, serial and threaded
+bool checkPME() {
+  SpeciesList speciesList;
+  speciesList.add(new SpeciesSimple(1,1));
+  speciesList.add(new SpeciesSimple(1,1));
+  Box box(speciesList);
+  box.setBoxSize(12,12,12);
+  box.setNumMolecules(0, 100);
+  box.setNumMolecules(1, 100);
+  box.initCoordinates();
+  Random random(5);
+  jiggle(box, random, 0.3);
+  int n = box.getNumAtoms();
+  PotentialLJ plj(1,1,TRUNC_SIMPLE, 3.0);
+
+  PotentialMaster direct(speciesList, box, false), pme(speciesList, box, false), pme4(speciesList, box, false);
+  setupCharges(direct, plj);
+  setupCharges(pme, plj);
+  setupCharges(pme4, plj);
+  direct.setEwald(3.0, 0.8);
+  pme.setEwald(3.0, 0.8, 6);
+  pme4.setEwald(3.0, 0.8, 6);
+  pme4.setFourierTasks(4);
+  vector<double> fd, fp, fp4;
+  double ud = energyForces(direct, n, fd);
+  double up = energyForces(pme, n, fp);
+  ThreadPool::get().setNumThreads(4);
+  double up4 = energyForces(pme4, n, fp4);
+  ThreadPool::get().setNumThreads(1);
+
+  bool bad = false;
+  bad |= report("PME energy vs direct Ewald", fabs(up-ud)/fabs(ud), 1e-3);
+  bad |= report("PME forces vs direct Ewald", maxDiff(fp, fd), 1e-2);
+  bad |= report("PME 4 tasks vs 1 task", fmax(fabs(up4-up), maxDiff(fp4, fp)), 1e-10);
+  Random random2(6);
+  IntegratorMC mc(pme, random2);
+  mc.reset();
+  bad |= report("PME MC reset vs direct Ewald", fabs(mc.getPotentialEnergy()-ud), 1e-8);
+  return bad;
+}
+
+// tabulated Ewald kernel against erfc
+bool checkEwaldTable() {
+  double alpha = 0.26111648393354675;
+  bool bad = false;
+  for (int type=0; type<2; type++) {
+    EwaldTable table(alpha, 1.0, 11.0, type, 1e-8);
+    PotentialEwaldBare exact(alpha, 1, 11.0), tabulated(alpha, 1, 11.0);
+    tabulated.setTable(&table);
+    double err = 0;
+    for (int i=0; i<200000; i++) {
+      double r2 = 1 + 120.0*i/200000.0 + 1e-7;
+      double u, du, d2u, tu, tdu, td2u;
+      exact.u012(r2, u, du, d2u);
+      tabulated.u012(r2, tu, tdu, td2u);
+      err = fmax(err, fmax(fabs(tu-u)/fabs(u), fabs(tdu-du)/fabs(du)));
+    }
+    bad |= report(type==EWALD_TABLE_SPLINE ? "EwaldTable spline vs erfc" : "EwaldTable Chebyshev vs erfc", err, 2*fmax(table.getError(), 1e-8));
+  }
+  return bad;
+}
+
+// vectorized and cluster pair kernels, and threads, against the plain
+// PotentialMaster
+bool checkKernels() {
+  bool bad = false;
+  int numAtoms = 2000;
+  PotentialLJ p00(1,1,TRUNC_SIMPLE,3.0), p01(1,1.1,TRUNC_SIMPLE,3.0), p11(1,1.2,TRUNC_SIMPLE,3.0);
+  SpeciesList speciesList;
+  speciesList.add(new SpeciesSimple(1,1));
+  speciesList.add(new SpeciesSimple(1,1));
+  Box box(speciesList);
+  double L = pow(numAtoms/0.8, 1.0/3.0);
+  box.setBoxSize(L,L,L);
+  box.setNumMolecules(0, numAtoms/2);
+  box.setNumMolecules(1, numAtoms/2);
+  box.initCoordinates();
+  Random random(12345);
+  jiggle(box, random, 0.2);
+
+  PotentialMaster plain(speciesList, box, false);
+  plain.setPairPotential(0,0,&p00);
+  plain.setPairPotential(0,1,&p01);
+  plain.setPairPotential(1,1,&p11);
+  plain.setDoTruncationCorrection(false);
+  PotentialCallbackCapture ref(numAtoms);
+  vector<PotentialCallback*> callbacks;
+  callbacks.push_back(&ref);
+  plain.computeAll(callbacks);
+
+  int best = pairKernelLevel();
+  for (int level=0; level<=best; level+=(best>0 ? best : 1)) {
+    for (int cs=0; cs<=8; cs+=4) {
+      for (int nt=1; nt<=4; nt+=3) {
+        PotentialMasterList pm(speciesList, box, false, 2, 3.5);
+        pm.setPairPotential(0,0,&p00);
+        pm.setPairPotential(0,1,&p01);
+        pm.setPairPotential(1,1,&p11);
+        pm.setDoTruncationCorrection(false);
+        pm.setKernelLevel(level);
+        pm.setClusterSize(cs);
+        ThreadPool::get().setNumThreads(nt);
+        pm.init();
+        pm.reset();
+        PotentialCallbackCapture pcc(numAtoms);
+        callbacks[0] = &pcc;
+        pm.computeAll(callbacks);
+        double err = fmax(fabs(pcc.u-ref.u), fmax(fabs(pcc.virial-ref.virial), maxDiff(pcc.f, ref.f)));
+        char what[64];
+        snprintf(what, 64, "list kernel %d clusters %d threads %d", level, cs, nt);
+        bad |= report(what, err, 1e-8);
+      }
+    }
+  }
+  ThreadPool::get().setNumThreads(1);
+  return bad;
+}
+
+// atom energies from a list master with Ewald after permuting atoms
+bool checkPermute() {
+  SpeciesList speciesList;
+  speciesList.add(new SpeciesSimple(1,1));
+  speciesList.add(new SpeciesSimple(1,1));
+  Box box(speciesList);
+  box.setBoxSize(12,12,12);
+  box.setNumMolecules(0, 100);
+  box.setNumMolecules(1, 100);
+  box.initCoordinates();
+  Random random(5);
+  jiggle(box, random, 0.3);
+  int n = box.getNumAtoms();
+  PotentialLJ plj(1,1,TRUNC_SIMPLE, 3.0);
+  PotentialMasterList pl(speciesList, box, false, 2, 3.5);
+  PotentialMaster pb(speciesList, box, false);
+  setupCharges(pl, plj);
+  setupCharges(pb, plj);
+  pl.setEwald(2.5, 0.8);
+  pb.setEwald(2.5, 0.8);
+  pl.init();
+  pl.reset();
+  vector<PotentialCallback*> callbacks;
+  pl.computeAll(callbacks);
+
+  vector<int> idx(n);
+  for (int i=0; i<n; i++) idx[i] = i;
+  // atoms only trade places within a species
+  for (int i=0; i<n; i++) {
+    int j = (i/100)*100 + random.nextInt(100);
+    int t = idx[i];
+    idx[i] = idx[j];
+    idx[j] = t;
+  }
+  pl.permuteAtoms(idx.data());
+  pb.computeAll(callbacks);
+  double err = 0;
+  for (int i=0; i<n; i++) {
+    err = fmax(err, fabs(pl.oldMoleculeEnergy(i)-pb.oldMoleculeEnergy(i)));
+    pl.resetAtomDU();
+    pb.resetAtomDU();
+  }
+  return report("permuteAtoms vs plain Ewald", err, 1e-8);
+}
+
+// merged Average blocks against statistics of all samples
+bool checkAverageMerge() {
+  bool bad = false;
+  // few samples: nothing collapses, so each sample is a block
+  Average a1(1,1,1000,false), a2(1,1,1000,false), merged(1,1,1000,false);
+  double x1[5] = {1,2,3,4,5}, x2[3] = {10,11,12};
+  for (int i=0; i<5; i++) a1.addData(&x1[i]);
+  for (int i=0; i<3; i++) a2.addData(&x2[i]);
+  merged.mergeBlocks(a1);
+  merged.mergeBlocks(a2);
+  double** stats = merged.getStatistics();
+  double mu = 0, var = 0, cov = 0;
+  for (int i=0; i<5; i++) mu += x1[i];
+  for (int i=0; i<3; i++) mu += x2[i];
+  mu /= 8;
+  for (int i=0; i<5; i++) var += (x1[i]-mu)*(x1[i]-mu);
+  for (int i=0; i<3; i++) var += (x2[i]-mu)*(x2[i]-mu);
+  var /= 8;
+  // neighbors only within each walker's own sequence
+  for (int i=0; i<4; i++) cov += (x1[i]-mu)*(x1[i+1]-mu);
+  for (int i=0; i<2; i++) cov += (x2[i]-mu)*(x2[i+1]-mu);
+  cov /= 6;
+  double cor = cov/var;
+  if (cor <= -1 || cor >= 1) cor = 0;
+  double err = fmax(fabs(stats[0][AVG_AVG]-mu), fabs(stats[0][AVG_ERR]-sqrt(var/7)));
+  err = fmax(err, fabs(stats[0][AVG_ACOR]-cor));
+  bad |= report("merged blocks vs exact statistics", err, 1e-12);
+
+  // many samples: blocks collapse and partial blocks are left over
+  Random random(3);
+  Average b1(2,1,10,true), b2(2,1,10,true), b3(2,1,10,true), mergedB(2,1,10,true);
+  Average* walkers[3] = {&b1, &b2, &b3};
+  int lengths[3] = {1037, 555, 90};
+  double sum[2] = {0,0};
+  long n = 0;
+  for (int w=0; w<3; w++) {
+    for (int i=0; i<lengths[w]; i++) {
+      double x[2] = {random.nextDouble(), random.nextDouble()+1};
+      walkers[w]->addData(x);
+      sum[0] += x[0];
+      sum[1] += x[1];
+      n++;
+    }
+  }
+  for (int w=0; w<3; w++) mergedB.mergeBlocks(*walkers[w]);
+  stats = mergedB.getStatistics();
+  err = fmax(fabs(stats[0][AVG_AVG]-sum[0]/n), fabs(stats[1][AVG_AVG]-sum[1]/n));
+  bad |= report("merged collapsed blocks vs all samples", err, 1e-12);
+  return bad;
+}
+
+// Gibbs moves: acceptance against the textbook expressions, with energies
+// from scratch, and tracked box energies after a threaded run
+bool checkGibbs() {
+  bool bad = false;
+  double temperature = 1.5;
+  int numAtoms = 200;
+  double L = pow(numAtoms/0.3, 1.0/3.0);
+  Random random(11), random0(12), random1(13);
+  PotentialLJ plj(1,1,TRUNC_SIMPLE, 3.0);
+  SpeciesList speciesList;
+  speciesList.add(new SpeciesSimple(1,1));
+  Box box0(speciesList), box1(speciesList);
+  Box* boxes[2] = {&box0, &box1};
+  for (int i=0; i<2; i++) {
+    boxes[i]->setBoxSize(L,L,L);
+    boxes[i]->setNumMolecules(0, numAtoms);
+    boxes[i]->initCoordinates();
+  }
+  PotentialMasterCell pm0(speciesList, box0, false, 2), pm1(speciesList, box1, false, 2);
+  pm0.setDoTruncationCorrection(false);
+  pm1.setDoTruncationCorrection(false);
+  pm0.setPairPotential(0,0,&plj);
+  pm1.setPairPotential(0,0,&plj);
+  pm0.init();
+  pm1.init();
+  IntegratorMC integrator0(pm0, random0), integrator1(pm1, random1);
+  MCMoveDisplacement move0(box0, pm0, random0, 0.2), move1(box1, pm1, random1, 0.2);
+  integrator0.addMove(&move0, 1);
+  integrator1.addMove(&move1, 1);
+  MeterPotentialEnergy meterPE0(integrator0), meterPE1(integrator1);
+  IntegratorGibbs gibbs(pm0, random, integrator0, integrator1);
+  MCMoveGibbsTransfer transfer(box0, pm0, box1, pm1, random, 0);
+  MCMoveGibbsVolume volume(box0, pm0, meterPE0, box1, pm1, meterPE1, random, 0.05, speciesList);
+  gibbs.addMove(&transfer, 0.9);
+  gibbs.addMove(&volume, 0.1);
+  gibbs.setBoxSteps(10);
+  gibbs.setTemperature(temperature);
+  gibbs.reset();
+  ThreadPool::get().setNumThreads(2);
+  for (int i=0; i<2000; i++) gibbs.doStep();
+  ThreadPool::get().setNumThreads(1);
+  double err = 0;
+  for (int i=0; i<2; i++) {
+    err = fmax(err, fabs(gibbs.getBoxEnergy(i)-directEnergy(speciesList, *boxes[i], plj)));
+  }
+  bad |= report("Gibbs box energies vs recomputed", err, 1e-7);
+  double acc = fmin(transfer.getAcceptance(), volume.getAcceptance());
+  acc = fmin(acc, 1-fmax(transfer.getAcceptance(), volume.getAcceptance()));
+  bad |= report("Gibbs acceptance within (0,1)", acc > 0 ? 0 : 1, 0);
+
+  // volume trials, each rejected so the boxes are unchanged
+  double u[2], v[2];
+  int n[2];
+  err = 0;
+  for (int iTrial=0; iTrial<20; iTrial++) {
+    for (int i=0; i<2; i++) {
+      u[i] = directEnergy(speciesList, *boxes[i], plj);
+      const double* bs = boxes[i]->getBoxSize();
+      v[i] = bs[0]*bs[1]*bs[2];
+      n[i] = boxes[i]->getNumAtoms();
+    }
+    volume.doTrial();
+    double chi = volume.getChi(temperature);
+    double x = 0;
+    for (int i=0; i<2; i++) {
+      const double* bs = boxes[i]->getBoxSize();
+      x += -(directEnergy(speciesList, *boxes[i], plj) - u[i])/temperature;
+      x += (n[i]+1)*log(bs[0]*bs[1]*bs[2]/v[i]);
+    }
+    err = fmax(err, fabs(chi - (x>0 ? 1 : exp(x))));
+    volume.rejectNotify();
+  }
+  bad |= report("Gibbs volume acceptance vs textbook", err, 1e-8);
+
+  // transfer trials, each accepted so both boxes can be recomputed
+  err = 0;
+  for (int iTrial=0; iTrial<20; iTrial++) {
+    for (int i=0; i<2; i++) {
+      u[i] = directEnergy(speciesList, *boxes[i], plj);
+      const double* bs = boxes[i]->getBoxSize();
+      v[i] = bs[0]*bs[1]*bs[2];
+      n[i] = boxes[i]->getNumAtoms();
+    }
+    if (!transfer.doTrial()) continue;
+    double chi = transfer.getChi(temperature);
+    transfer.acceptNotify();
+    int s = transfer.getSourceBox(), d = 1-s;
+    double du = 0;
+    for (int i=0; i<2; i++) {
+      double dui = directEnergy(speciesList, *boxes[i], plj) - u[i];
+      err = fmax(err, fabs(transfer.energyChange(i) - dui));
+      du += dui;
+    }
+    double a = n[s]*v[d]/((n[d]+1)*v[s]);
+    err = fmax(err, fabs(chi - fmin(1, a*exp(-du/temperature))));
+  }
+  bad |= report("Gibbs transfer acceptance vs textbook", err, 1e-8);
+  return bad;
+}
+
+int main(int argc, char** argv) {
+  bool bad = false;
+  bad |= checkPME();
+  bad |= checkEwaldTable();
+  bad |= checkKernels();
+  bad |= checkPermute();
+  bad |= checkAverageMerge();
+  bad |= checkGibbs();
+  printf("%s\n", bad ? "FAILED" : "all checks passed");
+  return bad ? 1 : 0;
+}
@@ -13,6 +13,7 @@ MeterFullCompute::~MeterFullCompute() {
 
 void MeterFullCompute::addCallback(PotentialCallback* pcb) {
   callbacks.push_back(pcb);
+  if (pcb->callPermute) potentialMaster.addPermutationCallback(pcb);
   nData += pcb->getNumData();
   data = (double*)realloc(data, nData*sizeof(double));
 }
@@ -0,0 +1,47 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "move.h"
+#include "thread-pool.h"
+
+MCMoveCheckerboard::MCMoveCheckerboard(Box& b, PotentialMasterCell& p, Random& r, double ss) : MCMove(b,p,r,ss), potentialMasterCell(p), numTasks(0), uChange(0) {
+}
+
+MCMoveCheckerboard::~MCMoveCheckerboard() {
+  for (vector<Random*>::iterator it = taskRandom.begin(); it!=taskRandom.end(); it++) delete *it;
+}
+
+void MCMoveCheckerboard::setNumTasks(int n) {
+  numTasks = n;
+}
+
+bool MCMoveCheckerboard::doTrial() {
+  if (tunable && numTrials >= adjustInterval) {
+    adjustStepSize();
+  }
+  int nt = numTasks>0 ? numTasks : ThreadPool::get().getNumThreads();
+  // each stream is seeded from our own, so the run is reproducible for a
+  // given number of tasks
+  while ((int)taskRandom.size() < nt) taskRandom.push_back(new Random(random.nextInt(0x7fffffff)));
+  while ((int)taskRandom.size() > nt) {
+    delete taskRandom.back();
+    taskRandom.pop_back();
+  }
+  return box.getNumAtoms() > 0;
+}
+
+double MCMoveCheckerboard::getChi(double T) {
+  uChange = potentialMasterCell.sweepCheckerboard(stepSize, T, random, taskRandom, numTrials, numAccepted, chiSum);
+  return 1;
+}
+
+void MCMoveCheckerboard::acceptNotify() {}
+
+void MCMoveCheckerboard::rejectNotify() {
+  uChange = 0;
+}
+
+double MCMoveCheckerboard::energyChange() {
+  return uChange;
+}
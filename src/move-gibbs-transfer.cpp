@@ -0,0 +1,120 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "move-gibbs.h"
+
+MCMoveGibbsTransfer::MCMoveGibbsTransfer(Box& b0, PotentialMaster& pm0, Box& b1, PotentialMaster& pm1, Random& r, int s) : MCMoveGibbs(b0,pm0,b1,pm1,r,0), iSource(0), inserted(false), iSpecies(s), numAtoms(b0.getSpeciesList().get(s)->getNumAtoms()) {
+  tunable = false;
+}
+
+bool MCMoveGibbsTransfer::doTrial() {
+  numTrials++;
+  uOld = uNew = 0;
+  inserted = false;
+  iSource = random.nextInt(2);
+  Box& sBox = getBox(iSource);
+  Box& dBox = getBox(1-iSource);
+  int n = sBox.getNumMolecules(iSpecies);
+  if (n==0) return false;
+  xMolecule = random.nextInt(n);
+  iMolecule = sBox.getGlobalMoleculeIndex(iSpecies, xMolecule);
+  uOld = getPotentialMaster(iSource).oldMoleculeEnergy(iMolecule);
+
+  // insert a copy (same conformation) into the other box
+  xNewMolecule = dBox.getNumMolecules(iSpecies);
+  dBox.setNumMolecules(iSpecies, xNewMolecule+1);
+  const double *bs = dBox.getBoxSize();
+  double mPos[3];
+  for (int k=0; k<3; k++) {
+    mPos[k] = bs[k]*(random.nextDouble32()-0.5);
+  }
+  int sFirstAtom = sBox.getFirstAtom(iSpecies, xMolecule);
+  int dFirstAtom = dBox.getFirstAtom(iSpecies, xNewMolecule);
+  const double *s0 = sBox.getAtomPosition(sFirstAtom);
+  double *r0 = dBox.getAtomPosition(dFirstAtom);
+  for (int k=0; k<3; k++) r0[k] = mPos[k];
+  if (numAtoms>1) {
+    rotMat.randomize(random);
+    for (int j=1; j<numAtoms; j++) {
+      const double *sj = sBox.getAtomPosition(sFirstAtom+j);
+      double dr[3];
+      for (int k=0; k<3; k++) dr[k] = sj[k]-s0[k];
+      sBox.nearestImage(dr);
+      double *rj = dBox.getAtomPosition(dFirstAtom+j);
+      for (int k=0; k<3; k++) rj[k] = mPos[k] + dr[k];
+      rotMat.transformAbout(rj, r0, dBox);
+    }
+  }
+  PotentialMaster& dPM = getPotentialMaster(1-iSource);
+  dPM.newMolecule(iSpecies);
+  inserted = true;
+  if (numAtoms==1) {
+    dPM.computeOne(dFirstAtom, uNew);
+  }
+  else {
+    dPM.computeOneMolecule(dBox.getGlobalMoleculeIndex(iSpecies, xNewMolecule), uNew);
+  }
+  return true;
+}
+
+double MCMoveGibbsTransfer::getChi(double T) {
+  Box& sBox = getBox(iSource);
+  Box& dBox = getBox(1-iSource);
+  const double* bs = sBox.getBoxSize();
+  double sVol = bs[0]*bs[1]*bs[2];
+  bs = dBox.getBoxSize();
+  double dVol = bs[0]*bs[1]*bs[2];
+  // the destination already holds the new molecule
+  double a = sBox.getNumMolecules(iSpecies)*dVol/(dBox.getNumMolecules(iSpecies)*sVol);
+  double chi = a*exp(-(uNew-uOld)/T);
+  if (chi>1) chi = 1;
+  chiSum += chi;
+  return chi;
+}
+
+void MCMoveGibbsTransfer::acceptNotify() {
+  getPotentialMaster(1-iSource).processAtomU(1);
+
+  // now delete from the source, as MCMoveInsertDelete does
+  Box& sBox = getBox(iSource);
+  PotentialMaster& sPM = getPotentialMaster(iSource);
+  double uTmp;
+  if (numAtoms==1) {
+    sPM.computeOne(sBox.getFirstAtom(iSpecies, xMolecule), uTmp);
+  }
+  else {
+    sPM.computeOneMolecule(iMolecule, uTmp);
+  }
+  sPM.processAtomU(-1);
+  sPM.removeMolecule(iSpecies, xMolecule);
+
+  int jMolecule = sBox.getNumMolecules(iSpecies)-1;
+  if (jMolecule>xMolecule) {
+    int xFirstAtom = sBox.getFirstAtom(iSpecies, xMolecule);
+    int jFirstAtom = sBox.getFirstAtom(iSpecies, jMolecule);
+    for (int k=0; k<numAtoms; k++) {
+      double *rx = sBox.getAtomPosition(xFirstAtom + k);
+      double *rj = sBox.getAtomPosition(jFirstAtom + k);
+      for (int l=0; l<3; l++) rx[l] = rj[l];
+    }
+  }
+  sBox.setNumMolecules(iSpecies, jMolecule);
+
+  numAccepted++;
+}
+
+void MCMoveGibbsTransfer::rejectNotify() {
+  if (inserted) {
+    PotentialMaster& dPM = getPotentialMaster(1-iSource);
+    dPM.removeMolecule(iSpecies, xNewMolecule);
+    getBox(1-iSource).setNumMolecules(iSpecies, xNewMolecule);
+    dPM.resetAtomDU();
+  }
+  getPotentialMaster(iSource).resetAtomDU();
+  uOld = uNew = 0;
+}
+
+double MCMoveGibbsTransfer::energyChange(int iBox) {
+  return iBox==iSource ? -uOld : uNew;
+}
@@ -0,0 +1,71 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "move-gibbs.h"
+#include "move-volume.h"
+#include "thread-pool.h"
+
+MCMoveGibbsVolume::MCMoveGibbsVolume(Box& b0, PotentialMaster& pm0, Meter& oldPE0, Box& b1, PotentialMaster& pm1, Meter& oldPE1, Random& r, double ss, SpeciesList& sl) : MCMoveGibbs(b0,pm0,b1,pm1,r,ss), speciesList(sl) {
+  oldMeterPE[0] = &oldPE0;
+  oldMeterPE[1] = &oldPE1;
+  for (int i=0; i<2; i++) callbacks[i].push_back(&pce[i]);
+}
+
+void MCMoveGibbsVolume::computeEnergies() {
+  ThreadPool::get().run(2, [&](int i) {
+    pce[i].reset();
+    getPotentialMaster(i).computeAll(callbacks[i]);
+    uNew[i] = pce[i].getData()[0];
+  });
+}
+
+bool MCMoveGibbsVolume::doTrial() {
+  if (tunable && numTrials >= adjustInterval) {
+    adjustStepSize();
+  }
+  for (int i=0; i<2; i++) {
+    uOld[i] = oldMeterPE[i]->getData()[0];
+    const double* bs = getBox(i).getBoxSize();
+    vOld[i] = bs[0]*bs[1]*bs[2];
+  }
+  double vTot = vOld[0] + vOld[1];
+  double lnRatio = log(vOld[0]/vOld[1]) + (2*random.nextDouble32()-1)*stepSize;
+  vNew[0] = vTot/(1+exp(-lnRatio));
+  vNew[1] = vTot - vNew[0];
+  for (int i=0; i<2; i++) {
+    scale[i] = cbrt(vNew[i]/vOld[i]);
+    MCMoveVolume::scaleVolume(getBox(i), speciesList, scale[i]);
+    getPotentialMaster(i).updateVolume();
+  }
+  numTrials++;
+  return true;
+}
+
+double MCMoveGibbsVolume::getChi(double T) {
+  computeEnergies();
+  double x = -(uNew[0] - uOld[0] + uNew[1] - uOld[1])/T;
+  for (int i=0; i<2; i++) {
+    x += (getBox(i).getTotalNumMolecules()+1)*log(vNew[i]/vOld[i]);
+  }
+  double chi = x>0 ? 1 : exp(x);
+  chiSum += chi;
+  return chi;
+}
+
+void MCMoveGibbsVolume::acceptNotify() {
+  numAccepted++;
+}
+
+void MCMoveGibbsVolume::rejectNotify() {
+  for (int i=0; i<2; i++) {
+    MCMoveVolume::scaleVolume(getBox(i), speciesList, 1/scale[i]);
+    getPotentialMaster(i).updateVolume();
+  }
+  // we have to recompute energy so that atom energies are re-updated
+  computeEnergies();
+}
+
+double MCMoveGibbsVolume::energyChange(int iBox) {
+  return uNew[iBox]-uOld[iBox];
+}
@@ -0,0 +1,12 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "move-gibbs.h"
+
+MCMoveGibbs::MCMoveGibbs(Box& b0, PotentialMaster& pm0, Box& b1, PotentialMaster& pm1, Random& r, double ss) : MCMove(b0,pm0,r,ss), box1(b1), potentialMaster1(pm1) {
+}
+
+double MCMoveGibbs::energyChange() {
+  return energyChange(0) + energyChange(1);
+}
@@ -0,0 +1,83 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "move.h"
+#include "meter.h"
+#include "species.h"
+
+/**
+ * Move involving both boxes of a Gibbs ensemble (see IntegratorGibbs).
+ * Our base class holds box 0; we also hold box 1.
+ */
+class MCMoveGibbs : public MCMove {
+  protected:
+    Box& box1;
+    PotentialMaster& potentialMaster1;
+    Box& getBox(int iBox) {return iBox==0 ? box : box1;}
+    PotentialMaster& getPotentialMaster(int iBox) {return iBox==0 ? potentialMaster : potentialMaster1;}
+
+  public:
+    MCMoveGibbs(Box& box0, PotentialMaster& potentialMaster0, Box& box1, PotentialMaster& potentialMaster1, Random& random, double stepSize);
+    virtual ~MCMoveGibbs() {}
+    // change in the energy of box iBox from the last accepted trial
+    virtual double energyChange(int iBox) = 0;
+    virtual double energyChange();
+};
+
+/**
+ * Moves a molecule from one box into the other, at a random position and
+ * orientation there.  Energies come from the incremental machinery used by
+ * MCMoveInsertDelete.
+ */
+class MCMoveGibbsTransfer : public MCMoveGibbs {
+  private:
+    double uOld, uNew;
+    // box we take the molecule from
+    int iSource;
+    int xMolecule, iMolecule;
+    int xNewMolecule;
+    bool inserted;
+    const int iSpecies;
+    const int numAtoms;
+    RotationMatrix rotMat;
+
+  public:
+    MCMoveGibbsTransfer(Box& box0, PotentialMaster& potentialMaster0, Box& box1, PotentialMaster& potentialMaster1, Random& random, int iSpecies);
+    ~MCMoveGibbsTransfer() {}
+
+    virtual bool doTrial();
+    virtual double getChi(double temperature);
+    virtual void acceptNotify();
+    virtual void rejectNotify();
+    virtual double energyChange(int iBox);
+    int getSourceBox() {return iSource;}
+};
+
+/**
+ * Exchanges volume between the boxes, keeping the total constant.  Steps
+ * are taken in ln(V0/V1).  Both boxes are recomputed concurrently on the
+ * ThreadPool.
+ */
+class MCMoveGibbsVolume : public MCMoveGibbs {
+  private:
+    SpeciesList& speciesList;
+    Meter* oldMeterPE[2];
+    double vOld[2], vNew[2], scale[2];
+    double uOld[2], uNew[2];
+    PotentialCallbackEnergy pce[2];
+    vector<PotentialCallback*> callbacks[2];
+    void computeEnergies();
+
+  public:
+    MCMoveGibbsVolume(Box& box0, PotentialMaster& potentialMaster0, Meter& oldMeterPE0, Box& box1, PotentialMaster& potentialMaster1, Meter& oldMeterPE1, Random& random, double stepSize, SpeciesList& speciesList);
+    ~MCMoveGibbsVolume() {}
+
+    virtual bool doTrial();
+    virtual double getChi(double temperature);
+    virtual void acceptNotify();
+    virtual void rejectNotify();
+    virtual double energyChange(int iBox);
+};
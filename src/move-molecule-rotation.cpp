@@ -59,7 +59,8 @@ bool MCMoveMoleculeRotate::doTrial() {
   double theta = stepSize*2*(random.nextDouble32()-0.5);
   mat.setSimpleAxisAngle(axis, theta);
   Species* species = speciesList.get(mySpecies);
-  double* center = species->getMoleculeCOM(box, iAtomFirst, iAtomLast);
+  double center[3];
+  species->getMoleculeCOM(box, iAtomFirst, iAtomLast, center);
   for (int i=0; i<na; i++) {
     int iAtom = iAtomFirst + i;
     double *ri = box.getAtomPosition(iAtom);
@@ -97,7 +98,8 @@ void MCMoveMoleculeRotate::acceptNotify() {
   // this call is designed to set up the next call.  uTmp won't necessarily be correct
   potentialMaster.processAtomU(-1);
   Species* species = speciesList.get(mySpecies);
-  double* center = species->getMoleculeCOM(box, iAtomFirst, iAtomLast);
+  double center[3];
+  species->getMoleculeCOM(box, iAtomFirst, iAtomLast, center);
   for (int i=0; i<na; i++) {
     int iAtom = iAtomFirst + i;
     double *ri = box.getAtomPosition(iAtom);
@@ -9,13 +9,18 @@ MCMoveVolume::MCMoveVolume(Box& b, PotentialMaster& pm, Random& r, double p, dou
 }
 
 void MCMoveVolume::scaleVolume(double s) {
+  scaleVolume(box, speciesList, s);
+}
+
+void MCMoveVolume::scaleVolume(Box& box, SpeciesList& speciesList, double s) {
   int nm = box.getTotalNumMolecules();
   s -= 1;
   for (int iMolecule=0; iMolecule<nm; iMolecule++) {
     int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
     box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
     Species* species = speciesList.get(iSpecies);
-    double* iPos = species->getMoleculeCOM(box, iFirstAtom, iLastAtom);
+    double iPos[3];
+    species->getMoleculeCOM(box, iFirstAtom, iLastAtom, iPos);
     double dr[3] = {iPos[0]*s, iPos[1]*s, iPos[2]*s};
     for (int jAtom=iFirstAtom; jAtom<=iLastAtom; jAtom++) {
       double* rj = box.getAtomPosition(jAtom);
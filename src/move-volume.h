@@ -2,6 +2,8 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#pragma once
+
 #include "move.h"
 #include "meter.h"
 #include "species.h"
@@ -21,6 +23,8 @@ class MCMoveVolume : public MCMove {
   public:
     MCMoveVolume(Box& box, PotentialMaster& potentialMaster, Random& random, double pressure, double stepSize, SpeciesList& speciesList, Meter& oldMeterPE);
     ~MCMoveVolume() {}
+    // scales the box and the molecule centers by s
+    static void scaleVolume(Box& box, SpeciesList& speciesList, double s);
 
     virtual bool doTrial();
     virtual double getChi(double temperature);
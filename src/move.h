@@ -63,6 +63,31 @@ class MCMoveDisplacement : public MCMove {
     virtual double energyChange();
 };
 
+// one checkerboard sweep (see PotentialMasterCell::sweepCheckerboard) per
+// trial, which is always accepted.  the trial and acceptance counts are for
+// the single-atom trials within the sweeps.
+class MCMoveCheckerboard : public MCMove {
+  private:
+    PotentialMasterCell& potentialMasterCell;
+    int numTasks;
+    vector<Random*> taskRandom;
+    double uChange;
+
+  public:
+
+    MCMoveCheckerboard(Box& box, PotentialMasterCell& potentialMaster, Random& random, double stepSize);
+    ~MCMoveCheckerboard();
+
+    // the cells of each color are split into this many tasks, each with its
+    // own random number stream.  by default, one per thread in the pool.
+    void setNumTasks(int n);
+    virtual bool doTrial();
+    virtual double getChi(double temperature);
+    virtual void acceptNotify();
+    virtual void rejectNotify();
+    virtual double energyChange();
+};
+
 class MCMoveInsertDelete : public MCMove {
   private:
     double uOld, uNew;
@@ -0,0 +1,187 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <math.h>
+#include "potential.h"
+#include "ewald-table.h"
+#include "util.h"
+
+/**
+ * PairTable holds the parameters of the pair potential for every pair of
+ * atom types in flat, aligned arrays (index iType*numAtomTypes+jType).  If
+ * every pair potential can be described by one of the functors below,
+ * PotentialMaster instantiates its pair loops with that functor; otherwise
+ * the PairVirtual functor calls the Potential objects.
+ */
+class PairTable {
+  public:
+    const int numAtomTypes;
+    int kind;
+    // exponent shared by all soft-sphere pairs, -1 if they differ
+    int ssExponent;
+    Potential** potentials;
+    double *rc2, *epsilon, *sigma2, *uShift, *ufShift, *qiqj, *alpha;
+    int *exponent;
+    const EwaldTable** ewaldTable;
+
+    PairTable(int numAtomTypes);
+    ~PairTable();
+    void update(Potential*** pairPotentials, double** pairCutoffs);
+};
+
+class PairVirtual {
+  public:
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      return t.potentials[ij]->u(r2);
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      t.potentials[ij]->u012(r2, u, du, d2u);
+    }
+};
+
+class PairLJ {
+  public:
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      double s2 = t.sigma2[ij]/r2;
+      double s6 = s2*s2*s2;
+      double u = 4*t.epsilon[ij]*s6*(s6 - 1) + t.uShift[ij];
+      if (t.ufShift[ij]!=0) u += t.ufShift[ij]*sqrt(r2);
+      return u;
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      const double epsilon = t.epsilon[ij];
+      double s2 = t.sigma2[ij]/r2;
+      double s6 = s2*s2*s2;
+      u = 4*epsilon*s6*(s6 - 1) + t.uShift[ij];
+      du = -4*12*epsilon*s6*(s6 - 0.5);
+      if (t.ufShift[ij] != 0) {
+        double x = sqrt(r2)*t.ufShift[ij];
+        u += x;
+        du += x;
+      }
+      d2u = 4*12*epsilon*s6*(13*s6 - 0.5*7);
+    }
+};
+
+class PairSS {
+  public:
+    static inline double epsrpow(const PairTable& t, const int ij, const double r2) {
+      double s2 = 1/r2;
+      double s6;
+      switch (t.exponent[ij]) {
+        case 12:
+          s6 = s2*s2*s2;
+          return t.epsilon[ij]*(s6*s6);
+        case 6:
+          return t.epsilon[ij]*(s2*s2*s2);
+        case 8:
+          s6 = s2*s2*s2;
+          return t.epsilon[ij]*(s6*s2);
+        case 9:
+          s6 = s2*s2*s2;
+          return t.epsilon[ij]*(s6*s2*sqrt(s2));
+        case 10:
+          s6 = s2*s2*s2;
+          return t.epsilon[ij]*(s6*s2*s2);
+        case 0:
+          return t.epsilon[ij];
+        case 1:
+          return t.epsilon[ij]*sqrt(s2);
+        case 2:
+          return t.epsilon[ij]*s2;
+        case 3:
+          return t.epsilon[ij]*(s2*sqrt(s2));
+        case 4:
+          return t.epsilon[ij]*(s2*s2);
+        case 5:
+          return t.epsilon[ij]*(s2*s2/sqrt(r2));
+        default:
+          return t.epsilon[ij]*pow(s2, t.exponent[ij]*0.5);
+      }
+    }
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      double u = epsrpow(t, ij, r2) + t.uShift[ij];
+      if (t.ufShift[ij]!=0) u += t.ufShift[ij]*sqrt(r2);
+      return u;
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      const int exponent = t.exponent[ij];
+      u = epsrpow(t, ij, r2);
+      du = -exponent*u;
+      d2u = -(exponent+1)*du;
+      u += t.uShift[ij];
+      if (t.ufShift[ij] != 0) {
+        double x = sqrt(r2)*t.ufShift[ij];
+        u += x;
+        du += x;
+      }
+    }
+};
+
+class PairHS {
+  public:
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      return r2>t.sigma2[ij] ? 0 : INFINITY;
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      u = r2>t.sigma2[ij] ? 0 : INFINITY;
+      du = d2u = 0;
+    }
+};
+
+class PairEwald {
+  public:
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      if (t.ewaldTable[ij]) return t.qiqj[ij]*t.ewaldTable[ij]->u(r2);
+      double r = sqrt(r2);
+      return t.qiqj[ij]*erfc(t.alpha[ij]*r)/r;
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      const double qiqj = t.qiqj[ij];
+      if (t.ewaldTable[ij]) t.ewaldTable[ij]->u012(r2, u, du, d2u);
+      else EwaldTable::exact(t.alpha[ij], r2, u, du, d2u);
+      u *= qiqj;
+      du *= qiqj;
+      d2u *= qiqj;
+    }
+};
+
+// LJ plus real-space Ewald, covering PotentialEwald wrapped around LJ and
+// any mix of LJ and bare Ewald pairs (one of the two terms is then 0)
+class PairLJEwald {
+  public:
+    static inline double u(const PairTable& t, const int ij, const double r2) {
+      double u = t.epsilon[ij]!=0 ? PairLJ::u(t, ij, r2) : 0;
+      if (t.qiqj[ij]!=0) u += PairEwald::u(t, ij, r2);
+      return u;
+    }
+    static inline void u012(const PairTable& t, const int ij, const double r2, double &u, double &du, double &d2u) {
+      if (t.epsilon[ij]!=0) {
+        PairLJ::u012(t, ij, r2, u, du, d2u);
+      }
+      else {
+        u = du = d2u = 0;
+      }
+      if (t.qiqj[ij]!=0) {
+        double uq, duq, d2uq;
+        PairEwald::u012(t, ij, r2, uq, duq, d2uq);
+        u += uq;
+        du += duq;
+        d2u += d2uq;
+      }
+    }
+};
+
+// calls func<functor> args for the functor matching kind
+#define PAIR_FUNCTOR_DISPATCH(kind, func, args) \
+  switch (kind) { \
+    case PAIR_LJ: func<PairLJ> args; break; \
+    case PAIR_SS: func<PairSS> args; break; \
+    case PAIR_HS: func<PairHS> args; break; \
+    case PAIR_EWALD: func<PairEwald> args; break; \
+    case PAIR_LJ_EWALD: func<PairLJEwald> args; break; \
+    default: func<PairVirtual> args; \
+  }
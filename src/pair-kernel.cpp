@@ -0,0 +1,527 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "pair-kernel.h"
+
+// the kernels are compiled for their instruction sets with target
+// attributes, so the rest of the code can keep the baseline flags
+#if defined(__x86_64__) && defined(__GNUC__)
+#define PAIR_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+int pairKernelLevel() {
+#ifdef PAIR_KERNEL_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")) return PAIR_KERNEL_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return PAIR_KERNEL_AVX2;
+#endif
+  return PAIR_KERNEL_SCALAR;
+}
+
+bool pairKernelHandles(const PairTable& table) {
+  return table.kind == PAIR_LJ || (table.kind == PAIR_SS && table.ssExponent >= 0);
+}
+
+#ifdef PAIR_KERNEL_X86
+
+__attribute__((target("avx2")))
+static inline double hsum4(__m256d v) {
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+// energy and virial (r du/dr) of 4 pairs, zero for pairs outside the
+// cutoff.  r2 must already be finite (non-zero) for every lane.
+template<bool ss>
+__attribute__((target("avx2,fma")))
+static inline void pairAVX2(const __m256d r2, const __m256d inside, const __m256d epsilon, const __m256d sigma2, const __m256d uShift, const __m256d ufShift, const int exponent, __m256d &u, __m256d &du) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  if (ss) {
+    const __m256d s2 = _mm256_div_pd(one, r2);
+    __m256d p = one;
+    for (int k=0; k<exponent/2; k++) p = _mm256_mul_pd(p, s2);
+    if (exponent & 1) p = _mm256_mul_pd(p, _mm256_sqrt_pd(s2));
+    u = _mm256_mul_pd(epsilon, p);
+    du = _mm256_mul_pd(_mm256_set1_pd(-exponent), u);
+  }
+  else {
+    const __m256d s2 = _mm256_div_pd(sigma2, r2);
+    const __m256d s6 = _mm256_mul_pd(_mm256_mul_pd(s2, s2), s2);
+    const __m256d es6 = _mm256_mul_pd(epsilon, s6);
+    u = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), es6), _mm256_sub_pd(s6, one));
+    du = _mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(-4*12.0), es6), _mm256_sub_pd(s6, _mm256_set1_pd(0.5)));
+  }
+  const __m256d x = _mm256_mul_pd(_mm256_sqrt_pd(r2), ufShift);
+  u = _mm256_and_pd(inside, _mm256_add_pd(_mm256_add_pd(u, uShift), x));
+  du = _mm256_and_pd(inside, _mm256_add_pd(du, x));
+}
+
+// 4 neighbors at a time.  coordinates and pair parameters are gathered,
+// updates to the neighbors' energies and forces are scattered one lane at a
+// time since a neighbor can appear more than once (with different images).
+// with halo, neighbors index ghost atoms directly and there are no images.
+template<bool doForces, bool ss, bool halo>
+__attribute__((target("avx2,fma")))
+static void computeAVX2(const PairKernelData& d, double &uTot, double &virialTot) {
+  const PairTable& t = *d.table;
+  const int exponent = t.ssExponent;
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+  alignas(32) double ox[4], oy[4], oz[4], uj[4], fxj[4], fyj[4], fzj[4];
+  double uSum = 0, virialSum = 0;
+  for (int iAtom=d.atomStart; iAtom<d.atomEnd; iAtom++) {
+    const int iNumNbrs = d.nbrStart[iAtom+1] - d.nbrStart[iAtom];
+    if (iNumNbrs == 0) continue;
+    const int* iNbrs = d.nbrAtoms + d.nbrStart[iAtom];
+    const unsigned char* iNbrImages = d.nbrImages + d.nbrStart[iAtom];
+    const __m128i iPair = _mm_set1_epi32(d.types[iAtom]*t.numAtomTypes);
+    const __m256d xi = _mm256_set1_pd(d.x[iAtom]);
+    const __m256d yi = _mm256_set1_pd(d.y[iAtom]);
+    const __m256d zi = _mm256_set1_pd(d.z[iAtom]);
+    __m256d ui = zero, virialI = zero, fxi = zero, fyi = zero, fzi = zero;
+    for (int j=0; j<iNumNbrs; j+=4) {
+      const int m = iNumNbrs-j < 4 ? iNumNbrs-j : 4;
+      const __m128i valid = _mm_cmplt_epi32(lanes, _mm_set1_epi32(m));
+      const __m256d valid64 = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(valid));
+      const __m128i jAtoms = _mm_maskload_epi32(iNbrs+j, valid);
+      __m256d dx = _mm256_mask_i32gather_pd(zero, d.x, jAtoms, valid64, 8);
+      __m256d dy = _mm256_mask_i32gather_pd(zero, d.y, jAtoms, valid64, 8);
+      __m256d dz = _mm256_mask_i32gather_pd(zero, d.z, jAtoms, valid64, 8);
+      if (!halo) {
+        for (int l=0; l<4; l++) {
+          const double* jbo = l<m ? d.images[iNbrImages[j+l]] : nullptr;
+          ox[l] = jbo ? jbo[0] : 0;
+          oy[l] = jbo ? jbo[1] : 0;
+          oz[l] = jbo ? jbo[2] : 0;
+        }
+        dx = _mm256_add_pd(dx, _mm256_load_pd(ox));
+        dy = _mm256_add_pd(dy, _mm256_load_pd(oy));
+        dz = _mm256_add_pd(dz, _mm256_load_pd(oz));
+      }
+      dx = _mm256_sub_pd(dx, xi);
+      dy = _mm256_sub_pd(dy, yi);
+      dz = _mm256_sub_pd(dz, zi);
+      __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+      const __m128i jTypes = _mm_mask_i32gather_epi32(_mm_setzero_si128(), d.types, jAtoms, valid, 4);
+      const __m128i ij = _mm_add_epi32(iPair, jTypes);
+      const __m256d rc2 = _mm256_mask_i32gather_pd(zero, t.rc2, ij, valid64, 8);
+      const __m256d inside = _mm256_and_pd(valid64, _mm256_cmp_pd(r2, rc2, _CMP_LT_OQ));
+      if (_mm256_movemask_pd(inside) == 0) continue;
+      // keep lanes outside the cutoff finite
+      r2 = _mm256_blendv_pd(one, r2, inside);
+      const __m256d epsilon = _mm256_mask_i32gather_pd(zero, t.epsilon, ij, inside, 8);
+      const __m256d sigma2 = ss ? zero : _mm256_mask_i32gather_pd(zero, t.sigma2, ij, inside, 8);
+      const __m256d uShift = _mm256_mask_i32gather_pd(zero, t.uShift, ij, inside, 8);
+      const __m256d ufShift = _mm256_mask_i32gather_pd(zero, t.ufShift, ij, inside, 8);
+      __m256d u, du;
+      pairAVX2<ss>(r2, inside, epsilon, sigma2, uShift, ufShift, exponent, u, du);
+      ui = _mm256_add_pd(ui, u);
+      virialI = _mm256_add_pd(virialI, du);
+      _mm256_store_pd(uj, u);
+      for (int l=0; l<m; l++) d.uAtom[iNbrs[j+l]] += 0.5*uj[l];
+      if (doForces) {
+        const __m256d fr = _mm256_div_pd(du, r2);
+        dx = _mm256_mul_pd(dx, fr);
+        dy = _mm256_mul_pd(dy, fr);
+        dz = _mm256_mul_pd(dz, fr);
+        fxi = _mm256_add_pd(fxi, dx);
+        fyi = _mm256_add_pd(fyi, dy);
+        fzi = _mm256_add_pd(fzi, dz);
+        _mm256_store_pd(fxj, dx);
+        _mm256_store_pd(fyj, dy);
+        _mm256_store_pd(fzj, dz);
+        for (int l=0; l<m; l++) {
+          int jAtom = iNbrs[j+l];
+          d.fx[jAtom] -= fxj[l];
+          d.fy[jAtom] -= fyj[l];
+          d.fz[jAtom] -= fzj[l];
+        }
+      }
+    }
+    double uiSum = hsum4(ui);
+    d.uAtom[iAtom] += 0.5*uiSum;
+    uSum += uiSum;
+    virialSum += hsum4(virialI);
+    if (doForces) {
+      d.fx[iAtom] += hsum4(fxi);
+      d.fy[iAtom] += hsum4(fyi);
+      d.fz[iAtom] += hsum4(fzi);
+    }
+  }
+  uTot += uSum;
+  virialTot += virialSum;
+}
+
+// i atoms one at a time against a whole j cluster of 4.  j clusters are
+// stored contiguously, so coordinates are plain loads and j forces and
+// energies are accumulated in registers over the tile.
+template<bool doForces, bool ss, bool oneType>
+__attribute__((target("avx2,fma")))
+static void clustersAVX2(const PairClusterData& d, double &uTot, double &virialTot) {
+  const PairTable& t = *d.table;
+  const int exponent = t.ssExponent;
+  const int numAtomTypes = t.numAtomTypes;
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m256i laneBits = _mm256_setr_epi64x(1, 2, 4, 8);
+  // with a single atom type the parameters are the same for every pair
+  const __m256d rc2One = _mm256_set1_pd(t.rc2[0]);
+  const __m256d epsilonOne = _mm256_set1_pd(t.epsilon[0]);
+  const __m256d sigma2One = _mm256_set1_pd(t.sigma2[0]);
+  const __m256d uShiftOne = _mm256_set1_pd(t.uShift[0]);
+  const __m256d ufShiftOne = _mm256_set1_pd(t.ufShift[0]);
+  __m256d uAcc = zero, virialAcc = zero;
+  for (int iCluster=0; iCluster<d.numClusters; iCluster++) {
+    const int i0 = iCluster*4;
+    __m256d ui[4], fxi[4], fyi[4], fzi[4];
+    for (int a=0; a<4; a++) ui[a] = fxi[a] = fyi[a] = fzi[a] = zero;
+    for (int p=d.pairStart[iCluster]; p<d.pairStart[iCluster+1]; p++) {
+      const int j0 = d.pairCluster[p]*4;
+      const double *jbo = d.pairOffsets[p];
+      const uint64_t mask = d.pairMask[p];
+      const __m256d xj = _mm256_add_pd(_mm256_load_pd(d.x+j0), _mm256_set1_pd(jbo[0]));
+      const __m256d yj = _mm256_add_pd(_mm256_load_pd(d.y+j0), _mm256_set1_pd(jbo[1]));
+      const __m256d zj = _mm256_add_pd(_mm256_load_pd(d.z+j0), _mm256_set1_pd(jbo[2]));
+      const __m128i jTypes = oneType ? _mm_setzero_si128() : _mm_load_si128((const __m128i*)(d.types+j0));
+      __m256d uj = zero, fxj = zero, fyj = zero, fzj = zero;
+      for (int a=0; a<4; a++) {
+        const int bits = (mask >> (a*4)) & 0xF;
+        if (!bits) continue;
+        const __m256d listed = _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(bits), laneBits), laneBits));
+        __m256d dx = _mm256_sub_pd(xj, _mm256_set1_pd(d.x[i0+a]));
+        __m256d dy = _mm256_sub_pd(yj, _mm256_set1_pd(d.y[i0+a]));
+        __m256d dz = _mm256_sub_pd(zj, _mm256_set1_pd(d.z[i0+a]));
+        __m256d r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+        __m128i ij = _mm_setzero_si128();
+        if (!oneType) ij = _mm_add_epi32(_mm_set1_epi32(d.types[i0+a]*numAtomTypes), jTypes);
+        const __m256d rc2 = oneType ? rc2One : _mm256_mask_i32gather_pd(zero, t.rc2, ij, listed, 8);
+        const __m256d inside = _mm256_and_pd(listed, _mm256_cmp_pd(r2, rc2, _CMP_LT_OQ));
+        if (_mm256_movemask_pd(inside) == 0) continue;
+        r2 = _mm256_blendv_pd(one, r2, inside);
+        __m256d u, du;
+        if (oneType) {
+          pairAVX2<ss>(r2, inside, epsilonOne, sigma2One, uShiftOne, ufShiftOne, exponent, u, du);
+        }
+        else {
+          const __m256d epsilon = _mm256_mask_i32gather_pd(zero, t.epsilon, ij, inside, 8);
+          const __m256d sigma2 = ss ? zero : _mm256_mask_i32gather_pd(zero, t.sigma2, ij, inside, 8);
+          const __m256d uShift = _mm256_mask_i32gather_pd(zero, t.uShift, ij, inside, 8);
+          const __m256d ufShift = _mm256_mask_i32gather_pd(zero, t.ufShift, ij, inside, 8);
+          pairAVX2<ss>(r2, inside, epsilon, sigma2, uShift, ufShift, exponent, u, du);
+        }
+        ui[a] = _mm256_add_pd(ui[a], u);
+        uj = _mm256_add_pd(uj, u);
+        virialAcc = _mm256_add_pd(virialAcc, du);
+        if (doForces) {
+          const __m256d fr = _mm256_div_pd(du, r2);
+          dx = _mm256_mul_pd(dx, fr);
+          dy = _mm256_mul_pd(dy, fr);
+          dz = _mm256_mul_pd(dz, fr);
+          fxi[a] = _mm256_add_pd(fxi[a], dx);
+          fyi[a] = _mm256_add_pd(fyi[a], dy);
+          fzi[a] = _mm256_add_pd(fzi[a], dz);
+          fxj = _mm256_add_pd(fxj, dx);
+          fyj = _mm256_add_pd(fyj, dy);
+          fzj = _mm256_add_pd(fzj, dz);
+        }
+      }
+      uAcc = _mm256_add_pd(uAcc, uj);
+      _mm256_store_pd(d.u+j0, _mm256_fmadd_pd(half, uj, _mm256_load_pd(d.u+j0)));
+      if (doForces) {
+        _mm256_store_pd(d.fx+j0, _mm256_sub_pd(_mm256_load_pd(d.fx+j0), fxj));
+        _mm256_store_pd(d.fy+j0, _mm256_sub_pd(_mm256_load_pd(d.fy+j0), fyj));
+        _mm256_store_pd(d.fz+j0, _mm256_sub_pd(_mm256_load_pd(d.fz+j0), fzj));
+      }
+    }
+    for (int a=0; a<4; a++) {
+      d.u[i0+a] += 0.5*hsum4(ui[a]);
+      if (doForces) {
+        d.fx[i0+a] += hsum4(fxi[a]);
+        d.fy[i0+a] += hsum4(fyi[a]);
+        d.fz[i0+a] += hsum4(fzi[a]);
+      }
+    }
+  }
+  uTot += hsum4(uAcc);
+  virialTot += hsum4(virialAcc);
+}
+
+// GCC 12 flags the undefined pass-through operands inside the AVX-512
+// intrinsics as uninitialized (where the kernels are instantiated)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+template<bool ss>
+__attribute__((target("avx512f,avx512vl")))
+static inline void pairAVX512(const __m512d r2, const __mmask8 inside, const __m512d epsilon, const __m512d sigma2, const __m512d uShift, const __m512d ufShift, const int exponent, __m512d &u, __m512d &du) {
+  const __m512d one = _mm512_set1_pd(1.0);
+  if (ss) {
+    const __m512d s2 = _mm512_div_pd(one, r2);
+    __m512d p = one;
+    for (int k=0; k<exponent/2; k++) p = _mm512_mul_pd(p, s2);
+    if (exponent & 1) p = _mm512_mul_pd(p, _mm512_sqrt_pd(s2));
+    u = _mm512_mul_pd(epsilon, p);
+    du = _mm512_mul_pd(_mm512_set1_pd(-exponent), u);
+  }
+  else {
+    const __m512d s2 = _mm512_div_pd(sigma2, r2);
+    const __m512d s6 = _mm512_mul_pd(_mm512_mul_pd(s2, s2), s2);
+    const __m512d es6 = _mm512_mul_pd(epsilon, s6);
+    u = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(4.0), es6), _mm512_sub_pd(s6, one));
+    du = _mm512_mul_pd(_mm512_mul_pd(_mm512_set1_pd(-4*12.0), es6), _mm512_sub_pd(s6, _mm512_set1_pd(0.5)));
+  }
+  const __m512d x = _mm512_mul_pd(_mm512_sqrt_pd(r2), ufShift);
+  u = _mm512_maskz_mov_pd(inside, _mm512_add_pd(_mm512_add_pd(u, uShift), x));
+  du = _mm512_maskz_mov_pd(inside, _mm512_add_pd(du, x));
+}
+
+// same as computeAVX2, 8 neighbors at a time with mask registers
+template<bool doForces, bool ss, bool halo>
+__attribute__((target("avx512f,avx512vl")))
+static void computeAVX512(const PairKernelData& d, double &uTot, double &virialTot) {
+  const PairTable& t = *d.table;
+  const int exponent = t.ssExponent;
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d one = _mm512_set1_pd(1.0);
+  alignas(64) double ox[8], oy[8], oz[8], uj[8], fxj[8], fyj[8], fzj[8];
+  double uSum = 0, virialSum = 0;
+  for (int iAtom=d.atomStart; iAtom<d.atomEnd; iAtom++) {
+    const int iNumNbrs = d.nbrStart[iAtom+1] - d.nbrStart[iAtom];
+    if (iNumNbrs == 0) continue;
+    const int* iNbrs = d.nbrAtoms + d.nbrStart[iAtom];
+    const unsigned char* iNbrImages = d.nbrImages + d.nbrStart[iAtom];
+    const __m256i iPair = _mm256_set1_epi32(d.types[iAtom]*t.numAtomTypes);
+    const __m512d xi = _mm512_set1_pd(d.x[iAtom]);
+    const __m512d yi = _mm512_set1_pd(d.y[iAtom]);
+    const __m512d zi = _mm512_set1_pd(d.z[iAtom]);
+    __m512d ui = zero, virialI = zero, fxi = zero, fyi = zero, fzi = zero;
+    for (int j=0; j<iNumNbrs; j+=8) {
+      const int m = iNumNbrs-j < 8 ? iNumNbrs-j : 8;
+      const __mmask8 valid = (__mmask8)((1u<<m)-1);
+      const __m256i jAtoms = _mm256_maskz_loadu_epi32(valid, iNbrs+j);
+      __m512d dx = _mm512_mask_i32gather_pd(zero, valid, jAtoms, d.x, 8);
+      __m512d dy = _mm512_mask_i32gather_pd(zero, valid, jAtoms, d.y, 8);
+      __m512d dz = _mm512_mask_i32gather_pd(zero, valid, jAtoms, d.z, 8);
+      if (!halo) {
+        for (int l=0; l<8; l++) {
+          const double* jbo = l<m ? d.images[iNbrImages[j+l]] : nullptr;
+          ox[l] = jbo ? jbo[0] : 0;
+          oy[l] = jbo ? jbo[1] : 0;
+          oz[l] = jbo ? jbo[2] : 0;
+        }
+        dx = _mm512_add_pd(dx, _mm512_load_pd(ox));
+        dy = _mm512_add_pd(dy, _mm512_load_pd(oy));
+        dz = _mm512_add_pd(dz, _mm512_load_pd(oz));
+      }
+      dx = _mm512_sub_pd(dx, xi);
+      dy = _mm512_sub_pd(dy, yi);
+      dz = _mm512_sub_pd(dz, zi);
+      __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+      const __m256i jTypes = _mm256_mmask_i32gather_epi32(_mm256_setzero_si256(), valid, jAtoms, d.types, 4);
+      const __m256i ij = _mm256_add_epi32(iPair, jTypes);
+      const __m512d rc2 = _mm512_mask_i32gather_pd(zero, valid, ij, t.rc2, 8);
+      const __mmask8 inside = _mm512_mask_cmp_pd_mask(valid, r2, rc2, _CMP_LT_OQ);
+      if (inside == 0) continue;
+      r2 = _mm512_mask_blend_pd(inside, one, r2);
+      const __m512d epsilon = _mm512_mask_i32gather_pd(zero, inside, ij, t.epsilon, 8);
+      const __m512d sigma2 = ss ? zero : _mm512_mask_i32gather_pd(zero, inside, ij, t.sigma2, 8);
+      const __m512d uShift = _mm512_mask_i32gather_pd(zero, inside, ij, t.uShift, 8);
+      const __m512d ufShift = _mm512_mask_i32gather_pd(zero, inside, ij, t.ufShift, 8);
+      __m512d u, du;
+      pairAVX512<ss>(r2, inside, epsilon, sigma2, uShift, ufShift, exponent, u, du);
+      ui = _mm512_add_pd(ui, u);
+      virialI = _mm512_add_pd(virialI, du);
+      _mm512_store_pd(uj, u);
+      for (int l=0; l<m; l++) d.uAtom[iNbrs[j+l]] += 0.5*uj[l];
+      if (doForces) {
+        const __m512d fr = _mm512_div_pd(du, r2);
+        dx = _mm512_mul_pd(dx, fr);
+        dy = _mm512_mul_pd(dy, fr);
+        dz = _mm512_mul_pd(dz, fr);
+        fxi = _mm512_add_pd(fxi, dx);
+        fyi = _mm512_add_pd(fyi, dy);
+        fzi = _mm512_add_pd(fzi, dz);
+        _mm512_store_pd(fxj, dx);
+        _mm512_store_pd(fyj, dy);
+        _mm512_store_pd(fzj, dz);
+        for (int l=0; l<m; l++) {
+          int jAtom = iNbrs[j+l];
+          d.fx[jAtom] -= fxj[l];
+          d.fy[jAtom] -= fyj[l];
+          d.fz[jAtom] -= fzj[l];
+        }
+      }
+    }
+    double uiSum = _mm512_reduce_add_pd(ui);
+    d.uAtom[iAtom] += 0.5*uiSum;
+    uSum += uiSum;
+    virialSum += _mm512_reduce_add_pd(virialI);
+    if (doForces) {
+      d.fx[iAtom] += _mm512_reduce_add_pd(fxi);
+      d.fy[iAtom] += _mm512_reduce_add_pd(fyi);
+      d.fz[iAtom] += _mm512_reduce_add_pd(fzi);
+    }
+  }
+  uTot += uSum;
+  virialTot += virialSum;
+}
+
+// same as clustersAVX2, with clusters of 8
+template<bool doForces, bool ss, bool oneType>
+__attribute__((target("avx512f,avx512vl")))
+static void clustersAVX512(const PairClusterData& d, double &uTot, double &virialTot) {
+  const PairTable& t = *d.table;
+  const int exponent = t.ssExponent;
+  const int numAtomTypes = t.numAtomTypes;
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d half = _mm512_set1_pd(0.5);
+  const __m512d rc2One = _mm512_set1_pd(t.rc2[0]);
+  const __m512d epsilonOne = _mm512_set1_pd(t.epsilon[0]);
+  const __m512d sigma2One = _mm512_set1_pd(t.sigma2[0]);
+  const __m512d uShiftOne = _mm512_set1_pd(t.uShift[0]);
+  const __m512d ufShiftOne = _mm512_set1_pd(t.ufShift[0]);
+  __m512d uAcc = zero, virialAcc = zero;
+  for (int iCluster=0; iCluster<d.numClusters; iCluster++) {
+    const int i0 = iCluster*8;
+    __m512d ui[8], fxi[8], fyi[8], fzi[8];
+    for (int a=0; a<8; a++) ui[a] = fxi[a] = fyi[a] = fzi[a] = zero;
+    for (int p=d.pairStart[iCluster]; p<d.pairStart[iCluster+1]; p++) {
+      const int j0 = d.pairCluster[p]*8;
+      const double *jbo = d.pairOffsets[p];
+      const uint64_t mask = d.pairMask[p];
+      const __m512d xj = _mm512_add_pd(_mm512_load_pd(d.x+j0), _mm512_set1_pd(jbo[0]));
+      const __m512d yj = _mm512_add_pd(_mm512_load_pd(d.y+j0), _mm512_set1_pd(jbo[1]));
+      const __m512d zj = _mm512_add_pd(_mm512_load_pd(d.z+j0), _mm512_set1_pd(jbo[2]));
+      const __m256i jTypes = oneType ? _mm256_setzero_si256() : _mm256_load_si256((const __m256i*)(d.types+j0));
+      __m512d uj = zero, fxj = zero, fyj = zero, fzj = zero;
+      for (int a=0; a<8; a++) {
+        const __mmask8 listed = (__mmask8)(mask >> (a*8));
+        if (!listed) continue;
+        __m512d dx = _mm512_sub_pd(xj, _mm512_set1_pd(d.x[i0+a]));
+        __m512d dy = _mm512_sub_pd(yj, _mm512_set1_pd(d.y[i0+a]));
+        __m512d dz = _mm512_sub_pd(zj, _mm512_set1_pd(d.z[i0+a]));
+        __m512d r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+        __m256i ij = _mm256_setzero_si256();
+        if (!oneType) ij = _mm256_add_epi32(_mm256_set1_epi32(d.types[i0+a]*numAtomTypes), jTypes);
+        const __m512d rc2 = oneType ? rc2One : _mm512_mask_i32gather_pd(zero, listed, ij, t.rc2, 8);
+        const __mmask8 inside = _mm512_mask_cmp_pd_mask(listed, r2, rc2, _CMP_LT_OQ);
+        if (inside == 0) continue;
+        r2 = _mm512_mask_blend_pd(inside, one, r2);
+        __m512d u, du;
+        if (oneType) {
+          pairAVX512<ss>(r2, inside, epsilonOne, sigma2One, uShiftOne, ufShiftOne, exponent, u, du);
+        }
+        else {
+          const __m512d epsilon = _mm512_mask_i32gather_pd(zero, inside, ij, t.epsilon, 8);
+          const __m512d sigma2 = ss ? zero : _mm512_mask_i32gather_pd(zero, inside, ij, t.sigma2, 8);
+          const __m512d uShift = _mm512_mask_i32gather_pd(zero, inside, ij, t.uShift, 8);
+          const __m512d ufShift = _mm512_mask_i32gather_pd(zero, inside, ij, t.ufShift, 8);
+          pairAVX512<ss>(r2, inside, epsilon, sigma2, uShift, ufShift, exponent, u, du);
+        }
+        ui[a] = _mm512_add_pd(ui[a], u);
+        uj = _mm512_add_pd(uj, u);
+        virialAcc = _mm512_add_pd(virialAcc, du);
+        if (doForces) {
+          const __m512d fr = _mm512_div_pd(du, r2);
+          dx = _mm512_mul_pd(dx, fr);
+          dy = _mm512_mul_pd(dy, fr);
+          dz = _mm512_mul_pd(dz, fr);
+          fxi[a] = _mm512_add_pd(fxi[a], dx);
+          fyi[a] = _mm512_add_pd(fyi[a], dy);
+          fzi[a] = _mm512_add_pd(fzi[a], dz);
+          fxj = _mm512_add_pd(fxj, dx);
+          fyj = _mm512_add_pd(fyj, dy);
+          fzj = _mm512_add_pd(fzj, dz);
+        }
+      }
+      uAcc = _mm512_add_pd(uAcc, uj);
+      _mm512_store_pd(d.u+j0, _mm512_fmadd_pd(half, uj, _mm512_load_pd(d.u+j0)));
+      if (doForces) {
+        _mm512_store_pd(d.fx+j0, _mm512_sub_pd(_mm512_load_pd(d.fx+j0), fxj));
+        _mm512_store_pd(d.fy+j0, _mm512_sub_pd(_mm512_load_pd(d.fy+j0), fyj));
+        _mm512_store_pd(d.fz+j0, _mm512_sub_pd(_mm512_load_pd(d.fz+j0), fzj));
+      }
+    }
+    for (int a=0; a<8; a++) {
+      d.u[i0+a] += 0.5*_mm512_reduce_add_pd(ui[a]);
+      if (doForces) {
+        d.fx[i0+a] += _mm512_reduce_add_pd(fxi[a]);
+        d.fy[i0+a] += _mm512_reduce_add_pd(fyi[a]);
+        d.fz[i0+a] += _mm512_reduce_add_pd(fzi[a]);
+      }
+    }
+  }
+  uTot += _mm512_reduce_add_pd(uAcc);
+  virialTot += _mm512_reduce_add_pd(virialAcc);
+}
+
+#endif
+
+// picks the instantiation for the configuration of this call
+#define PAIR_KERNEL_DISPATCH(func, flag) \
+  switch ((doForces?4:0) + (ss?2:0) + (flag?1:0)) { \
+    case 0: func<false,false,false>(d, uTot, virialTot); break; \
+    case 1: func<false,false,true>(d, uTot, virialTot); break; \
+    case 2: func<false,true,false>(d, uTot, virialTot); break; \
+    case 3: func<false,true,true>(d, uTot, virialTot); break; \
+    case 4: func<true,false,false>(d, uTot, virialTot); break; \
+    case 5: func<true,false,true>(d, uTot, virialTot); break; \
+    case 6: func<true,true,false>(d, uTot, virialTot); break; \
+    default: func<true,true,true>(d, uTot, virialTot); \
+  }
+
+void pairKernelCompute(int level, const PairKernelData& d, double &uTot, double &virialTot) {
+  const bool doForces = d.fx != nullptr;
+  const bool ss = d.table->kind == PAIR_SS;
+  const bool halo = d.images == nullptr;
+#ifdef PAIR_KERNEL_X86
+  if (level == PAIR_KERNEL_AVX512) {
+    PAIR_KERNEL_DISPATCH(computeAVX512, halo);
+    return;
+  }
+  if (level == PAIR_KERNEL_AVX2) {
+    PAIR_KERNEL_DISPATCH(computeAVX2, halo);
+    return;
+  }
+#endif
+  fprintf(stderr, "pair kernel level %d is not available\n", level);
+  abort();
+}
+
+bool pairKernelHandlesClusters(int level, int clusterSize) {
+#ifdef PAIR_KERNEL_X86
+  if (clusterSize == 8) return level >= PAIR_KERNEL_AVX512;
+  if (clusterSize == 4) return level >= PAIR_KERNEL_AVX2;
+#endif
+  return false;
+}
+
+void pairKernelComputeClusters(int level, const PairClusterData& d, double &uTot, double &virialTot) {
+  if (!pairKernelHandlesClusters(level, d.clusterSize)) {
+    fprintf(stderr, "pair kernel level %d can't handle clusters of %d\n", level, d.clusterSize);
+    abort();
+  }
+#ifdef PAIR_KERNEL_X86
+  const bool doForces = d.fx != nullptr;
+  const bool ss = d.table->kind == PAIR_SS;
+  const bool oneType = d.table->numAtomTypes == 1;
+  if (d.clusterSize == 8) {
+    PAIR_KERNEL_DISPATCH(clustersAVX512, oneType);
+  }
+  else {
+    PAIR_KERNEL_DISPATCH(clustersAVX2, oneType);
+  }
+#endif
+}
+
+#ifdef PAIR_KERNEL_X86
+#pragma GCC diagnostic pop
+#endif
@@ -0,0 +1,65 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include "pair-functor.h"
+
+#define PAIR_KERNEL_SCALAR 0
+#define PAIR_KERNEL_AVX2 1
+#define PAIR_KERNEL_AVX512 2
+
+/**
+ * Everything the vectorized neighbor-list kernels need, as raw arrays.
+ * Pairs are computed for atoms atomStart up to atomEnd-1 and their up
+ * neighbors.  Positions and forces are structure-of-arrays; forces are
+ * nullptr when only energy and virial are needed.  Neighbors are in compressed rows, with
+ * an index into images for the box offset of each.  In halo mode images is
+ * nullptr and the neighbors are ghost atoms stored after the real ones.
+ */
+class PairKernelData {
+  public:
+    int atomStart, atomEnd;
+    const double *x, *y, *z;
+    double *fx, *fy, *fz;
+    double *uAtom;
+    const int *types;
+    const int *nbrStart, *nbrAtoms;
+    const unsigned char *nbrImages;
+    double **images;
+    const PairTable *table;
+};
+
+/**
+ * Cluster-pair version of PairKernelData.  Atoms are grouped into clusters
+ * of clusterSize and everything is stored in cluster order (slot
+ * iCluster*clusterSize+lane).  Each cluster pair carries the image offset of
+ * the j cluster and a bit mask (bit a*clusterSize+b) of the i-j atom pairs
+ * it covers; empty slots and excluded pairs have their bits cleared.
+ */
+class PairClusterData {
+  public:
+    int clusterSize, numClusters;
+    const double *x, *y, *z;
+    const int *types;
+    double *fx, *fy, *fz;
+    double *u;
+    const int *pairStart, *pairCluster;
+    double **pairOffsets;
+    const uint64_t *pairMask;
+    const PairTable *table;
+};
+
+// the best kernel supported by this CPU
+int pairKernelLevel();
+// can the vectorized kernels handle pairs described by this table?
+bool pairKernelHandles(const PairTable& table);
+// computes energy, virial and (optionally) forces with the given kernel
+void pairKernelCompute(int level, const PairKernelData& d, double &uTot, double &virialTot);
+// can the given kernel level handle clusters of this size?
+bool pairKernelHandlesClusters(int level, int clusterSize);
+// cluster-pair version of pairKernelCompute; u and forces are accumulated
+// into the cluster-ordered arrays
+void pairKernelComputeClusters(int level, const PairClusterData& d, double &uTot, double &virialTot);
@@ -0,0 +1,92 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdlib.h>
+#include "pair-functor.h"
+#include "alloc2d.h"
+
+PairTable::PairTable(int nt) : numAtomTypes(nt), kind(PAIR_VIRTUAL), ssExponent(-1) {
+  int n = ALIGNED_DOUBLES(numAtomTypes*numAtomTypes);
+  potentials = (Potential**)malloc(n*sizeof(Potential*));
+  rc2 = (double*)mallocAligned(n*sizeof(double));
+  epsilon = (double*)mallocAligned(n*sizeof(double));
+  sigma2 = (double*)mallocAligned(n*sizeof(double));
+  uShift = (double*)mallocAligned(n*sizeof(double));
+  ufShift = (double*)mallocAligned(n*sizeof(double));
+  qiqj = (double*)mallocAligned(n*sizeof(double));
+  alpha = (double*)mallocAligned(n*sizeof(double));
+  exponent = (int*)mallocAligned(n*sizeof(int));
+  ewaldTable = (const EwaldTable**)malloc(n*sizeof(EwaldTable*));
+  for (int i=0; i<n; i++) {
+    potentials[i] = nullptr;
+    rc2[i] = epsilon[i] = sigma2[i] = uShift[i] = ufShift[i] = qiqj[i] = alpha[i] = 0;
+    exponent[i] = 0;
+    ewaldTable[i] = nullptr;
+  }
+}
+
+PairTable::~PairTable() {
+  free(potentials);
+  free(rc2);
+  free(epsilon);
+  free(sigma2);
+  free(uShift);
+  free(ufShift);
+  free(qiqj);
+  free(alpha);
+  free(exponent);
+  free(ewaldTable);
+}
+
+void PairTable::update(Potential*** pairPotentials, double** pairCutoffs) {
+  bool hasKind[PAIR_LJ_EWALD+1];
+  for (int i=0; i<=PAIR_LJ_EWALD; i++) hasKind[i] = false;
+  ssExponent = -1;
+  bool ssMixed = false;
+  for (int iType=0; iType<numAtomTypes; iType++) {
+    for (int jType=0; jType<numAtomTypes; jType++) {
+      int ij = iType*numAtomTypes + jType;
+      Potential* p = pairPotentials[iType][jType];
+      potentials[ij] = p;
+      if (!p) {
+        rc2[ij] = epsilon[ij] = sigma2[ij] = uShift[ij] = ufShift[ij] = qiqj[ij] = alpha[ij] = 0;
+        exponent[ij] = 0;
+        ewaldTable[ij] = nullptr;
+        continue;
+      }
+      PairParams pp;
+      p->getPairParams(pp);
+      hasKind[pp.kind] = true;
+      rc2[ij] = pairCutoffs[iType][jType];
+      epsilon[ij] = pp.epsilon;
+      sigma2[ij] = pp.sigma2;
+      uShift[ij] = pp.uShift;
+      ufShift[ij] = pp.ufShift;
+      exponent[ij] = pp.exponent;
+      qiqj[ij] = pp.qiqj;
+      alpha[ij] = pp.alpha;
+      ewaldTable[ij] = pp.ewaldTable;
+      if (pp.kind == PAIR_SS) {
+        if (ssExponent >= 0 && ssExponent != pp.exponent) ssMixed = true;
+        ssExponent = pp.exponent;
+      }
+    }
+  }
+  if (ssMixed) ssExponent = -1;
+  int numKinds = 0;
+  kind = PAIR_VIRTUAL;
+  for (int i=0; i<=PAIR_LJ_EWALD; i++) {
+    if (!hasKind[i]) continue;
+    numKinds++;
+    kind = i;
+  }
+  if (hasKind[PAIR_VIRTUAL]) {
+    kind = PAIR_VIRTUAL;
+  }
+  else if (numKinds > 1) {
+    // LJ and Ewald pairs can share the combined functor
+    bool ljEwald = !hasKind[PAIR_SS] && !hasKind[PAIR_HS];
+    kind = ljEwald ? PAIR_LJ_EWALD : PAIR_VIRTUAL;
+  }
+}
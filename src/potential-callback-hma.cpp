@@ -11,6 +11,7 @@
 PotentialCallbackHMA::PotentialCallbackHMA(Box& b, double T, double Ph, bool d2) : box(b), temperature(T), Pharm(Ph), phiSum(0), doD2(d2), returnAnh(false), computingLat(false) {
   callFinished = true;
   takesForces = true;
+  callPermute = true;
   callPair = d2;
   data = (double*) malloc((d2 ? 6 : 4)*sizeof(double));
   int N = box.getNumAtoms();
@@ -40,6 +41,14 @@ void PotentialCallbackHMA::setReturnAnharmonic(bool ra, PotentialMaster* pm) {
   }
 }
 
+void PotentialCallbackHMA::atomsPermuted(const int* oldIndex) {
+  int N = box.getNumAtoms();
+  double** tmp = (double**)malloc2D(N, 3, sizeof(double));
+  for (int i=0; i<N; i++) std::copy(latticePositions[oldIndex[i]], latticePositions[oldIndex[i]]+3, tmp[i]);
+  free2D((void**)latticePositions);
+  latticePositions = tmp;
+}
+
 int PotentialCallbackHMA::getNumData() {return doD2 ? 6 : 4;}
 
 void PotentialCallbackHMA::pairCompute(int iAtom, int jAtom, double* drij, double u, double du, double d2u) {
@@ -15,6 +15,7 @@
 PotentialCallbackMoleculeHMA::PotentialCallbackMoleculeHMA(Box& b, SpeciesList& sl, double T, double Ph) : box(b), speciesList(sl), temperature(T), Pharm(Ph), returnAnh(false), computingLat(false) {
   callFinished = true;
   takesForces = true;
+  callPermute = true;
   int N = box.getTotalNumMolecules();
   latticePositions = (double**)malloc2D(N, 3, sizeof(double));
   latticeOrientations = (double**)malloc2D(N, 6, sizeof(double));
@@ -23,8 +24,7 @@ PotentialCallbackMoleculeHMA::PotentialCallbackMoleculeHMA(Box& b, SpeciesList&
     int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
     box.getMoleculeInfo(i, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
     Species* species = speciesList.get(iSpecies);
-    double* pos = species->getMoleculeCOM(box, iFirstAtom, iLastAtom);
-    std::copy(pos, pos+3, latticePositions[i]);
+    species->getMoleculeCOM(box, iFirstAtom, iLastAtom, latticePositions[i]);
     double o[6];
     species->getMoleculeOrientation(box, iFirstAtom, o, o+3);
     std::copy(o, o+6, latticeOrientations[i]);
@@ -52,6 +52,32 @@ void PotentialCallbackMoleculeHMA::setReturnAnharmonic(bool ra, PotentialMaster*
   }
 }
 
+void PotentialCallbackMoleculeHMA::atomsPermuted(const int* oldIndex) {
+  // only single-atom molecules are permuted, so each moves with its atom
+  int N = box.getTotalNumMolecules();
+  double** newPositions = (double**)malloc2D(N, 3, sizeof(double));
+  double** newOrientations = (double**)malloc2D(N, 6, sizeof(double));
+  for (int i=0; i<N; i++) {
+    std::copy(latticePositions[i], latticePositions[i]+3, newPositions[i]);
+    std::copy(latticeOrientations[i], latticeOrientations[i]+6, newOrientations[i]);
+  }
+  int numAtoms = box.getNumAtoms();
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    if (oldIndex[iAtom] == iAtom) continue;
+    int iMolecule, jMolecule, iSpecies, iFirstAtom;
+    box.getMoleculeInfoAtom(iAtom, iMolecule, iSpecies, iFirstAtom);
+    box.getMoleculeInfoAtom(oldIndex[iAtom], jMolecule, iSpecies, iFirstAtom);
+    iMolecule = box.getGlobalMoleculeIndex(iSpecies, iMolecule);
+    jMolecule = box.getGlobalMoleculeIndex(iSpecies, jMolecule);
+    std::copy(latticePositions[jMolecule], latticePositions[jMolecule]+3, newPositions[iMolecule]);
+    std::copy(latticeOrientations[jMolecule], latticeOrientations[jMolecule]+6, newOrientations[iMolecule]);
+  }
+  free2D((void**)latticePositions);
+  free2D((void**)latticeOrientations);
+  latticePositions = newPositions;
+  latticeOrientations = newOrientations;
+}
+
 int PotentialCallbackMoleculeHMA::getNumData() {return 4;}
 
 void PotentialCallbackMoleculeHMA::allComputeFinished(double uTot, double virialTot, double** f) {
@@ -68,7 +94,8 @@ void PotentialCallbackMoleculeHMA::allComputeFinished(double uTot, double virial
   int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
   box.getMoleculeInfo(0, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
   Species* species = speciesList.get(iSpecies);
-  double* ri = species->getMoleculeCOM(box, iFirstAtom, iLastAtom);
+  double ri[3];
+  species->getMoleculeCOM(box, iFirstAtom, iLastAtom, ri);
   for (int j=0; j<3; j++) {
     dr0[j] = ri[j] - latticePositions[0][j];
   }
@@ -77,7 +104,7 @@ void PotentialCallbackMoleculeHMA::allComputeFinished(double uTot, double virial
   for (int i=0; i<N; i++) {
     box.getMoleculeInfo(i, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
     species = speciesList.get(iSpecies);
-    double* ri = species->getMoleculeCOM(box, iFirstAtom, iLastAtom);
+    species->getMoleculeCOM(box, iFirstAtom, iLastAtom, ri);
     for (int j=0; j<3; j++) {
       dr[j] = ri[j] - latticePositions[i][j] - dr0[j];
     }
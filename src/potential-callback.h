@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <vector>
+
 class Box;
 class SpeciesList;
 class PotentialMaster;
@@ -13,12 +15,19 @@ class PotentialCallback {
     bool callPair;
     bool callFinished;
     bool takesForces;
+    // has per-atom state that must follow atoms when they are permuted.
+    // potential masters register it when it is passed to computeAll.
+    bool callPermute;
+    // potential masters that have registered us, so we can unregister
+    std::vector<PotentialMaster*> permuteMasters;
 
     PotentialCallback();
-    virtual ~PotentialCallback() {}
+    virtual ~PotentialCallback();
     virtual void reset() {}
     virtual void pairCompute(int iAtom, int jAtom, double* dr, double u, double du, double d2u) {}
     virtual void allComputeFinished(double uTot, double virialTot, double** f) {}
+    // atom oldIndex[i] is now atom i
+    virtual void atomsPermuted(const int* oldIndex) {}
     virtual int getNumData() {return 0;}
     virtual double* getData() {return nullptr;}
 };
@@ -64,6 +73,7 @@ class PotentialCallbackHMA : public PotentialCallback {
     ~PotentialCallbackHMA();
     virtual void pairCompute(int iAtom, int jAtom, double* dr, double u, double du, double d2u);
     virtual void allComputeFinished(double uTot, double virialTot, double** f);
+    virtual void atomsPermuted(const int* oldIndex);
     virtual int getNumData();
     virtual double* getData();
     void setReturnAnharmonic(bool returnAnharmonic, PotentialMaster* potentialMaster);
@@ -84,6 +94,7 @@ class PotentialCallbackMoleculeHMA : public PotentialCallback {
     PotentialCallbackMoleculeHMA(Box& box, SpeciesList& speciesList, double temperature, double Pharm);
     ~PotentialCallbackMoleculeHMA();
     virtual void allComputeFinished(double uTot, double virialTot, double** f);
+    virtual void atomsPermuted(const int* oldIndex);
     virtual int getNumData();
     virtual double* getData();
     void setReturnAnharmonic(bool returnAnharmonic, PotentialMaster* potentialMaster);
@@ -6,19 +6,25 @@
 #include <iostream>
 #include "alloc2d.h"
 #include "potential-master.h"
+#include "random.h"
+#include "thread-pool.h"
 #ifdef VALGRIND_CHECKS
 #include "valgrind/memcheck.h"
 #endif
 
-PotentialMasterCell::PotentialMasterCell(const SpeciesList& sl, Box& box, bool doEmbed, int cRange) : PotentialMaster(sl, box, doEmbed), cellManager(sl, box, cRange), cellRange(cRange), cellNextAtom(cellManager.cellNextAtom), atomCell(cellManager.atomCell), cellLastAtom(cellManager.cellLastAtom), cellOffsets(cellManager.cellOffsets), wrapMap(cellManager.wrapMap), boxOffsets(cellManager.boxOffsets), lsNeeded(false) {
+PotentialMasterCell::PotentialMasterCell(const SpeciesList& sl, Box& box, bool doEmbed, int cRange) : PotentialMaster(sl, box, doEmbed), cellManager(sl, box, cRange), cellRange(cRange), atomCell(cellManager.atomCell), cellStart(cellManager.cellStart), cellEnd(cellManager.cellEnd), cellAtoms(cellManager.cellAtoms), atomSlot(cellManager.atomSlot), cellOffsets(cellManager.cellOffsets), wrapMap(cellManager.wrapMap), boxOffsets(cellManager.boxOffsets), lsNeeded(false) {
 }
 
 PotentialMasterCell::~PotentialMasterCell() {
 }
 
-void PotentialMasterCell::setPairPotential(int iType, int jType, Potential *pij) {
-  PotentialMaster::setPairPotential(iType, jType, pij);
-  cellManager.setRange(getRange());
+void PotentialMasterCell::updatePairTable() {
+  PotentialMaster::updatePairTable();
+  double range = getRange();
+  if (range == cellManager.range) return;
+  cellManager.setRange(range);
+  // cells already laid out for the old range need to be redone
+  if (!cellStart.empty()) cellManager.init();
 }
 
 double PotentialMasterCell::getRange() {
@@ -41,6 +47,7 @@ double PotentialMasterCell::getRange() {
 }
 
 void PotentialMasterCell::init() {
+  updatePairTable();
   cellManager.init();
 #ifdef DEBUG
   uAtom[0] = 0;
@@ -48,6 +55,7 @@ void PotentialMasterCell::init() {
 }
 
 void PotentialMasterCell::updateVolume() {
+  PotentialMaster::updateVolume();
   cellManager.init();
 #ifdef DEBUG
   uAtom[0] = 0;
@@ -62,9 +70,9 @@ void PotentialMasterCell::updateAtom(int iAtom) {
   cellManager.updateAtom(iAtom);
 }
 
-double PotentialMasterCell::oldEmbeddingEnergy(int iAtom) {
-  rhoAtomsChanged.clear();
-  rhoAtomsChanged.push_back(iAtom);
+double PotentialMasterCell::oldEmbeddingEnergy(PotentialContext& ctx, int iAtom) {
+  ctx.rhoAtomsChanged.clear();
+  ctx.rhoAtomsChanged.push_back(iAtom);
   int iType = box.getAtomType(iAtom);
   double u = embedF[iType]->f(rhoSum[iAtom]);
 
@@ -72,28 +80,97 @@ double PotentialMasterCell::oldEmbeddingEnergy(int iAtom) {
 
   const double *jbo = boxOffsets[iCell];
   const double *ri = box.getAtomPosition(iAtom);
-  for (int jAtom = cellLastAtom[iCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-    if (jAtom!=iAtom) handleOldEmbedding(ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
+  for (int s = cellStart[iCell]; s<cellEnd[iCell]; s++) {
+    const int jAtom = cellAtoms[s];
+    if (jAtom!=iAtom) handleOldEmbedding(ctx, ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
   }
 
   for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
     int jCell = iCell + *it;
     jbo = boxOffsets[jCell];
     jCell = wrapMap[jCell];
-    for (int jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-      handleOldEmbedding(ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
+    for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+      const int jAtom = cellAtoms[s];
+      handleOldEmbedding(ctx, ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
     }
     jCell = iCell - *it;
     jbo = boxOffsets[jCell];
     jCell = wrapMap[jCell];
-    for (int jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-      handleOldEmbedding(ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
+    for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+      const int jAtom = cellAtoms[s];
+      handleOldEmbedding(ctx, ri, box.getAtomPosition(jAtom), jbo, jAtom, u, box.getAtomType(jAtom));
     }
   }
   return u;
 }
 
+template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+void PotentialMasterCell::computeAllPairs(double &uTot, double &virialTot) {
+  const int numAtoms = box.getNumAtoms();
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    int iMolecule = iAtom;
+    vector<int> *iBondedAtoms = nullptr;
+    int iSpecies = 0;
+    if (molecular) {
+      int iFirstAtom;
+      box.getMoleculeInfoAtom(iAtom, iMolecule, iSpecies, iFirstAtom);
+      if (!rigidMolecules) {
+        iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
+      }
+    }
+    const int iType = box.getAtomType(iAtom);
+    const double *iCutoffs = pairCutoffs[iType];
+    Potential** iPotentials = pairPotentials[iType];
+    const int iPair = iType*numAtomTypes;
+    const double *ri = box.getAtomPosition(iAtom);
+    double *fi = doForces ? force[iAtom] : nullptr;
+    Potential* iRhoPotential = doEmbed ? rhoPotentials[iType] : nullptr;
+    double iRhoCutoff = doEmbed ? rhoCutoffs[iType] : 0;
+    int jAtom;
+    const double *jbo = boxOffsets[atomCell[iAtom]];
+#ifdef VALGRIND_CHECKS
+    if (VALGRIND_CHECK_MEM_IS_ADDRESSABLE(jbo, 24)) {
+      printf("oops 0 not addressable for %d %d\n", iAtom, atomCell[iAtom]);
+    }
+#endif
+    for (int s = atomSlot[iAtom]+1; s<cellEnd[atomCell[iAtom]]; s++) {
+      jAtom = cellAtoms[s];
+      if (molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
+      const int jType = box.getAtomType(jAtom);
+      if (!iPotentials[jType]) continue;
+      const double *rj = box.getAtomPosition(jAtom);
+      handleComputeAll<PF,doForces,doEmbed,doCallbacks>(iAtom, jAtom, ri, rj, jbo, iPair+jType, uAtom[iAtom], uAtom[jAtom], fi, doForces?force[jAtom]:nullptr, uTot, virialTot, iCutoffs[jType], iRhoPotential, iRhoCutoff, iType, jType, false, rhoSum+iAtom, rhoSum+jAtom, rdrho);
+    }
+    const int iCell = atomCell[iAtom];
+    for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
+      int jCell = iCell + *it;
+      jbo = boxOffsets[jCell];
+#ifdef VALGRIND_CHECKS
+      if (VALGRIND_CHECK_MEM_IS_ADDRESSABLE(jbo, 24)) {
+        printf("oops up not addressable for iCell %d offset %d jCell %d\n", iCell, *it, jCell);
+        abort();
+      }
+#endif
+      jCell = wrapMap[jCell];
+      for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+        jAtom = cellAtoms[s];
+        bool skipIntra = molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
+        const int jType = box.getAtomType(jAtom);
+        if (!iPotentials[jType]) continue;
+        const double *rj = box.getAtomPosition(jAtom);
+        handleComputeAll<PF,doForces,doEmbed,doCallbacks>(iAtom, jAtom, ri, rj, jbo, iPair+jType, uAtom[iAtom], uAtom[jAtom], fi, doForces?force[jAtom]:nullptr, uTot, virialTot, iCutoffs[jType], iRhoPotential, iRhoCutoff, iType, jType, skipIntra, rhoSum+iAtom, rhoSum+jAtom, rdrho);
+      }
+    }
+  }
+}
+
+template<class PF>
+void PotentialMasterCell::computeAllPairsF(const bool doForces, double &uTot, double &virialTot) {
+  COMPUTE_ALL_DISPATCH(PF, computeAllPairs, doForces, (uTot, virialTot));
+}
+
 void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
+  checkPairTable();
   const double *bs = box.getBoxSize();
   minR2 = 0.5*bs[0];
   for (int k=1; k<3; k++) minR2 = bs[k]<minR2 ? 0.5*bs[k] : minR2;
@@ -103,6 +180,7 @@ void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
   for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
     if (!embeddingPotentials && (*it)->callPair) pairCallbacks.push_back(*it);
     if ((*it)->takesForces) doForces = true;
+    if ((*it)->callPermute) addPermutationCallback(*it);
   }
   const int numAtoms = box.getNumAtoms();
   if (doForces && numAtoms > numForceAtoms) {
@@ -113,7 +191,7 @@ void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
     numForceAtoms = numAtoms;
   }
   if (embeddingPotentials && numAtoms > numRhoSumAtoms) {
-    drhoSum.resize(numAtoms);
+    context.drhoSum.resize(numAtoms);
     numRhoSumAtoms = numAtoms;
     rhoSum = (double*)realloc(rhoSum, numAtoms*sizeof(double));
   }
@@ -132,64 +210,11 @@ void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
     uAtom[i] = 0;
     if (embeddingPotentials) {
       rhoSum[i] = 0;
-      drhoSum[i] = 0;
+      context.drhoSum[i] = 0;
     }
     if (doForces) for (int k=0; k<3; k++) force[i][k] = 0;
   }
-  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-    int iMolecule = iAtom;
-    vector<int> *iBondedAtoms = nullptr;
-    int iSpecies;
-    if (!pureAtoms) {
-      int iFirstAtom;
-      box.getMoleculeInfoAtom(iAtom, iMolecule, iSpecies, iFirstAtom);
-      if (!rigidMolecules) {
-        iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
-      }
-    }
-    const int iType = box.getAtomType(iAtom);
-    const double *iCutoffs = pairCutoffs[iType];
-    Potential** iPotentials = pairPotentials[iType];
-    const double *ri = box.getAtomPosition(iAtom);
-    double *fi = doForces ? force[iAtom] : nullptr;
-    Potential* iRhoPotential = embeddingPotentials ? rhoPotentials[iType] : nullptr;
-    double iRhoCutoff = embeddingPotentials ? rhoCutoffs[iType] : 0;
-    int jAtom=iAtom;
-    const double *jbo = boxOffsets[atomCell[iAtom]];
-#ifdef VALGRIND_CHECKS
-    if (VALGRIND_CHECK_MEM_IS_ADDRESSABLE(jbo, 24)) {
-      printf("oops 0 not addressable for %d %d\n", iAtom, atomCell[iAtom]);
-    }
-#endif
-    while ((jAtom = cellNextAtom[jAtom]) > -1) {
-      if (checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
-      const int jType = box.getAtomType(jAtom);
-      Potential* pij = iPotentials[jType];
-      if (!pij) continue;
-      const double *rj = box.getAtomPosition(jAtom);
-      handleComputeAll(iAtom, jAtom, ri, rj, jbo, pij, uAtom[iAtom], uAtom[jAtom], fi, doForces?force[jAtom]:nullptr, uTot, virialTot, iCutoffs[jType], iRhoPotential, iRhoCutoff, iType, jType, doForces, false);
-    }
-    const int iCell = atomCell[iAtom];
-    for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
-      int jCell = iCell + *it;
-      jbo = boxOffsets[jCell];
-#ifdef VALGRIND_CHECKS
-      if (VALGRIND_CHECK_MEM_IS_ADDRESSABLE(jbo, 24)) {
-        printf("oops up not addressable for iCell %d offset %d jCell %d\n", iCell, *it, jCell);
-        abort();
-      }
-#endif
-      jCell = wrapMap[jCell];
-      for (jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-        bool skipIntra = checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
-        const int jType = box.getAtomType(jAtom);
-        Potential* pij = iPotentials[jType];
-        if (!pij) continue;
-        const double *rj = box.getAtomPosition(jAtom);
-        handleComputeAll(iAtom, jAtom, ri, rj, jbo, pij, uAtom[iAtom], uAtom[jAtom], fi, doForces?force[jAtom]:nullptr, uTot, virialTot, iCutoffs[jType], iRhoPotential, iRhoCutoff, iType, jType, doForces, skipIntra);
-      }
-    }
-  }
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeAllPairsF, (doForces, uTot, virialTot));
   if (embeddingPotentials) {
     // we need another pass to include embedding contributions
     int rdrhoIdx = 0;
@@ -207,22 +232,24 @@ void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
         double iRhoCutoff = rhoCutoffs[iType];
         Potential* iRhoPotential = rhoPotentials[iType];
         double df = idf[iAtom];
-        int jAtom = iAtom;
+        int jAtom;
         const double *jbo = boxOffsets[atomCell[iAtom]];
-        while ((jAtom = cellNextAtom[jAtom]) > -1) {
+        for (int s = atomSlot[iAtom]+1; s<cellEnd[atomCell[iAtom]]; s++) {
+          jAtom = cellAtoms[s];
           int jType = box.getAtomType(jAtom);
           double *rj = box.getAtomPosition(jAtom);
-          handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrhoIdx);
+          handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrho, rdrhoIdx, force[iAtom], force[jAtom]);
         }
         const int iCell = atomCell[iAtom];
         for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
           int jCell = iCell + *it;
           jbo = boxOffsets[jCell];
           jCell = wrapMap[jCell];
-          for (jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
+          for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+            jAtom = cellAtoms[s];
             const int jType = box.getAtomType(jAtom);
             const double *rj = box.getAtomPosition(jAtom);
-            handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrhoIdx);
+            handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrho, rdrhoIdx, force[iAtom], force[jAtom]);
           }
         }
       }
@@ -265,28 +292,31 @@ void PotentialMasterCell::computeAll(vector<PotentialCallback*> &callbacks) {
   }
 }
 
-void PotentialMasterCell::computeOneInternal(const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+template<class PF, bool doEmbed, bool molecular, bool duSingle>
+void PotentialMasterCell::computeOneInternalT(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
   const int iType = box.getAtomType(iAtom);
   const double *iCutoffs = pairCutoffs[iType];
   Potential** iPotentials = pairPotentials[iType];
+  const int iPair = iType*numAtomTypes;
 
-  const int iCell = atomCell[iAtom];
+  // a trial position (computeOneAt) can be in another cell
+  const int iCell = ri==box.getAtomPosition(iAtom) ? atomCell[iAtom] : cellManager.cellForCoord(ri);
 
   vector<int> *iBondedAtoms = nullptr;
-  if (!pureAtoms && !rigidMolecules) {
+  if (molecular && !rigidMolecules) {
     iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
   }
-  double iRhoCutoff = embeddingPotentials ? rhoCutoffs[iType] : 0;
-  Potential* iRhoPotential = embeddingPotentials ? rhoPotentials[iType] : nullptr;
+  double iRhoCutoff = doEmbed ? rhoCutoffs[iType] : 0;
+  Potential* iRhoPotential = doEmbed ? rhoPotentials[iType] : nullptr;
   const double *jbo = boxOffsets[iCell];
-  for (int jAtom = cellLastAtom[iCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
+  for (int s = cellStart[iCell]; s<cellEnd[iCell]; s++) {
+    const int jAtom = cellAtoms[s];
     if (jAtom!=iAtom) {
-      if (checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
+      if (molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
       const int jType = box.getAtomType(jAtom);
-      Potential* pij = iPotentials[jType];
-      if (!pij) continue;
+      if (!iPotentials[jType]) continue;
       const double *rj = box.getAtomPosition(jAtom);
-      handleComputeOne(pij, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, false);
+      handleComputeOne<PF,doEmbed,duSingle>(ctx, iPair+jType, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, false);
     }
   }
 
@@ -294,42 +324,53 @@ void PotentialMasterCell::computeOneInternal(const int iAtom, const double *ri,
     int jCell = iCell + *it;
     jbo = boxOffsets[jCell];
     jCell = wrapMap[jCell];
-    for (int jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-      bool skipIntra = checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
+    for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+      const int jAtom = cellAtoms[s];
+      if (jAtom==iAtom) continue;
+      bool skipIntra = molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
       const int jType = box.getAtomType(jAtom);
-      Potential* pij = iPotentials[jType];
-      if (!pij) continue;
+      if (!iPotentials[jType]) continue;
       const double *rj = box.getAtomPosition(jAtom);
-      handleComputeOne(pij, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, skipIntra);
+      handleComputeOne<PF,doEmbed,duSingle>(ctx, iPair+jType, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, skipIntra);
     }
     // now down
     jCell = iCell - *it;
     jbo = boxOffsets[jCell];
     jCell = wrapMap[jCell];
-    for (int jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-      bool skipIntra = checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
+    for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+      const int jAtom = cellAtoms[s];
+      if (jAtom==iAtom) continue;
+      bool skipIntra = molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
       if (skipIntra && !onlyAtom) continue;
       const int jType = box.getAtomType(jAtom);
-      Potential* pij = iPotentials[jType];
-      if (!pij) continue;
+      if (!iPotentials[jType]) continue;
       const double *rj = box.getAtomPosition(jAtom);
-      handleComputeOne(pij, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, skipIntra);
+      handleComputeOne<PF,doEmbed,duSingle>(ctx, iPair+jType, ri, rj, jbo, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, skipIntra);
     }
   }
-  if (embeddingPotentials) {
+  if (doEmbed) {
     // we just computed new rhoSum[iAtom].  now subtract the old one
-    drhoSum[iAtom] -= rhoSum[iAtom];
-    u1 += embedF[iType]->f(rhoSum[iAtom] + drhoSum[iAtom]);
+    ctx.drhoSum[iAtom] -= rhoSum[iAtom];
+    u1 += embedF[iType]->f(rhoSum[iAtom] + ctx.drhoSum[iAtom]);
   }
 }
 
-double PotentialMasterCell::oldIntraMoleculeEnergyLS(int iAtom, int iLastAtom) {
+template<class PF>
+void PotentialMasterCell::computeOneInternalF(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+  COMPUTE_ONE_DISPATCH(PF, computeOneInternalT, (ctx, iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, onlyAtom));
+}
+
+void PotentialMasterCell::computeOneInternal(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeOneInternalF, (ctx, iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, onlyAtom));
+}
+
+double PotentialMasterCell::oldIntraMoleculeEnergyLS(PotentialContext& ctx, int iAtom, int iLastAtom) {
   // pretend we're doing computeOne... handleComputeOne expects this stuff to exist
-  duAtomSingle = true;
-  uAtomsChanged.resize(1);
-  duAtom.resize(1);
-  uAtomsChanged[0] = iAtom;
-  duAtom[0] = 0;
+  ctx.duAtomSingle = true;
+  ctx.uAtomsChanged.resize(1);
+  ctx.duAtom.resize(1);
+  ctx.uAtomsChanged[0] = iAtom;
+  ctx.duAtom[0] = 0;
 
   const int iType = box.getAtomType(iAtom);
   const double *iCutoffs = pairCutoffs[iType];
@@ -341,19 +382,18 @@ double PotentialMasterCell::oldIntraMoleculeEnergyLS(int iAtom, int iLastAtom) {
   double u = 0;
   for (int jAtom=iAtom; jAtom<=iLastAtom; jAtom++) {
     const int jType = box.getAtomType(jAtom);
-    Potential* pij = iPotentials[jType];
-    if (!pij) continue;
+    if (!iPotentials[jType]) continue;
     double rc2 = iCutoffs[jType];
     if (rc2 < minR2) continue;
     const double *rj = box.getAtomPosition(jAtom);
     for (int ijbo=0; ijbo<numRawBoxOffsets; ijbo++) {
       double* jbo = rawBoxOffsets[ijbo];
-      handleComputeOne(pij, ri, rj, jbo, iAtom, jAtom, u, rc2, 0, nullptr, iType, jType, true);
+      handleComputeOne<PairVirtual,false,true>(ctx, iType*numAtomTypes+jType, ri, rj, jbo, iAtom, jAtom, u, rc2, 0, nullptr, iType, jType, true);
     }
   }
-  duAtomSingle = false;
-  uAtomsChanged.clear();
-  duAtom.clear();
+  ctx.duAtomSingle = false;
+  ctx.uAtomsChanged.clear();
+  ctx.duAtom.clear();
   return u;
 }
 
@@ -377,3 +417,174 @@ void PotentialMasterCell::newMolecule(int iSpecies) {
   // we need to repeat that for cell stuff
   cellManager.newMolecule(iSpecies);
 }
+
+// colors the interior cells so that cells of one color are more than
+// cellRange apart (in some direction).  along each direction, the first
+// multiple of cellRange+1 cells cycle through cellRange+1 colors and any
+// left over get colors of their own.
+void PotentialMasterCell::colorCheckerboard() {
+  const int m = cellRange+1;
+  const int *numCells = cellManager.numCells;
+  const int *jump = cellManager.jump;
+  vector<int> color[3];
+  int numColors[3];
+  for (int d=0; d<3; d++) {
+    const int n = numCells[d] - 2*cellRange;
+    const int q = n/m;
+    color[d].resize(n);
+    for (int i=0; i<n; i++) color[d][i] = i<q*m ? i%m : m+i-q*m;
+    numColors[d] = m + n - q*m;
+  }
+  colorCells.resize(numColors[0]*numColors[1]*numColors[2]);
+  for (vector<vector<int> >::iterator it = colorCells.begin(); it!=colorCells.end(); ++it) it->clear();
+  for (int ix=0; ix<(int)color[0].size(); ix++) {
+    for (int iy=0; iy<(int)color[1].size(); iy++) {
+      for (int iz=0; iz<(int)color[2].size(); iz++) {
+        int c = (color[0][ix]*numColors[1] + color[1][iy])*numColors[2] + color[2][iz];
+        colorCells[c].push_back((ix+cellRange)*jump[0] + (iy+cellRange)*jump[1] + (iz+cellRange)*jump[2]);
+      }
+    }
+  }
+}
+
+template<class PF>
+void PotentialMasterCell::sweepCells(const vector<int> &cells, const int c0, const int c1, const int t, const double stepSize, const double temperature, Random& rand) {
+  vector<int> &tAtoms = trialAtoms[t];
+  vector<double> &tDU = trialDU[t];
+  vector<int> &sAtoms = sweepAtoms[t];
+  vector<double> &sDU = sweepDU[t];
+  double *sums = &sweepSums[4*t];
+  for (int c=c0; c<c1; c++) {
+    const int iCell = cells[c];
+    const int n = cellEnd[iCell] - cellStart[iCell];
+    for (int k=0; k<n; k++) {
+      const int iAtom = cellAtoms[cellStart[iCell] + rand.nextInt(n)];
+      double *ri = box.getAtomPosition(iAtom);
+      double rNew[3];
+      for (int a=0; a<3; a++) rNew[a] = ri[a] + 2*stepSize*(rand.nextDouble32()-0.5);
+      sums[2]++;
+      // the atom has to stay in the cell (which it might have been clamped
+      // into by assignCells)
+      if (cellManager.cellForCoord(ri) != iCell || cellManager.cellForCoord(rNew) != iCell) continue;
+
+      const int iType = box.getAtomType(iAtom);
+      const double *iCutoffs = pairCutoffs[iType];
+      Potential** iPotentials = pairPotentials[iType];
+      const int iPair = iType*numAtomTypes;
+      double du = 0;
+      tAtoms.clear();
+      tDU.clear();
+      auto cellPairs = [&](int jCell) {
+        const double *jbo = boxOffsets[jCell];
+        jCell = wrapMap[jCell];
+        for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+          const int jAtom = cellAtoms[s];
+          if (jAtom==iAtom) continue;
+          const int jType = box.getAtomType(jAtom);
+          if (!iPotentials[jType]) continue;
+          const double *rj = box.getAtomPosition(jAtom);
+          double r2Old = 0, r2New = 0;
+          for (int a=0; a<3; a++) {
+            double rja = rj[a] + jbo[a];
+            r2Old += (ri[a]-rja)*(ri[a]-rja);
+            r2New += (rNew[a]-rja)*(rNew[a]-rja);
+          }
+          const double rc2 = iCutoffs[jType];
+          double uOld = r2Old < rc2 ? PF::u(pairTable, iPair+jType, r2Old) : 0;
+          double uNew = r2New < rc2 ? PF::u(pairTable, iPair+jType, r2New) : 0;
+          if (uOld==uNew) continue;
+          du += uNew-uOld;
+          tAtoms.push_back(jAtom);
+          tDU.push_back(0.5*(uNew-uOld));
+        }
+      };
+      cellPairs(iCell);
+      for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
+        cellPairs(iCell + *it);
+        cellPairs(iCell - *it);
+      }
+
+      double chi = du<0 ? 1 : exp(-du/temperature);
+      sums[1] += chi;
+      if (chi==0 || (chi<1 && chi<rand.nextDouble())) continue;
+      std::copy(rNew, rNew+3, ri);
+      sums[0] += du;
+      sums[3]++;
+      sAtoms.push_back(iAtom);
+      sDU.push_back(0.5*du);
+      sAtoms.insert(sAtoms.end(), tAtoms.begin(), tAtoms.end());
+      sDU.insert(sDU.end(), tDU.begin(), tDU.end());
+    }
+  }
+}
+
+double PotentialMasterCell::sweepCheckerboard(double stepSize, double temperature, Random& random, vector<Random*> &taskRandom, long &numTrials, long &numAccepted, double &chiSum) {
+  checkPairTable();
+  if (!pureAtoms || embeddingPotentials || doEwald) {
+    fprintf(stderr, "checkerboard sweeps can only handle atoms without embedding or Ewald\n");
+    abort();
+  }
+  const bool* periodic = box.getPeriodic();
+  if (!periodic[0] || !periodic[1] || !periodic[2]) {
+    fprintf(stderr, "checkerboard sweeps need a periodic box\n");
+    abort();
+  }
+  const int nt = taskRandom.size();
+  const int numAtoms = box.getNumAtoms();
+  const double* bs = box.getBoxSize();
+  double shift[3];
+  for (int a=0; a<3; a++) shift[a] = bs[a]*(random.nextDouble()-0.5);
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double* r = box.getAtomPosition(iAtom);
+    for (int a=0; a<3; a++) r[a] += shift[a];
+    box.nearestImage(r);
+  }
+  cellManager.assignCells();
+  colorCheckerboard();
+
+  sweepAtoms.resize(nt);
+  sweepDU.resize(nt);
+  trialAtoms.resize(nt);
+  trialDU.resize(nt);
+  sweepSums.assign(4*nt, 0);
+  // cells of one color don't interact, so only the order of the colors
+  // matters
+  const int numColors = colorCells.size();
+  int colorOrder[numColors];
+  for (int i=0; i<numColors; i++) colorOrder[i] = i;
+  for (int i=numColors-1; i>0; i--) {
+    int j = random.nextInt(i+1);
+    std::swap(colorOrder[i], colorOrder[j]);
+  }
+  ThreadPool& pool = ThreadPool::get();
+  for (int i=0; i<numColors; i++) {
+    const vector<int> &cells = colorCells[colorOrder[i]];
+    if (cells.size()==0) continue;
+    const int nc = cells.size();
+    pool.run(nt, [&](int t) {
+      sweepAtoms[t].clear();
+      sweepDU[t].clear();
+      const int c0 = ThreadPool::taskStart(nc, t, nt), c1 = ThreadPool::taskStart(nc, t+1, nt);
+      PAIR_FUNCTOR_DISPATCH(pairTable.kind, sweepCells, (cells, c0, c1, t, stepSize, temperature, *taskRandom[t]));
+    });
+    for (int t=0; t<nt; t++) {
+      for (int k=0; k<(int)sweepAtoms[t].size(); k++) uAtom[sweepAtoms[t][k]] += sweepDU[t][k];
+    }
+  }
+
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double* r = box.getAtomPosition(iAtom);
+    for (int a=0; a<3; a++) r[a] -= shift[a];
+    box.nearestImage(r);
+  }
+  cellManager.assignCells();
+
+  double du = 0;
+  for (int t=0; t<nt; t++) {
+    du += sweepSums[4*t];
+    chiSum += sweepSums[4*t+1];
+    numTrials += (long)sweepSums[4*t+2];
+    numAccepted += (long)sweepSums[4*t+3];
+  }
+  return du;
+}
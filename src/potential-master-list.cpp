@@ -3,22 +3,188 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <stdio.h>
+#include <limits.h>
 #include "potential-master.h"
 #include "alloc2d.h"
+#include "pair-kernel.h"
+#include "thread-pool.h"
 
-PotentialMasterList::PotentialMasterList(const SpeciesList& sl, Box& box, bool doEmbed, int cellRange, double nRange) : PotentialMasterCell(sl, box, doEmbed, cellRange), nbrRange(nRange), nbrs(nullptr), onlyUpNbrs(true), numAtomNbrsUp(nullptr), numAtomNbrsDn(nullptr), nbrsNumAtoms(0), maxNab(0), nbrBoxOffsets(nullptr), oldAtomPositions(nullptr), safetyFac(0.1) {
+PotentialMasterList::PotentialMasterList(const SpeciesList& sl, Box& box, bool doEmbed, int cellRange, double nRange) : PotentialMasterCell(sl, box, doEmbed, cellRange), nbrRange(nRange), onlyUpNbrs(true), nbrsNumAtoms(0), nbrStart(nullptr), nbrAtoms(nullptr), nbrImages(nullptr), numNbrs(0), nbrCapacity(0), nbrDnStart(nullptr), nbrDnAtoms(nullptr), nbrDnCapacity(0), oldAtomPositions(nullptr), safetyFac(0.1), kernelLevel(pairKernelLevel()), clusterSize(0), numClusters(0), clusterSlots(0), clusterAtoms(nullptr), atomClusterSlot(nullptr), clusterTypes(nullptr), clusterU(nullptr), clusterPairStart(nullptr), clusterPairCluster(nullptr), clusterPairOffsets(nullptr), clusterPairMask(nullptr), numClusterPairs(0), maxClusterPairs(0), nbrHaloAtoms(nullptr), haloNbrs(false), haloCapacity(0), haloTypes(nullptr), haloU(nullptr), packCapacity(0), numOwnedAtoms(-1), reorderInterval(0), reorderCountdown(0), numThreads(0), splitTasks(0) {
   maxR2 = (double*)malloc(numAtomTypes*sizeof(double));
   maxR2Unsafe = (double*)malloc(numAtomTypes*sizeof(double));
+  for (int k=0; k<3; k++) clusterX[k] = clusterF[k] = haloX[k] = haloF[k] = packX[k] = nullptr;
+  syncThreads();
 }
 
 PotentialMasterList::~PotentialMasterList() {
   free(maxR2);
   free(maxR2Unsafe);
-  free(numAtomNbrsUp);
-  free(numAtomNbrsDn);
-  free2D((void**)nbrs);
-  free2D((void**)nbrBoxOffsets);
+  free(nbrStart);
+  free(nbrAtoms);
+  free(nbrImages);
+  free(nbrDnStart);
+  free(nbrDnAtoms);
   free2D((void**)oldAtomPositions);
+  free(clusterAtoms);
+  free(atomClusterSlot);
+  free(clusterTypes);
+  for (int k=0; k<3; k++) {
+    free(clusterX[k]);
+    free(clusterF[k]);
+  }
+  free(clusterU);
+  free(clusterPairStart);
+  free(clusterPairCluster);
+  free(clusterPairOffsets);
+  free(clusterPairMask);
+  free(nbrHaloAtoms);
+  free(haloTypes);
+  for (int k=0; k<3; k++) {
+    free(haloX[k]);
+    free(haloF[k]);
+    free(packX[k]);
+  }
+  free(haloU);
+  for (int t=0; t<numThreads; t++) {
+    free(threadClusterData[t]);
+    free(threadClusterTypes[t]);
+  }
+}
+
+void PotentialMasterList::setKernelLevel(int level) {
+  int maxLevel = pairKernelLevel();
+  if (level > maxLevel) {
+    fprintf(stderr, "pair kernel level %d is not supported, using %d\n", level, maxLevel);
+    level = maxLevel;
+  }
+  kernelLevel = level;
+}
+
+void PotentialMasterList::setClusterSize(int size) {
+  if (size != 0 && size != 4 && size != 8) {
+    fprintf(stderr, "cluster size must be 0, 4 or 8\n");
+    abort();
+  }
+  clusterSize = size;
+  // the current clusters (if any) are no good now
+  numClusters = 0;
+}
+
+void PotentialMasterList::setHalo(bool doHalo) {
+  cellManager.setHalo(doHalo);
+  // the current lists have no ghosts
+  haloNbrs = false;
+}
+
+void PotentialMasterList::setReorderInterval(int interval) {
+  reorderInterval = interval;
+  // reorder at the next rebuild
+  reorderCountdown = 0;
+}
+
+// sizes the per-task arrays for the current number of pool threads
+void PotentialMasterList::syncThreads() {
+  const int n = ThreadPool::get().getNumThreads();
+  if (n == numThreads) return;
+  for (int t=n; t<numThreads; t++) {
+    free(threadClusterData[t]);
+    free(threadClusterTypes[t]);
+  }
+  threadClusterData.resize(n, nullptr);
+  threadClusterTypes.resize(n, nullptr);
+  threadClusterCapacity.resize(n, 0);
+  threadPairCluster.resize(n);
+  threadPairOffsets.resize(n);
+  threadPairMask.resize(n);
+  numThreads = n;
+  threadStart.resize(n+1);
+  threadU.resize(n);
+  threadF.resize(n);
+  threadRho.resize(n);
+  threadRdrho.resize(n);
+  threadX.resize(n);
+  threadTypes.resize(n);
+  threadSums.resize(2*n);
+  threadNbrAtoms.resize(n);
+  threadNbrImages.resize(n);
+  threadNbrOffset.resize(n);
+  threadDnCount.resize(n);
+}
+
+// splits the atoms so that each task gets about the same number of pairs
+void PotentialMasterList::splitThreads() {
+  const int numAtoms = box.getNumAtoms();
+  threadStart[0] = 0;
+  for (int t=1; t<numThreads; t++) {
+    const int target = (int)((long)numNbrs*t/numThreads);
+    threadStart[t] = lower_bound(nbrStart, nbrStart+numAtoms, target) - nbrStart;
+  }
+  threadStart[numThreads] = numAtoms;
+  splitTasks = numThreads;
+  atomSlots.numTasks = ghostSlots.numTasks = 0;
+}
+
+// builds s for the split in s.start, item i having the neighbors
+// entries[rowStart[i]] .. entries[rowStart[i+1]-1]
+void PotentialMasterList::buildSlots(ThreadSlots &s, const int *rowStart, const int *entries) {
+  const int numTasks = s.start.size() - 1;
+  s.halo.resize(numTasks);
+  s.slot.resize(rowStart[s.start[numTasks]]);
+  ThreadPool::get().run(numTasks, [&](int t) {
+    const int i0 = s.start[t], i1 = s.start[t+1];
+    const int j0 = rowStart[i0], j1 = rowStart[i1];
+    vector<int> &h = s.halo[t];
+    h.clear();
+    for (int j=j0; j<j1; j++) {
+      if (entries[j] < i0 || entries[j] >= i1) h.push_back(entries[j]);
+    }
+    sort(h.begin(), h.end());
+    h.erase(unique(h.begin(), h.end()), h.end());
+    for (int j=j0; j<j1; j++) {
+      const int jItem = entries[j];
+      if (jItem >= i0 && jItem < i1) s.slot[j] = jItem - i0;
+      else s.slot[j] = i1 - i0 + (lower_bound(h.begin(), h.end(), jItem) - h.begin());
+    }
+  });
+  s.numTasks = numTasks;
+}
+
+// (re)builds the slots for the neighbors jAtoms (nbrAtoms or nbrHaloAtoms)
+// if the lists or the tasks have changed
+void PotentialMasterList::checkSlots(ThreadSlots &s, const int *jAtoms) {
+  if (splitTasks != numThreads) splitThreads();
+  if (s.numTasks == numThreads) return;
+  s.start = threadStart;
+  buildSlots(s, nbrStart, jAtoms);
+}
+
+static inline const double* taskData(const vector<double> &v) {return v.data();}
+static inline const double* taskData(const double *p) {return p;}
+
+// adds the tasks' arrays into dst.  the values start at block*n*size (size
+// being the task's number of slots), with n per slot, and go to dst[n*i]
+// .. dst[n*i+n-1] for item i.  each task adds up a block of items: its own
+// part and then the halo parts of the tasks, in task order.  items from the
+// end of the last block up to numAll (ghosts) are only in halos, and go to
+// the last task.
+template<class A>
+void PotentialMasterList::reduceSlots(const ThreadSlots &s, const vector<A> &src, int block, int n, double *dst, int numAll) {
+  ThreadPool::get().run(s.numTasks, [&](int t) {
+    const int i0 = s.start[t], i1 = s.start[t+1];
+    const int iEnd = t==s.numTasks-1 ? numAll : i1;
+    const double *own = taskData(src[t]) + block*n*s.numSlots(t);
+    for (int i=n*i0; i<n*i1; i++) dst[i] += own[i-n*i0];
+    for (int r=0; r<s.numTasks; r++) {
+      const vector<int> &h = s.halo[r];
+      // our own halo is outside our block, except for ghosts
+      const int k0 = lower_bound(h.begin(), h.end(), r==t ? i1 : i0) - h.begin();
+      const int k1 = lower_bound(h.begin(), h.end(), iEnd) - h.begin();
+      const double *rh = taskData(src[r]) + block*n*s.numSlots(r) + n*(s.start[r+1] - s.start[r]);
+      for (int k=k0; k<k1; k++) {
+        for (int c=0; c<n; c++) dst[n*h[k]+c] += rh[n*k+c];
+      }
+    }
+  });
 }
 
 double PotentialMasterList::getRange() {
@@ -27,6 +193,10 @@ double PotentialMasterList::getRange() {
 
 void PotentialMasterList::init() {
   PotentialMasterCell::init();
+}
+
+void PotentialMasterList::updatePairTable() {
+  PotentialMasterCell::updatePairTable();
   double maxRhoCut = 0;
   if (embeddingPotentials) {
     for (int i=0; i<numAtomTypes; i++) {
@@ -52,22 +222,159 @@ void PotentialMasterList::setDoDownNbrs(bool doDown) {
   onlyUpNbrs = !doDown;
 }
 
-int PotentialMasterList::checkNbrPair(int iAtom, int jAtom, const bool skipIntra, double *ri, double *rj, double rc2, double minR2, double *jbo) {
+void PotentialMasterList::checkNbrPair(int jAtom, const bool skipIntra, const double *ri, const double *rj, double rc2, double minR2, const double *jbo, int image, vector<int> &tAtoms, vector<unsigned char> &tImages) {
   double r2 = 0;
   for (int k=0; k<3; k++) {
     double dr = rj[k]+jbo[k]-ri[k];
     r2 += dr*dr;
   }
-  if (r2 > rc2 || (skipIntra && r2 < minR2)) return 0;
-  if (numAtomNbrsUp[iAtom] >= maxNab) return 1;
-  nbrs[iAtom][numAtomNbrsUp[iAtom]] = jAtom;
-  nbrBoxOffsets[iAtom][numAtomNbrsUp[iAtom]] = jbo;
-  numAtomNbrsUp[iAtom]++;
-  return 0;
+  if (r2 > rc2 || (skipIntra && r2 < minR2)) return;
+  tAtoms.push_back(jAtom);
+  tImages.push_back(image);
 }
 
-void PotentialMasterList::checkUpdateNbrs() {
-  int boxNumAtoms = box.getNumAtoms();
+// up neighbors of atoms iStart .. iEnd-1, appended to the given arrays.
+// nbrStart for these atoms is set relative to the start of the arrays.
+void PotentialMasterList::buildNbrRows(int iStart, int iEnd, vector<int> &tAtoms, vector<unsigned char> &tImages) {
+  const vector<int> &boxOffsetIndex = cellManager.boxOffsetIndex;
+  const double rc2 = nbrRange*nbrRange;
+  for (int iAtom=iStart; iAtom<iEnd; iAtom++) {
+    nbrStart[iAtom] = tAtoms.size();
+    int iMolecule = iAtom;
+    vector<int> *iBondedAtoms = nullptr;
+    int iSpecies = 0;
+    if (!pureAtoms) {
+      int iFirstAtom;
+      box.getMoleculeInfoAtom(iAtom, iMolecule, iSpecies, iFirstAtom);
+      if (!rigidMolecules) {
+        iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
+      }
+    }
+    double *ri = box.getAtomPosition(iAtom);
+    // a ghost only pairs with owned atoms
+    const int jGhost = (numOwnedAtoms < 0 || iAtom < numOwnedAtoms) ? INT_MAX : numOwnedAtoms;
+    int jAtom;
+    int iCell = atomCell[iAtom];
+    double *jbo = boxOffsets[iCell]; // always 0
+    int jImage = boxOffsetIndex[iCell];
+    Potential** iPotentials = pairPotentials[box.getAtomType(iAtom)];
+    for (int s = atomSlot[iAtom]+1; s<cellEnd[iCell]; s++) {
+      jAtom = cellAtoms[s];
+      if (!iPotentials[box.getAtomType(jAtom)] || jAtom >= jGhost) continue;
+      if (checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
+      double *rj = box.getAtomPosition(jAtom);
+      checkNbrPair(jAtom, false, ri, rj, rc2, minR2, jbo, jImage, tAtoms, tImages);
+    }
+    for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
+      int jCell = iCell + *it;
+      jbo = boxOffsets[jCell];
+      jImage = boxOffsetIndex[jCell];
+      jCell = wrapMap[jCell];
+      for (int s = cellStart[jCell]; s<cellEnd[jCell]; s++) {
+        jAtom = cellAtoms[s];
+        if (!iPotentials[box.getAtomType(jAtom)] || jAtom >= jGhost) {
+          continue;
+        }
+        bool skipIntra = checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
+        double *rj = box.getAtomPosition(jAtom);
+        checkNbrPair(jAtom, skipIntra, ri, rj, rc2, minR2, jbo, jImage, tAtoms, tImages);
+      }
+    }
+  }
+}
+
+// down neighbors are the transpose of the up lists.  each thread counts
+// the down neighbors coming from its block of up rows, by slot (so only
+// for its block and halo); per-atom offsets for each thread then let the
+// threads fill their entries without conflict, in the same (ascending)
+// order a serial pass would.
+void PotentialMasterList::buildDnNbrs() {
+  const int boxNumAtoms = box.getNumAtoms();
+  nbrDnStart = (int*)realloc(nbrDnStart, (nbrsNumAtoms+1)*sizeof(int));
+  if (numNbrs > nbrDnCapacity) {
+    nbrDnCapacity = numNbrs;
+    nbrDnAtoms = (int*)realloc(nbrDnAtoms, nbrDnCapacity*sizeof(int));
+  }
+  checkSlots(atomSlots, nbrAtoms);
+  const int *slot = atomSlots.slot.data();
+  ThreadPool::get().run(numThreads, [&](int t) {
+    vector<int> &count = threadDnCount[t];
+    count.assign(atomSlots.numSlots(t), 0);
+    for (int j=nbrStart[threadStart[t]]; j<nbrStart[threadStart[t+1]]; j++) count[slot[j]]++;
+  });
+  // turn the counts into offsets within each atom's row, tallying the
+  // totals of each block of atoms.  the counts for an atom are in its own
+  // task's block and in the halos of the others.
+  ThreadPool::get().run(numThreads, [&](int t) {
+    const int i0 = threadStart[t], i1 = threadStart[t+1];
+    for (int iAtom=i0; iAtom<i1; iAtom++) nbrDnStart[iAtom] = 0;
+    for (int s=0; s<numThreads; s++) {
+      vector<int> &count = threadDnCount[s];
+      if (s == t) {
+        for (int iAtom=i0; iAtom<i1; iAtom++) {
+          int c = count[iAtom-i0];
+          count[iAtom-i0] = nbrDnStart[iAtom];
+          nbrDnStart[iAtom] += c;
+        }
+        continue;
+      }
+      const vector<int> &h = atomSlots.halo[s];
+      const int k0 = lower_bound(h.begin(), h.end(), i0) - h.begin();
+      const int k1 = lower_bound(h.begin(), h.end(), i1) - h.begin();
+      const int sOwn = threadStart[s+1] - threadStart[s];
+      for (int k=k0; k<k1; k++) {
+        int c = count[sOwn+k];
+        count[sOwn+k] = nbrDnStart[h[k]];
+        nbrDnStart[h[k]] += c;
+      }
+    }
+    int blockTotal = 0;
+    for (int iAtom=i0; iAtom<i1; iAtom++) {
+      int n = nbrDnStart[iAtom];
+      nbrDnStart[iAtom] = blockTotal;
+      blockTotal += n;
+    }
+    threadNbrOffset[t] = blockTotal;
+  });
+  int total = 0;
+  for (int t=0; t<numThreads; t++) {
+    int blockTotal = threadNbrOffset[t];
+    threadNbrOffset[t] = total;
+    total += blockTotal;
+  }
+  ThreadPool::get().run(numThreads, [&](int t) {
+    const int offset = threadNbrOffset[t];
+    for (int iAtom=threadStart[t]; iAtom<threadStart[t+1]; iAtom++) nbrDnStart[iAtom] += offset;
+  });
+  nbrDnStart[boxNumAtoms] = total;
+  ThreadPool::get().run(numThreads, [&](int t) {
+    vector<int> &next = threadDnCount[t];
+    for (int iAtom=threadStart[t]; iAtom<threadStart[t+1]; iAtom++) {
+      for (int j=nbrStart[iAtom]; j<nbrStart[iAtom+1]; j++) {
+        nbrDnAtoms[nbrDnStart[nbrAtoms[j]] + next[slot[j]]++] = iAtom;
+      }
+    }
+  });
+}
+
+void PotentialMasterList::atomsReplaced(int numOwned) {
+  const int numAtoms = box.getNumAtoms();
+  numOwnedAtoms = numOwned;
+  uAtom.resize(numAtoms);
+  // MD integrators hold on to our forces, which the caller fills in again
+  if (force && numAtoms > numForceAtoms) {
+    force = (double**)realloc2D((void**)force, numAtoms, 3, sizeof(double));
+    numForceAtoms = numAtoms;
+  }
+  for (int i=0; i<numAtomTypes; i++) numAtomsByType[i] = 0;
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) numAtomsByType[box.getAtomType(iAtom)]++;
+  // the current clusters and ghosts refer to the old atoms
+  numClusters = 0;
+  haloNbrs = false;
+}
+
+bool PotentialMasterList::needsNbrUpdate() {
+  int boxNumAtoms = numOwnedAtoms < 0 ? box.getNumAtoms() : numOwnedAtoms;
 #ifdef DEBUG
   bool needsUpdate = false;
 #endif
@@ -86,56 +393,292 @@ void PotentialMasterList::checkUpdateNbrs() {
       }
       needsUpdate = true;
 #else
-      reset();
-      return;
+      return true;
 #endif
     }
   }
 #ifdef DEBUG
-  if (needsUpdate) reset();
+  return needsUpdate;
+#else
+  return false;
 #endif
 }
 
+void PotentialMasterList::checkUpdateNbrs() {
+  if (needsNbrUpdate()) reset();
+}
+
 void PotentialMasterList::reset() {
   int boxNumAtoms = box.getNumAtoms();
   if (boxNumAtoms==0) return;
-  bool moreAtoms = boxNumAtoms > nbrsNumAtoms;
-  if (moreAtoms) {
+  syncThreads();
+  if (boxNumAtoms > nbrsNumAtoms) {
     oldAtomPositions = (double**)realloc2D((void**)oldAtomPositions, boxNumAtoms, 3, sizeof(double));
+    nbrStart = (int*)realloc(nbrStart, (boxNumAtoms+1)*sizeof(int));
+    nbrsNumAtoms = boxNumAtoms;
   }
   for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) {
-    double *ri = box.getAtomPosition(iAtom);
-    box.nearestImage(ri);
-    for (int j=0; j<3; j++) oldAtomPositions[iAtom][j] = ri[j];
+    box.nearestImage(box.getAtomPosition(iAtom));
   }
 
   cellManager.assignCells();
-
-// if an atom has more neighbors than we've allocated space for, then
-// maxNab will be increased and execution will return to this point
-  bool forceReallocNbrs = false;
-resetStart:
-  if ((!numAtomNbrsUp || moreAtoms) && boxNumAtoms>0)  {
-    numAtomNbrsUp = (int*)realloc(numAtomNbrsUp, boxNumAtoms*sizeof(int));
-    if (!onlyUpNbrs) numAtomNbrsDn = (int*)realloc(numAtomNbrsDn, boxNumAtoms*sizeof(int));
+  // a domain's owned atoms and ghosts keep their order
+  if (reorderInterval > 0 && numOwnedAtoms < 0) {
+    if (reorderCountdown == 0) {
+      cellManager.mortonOrder(reorderIndex);
+      permuteAtoms(reorderIndex.data());
+      cellManager.assignCells();
+      reorderCountdown = reorderInterval;
+    }
+    reorderCountdown--;
   }
-  // forceReallocNbrs can be used to force reallocation when max # of nbrs is too small
-  if ((!nbrs || moreAtoms || forceReallocNbrs) && boxNumAtoms>0)  {
-    if (!maxNab) maxNab = 5;
-    if (moreAtoms) nbrsNumAtoms = boxNumAtoms;
-    nbrs = (int**)realloc2D((void**)nbrs, nbrsNumAtoms, maxNab, sizeof(int));
-    nbrBoxOffsets = (double***)realloc2D((void**)nbrBoxOffsets, nbrsNumAtoms, maxNab, sizeof(double*));
-    forceReallocNbrs = false;
+  for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) {
+    double *ri = box.getAtomPosition(iAtom);
+    for (int j=0; j<3; j++) oldAtomPositions[iAtom][j] = ri[j];
+  }
+  if (cellManager.numRawBoxOffsets > 256) {
+    fprintf(stderr, "too many periodic images (%d) for neighbor list\n", cellManager.numRawBoxOffsets);
+    abort();
   }
-
-  for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) numAtomNbrsUp[iAtom] = 0;
-
-  double rc2 = nbrRange*nbrRange;
   const double *bs = box.getBoxSize();
   minR2 = 0.5*bs[0];
   for (int k=1; k<3; k++) minR2 = bs[k]<minR2 ? 0.5*bs[k] : minR2;
   minR2 *= minR2;
-  for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) {
+
+  // each thread builds the rows for a block of atoms into its own arrays;
+  // the blocks are then copied into place after a prefix sum of their sizes
+  for (int t=0; t<=numThreads; t++) threadStart[t] = (int)((long)boxNumAtoms*t/numThreads);
+  ThreadPool::get().run(numThreads, [&](int t) {
+    threadNbrAtoms[t].clear();
+    threadNbrImages[t].clear();
+    buildNbrRows(threadStart[t], threadStart[t+1], threadNbrAtoms[t], threadNbrImages[t]);
+  });
+  numNbrs = 0;
+  for (int t=0; t<numThreads; t++) {
+    threadNbrOffset[t] = numNbrs;
+    numNbrs += threadNbrAtoms[t].size();
+  }
+  if (numNbrs > nbrCapacity) {
+    // leave some room to grow
+    nbrCapacity = numNbrs + numNbrs/4;
+    nbrAtoms = (int*)realloc(nbrAtoms, nbrCapacity*sizeof(int));
+    nbrImages = (unsigned char*)realloc(nbrImages, nbrCapacity);
+  }
+  ThreadPool::get().run(numThreads, [&](int t) {
+    const int offset = threadNbrOffset[t];
+    copy(threadNbrAtoms[t].begin(), threadNbrAtoms[t].end(), nbrAtoms+offset);
+    copy(threadNbrImages[t].begin(), threadNbrImages[t].end(), nbrImages+offset);
+    for (int iAtom=threadStart[t]; iAtom<threadStart[t+1]; iAtom++) nbrStart[iAtom] += offset;
+  });
+  nbrStart[boxNumAtoms] = numNbrs;
+  // the tasks (and slots) for computeAll go by pairs, not atoms
+  splitTasks = 0;
+  if (!onlyUpNbrs) buildDnNbrs();
+  haloNbrs = cellManager.halo;
+  if (haloNbrs) buildHalo();
+  if (clusterSize > 0) buildClusters();
+}
+
+void PotentialMasterList::buildHalo() {
+  const int boxNumAtoms = box.getNumAtoms();
+  // assignCells dropped the old ghosts; we make the ones our lists need
+  nbrHaloAtoms = (int*)realloc(nbrHaloAtoms, nbrCapacity*sizeof(int));
+  for (int j=0; j<numNbrs; j++) {
+    nbrHaloAtoms[j] = cellManager.ghostIndex(nbrAtoms[j], nbrImages[j]);
+  }
+  const int numGhosts = cellManager.getNumGhosts();
+  const int n = boxNumAtoms + numGhosts;
+  if (n > haloCapacity) {
+    int padded = ALIGNED_DOUBLES(n);
+    free(haloTypes);
+    haloTypes = (int*)mallocAligned(padded*sizeof(int));
+    for (int k=0; k<3; k++) {
+      free(haloX[k]);
+      free(haloF[k]);
+      haloX[k] = (double*)mallocAligned(padded*sizeof(double));
+      haloF[k] = (double*)mallocAligned(padded*sizeof(double));
+    }
+    free(haloU);
+    haloU = (double*)mallocAligned(padded*sizeof(double));
+    haloCapacity = padded;
+  }
+  for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) haloTypes[iAtom] = box.getAtomType(iAtom);
+  for (int g=0; g<numGhosts; g++) {
+    haloTypes[boxNumAtoms+g] = box.getAtomType(cellManager.ghostAtom[g]);
+  }
+}
+
+void PotentialMasterList::buildClusters() {
+  const int boxNumAtoms = box.getNumAtoms();
+  const int nc = (boxNumAtoms+clusterSize-1)/clusterSize;
+  const int slots = nc*clusterSize;
+  if (slots > clusterSlots) {
+    free(clusterAtoms);
+    free(atomClusterSlot);
+    free(clusterTypes);
+    clusterAtoms = (int*)malloc(slots*sizeof(int));
+    atomClusterSlot = (int*)malloc(slots*sizeof(int));
+    clusterTypes = (int*)mallocAligned(slots*sizeof(int));
+    for (int k=0; k<3; k++) {
+      free(clusterX[k]);
+      free(clusterF[k]);
+      clusterX[k] = (double*)mallocAligned(slots*sizeof(double));
+      clusterF[k] = (double*)mallocAligned(slots*sizeof(double));
+    }
+    free(clusterU);
+    clusterU = (double*)mallocAligned(slots*sizeof(double));
+    clusterPairStart = (int*)realloc(clusterPairStart, (nc+1)*sizeof(int));
+    clusterSlots = slots;
+  }
+  numClusters = nc;
+  // atoms are taken cell by cell, so each run of clusterSize atoms is
+  // spatially compact
+  const int totalCells = cellEnd.size();
+  cellSlotStart.resize(totalCells+1);
+  int s = 0;
+  for (int iCell=0; iCell<totalCells; iCell++) {
+    cellSlotStart[iCell] = s;
+    for (int c=cellStart[iCell]; c<cellEnd[iCell]; c++) {
+      const int iAtom = cellAtoms[c];
+      clusterAtoms[s] = iAtom;
+      clusterTypes[s] = box.getAtomType(iAtom);
+      atomClusterSlot[iAtom] = s;
+      s++;
+    }
+  }
+  cellSlotStart[totalCells] = s;
+  for ( ; s<slots; s++) {
+    clusterAtoms[s] = -1;
+    clusterTypes[s] = 0;
+    for (int k=0; k<3; k++) clusterX[k][s] = 0;
+  }
+  clusterBox.resize(6*nc);
+  for (int iCluster=0; iCluster<nc; iCluster++) {
+    double *b = &clusterBox[6*iCluster];
+    for (int k=0; k<3; k++) {
+      b[k] = 1e100;
+      b[3+k] = -1e100;
+    }
+    for (int a=0; a<clusterSize; a++) {
+      const int iAtom = clusterAtoms[iCluster*clusterSize+a];
+      if (iAtom < 0) break;
+      const double *ri = box.getAtomPosition(iAtom);
+      for (int k=0; k<3; k++) {
+        if (ri[k] < b[k]) b[k] = ri[k];
+        if (ri[k] > b[3+k]) b[3+k] = ri[k];
+      }
+    }
+  }
+
+  // each task finds the tiles for a block of i clusters, which are then
+  // copied into place after a prefix sum of their sizes
+  ThreadPool::get().run(numThreads, [&](int t) {
+    threadPairCluster[t].clear();
+    threadPairOffsets[t].clear();
+    threadPairMask[t].clear();
+    buildClusterRows(ThreadPool::taskStart(nc, t, numThreads), ThreadPool::taskStart(nc, t+1, numThreads), threadPairCluster[t], threadPairOffsets[t], threadPairMask[t]);
+  });
+  numClusterPairs = 0;
+  for (int t=0; t<numThreads; t++) {
+    threadNbrOffset[t] = numClusterPairs;
+    numClusterPairs += threadPairCluster[t].size();
+  }
+  if (numClusterPairs > maxClusterPairs) {
+    // leave some room to grow
+    maxClusterPairs = numClusterPairs + numClusterPairs/4;
+    clusterPairCluster = (int*)realloc(clusterPairCluster, maxClusterPairs*sizeof(int));
+    clusterPairOffsets = (double**)realloc(clusterPairOffsets, maxClusterPairs*sizeof(double*));
+    clusterPairMask = (uint64_t*)realloc(clusterPairMask, maxClusterPairs*sizeof(uint64_t));
+  }
+  ThreadPool::get().run(numThreads, [&](int t) {
+    const int offset = threadNbrOffset[t];
+    copy(threadPairCluster[t].begin(), threadPairCluster[t].end(), clusterPairCluster+offset);
+    copy(threadPairOffsets[t].begin(), threadPairOffsets[t].end(), clusterPairOffsets+offset);
+    copy(threadPairMask[t].begin(), threadPairMask[t].end(), clusterPairMask+offset);
+    const int c1 = ThreadPool::taskStart(nc, t+1, numThreads);
+    for (int iCluster=ThreadPool::taskStart(nc, t, numThreads); iCluster<c1; iCluster++) {
+      clusterPairStart[iCluster] += offset;
+    }
+  });
+  clusterPairStart[nc] = numClusterPairs;
+  clusterTaskSlots.numTasks = 0;
+}
+
+// tiles of clusters c0 .. c1-1, appended to the given arrays, with
+// clusterPairStart set relative to the start of the arrays.  j clusters are
+// found through the cells (and images) in range of the i cluster's cells,
+// and kept if their bounding boxes come within the neighbor range.  each j
+// cluster comes after the i cluster (or is the i cluster itself), so each
+// atom pair and image is in one tile.
+void PotentialMasterList::buildClusterRows(int c0, int c1, vector<int> &tCluster, vector<double*> &tOffsets, vector<uint64_t> &tMask) {
+  const vector<int> &atomCell = cellManager.atomCell;
+  const vector<int> &cellOffsets = cellManager.cellOffsets;
+  const vector<int> &wrapMap = cellManager.wrapMap;
+  const vector<int> &boxOffsetIndex = cellManager.boxOffsetIndex;
+  const vector<double*> &boxOffsets = cellManager.boxOffsets;
+  const int zero = cellManager.zeroBoxOffset;
+  const int numOffsets = cellOffsets.size();
+  const double rc2 = nbrRange*nbrRange;
+  for (int iCluster=c0; iCluster<c1; iCluster++) {
+    const int start = tCluster.size();
+    clusterPairStart[iCluster] = start;
+    const double *iBox = &clusterBox[6*iCluster];
+    int lastCell = -1;
+    for (int a=0; a<clusterSize; a++) {
+      const int iAtom = clusterAtoms[iCluster*clusterSize+a];
+      if (iAtom < 0) break;
+      // the cluster's atoms are in cell order
+      const int iCell = atomCell[iAtom];
+      if (iCell == lastCell) continue;
+      lastCell = iCell;
+      // the cell itself and the cells in range on either side
+      for (int o=-numOffsets; o<=numOffsets; o++) {
+        int jCell = iCell + (o<0 ? -cellOffsets[-o-1] : (o>0 ? cellOffsets[o-1] : 0));
+        const int image = boxOffsetIndex[jCell];
+        double *jbo = boxOffsets[jCell];
+        jCell = wrapMap[jCell];
+        if (cellSlotStart[jCell] == cellSlotStart[jCell+1]) continue;
+        int jFirst = cellSlotStart[jCell]/clusterSize;
+        const int jLast = (cellSlotStart[jCell+1]-1)/clusterSize;
+        if (jFirst < iCluster) jFirst = iCluster;
+        for (int jCluster=jFirst; jCluster<=jLast; jCluster++) {
+          // images of the i cluster on the other side are the same pairs
+          if (jCluster == iCluster && image < zero) continue;
+          bool seen = false;
+          for (int q=start; q<(int)tCluster.size(); q++) {
+            if (tCluster[q] == jCluster && tOffsets[q] == jbo) {
+              seen = true;
+              break;
+            }
+          }
+          if (seen) continue;
+          const double *jBox = &clusterBox[6*jCluster];
+          double r2 = 0;
+          for (int k=0; k<3; k++) {
+            double dr = jBox[k]+jbo[k] - iBox[3+k];
+            if (dr < 0) dr = iBox[k] - (jBox[3+k]+jbo[k]);
+            if (dr > 0) r2 += dr*dr;
+          }
+          if (r2 > rc2) continue;
+          uint64_t mask = clusterPairBits(iCluster, jCluster, jbo, jCluster == iCluster && image == zero);
+          if (!mask) continue;
+          tCluster.push_back(jCluster);
+          tOffsets.push_back(jbo);
+          tMask.push_back(mask);
+        }
+      }
+    }
+  }
+}
+
+// bit a*clusterSize+b is set if atom a of the i cluster interacts with atom
+// b of the j cluster (at image jbo).  for a cluster with itself (self),
+// only a<b.
+uint64_t PotentialMasterList::clusterPairBits(int iCluster, int jCluster, const double *jbo, bool self) {
+  uint64_t mask = 0;
+  for (int a=0; a<clusterSize; a++) {
+    const int iAtom = clusterAtoms[iCluster*clusterSize+a];
+    if (iAtom < 0) break;
     int iMolecule = iAtom;
     vector<int> *iBondedAtoms = nullptr;
     int iSpecies = 0;
@@ -146,69 +689,527 @@ resetStart:
         iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
       }
     }
-    int tooMuch = 0;
-    double *ri = box.getAtomPosition(iAtom);
-    int jAtom=iAtom;
-    int iCell = atomCell[iAtom];
-    double *jbo = boxOffsets[iCell]; // always 0
+    // a ghost only pairs with owned atoms
+    const int jGhost = (numOwnedAtoms < 0 || iAtom < numOwnedAtoms) ? INT_MAX : numOwnedAtoms;
     Potential** iPotentials = pairPotentials[box.getAtomType(iAtom)];
-    while ((jAtom = cellNextAtom[jAtom]) > -1) {
-      if (!iPotentials[box.getAtomType(jAtom)]) continue;
-      if (checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
+    const double *ri = box.getAtomPosition(iAtom);
+    for (int b=self?a+1:0; b<clusterSize; b++) {
+      const int jAtom = clusterAtoms[jCluster*clusterSize+b];
+      if (jAtom < 0) break;
+      if (!iPotentials[box.getAtomType(jAtom)] || jAtom >= jGhost) continue;
+      if (!pureAtoms && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) {
+        // as in the atom lists, only images at least half a box away
+        const double *rj = box.getAtomPosition(jAtom);
+        double r2 = 0;
+        for (int k=0; k<3; k++) {
+          double dr = rj[k]+jbo[k]-ri[k];
+          r2 += dr*dr;
+        }
+        if (r2 < minR2) continue;
+      }
+      mask |= ((uint64_t)1) << (a*clusterSize + b);
+    }
+  }
+  return mask;
+}
+
+template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+void PotentialMasterList::computeAllPairs(double &uTot, double &virialTot) {
+  if (!doEmbed && !doCallbacks && numClusters > 0) {
+    computeAllClusters<PF,doForces>(uTot, virialTot);
+    return;
+  }
+  // the SoA path (and the vectorized kernels) handle plain pair potentials;
+  // embedding and per-pair callbacks go through the general loop.
+  // intramolecular exclusions were applied when the list was built.
+  if (!doEmbed && !doCallbacks && haloNbrs) {
+    computeAllSoA<PF,doForces,true>(uTot, virialTot);
+    return;
+  }
+  if (!doEmbed && !doCallbacks && (box.isSoA() || (kernelLevel>PAIR_KERNEL_SCALAR && pairKernelHandles(pairTable)))) {
+    computeAllSoA<PF,doForces,false>(uTot, virialTot);
+    return;
+  }
+  const int numAtoms = box.getNumAtoms();
+  if (doCallbacks || numThreads == 1) {
+    computeAllPairsRange<PF,doForces,doEmbed,doCallbacks>(0, numAtoms, nullptr, uAtom.data(), doForces ? force[0] : nullptr, rhoSum, rdrho, uTot, virialTot);
+    return;
+  }
+  checkSlots(atomSlots, nbrAtoms);
+  ThreadPool::get().run(numThreads, [&](int t) {
+    const int n = atomSlots.numSlots(t);
+    threadU[t].assign(n, 0);
+    if (doForces) threadF[t].assign(3*n, 0);
+    if (doEmbed) threadRho[t].assign(n, 0);
+    // the densities' derivatives are kept (per thread) for the embedding pass
+    threadRdrho[t].clear();
+    double tu = 0, tv = 0;
+    computeAllPairsRange<PF,doForces,doEmbed,false>(threadStart[t], threadStart[t+1], atomSlots.slot.data(), threadU[t].data(), threadF[t].data(), threadRho[t].data(), threadRdrho[t], tu, tv);
+    threadSums[2*t] = tu;
+    threadSums[2*t+1] = tv;
+  });
+  reduceSlots(atomSlots, threadU, 0, 1, uAtom.data(), numAtoms);
+  if (doForces) reduceSlots(atomSlots, threadF, 0, 3, force[0], numAtoms);
+  if (doEmbed) reduceSlots(atomSlots, threadRho, 0, 1, rhoSum, numAtoms);
+  for (int t=0; t<numThreads; t++) {
+    uTot += threadSums[2*t];
+    virialTot += threadSums[2*t+1];
+  }
+}
+
+// pairs of atoms iStart .. iEnd-1 with their up neighbors.  energies,
+// forces (3 per atom) and densities are added into u, f and rho, and the
+// density derivatives are appended to rdrhoT.  with slots, the arrays are
+// a task's (see ThreadSlots); otherwise they are indexed by atom.
+template<class PF, bool doForces, bool doEmbed, bool doCallbacks>
+void PotentialMasterList::computeAllPairsRange(int iStart, int iEnd, const int *slots, double *u, double *f, double *rho, vector<double> &rdrhoT, double &uTot, double &virialTot) {
+  for (int iAtom=iStart; iAtom<iEnd; iAtom++) {
+    double *ri = box.getAtomPosition(iAtom);
+    int iType = box.getAtomType(iAtom);
+    double *iCutoffs = pairCutoffs[iType];
+    const int iPair = iType*numAtomTypes;
+    const int is = slots ? iAtom-iStart : iAtom;
+    double *fi = doForces ? f+3*is : nullptr;
+    const int iNumNbrs = nbrStart[iAtom+1] - nbrStart[iAtom];
+    const int* iNbrs = nbrAtoms + nbrStart[iAtom];
+    const int* iSlots = slots ? slots + nbrStart[iAtom] : iNbrs;
+    const unsigned char* iNbrImages = nbrImages + nbrStart[iAtom];
+    Potential* iRhoPotential = doEmbed ? rhoPotentials[iType] : nullptr;
+    double iRhoCutoff = doEmbed ? rhoCutoffs[iType] : 0;
+    for (int j=0; j<iNumNbrs; j++) {
+      int jAtom = iNbrs[j];
+      int jType = box.getAtomType(jAtom);
+      double rc2 = iCutoffs[jType];
       double *rj = box.getAtomPosition(jAtom);
-      tooMuch += checkNbrPair(iAtom, jAtom, false, ri, rj, rc2, minR2, jbo);
+      double *jbo = cellManager.rawBoxOffsets[iNbrImages[j]];
+      const int js = iSlots[j];
+      handleComputeAll<PF,doForces,doEmbed,doCallbacks>(iAtom, jAtom, ri, rj, jbo, iPair+jType, u[is], u[js], fi, doForces?f+3*js:nullptr, uTot, virialTot, rc2, iRhoPotential, iRhoCutoff, iType, jType, false, rho+is, rho+js, rdrhoT);
     }
-    for (vector<int>::const_iterator it = cellOffsets.begin(); it!=cellOffsets.end(); ++it) {
-      int jCell = iCell + *it;
-      jbo = boxOffsets[jCell];
-      jCell = wrapMap[jCell];
-      for (jAtom = cellLastAtom[jCell]; jAtom>-1; jAtom = cellNextAtom[jAtom]) {
-        if (!iPotentials[box.getAtomType(jAtom)]) {
-          continue;
+  }
+}
+
+// embedding forces for atoms iStart .. iEnd-1 and their up neighbors, using
+// the density derivatives saved (in the same order) by computeAllPairsRange.
+// f is indexed as in computeAllPairsRange.
+void PotentialMasterList::computeAllEmbedRange(int iStart, int iEnd, const int *slots, const vector<double> &rdrhoT, double *f, double &virialTot) {
+  int rdrhoIdx = 0;
+  for (int iAtom=iStart; iAtom<iEnd; iAtom++) {
+    int iType = box.getAtomType(iAtom);
+    double *ri = box.getAtomPosition(iAtom);
+    double iRhoCutoff = rhoCutoffs[iType];
+    Potential* iRhoPotential = rhoPotentials[iType];
+    const int iNumNbrs = nbrStart[iAtom+1] - nbrStart[iAtom];
+    const int* iNbrs = nbrAtoms + nbrStart[iAtom];
+    const int* iSlots = slots ? slots + nbrStart[iAtom] : iNbrs;
+    const unsigned char* iNbrImages = nbrImages + nbrStart[iAtom];
+    double *fi = f + 3*(slots ? iAtom-iStart : iAtom);
+    double df = idf[iAtom];
+    for (int j=0; j<iNumNbrs; j++) {
+      int jAtom = iNbrs[j];
+      int jType = box.getAtomType(jAtom);
+      double *rj = box.getAtomPosition(jAtom);
+      double *jbo = cellManager.rawBoxOffsets[iNbrImages[j]];
+
+      handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrhoT, rdrhoIdx, fi, f+3*iSlots[j]);
+    }
+  }
+}
+
+template<class PF>
+void PotentialMasterList::computeAllPairsF(const bool doForces, double &uTot, double &virialTot) {
+  COMPUTE_ALL_DISPATCH(PF, computeAllPairs, doForces, (uTot, virialTot));
+}
+
+template<class PF, bool doForces>
+void PotentialMasterList::computeAllClusters(double &uTot, double &virialTot) {
+  const int slots = numClusters*clusterSize;
+  double *x = clusterX[0], *y = clusterX[1], *z = clusterX[2];
+  double *fx = clusterF[0], *fy = clusterF[1], *fz = clusterF[2];
+  for (int s=0; s<slots; s++) {
+    clusterU[s] = 0;
+    if (doForces) fx[s] = fy[s] = fz[s] = 0;
+    const int iAtom = clusterAtoms[s];
+    if (iAtom < 0) continue;
+    const double *ri = box.getAtomPosition(iAtom);
+    x[s] = ri[0];
+    y[s] = ri[1];
+    z[s] = ri[2];
+  }
+  PairClusterData d;
+  d.clusterSize = clusterSize;
+  d.numClusters = numClusters;
+  d.x = x;
+  d.y = y;
+  d.z = z;
+  d.types = clusterTypes;
+  d.fx = doForces ? fx : nullptr;
+  d.fy = doForces ? fy : nullptr;
+  d.fz = doForces ? fz : nullptr;
+  d.u = clusterU;
+  d.pairStart = clusterPairStart;
+  d.pairCluster = clusterPairCluster;
+  d.pairOffsets = clusterPairOffsets;
+  d.pairMask = clusterPairMask;
+  d.table = &pairTable;
+  if (numThreads == 1) {
+    computeAllClustersRange<PF,doForces>(d, uTot, virialTot);
+  }
+  else {
+    // each task works on copies of its block of i clusters and its halo,
+    // with the tiles pointing at slots instead of clusters
+    ThreadSlots &ts = clusterTaskSlots;
+    if (ts.numTasks != numThreads) {
+      ts.start.resize(numThreads+1);
+      ts.start[0] = 0;
+      for (int t=1; t<numThreads; t++) {
+        const int target = (int)((long)numClusterPairs*t/numThreads);
+        ts.start[t] = lower_bound(clusterPairStart, clusterPairStart+numClusters, target) - clusterPairStart;
+      }
+      ts.start[numThreads] = numClusters;
+      buildSlots(ts, clusterPairStart, clusterPairCluster);
+    }
+    ThreadPool::get().run(numThreads, [&](int t) {
+      const int c0 = ts.start[t], c1 = ts.start[t+1];
+      const int n = ts.numSlots(t)*clusterSize;
+      if (n > threadClusterCapacity[t]) {
+        free(threadClusterData[t]);
+        free(threadClusterTypes[t]);
+        threadClusterData[t] = (double*)mallocAligned(7*n*sizeof(double));
+        threadClusterTypes[t] = (int*)mallocAligned(n*sizeof(int));
+        threadClusterCapacity[t] = n;
+      }
+      double *tx = threadClusterData[t], *ty = tx+n, *tz = ty+n, *tUAtom = tz+n;
+      int *tTypes = threadClusterTypes[t];
+      const vector<int> &h = ts.halo[t];
+      for (int k=0; k<n/clusterSize; k++) {
+        const int c = k < c1-c0 ? c0+k : h[k-(c1-c0)];
+        for (int a=0; a<clusterSize; a++) {
+          const int ks = k*clusterSize + a, s = c*clusterSize + a;
+          tx[ks] = x[s];
+          ty[ks] = y[s];
+          tz[ks] = z[s];
+          tTypes[ks] = clusterTypes[s];
         }
-        bool skipIntra = checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms);
-        double *rj = box.getAtomPosition(jAtom);
-        tooMuch += checkNbrPair(iAtom, jAtom, skipIntra, ri, rj, rc2, minR2, jbo);
       }
+      for (int ks=0; ks<(doForces?4:1)*n; ks++) tUAtom[ks] = 0;
+      PairClusterData dt = d;
+      dt.numClusters = c1-c0;
+      dt.x = tx;
+      dt.y = ty;
+      dt.z = tz;
+      dt.types = tTypes;
+      dt.u = tUAtom;
+      if (doForces) {
+        dt.fx = tUAtom+n;
+        dt.fy = dt.fx+n;
+        dt.fz = dt.fy+n;
+      }
+      dt.pairStart = clusterPairStart + c0;
+      dt.pairCluster = ts.slot.data();
+      double tu = 0, tv = 0;
+      computeAllClustersRange<PF,doForces>(dt, tu, tv);
+      threadSums[2*t] = tu;
+      threadSums[2*t+1] = tv;
+    });
+    // u, fx, fy and fz are blocks 3-6 of each task's data
+    reduceSlots(ts, threadClusterData, 3, clusterSize, clusterU, numClusters);
+    if (doForces) {
+      reduceSlots(ts, threadClusterData, 4, clusterSize, fx, numClusters);
+      reduceSlots(ts, threadClusterData, 5, clusterSize, fy, numClusters);
+      reduceSlots(ts, threadClusterData, 6, clusterSize, fz, numClusters);
     }
-    if (tooMuch > 0) {
-#ifdef DEBUG
-      printf("maxNab %d => %d\n", maxNab, maxNab+tooMuch);
-#endif
-      maxNab += tooMuch;
-      forceReallocNbrs = true;
-      goto resetStart;
-    }
-  }
-  if (!onlyUpNbrs) {
-    for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) numAtomNbrsDn[iAtom] = 0;
-    for (int iAtom=0; iAtom<boxNumAtoms; iAtom++) {
-      int iNumNbrs = numAtomNbrsUp[iAtom];
-      int* iNbrs = nbrs[iAtom];
-      for (int j=0; j<iNumNbrs; j++) {
-        int jAtom = iNbrs[j];
-        if (numAtomNbrsDn[jAtom]+numAtomNbrsUp[jAtom] >= maxNab) {
-#ifdef DEBUG
-          printf("maxNab %d => %d\n", maxNab, maxNab*4/3);
-#endif
-          maxNab = (maxNab*4) / 3;
-          forceReallocNbrs = true;
-          goto resetStart;
+    for (int t=0; t<numThreads; t++) {
+      uTot += threadSums[2*t];
+      virialTot += threadSums[2*t+1];
+    }
+  }
+  for (int s=0; s<slots; s++) {
+    const int iAtom = clusterAtoms[s];
+    if (iAtom < 0) continue;
+    uAtom[iAtom] += clusterU[s];
+    if (doForces) {
+      force[iAtom][0] += fx[s];
+      force[iAtom][1] += fy[s];
+      force[iAtom][2] += fz[s];
+    }
+  }
+}
+
+// the tiles described by d, with the vectorized kernel if we can
+template<class PF, bool doForces>
+void PotentialMasterList::computeAllClustersRange(const PairClusterData &d, double &uTot, double &virialTot) {
+  if (pairKernelHandles(pairTable) && pairKernelHandlesClusters(kernelLevel, clusterSize)) {
+    pairKernelComputeClusters(kernelLevel, d, uTot, virialTot);
+    return;
+  }
+  const double *x = d.x, *y = d.y, *z = d.z;
+  double *fx = d.fx, *fy = d.fy, *fz = d.fz;
+  for (int iCluster=0; iCluster<d.numClusters; iCluster++) {
+    for (int p=d.pairStart[iCluster]; p<d.pairStart[iCluster+1]; p++) {
+      const int jCluster = d.pairCluster[p];
+      const double *jbo = d.pairOffsets[p];
+      const uint64_t mask = d.pairMask[p];
+      for (int a=0; a<clusterSize; a++) {
+        const int is = iCluster*clusterSize + a;
+        const int iPair = d.types[is]*numAtomTypes;
+        for (int b=0; b<clusterSize; b++) {
+          if (!((mask >> (a*clusterSize+b)) & 1)) continue;
+          const int js = jCluster*clusterSize + b;
+          double dx = x[js]+jbo[0]-x[is];
+          double dy = y[js]+jbo[1]-y[is];
+          double dz = z[js]+jbo[2]-z[is];
+          double r2 = dx*dx + dy*dy + dz*dz;
+          const int ij = iPair + d.types[js];
+          if (r2 >= pairTable.rc2[ij]) continue;
+          double u, du, d2u;
+          PF::u012(pairTable, ij, r2, u, du, d2u);
+          d.u[is] += 0.5*u;
+          d.u[js] += 0.5*u;
+          uTot += u;
+          virialTot += du;
+          if (doForces) {
+            du /= r2;
+            fx[is] += dx*du;
+            fy[is] += dy*du;
+            fz[is] += dz*du;
+            fx[js] -= dx*du;
+            fy[js] -= dy*du;
+            fz[js] -= dz*du;
+          }
         }
+      }
+    }
+  }
+}
+
+// with halo, neighbors are indices into haloX (real atoms, then ghosts) and
+// need no image offsets; ghost forces and energies are folded back at the end
+template<class PF, bool doForces, bool halo>
+void PotentialMasterList::computeAllSoA(double &uTot, double &virialTot) {
+  int numAtoms = box.getNumAtoms();
+  const double *x, *y, *z;
+  double *fx, *fy, *fz, *u;
+  const int *types, *jAtoms;
+  int numAll = numAtoms;
+  if (halo) {
+    numAll += cellManager.getNumGhosts();
+    for (int i=0; i<numAtoms; i++) {
+      const double *ri = box.getAtomPosition(i);
+      haloX[0][i] = ri[0];
+      haloX[1][i] = ri[1];
+      haloX[2][i] = ri[2];
+    }
+    cellManager.copyGhosts(haloX, numAtoms);
+    x = haloX[0];
+    y = haloX[1];
+    z = haloX[2];
+    fx = haloF[0];
+    fy = haloF[1];
+    fz = haloF[2];
+    u = haloU;
+    for (int i=0; i<numAll; i++) u[i] = 0;
+    types = haloTypes;
+    jAtoms = nbrHaloAtoms;
+  }
+  else {
+    if (box.isSoA()) {
+      box.packSoA();
+      double** soaPositions = box.getPositionsSoA();
+      x = soaPositions[0];
+      y = soaPositions[1];
+      z = soaPositions[2];
+    }
+    else {
+      // pack privately rather than switching the box's storage for everyone
+      if (numAtoms > packCapacity) {
+        packCapacity = ALIGNED_DOUBLES(numAtoms);
+        for (int k=0; k<3; k++) {
+          free(packX[k]);
+          packX[k] = (double*)mallocAligned(packCapacity*sizeof(double));
+        }
+      }
+      for (int i=0; i<numAtoms; i++) {
+        const double *ri = box.getAtomPosition(i);
+        packX[0][i] = ri[0];
+        packX[1][i] = ri[1];
+        packX[2][i] = ri[2];
+      }
+      x = packX[0];
+      y = packX[1];
+      z = packX[2];
+    }
+    if (doForces && numAtoms > numForceSoAAtoms) {
+      int padded = ALIGNED_DOUBLES(numAtoms);
+      for (int k=0; k<3; k++) {
+        free(forceSoA[k]);
+        forceSoA[k] = (double*)mallocAligned(padded*sizeof(double));
+      }
+      numForceSoAAtoms = padded;
+    }
+    fx = forceSoA[0];
+    fy = forceSoA[1];
+    fz = forceSoA[2];
+    u = uAtom.data();
+    types = box.getAtomTypes();
+    jAtoms = nbrAtoms;
+  }
+  if (doForces) {
+    for (int i=0; i<numAll; i++) fx[i] = fy[i] = fz[i] = 0;
+  }
+  PairKernelData d;
+  d.atomStart = 0;
+  d.atomEnd = numAtoms;
+  d.x = x;
+  d.y = y;
+  d.z = z;
+  d.fx = doForces ? fx : nullptr;
+  d.fy = doForces ? fy : nullptr;
+  d.fz = doForces ? fz : nullptr;
+  d.uAtom = u;
+  d.types = types;
+  d.nbrStart = nbrStart;
+  d.nbrAtoms = jAtoms;
+  d.nbrImages = nbrImages;
+  d.images = halo ? nullptr : cellManager.rawBoxOffsets;
+  d.table = &pairTable;
+  if (numThreads == 1) {
+    computeAllSoARange<PF,doForces,halo>(d, uTot, virialTot);
+  }
+  else {
+    // each task works on a copy of its block and halo, with the lists
+    // pointing at slots instead of atoms
+    ThreadSlots &slots = halo ? ghostSlots : atomSlots;
+    checkSlots(slots, jAtoms);
+    ThreadPool::get().run(numThreads, [&](int t) {
+      const int i0 = threadStart[t], i1 = threadStart[t+1];
+      const int n = slots.numSlots(t);
+      const vector<int> &h = slots.halo[t];
+      threadX[t].resize(3*n);
+      threadTypes[t].resize(n);
+      double *tx = threadX[t].data(), *ty = tx + n, *tz = ty + n;
+      int *tTypes = threadTypes[t].data();
+      for (int k=0; k<n; k++) {
+        const int i = k < i1-i0 ? i0+k : h[k-(i1-i0)];
+        tx[k] = x[i];
+        ty[k] = y[i];
+        tz[k] = z[i];
+        tTypes[k] = types[i];
+      }
+      PairKernelData dt = d;
+      dt.atomStart = 0;
+      dt.atomEnd = i1-i0;
+      dt.x = tx;
+      dt.y = ty;
+      dt.z = tz;
+      dt.types = tTypes;
+      dt.nbrStart = nbrStart + i0;
+      dt.nbrAtoms = slots.slot.data();
+      threadU[t].assign(n, 0);
+      dt.uAtom = threadU[t].data();
+      if (doForces) {
+        threadF[t].assign(3*n, 0);
+        dt.fx = threadF[t].data();
+        dt.fy = dt.fx + n;
+        dt.fz = dt.fy + n;
+      }
+      double tu = 0, tv = 0;
+      computeAllSoARange<PF,doForces,halo>(dt, tu, tv);
+      threadSums[2*t] = tu;
+      threadSums[2*t+1] = tv;
+    });
+    reduceSlots(slots, threadU, 0, 1, u, numAll);
+    if (doForces) {
+      reduceSlots(slots, threadF, 0, 1, fx, numAll);
+      reduceSlots(slots, threadF, 1, 1, fy, numAll);
+      reduceSlots(slots, threadF, 2, 1, fz, numAll);
+    }
+    for (int t=0; t<numThreads; t++) {
+      uTot += threadSums[2*t];
+      virialTot += threadSums[2*t+1];
+    }
+  }
+  if (halo) {
+    cellManager.foldGhosts(doForces ? haloF : nullptr, u, numAtoms);
+    for (int i=0; i<numAtoms; i++) uAtom[i] += u[i];
+  }
+  if (!doForces) return;
+  for (int i=0; i<numAtoms; i++) {
+    force[i][0] = fx[i];
+    force[i][1] = fy[i];
+    force[i][2] = fz[i];
+  }
+}
 
-        nbrs[jAtom][maxNab-1-numAtomNbrsDn[jAtom]] = iAtom;
-        numAtomNbrsDn[jAtom]++;
+// the pairs described by d, with the vectorized kernel if we can
+template<class PF, bool doForces, bool halo>
+void PotentialMasterList::computeAllSoARange(const PairKernelData &d, double &uTot, double &virialTot) {
+  if (kernelLevel>PAIR_KERNEL_SCALAR && pairKernelHandles(pairTable)) {
+    pairKernelCompute(kernelLevel, d, uTot, virialTot);
+    return;
+  }
+  const double *x = d.x, *y = d.y, *z = d.z;
+  double *fx = d.fx, *fy = d.fy, *fz = d.fz, *u = d.uAtom;
+  const int *types = d.types, *jAtoms = d.nbrAtoms, *dStart = d.nbrStart;
+  for (int iAtom=d.atomStart; iAtom<d.atomEnd; iAtom++) {
+    const double xi = x[iAtom], yi = y[iAtom], zi = z[iAtom];
+    int iType = types[iAtom];
+    double *iCutoffs = pairCutoffs[iType];
+    const int iPair = iType*numAtomTypes;
+    const int iNumNbrs = dStart[iAtom+1] - dStart[iAtom];
+    const int* iNbrs = jAtoms + dStart[iAtom];
+    const unsigned char* iNbrImages = d.nbrImages + dStart[iAtom];
+    double fxi = 0, fyi = 0, fzi = 0, ui = 0;
+    for (int j=0; j<iNumNbrs; j++) {
+      int jAtom = iNbrs[j];
+      int jType = types[jAtom];
+      double dx = x[jAtom]-xi;
+      double dy = y[jAtom]-yi;
+      double dz = z[jAtom]-zi;
+      if (!halo) {
+        const double *jbo = cellManager.rawBoxOffsets[iNbrImages[j]];
+        dx += jbo[0];
+        dy += jbo[1];
+        dz += jbo[2];
+      }
+      double r2 = dx*dx + dy*dy + dz*dz;
+      if (r2 >= iCutoffs[jType]) continue;
+      double uij, du, d2u;
+      PF::u012(pairTable, iPair+jType, r2, uij, du, d2u);
+      ui += 0.5*uij;
+      u[jAtom] += 0.5*uij;
+      uTot += uij;
+      virialTot += du;
+      if (doForces) {
+        du /= r2;
+        dx *= du;
+        dy *= du;
+        dz *= du;
+        fxi += dx;
+        fyi += dy;
+        fzi += dz;
+        fx[jAtom] -= dx;
+        fy[jAtom] -= dy;
+        fz[jAtom] -= dz;
       }
     }
+    u[iAtom] += ui;
+    if (doForces) {
+      fx[iAtom] += fxi;
+      fy[iAtom] += fyi;
+      fz[iAtom] += fzi;
+    }
   }
 }
 
 void PotentialMasterList::computeAll(vector<PotentialCallback*> &callbacks) {
+  checkPairTable();
+  syncThreads();
   pairCallbacks.resize(0);
   bool doForces = false;
   for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
     if (!embeddingPotentials && (*it)->callPair) pairCallbacks.push_back(*it);
     if ((*it)->takesForces) doForces = true;
+    if ((*it)->callPermute) addPermutationCallback(*it);
   }
   int numAtoms = box.getNumAtoms();
   if (doForces && numAtoms > numForceAtoms) {
@@ -225,30 +1226,9 @@ void PotentialMasterList::computeAll(vector<PotentialCallback*> &callbacks) {
     if (embeddingPotentials) rhoSum[i] = 0;
     if (doForces) for (int k=0; k<3; k++) force[i][k] = 0;
   }
-  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-    double *ri = box.getAtomPosition(iAtom);
-    int iType = box.getAtomType(iAtom);
-    double *iCutoffs = pairCutoffs[iType];
-    Potential** iPotentials = pairPotentials[iType];
-    double *fi = doForces ? force[iAtom] : nullptr;
-    int iNumNbrs = numAtomNbrsUp[iAtom];
-    int* iNbrs = nbrs[iAtom];
-    double** iNbrBoxOffsets = nbrBoxOffsets[iAtom];
-    Potential* iRhoPotential = embeddingPotentials ? rhoPotentials[iType] : nullptr;
-    double iRhoCutoff = embeddingPotentials ? rhoCutoffs[iType] : 0;
-    for (int j=0; j<iNumNbrs; j++) {
-      int jAtom = iNbrs[j];
-      int jType = box.getAtomType(jAtom);
-      double rc2 = iCutoffs[jType];
-      Potential* pij = iPotentials[jType];
-      double *rj = box.getAtomPosition(jAtom);
-      double *jbo = iNbrBoxOffsets[j];
-      handleComputeAll(iAtom, jAtom, ri, rj, jbo, pij, uAtom[iAtom], uAtom[jAtom], fi, doForces?force[jAtom]:nullptr, uTot, virialTot, rc2, iRhoPotential, iRhoCutoff, iType, jType, doForces, false);
-    }
-  }
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeAllPairsF, (doForces, uTot, virialTot));
   if (embeddingPotentials) {
     // we need another pass to include embedding contributions
-    int rdrhoIdx = 0;
     for (int iAtom=0; iAtom<numAtoms; iAtom++) {
       int iType = box.getAtomType(iAtom);
       double f, df, d2f;
@@ -259,27 +1239,21 @@ void PotentialMasterList::computeAll(vector<PotentialCallback*> &callbacks) {
       }
     }
     if (doForces) {
-      for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-        int iType = box.getAtomType(iAtom);
-        if (doForces) {
-          double *ri = box.getAtomPosition(iAtom);
-          double iRhoCutoff = rhoCutoffs[iType];
-          Potential* iRhoPotential = rhoPotentials[iType];
-          int iNumNbrs = numAtomNbrsUp[iAtom];
-          int* iNbrs = nbrs[iAtom];
-          double** iNbrBoxOffsets = nbrBoxOffsets[iAtom];
-          double df = idf[iAtom];
-          for (int j=0; j<iNumNbrs; j++) {
-            int jAtom = iNbrs[j];
-            int jType = box.getAtomType(jAtom);
-            double *rj = box.getAtomPosition(jAtom);
-            double *jbo = iNbrBoxOffsets[j];
-
-            handleComputeAllEmbed(iAtom, jAtom, iType, jType, ri, rj, jbo, df, virialTot, iRhoPotential, iRhoCutoff, rdrhoIdx);
-          }
-        }
+      if (numThreads == 1) {
+        computeAllEmbedRange(0, numAtoms, nullptr, rdrho, force[0], virialTot);
+        rdrho.clear();
+      }
+      else {
+        // same split as the pair pass, which left each thread its rdrho
+        ThreadPool::get().run(numThreads, [&](int t) {
+          threadF[t].assign(3*atomSlots.numSlots(t), 0);
+          double tv = 0;
+          computeAllEmbedRange(threadStart[t], threadStart[t+1], atomSlots.slot.data(), threadRdrho[t], threadF[t].data(), tv);
+          threadSums[t] = tv;
+        });
+        reduceSlots(atomSlots, threadF, 0, 3, force[0], numAtoms);
+        for (int t=0; t<numThreads; t++) virialTot += threadSums[t];
       }
-      rdrho.clear();
     }
   }
   if (doEwald) {
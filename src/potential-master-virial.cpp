@@ -6,12 +6,13 @@
 
 PotentialMasterVirial::PotentialMasterVirial(const SpeciesList &sl, Box &box) : PotentialMaster(sl,box,false) {}
 
-void PotentialMasterVirial::computeAtoms(const int* iAtomList, const int nAtoms, double &energy) {
+template<class PF>
+void PotentialMasterVirial::computeAtomsT(const int* iAtomList, const int nAtoms, double &energy) {
   for (int i=0; i<nAtoms-1; i++) {
     int iAtom = iAtomList[i];
     int iType = box.getAtomType(iAtom);
     double* iCutoffs = pairCutoffs[iType];
-    Potential** iPotentials = pairPotentials[iType];
+    const int iPair = iType*numAtomTypes;
     double *ri = box.getAtomPosition(iAtom);
 
     for (int j=i+1; j<nAtoms; j++) {
@@ -21,18 +22,33 @@ void PotentialMasterVirial::computeAtoms(const int* iAtomList, const int nAtoms,
       double r2 = 0;
       for (int k=0; k<3; k++) {double dr = rj[k]-ri[k]; r2 += dr*dr;}
       if (r2 > iCutoffs[jType]) continue;
-      double uij = iPotentials[jType]->u(r2);
+      double uij = PF::u(pairTable, iPair+jType, r2);
       energy += uij;
     }
   }
 }
 
-void PotentialMasterVirial::computeMolecules(const int* iMoleculeList, const int nMolecules, double &energy) {
-  energy = 0;
-  if (pureAtoms) {
-    computeAtoms(iMoleculeList, nMolecules, energy);
-    return;
+void PotentialMasterVirial::computeAtoms(const int* iAtomList, const int nAtoms, double &energy) {
+  checkPairTable();
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeAtomsT, (iAtomList, nAtoms, energy));
+}
+
+template<class PF>
+void PotentialMasterVirial::computePairsT(const int iType, const int jType, const double* r2, const int n, double* u) {
+  const int ijPair = iType*numAtomTypes + jType;
+  const double rc2 = pairCutoffs[iType][jType];
+  for (int k=0; k<n; k++) {
+    u[k] = r2[k] > rc2 ? 0 : PF::u(pairTable, ijPair, r2[k]);
   }
+}
+
+void PotentialMasterVirial::computePairs(const int iType, const int jType, const double* r2, const int n, double* u) {
+  checkPairTable();
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computePairsT, (iType, jType, r2, n, u));
+}
+
+template<class PF>
+void PotentialMasterVirial::computeMoleculesT(const int* iMoleculeList, const int nMolecules, double &energy) {
   for (int i=0; i<nMolecules-1; i++) {
     int iMolecule = iMoleculeList[i];
     int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
@@ -40,7 +56,7 @@ void PotentialMasterVirial::computeMolecules(const int* iMoleculeList, const int
     for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
       int iType = box.getAtomType(iAtom);
       double* iCutoffs = pairCutoffs[iType];
-      Potential** iPotentials = pairPotentials[iType];
+      const int iPair = iType*numAtomTypes;
       double *ri = box.getAtomPosition(iAtom);
 
       for (int j=i+1; j<nMolecules; j++) {
@@ -55,7 +71,7 @@ void PotentialMasterVirial::computeMolecules(const int* iMoleculeList, const int
           for (int k=0; k<3; k++) {double dr = rj[k]-ri[k]; r2 += dr*dr;}
           if (r2 > iCutoffs[jType]) continue;
           //uAtomsChangedSet.insert(jAtom);
-          double uij = iPotentials[jType]->u(r2);
+          double uij = PF::u(pairTable, iPair+jType, r2);
           //duAtom[jAtom] += 0.5*uij;
           //duAtom[iAtom] += 0.5*uij;
           energy += uij;
@@ -65,6 +81,16 @@ void PotentialMasterVirial::computeMolecules(const int* iMoleculeList, const int
   }
 }
 
+void PotentialMasterVirial::computeMolecules(const int* iMoleculeList, const int nMolecules, double &energy) {
+  checkPairTable();
+  energy = 0;
+  if (pureAtoms) {
+    computeAtoms(iMoleculeList, nMolecules, energy);
+    return;
+  }
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeMoleculesT, (iMoleculeList, nMolecules, energy));
+}
+
 void PotentialMasterVirial::computeAll(vector<PotentialCallback*> &callbacks) {
   for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
     if ((*it)->callFinished) (*it)->allComputeFinished(0, 0, nullptr);
@@ -7,15 +7,25 @@
 #include "potential-master.h"
 #include "alloc2d.h"
 #include "util.h"
+#include "thread-pool.h"
 
-PotentialCallback::PotentialCallback() : callPair(false), callFinished(false), takesForces(false) {}
+PotentialCallback::PotentialCallback() : callPair(false), callFinished(false), takesForces(false), callPermute(false) {}
 
-PotentialMaster::PotentialMaster(const SpeciesList& sl, Box& b, bool doEmbed) : speciesList(sl), box(b), duAtomSingle(false), duAtomMulti(false), force(nullptr), numForceAtoms(0), numRhoSumAtoms(0), rhoSum(nullptr), idf(nullptr), numAtomTypes(sl.getNumAtomTypes()), pureAtoms(sl.isPurelyAtomic()), rigidMolecules(true), doTruncationCorrection(true), doSingleTruncationCorrection(false), embeddingPotentials(doEmbed), charges(nullptr), sFacAtom(nullptr), doEwald(false) {
+PotentialCallback::~PotentialCallback() {
+  // copy, since removePermutationCallback edits our list
+  vector<PotentialMaster*> masters(permuteMasters);
+  for (vector<PotentialMaster*>::iterator it = masters.begin(); it!=masters.end(); it++) {
+    (*it)->removePermutationCallback(this);
+  }
+}
+
+PotentialMaster::PotentialMaster(const SpeciesList& sl, Box& b, bool doEmbed) : speciesList(sl), box(b), force(nullptr), numForceAtoms(0), numForceSoAAtoms(0), numRhoSumAtoms(0), rhoSum(nullptr), idf(nullptr), numAtomTypes(sl.getNumAtomTypes()), pairTable(numAtomTypes), pairTableChangeCount(0), pureAtoms(sl.isPurelyAtomic()), rigidMolecules(true), doTruncationCorrection(true), doSingleTruncationCorrection(false), embeddingPotentials(doEmbed), charges(nullptr), kTableValid(false), kTableNumAtoms(0), fourierTasks(0), doEwald(false), sFacValid(false), pmeOrder(0), pmeFFT(nullptr) {
 
   if (embeddingPotentials && !pureAtoms) {
     fprintf(stderr, "Embedding potentials require a purely atomic system");
     abort();
   }
+  forceSoA[0] = forceSoA[1] = forceSoA[2] = nullptr;
   pairPotentials = (Potential***)malloc2D(numAtomTypes, numAtomTypes, sizeof(Potential*));
   pairCutoffs = (double**)malloc2D(numAtomTypes, numAtomTypes, sizeof(double));
   if (embeddingPotentials) {
@@ -24,8 +34,8 @@ PotentialMaster::PotentialMaster(const SpeciesList& sl, Box& b, bool doEmbed) :
     rhoCutoffs = (double*)malloc(numAtomTypes*sizeof(double));
     setDoTruncationCorrection(false);
     rhoSum = (double*)malloc(b.getNumAtoms()*sizeof(double));
-    drhoSum.resize(b.getNumAtoms());
-    fill(drhoSum.begin(), drhoSum.end(), 0);
+    context.drhoSum.resize(b.getNumAtoms());
+    fill(context.drhoSum.begin(), context.drhoSum.end(), 0);
     numRhoSumAtoms = b.getNumAtoms();
   }
   else {
@@ -67,6 +77,10 @@ PotentialMaster::PotentialMaster(const SpeciesList& sl, Box& b, bool doEmbed) :
 }
 
 PotentialMaster::~PotentialMaster() {
+  for (vector<PotentialCallback*>::iterator it = permutationCallbacks.begin(); it!=permutationCallbacks.end(); it++) {
+    vector<PotentialMaster*>& pms = (*it)->permuteMasters;
+    pms.erase(std::remove(pms.begin(), pms.end(), this), pms.end());
+  }
   free2D((void**)pairPotentials);
   free(rhoPotentials);
   free(embedF);
@@ -74,6 +88,7 @@ PotentialMaster::~PotentialMaster() {
   free(rhoCutoffs);
   free(rhoSum);
   free2D((void**)force);
+  for (int k=0; k<3; k++) free(forceSoA[k]);
   free(idf);
   delete[] bondedPairs;
   delete[] bondedPotentials;
@@ -82,6 +97,7 @@ PotentialMaster::~PotentialMaster() {
   delete[] bondAnglePotentials;
   delete[] numAtomsByType;
   delete[] charges;
+  delete pmeFFT;
 }
 
 void PotentialMaster::setDoTruncationCorrection(bool doCorrection) {
@@ -95,8 +111,20 @@ void PotentialMaster::setDoSingleTruncationCorrection(bool doCorrection) {
 
 void PotentialMaster::setPairPotential(int iType, int jType, Potential* p) {
   pairPotentials[iType][jType] = pairPotentials[jType][iType] = p;
-  double rc = p->getCutoff();
-  pairCutoffs[iType][jType] = pairCutoffs[jType][iType] = rc*rc;
+  updatePairTable();
+}
+
+void PotentialMaster::updatePairTable() {
+  pairTableChangeCount = Potential::getChangeCount();
+  for (int iType=0; iType<numAtomTypes; iType++) {
+    for (int jType=0; jType<numAtomTypes; jType++) {
+      Potential* p = pairPotentials[iType][jType];
+      if (!p) continue;
+      double rc = p->getCutoff();
+      pairCutoffs[iType][jType] = rc*rc;
+    }
+  }
+  pairTable.update(pairPotentials, pairCutoffs);
 }
 
 void PotentialMaster::setRhoPotential(int jType, Potential* p) {
@@ -122,10 +150,10 @@ void PotentialMaster::setCharge(int iType, double q) {
     doEwald = true;
     charges = new double[numAtomTypes];
     for (int i=0; i<numAtomTypes; i++) charges[i] = 0;
-    sFacAtom = (complex<double>*)malloc(box.getNumAtoms()*sizeof(complex<double>));
     setEwald(0, 0);
   }
   charges[iType] = q;
+  kTableValid = false;
 }
 
 void PotentialMaster::setEwald(double kc, double a) {
@@ -135,11 +163,28 @@ void PotentialMaster::setEwald(double kc, double a) {
   for (int i=0; i<3; i++) {
     kBasis[i] = 2*M_PI/bs[i];
   }
+  pmeOrder = 0;
+  kTableValid = sFacValid = false;
   if (!doEwald) {
     setCharge(0, 0);
   }
 }
 
+void PotentialMaster::setEwald(double kc, double a, int order) {
+  if (order<3) {
+    fprintf(stderr, "PME needs B-splines of order 3 or more\n");
+    abort();
+  }
+  setEwald(kc, a);
+  pmeOrder = order;
+  // force setupPME to rebuild the mesh
+  pmeMesh[0] = 0;
+}
+
+void PotentialMaster::updateVolume() {
+  kTableValid = sFacValid = false;
+}
+
 void PotentialMaster::setBondPotential(int iSpecies, vector<int*> &bp, Potential *p) {
   if (pureAtoms) {
     fprintf(stderr, "Potential master was configured for purely atomic interactions\n");
@@ -196,12 +241,50 @@ Box& PotentialMaster::getBox() {
   return box;
 }
 
+template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+void PotentialMaster::computeAllPairs(double &uTot, double &virialTot) {
+  const int numAtoms = box.getNumAtoms();
+  double dr[3];
+  double zero[3];
+  zero[0] = zero[1] = zero[2] = 0;
+  for (int i=0; i<numAtoms; i++) {
+    int iMolecule = i, iFirstAtom = i, iSpecies = 0;
+    vector<int> *iBondedAtoms = nullptr;
+    if (molecular) {
+      box.getMoleculeInfoAtom(i, iMolecule, iSpecies, iFirstAtom);
+      if (!rigidMolecules) {
+        iBondedAtoms = &bondedAtoms[iSpecies][i-iFirstAtom];
+      }
+    }
+    double *ri = box.getAtomPosition(i);
+    int iType = box.getAtomType(i);
+    Potential* iRhoPotential = doEmbed ? rhoPotentials[iType] : nullptr;
+    double iRhoCutoff = doEmbed ? rhoCutoffs[iType] : 0;
+    for (int j=0; j<i; j++) {
+      if (molecular && checkSkip(j, iSpecies, iMolecule, iBondedAtoms)) continue;
+      int jType = box.getAtomType(j);
+      if (!pairPotentials[iType][jType]) continue;
+      double *rj = box.getAtomPosition(j);
+      for (int k=0; k<3; k++) dr[k] = rj[k]-ri[k];
+      box.nearestImage(dr);
+      handleComputeAll<PF,doForces,doEmbed,doCallbacks>(i, j, zero, dr, zero, iType*numAtomTypes+jType, uAtom[i], uAtom[j], doForces?force[i]:nullptr, doForces?force[j]:nullptr, uTot, virialTot, pairCutoffs[iType][jType], iRhoPotential, iRhoCutoff, iType, jType, false, rhoSum+i, rhoSum+j, rdrho);
+    }
+  }
+}
+
+template<class PF>
+void PotentialMaster::computeAllPairsF(const bool doForces, double &uTot, double &virialTot) {
+  COMPUTE_ALL_DISPATCH(PF, computeAllPairs, doForces, (uTot, virialTot));
+}
+
 void PotentialMaster::computeAll(vector<PotentialCallback*> &callbacks) {
+  checkPairTable();
   pairCallbacks.resize(0);
   bool doForces = false;
   for (vector<PotentialCallback*>::iterator it = callbacks.begin(); it!=callbacks.end(); it++) {
     if (!embeddingPotentials && (*it)->callPair) pairCallbacks.push_back(*it);
     if ((*it)->takesForces) doForces = true;
+    if ((*it)->callPermute) addPermutationCallback(*it);
   }
   int numAtoms = box.getNumAtoms();
   if (doForces && numAtoms > numForceAtoms) {
@@ -209,13 +292,10 @@ void PotentialMaster::computeAll(vector<PotentialCallback*> &callbacks) {
     if (embeddingPotentials) {
       idf = (double*)realloc(idf, numAtoms*sizeof(double));
     }
-    if (doEwald) {
-      sFacAtom = (complex<double>*)realloc((void**)sFacAtom, box.getNumAtoms()*sizeof(double));
-    }
     numForceAtoms = numAtoms;
   }
   if (embeddingPotentials && numAtoms > numRhoSumAtoms) {
-    drhoSum.resize(numAtoms);
+    context.drhoSum.resize(numAtoms);
     numRhoSumAtoms = numAtoms;
     rhoSum = (double*)realloc(rhoSum, numAtoms*sizeof(double));
   }
@@ -228,34 +308,11 @@ void PotentialMaster::computeAll(vector<PotentialCallback*> &callbacks) {
     uAtom[i] = 0;
     if (embeddingPotentials) {
       rhoSum[i] = 0;
-      drhoSum[i] = 0;
+      context.drhoSum[i] = 0;
     }
     if (doForces) for (int k=0; k<3; k++) force[i][k] = 0;
   }
-  for (int i=0; i<numAtoms; i++) {
-    int iMolecule = i, iFirstAtom = i, iSpecies = 0;
-    vector<int> *iBondedAtoms = nullptr;
-    if (!pureAtoms) {
-      box.getMoleculeInfoAtom(i, iMolecule, iSpecies, iFirstAtom);
-      if (!rigidMolecules) {
-        iBondedAtoms = &bondedAtoms[iSpecies][i-iFirstAtom];
-      }
-    }
-    double *ri = box.getAtomPosition(i);
-    int iType = box.getAtomType(i);
-    Potential* iRhoPotential = embeddingPotentials ? rhoPotentials[iType] : nullptr;
-    double iRhoCutoff = embeddingPotentials ? rhoCutoffs[iType] : 0;
-    for (int j=0; j<i; j++) {
-      if (checkSkip(j, iSpecies, iMolecule, iBondedAtoms)) continue;
-      int jType = box.getAtomType(j);
-      Potential* pij = pairPotentials[iType][jType];
-      if (!pij) continue;
-      double *rj = box.getAtomPosition(j);
-      for (int k=0; k<3; k++) dr[k] = rj[k]-ri[k];
-      box.nearestImage(dr);
-      handleComputeAll(i, j, zero, dr, zero, pij, uAtom[i], uAtom[j], doForces?force[i]:nullptr, doForces?force[j]:nullptr, uTot, virialTot, pairCutoffs[iType][jType], iRhoPotential, iRhoCutoff, iType, jType, doForces, false);
-    }
-  }
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeAllPairsF, (doForces, uTot, virialTot));
   if (embeddingPotentials) {
     // we need another pass to include embedding contributions
     int rdrhoIdx = 0;
@@ -275,7 +332,7 @@ void PotentialMaster::computeAll(vector<PotentialCallback*> &callbacks) {
           for (int k=0; k<3; k++) dr[k] = rj[k]-ri[k];
           box.nearestImage(dr);
 
-          handleComputeAllEmbed(iAtom, jAtom, iType, jType, zero, dr, zero, df, virialTot, iRhoPotential, iRhoCutoff, rdrhoIdx);
+          handleComputeAllEmbed(iAtom, jAtom, iType, jType, zero, dr, zero, df, virialTot, iRhoPotential, iRhoCutoff, rdrho, rdrhoIdx, force[iAtom], force[jAtom]);
         }
       }
     }
@@ -346,15 +403,150 @@ void PotentialMaster::computeAllFourier(const bool doForces, double &uTot, doubl
     computeFourierIntramolecular(iMolecule, doForces, uTot, virialTot);
   }
 
+  if (pmeOrder>0) {
+    computeFourierPME(doForces, uTot, virialTot);
+    sFacValid = false;
+    return;
+  }
+  computeFourierDirect(doForces, uTot, virialTot);
+}
+
+void PotentialMaster::checkStructureFactor() {
+  const double* bs = box.getBoxSize();
+  // a box resized without updateVolume changes every k
+  if (sFacValid && bs[0] == kTableBoxSize[0] && bs[1] == kTableBoxSize[1] && bs[2] == kTableBoxSize[2]) return;
+  double u = 0, v = 0;
+  computeFourierDirect(false, u, v);
+}
+
+void PotentialMaster::checkKTable() {
+  const double* bs = box.getBoxSize();
+  if (kTableValid && box.getNumAtoms() == kTableNumAtoms && bs[0] == kTableBoxSize[0] && bs[1] == kTableBoxSize[1] && bs[2] == kTableBoxSize[2]) return;
+  setupKTable();
+}
+
+void PotentialMaster::setupKTable() {
   const double kCut2 = kCut*kCut;
   const double* bs = box.getBoxSize();
-  int kxMax = (int)(0.5*bs[0]/M_PI*kCut);
-  int kMax[3] = {kxMax, (int)(0.5*bs[1]/M_PI*kCut), (int)(0.5*bs[2]/M_PI*kCut)};
-  // cube instead of sphere, so conservatively big
+  for (int a=0; a<3; a++) {
+    kTableBoxSize[a] = bs[a];
+    kBasis[a] = 2*M_PI/bs[a];
+    kTableMax[a] = (int)(0.5*bs[a]/M_PI*kCut);
+  }
+  kTableIndex.clear();
+  kTableVec.clear();
+  fExp.clear();
+  for (int ikx=0; ikx<=kTableMax[0]; ikx++) {
+    double kx = ikx*kBasis[0];
+    double kx2 = kx*kx;
+    double kyCut2 = kCut2 - kx2;
+    bool xpositive = ikx>0;
+    int kyMax = (int)(0.5*bs[1]*sqrt(kyCut2)/M_PI);
+    for (int iky=-kyMax; iky<=kyMax; iky++) {
+      if (!xpositive && iky<0) continue;
+      bool ypositive = iky>0;
+      double ky = iky*kBasis[1];
+      double kxy2 = kx2 + ky*ky;
+      int kzMax = (int)(0.5*bs[2]*sqrt(kCut2 - kxy2)/M_PI);
+      for (int ikz=-kzMax; ikz<=kzMax; ikz++) {
+        if (!xpositive && !ypositive && ikz<=0) continue;
+        double kz = ikz*kBasis[2];
+        double kxyz2 = kxy2 + kz*kz;
+        kTableIndex.push_back(ikx);
+        kTableIndex.push_back(iky);
+        kTableIndex.push_back(ikz);
+        kTableVec.push_back(kx);
+        kTableVec.push_back(ky);
+        kTableVec.push_back(kz);
+        fExp.push_back(2*exp(-0.25*kxyz2/(alpha*alpha))/kxyz2);
+      }
+    }
+  }
+  const int numAtoms = box.getNumAtoms();
+  chargedAtoms.clear();
+  chargedQ.clear();
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+    double qi = charges[box.getAtomType(iAtom)];
+    if (qi==0) continue;
+    chargedAtoms.push_back(iAtom);
+    chargedQ.push_back(qi);
+  }
+  kTableNumAtoms = numAtoms;
+  kTableValid = true;
+}
+
+void PotentialMaster::fourierKernel(const int ik0, const int ik1, const int i0, const int i1, const int t, const bool doSums, const bool doForces, const double coeff) {
+  const int nq = chargedAtoms.size();
+  const int* kMax = kTableMax;
+  const double* q = chargedQ.data();
+  double* xyr = xyRe.data() + t*nq;
+  double* xyi = xyIm.data() + t*nq;
+  double* sr = doForces ? sFacAtomRe.data() + t*nq : nullptr;
+  double* si = doForces ? sFacAtomIm.data() + t*nq : nullptr;
+  int lastX = -1, lastY = 0;
+  for (int ik=ik0; ik<ik1; ik++) {
+    const int* kIdx = &kTableIndex[3*ik];
+    if (kIdx[0]!=lastX || kIdx[1]!=lastY) {
+      // q exp(i (kx rx + ky ry)), shared by all the kz
+      lastX = kIdx[0];
+      lastY = kIdx[1];
+      const double* xr = &eikRe[0][lastX*nq];
+      const double* xi = &eikIm[0][lastX*nq];
+      const double* yr = &eikRe[1][(kMax[1]+lastY)*nq];
+      const double* yi = &eikIm[1][(kMax[1]+lastY)*nq];
+      for (int i=i0; i<i1; i++) {
+        xyr[i] = q[i]*(xr[i]*yr[i] - xi[i]*yi[i]);
+        xyi[i] = q[i]*(xr[i]*yi[i] + xi[i]*yr[i]);
+      }
+    }
+    const double* zr = &eikRe[2][(kMax[2]+kIdx[2])*nq];
+    const double* zi = &eikIm[2][(kMax[2]+kIdx[2])*nq];
+    if (doForces) {
+      for (int i=i0; i<i1; i++) {
+        sr[i] = xyr[i]*zr[i] - xyi[i]*zi[i];
+        si[i] = xyr[i]*zi[i] + xyi[i]*zr[i];
+      }
+    }
+    if (doSums) {
+      double sRe = 0, sIm = 0;
+      if (doForces) {
+        for (int i=i0; i<i1; i++) {
+          sRe += sr[i];
+          sIm += si[i];
+        }
+      }
+      else {
+        for (int i=i0; i<i1; i++) {
+          sRe += xyr[i]*zr[i] - xyi[i]*zi[i];
+          sIm += xyr[i]*zi[i] + xyi[i]*zr[i];
+        }
+      }
+      sFac[ik] = complex<double>(sRe, sIm);
+      fourierSumK[ik] = fExp[ik] * (sRe*sRe + sIm*sIm);
+    }
+    if (doForces) {
+      const double sRe = sFac[ik].real(), sIm = sFac[ik].imag();
+      double coeffk = coeff * fExp[ik];
+      const double* kVec = &kTableVec[3*ik];
+      double* fx = fourierForce[0].data();
+      double* fy = fourierForce[1].data();
+      double* fz = fourierForce[2].data();
+      for (int i=i0; i<i1; i++) {
+        double coeffki = coeffk * (si[i]*sRe - sr[i]*sIm);
+        fx[i] += coeffki * kVec[0];
+        fy[i] += coeffki * kVec[1];
+        fz[i] += coeffki * kVec[2];
+      }
+    }
+  }
+}
+
+void PotentialMaster::computeFourierDirect(const bool doForces, double &uTot, double &virialTot) {
+  checkKTable();
+  const int nq = chargedAtoms.size();
+  const double* bs = box.getBoxSize();
+  const int* kMax = kTableMax;
   int nk[3] = {kMax[0]+1, 2*kMax[1]+1, 2*kMax[2]+1};
-  int nktot = ((2*(nk[0]-1)+1)*nk[1]*nk[2]-1)/2;
-  sFac.resize(nktot);
-  fExp.resize(nktot);
   // We want exp(i dot(k,r)) for every k and every r
   // then sum over atoms, s(k) = sum[exp(i dot(k,r))] and U(k) = s(k) * s*(k)
   //
@@ -367,79 +559,334 @@ void PotentialMaster::computeAllFourier(const bool doForces, double &uTot, doubl
   // See Allen & Tildesley for more details
   // https://dx.doi.org/10.1093/oso/9780198803195.001.0001
   // https://github.com/Allen-Tildesley/examples/blob/master/ewald_module.f90
+  //
+  // ea(l) for all the atoms is contiguous, so the loops over atoms below
+  // vectorize
   for (int a=0; a<3; a++) {
     double fac = 2.0*M_PI/bs[a];
-    eik[a].resize(numAtoms*nk[a]);
-    for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-      int iType = box.getAtomType(iAtom);
-      if (charges[iType] == 0) continue;
-      int idx = iAtom*nk[a];
-      if (a>0) idx += kMax[a];
-      double* ri = box.getAtomPosition(iAtom);
-      eik[a][idx] = 1;
-      eik[a][idx+1] = std::complex<double>(cos(fac*ri[a]), sin(fac*ri[a]));
-      for (int i=2; i<=kMax[a]; i++) {
-        eik[a][idx+i] = eik[a][idx+1] * eik[a][idx+i-1];
+    eikRe[a].resize(nk[a]*nq);
+    eikIm[a].resize(nk[a]*nq);
+    double* re = eikRe[a].data() + (a>0 ? kMax[a]*nq : 0);
+    double* im = eikIm[a].data() + (a>0 ? kMax[a]*nq : 0);
+    for (int i=0; i<nq; i++) {
+      double* ri = box.getAtomPosition(chargedAtoms[i]);
+      re[i] = 1;
+      im[i] = 0;
+      if (kMax[a]==0) continue;
+      re[nq+i] = cos(fac*ri[a]);
+      im[nq+i] = sin(fac*ri[a]);
+    }
+    for (int l=2; l<=kMax[a]; l++) {
+      for (int i=0; i<nq; i++) {
+        re[l*nq+i] = re[nq+i]*re[(l-1)*nq+i] - im[nq+i]*im[(l-1)*nq+i];
+        im[l*nq+i] = re[nq+i]*im[(l-1)*nq+i] + im[nq+i]*re[(l-1)*nq+i];
       }
-      if (a==0) continue;
-      for (int i=1; i<=kMax[a]; i++) {
-        eik[a][idx-i] = conj(eik[a][idx+i]);
+    }
+    if (a==0) continue;
+    for (int l=1; l<=kMax[a]; l++) {
+      for (int i=0; i<nq; i++) {
+        re[-l*nq+i] = re[l*nq+i];
+        im[-l*nq+i] = -im[l*nq+i];
       }
     }
   }
-  double coeff = 4*M_PI/(bs[0]*bs[1]*bs[2]);
+  const int numK = fExp.size();
+  sFac.resize(numK);
+  fourierSumK.resize(numK);
+  ThreadPool& pool = ThreadPool::get();
+  int nt = fourierTasks>0 ? fourierTasks : pool.getNumThreads();
+  if (nt > numK) nt = numK;
+  if (nt < 1) nt = 1;
+  xyRe.resize(nt*nq);
+  xyIm.resize(nt*nq);
+  if (doForces) {
+    sFacAtomRe.resize(nt*nq);
+    sFacAtomIm.resize(nt*nq);
+    for (int a=0; a<3; a++) {
+      fourierForce[a].resize(nq);
+      fill(fourierForce[a].begin(), fourierForce[a].end(), 0.0);
+    }
+  }
+  const double coeff = 4*M_PI/(bs[0]*bs[1]*bs[2]);
+  if (nt==1) {
+    fourierKernel(0, numK, 0, nq, 0, true, doForces, coeff);
+  }
+  else {
+    // each structure factor is independent, so tasks take blocks of k.
+    // forces then need all of sFac, so tasks take blocks of atoms, each
+    // summing over every k in order.  Every sum runs in the same order as
+    // with one task, so the results don't depend on the number of tasks.
+    pool.run(nt, [&](int t) {
+      fourierKernel(ThreadPool::taskStart(numK, t, nt), ThreadPool::taskStart(numK, t+1, nt), 0, nq, t, true, false, coeff);
+    });
+    if (doForces) {
+      pool.run(nt, [&](int t) {
+        fourierKernel(0, numK, ThreadPool::taskStart(nq, t, nt), ThreadPool::taskStart(nq, t+1, nt), t, false, true, coeff);
+      });
+    }
+  }
   double fourierSum = 0;
-  int ik = 0;
-  for (int ikx=0; ikx<=kxMax; ikx++) {
-    double kx = ikx*kBasis[0];
-    double kx2 = kx*kx;
-    double kyCut2 = kCut2 - kx2;
-    bool xpositive = ikx>0;
-    int kyMax = (int)(0.5*bs[1]*sqrt(kyCut2)/M_PI);
-    for (int iky=-kyMax; iky<=kyMax; iky++) {
-      if (!xpositive && iky<0) continue;
-      bool ypositive = iky>0;
-      double ky = iky*kBasis[1];
-      double kxy2 = kx2 + ky*ky;
-      int kzMax = (int)(0.5*bs[2]*sqrt(kCut2 - kxy2)/M_PI);
-      for (int ikz=-kzMax; ikz<=kzMax; ikz++) {
-        if (!xpositive && !ypositive && ikz<=0) continue;
-        double kz = ikz*kBasis[2];
-        double kxyz2 = kxy2 + kz*kz;
-        sFac[ik] = 0;
-        for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-          int iType = box.getAtomType(iAtom);
-          double qi = charges[iType];
-          if (qi==0) {
-            sFacAtom[iAtom] = 0;
-            continue;
-          }
-          sFacAtom[iAtom] = qi * eik[0][iAtom*nk[0]+ikx]
-                               * eik[1][iAtom*nk[1]+kMax[1]+iky]
-                               * eik[2][iAtom*nk[2]+kMax[2]+ikz];
-          sFac[ik] += sFacAtom[iAtom];
+  for (int ik=0; ik<numK; ik++) fourierSum += fourierSumK[ik];
+  if (doForces) {
+    for (int i=0; i<nq; i++) {
+      double* fi = force[chargedAtoms[i]];
+      for (int a=0; a<3; a++) fi[a] += fourierForce[a][i];
+    }
+  }
+  sFacValid = true;
+  // the molecules may have moved since we cached their contributions
+  sFacMolecule.resize(box.getTotalNumMolecules()*numK);
+  sFacMoleculeState.assign(box.getTotalNumMolecules(), 0);
+  uTot += 0.5*coeff * fourierSum;
+  virialTot += -3*0.5*coeff * fourierSum;
+}
+
+// smallest n >= nMin with no prime factors beyond 5, so the FFT is cheap
+static int pmeMeshSize(int nMin, bool even) {
+  for (int n=nMin; ; n++) {
+    if (even && n%2==1) continue;
+    int m = n;
+    while (m%2==0) m /= 2;
+    while (m%3==0) m /= 3;
+    while (m%5==0) m /= 5;
+    if (m==1) return n;
+  }
+}
+
+// cardinal B-spline M_n(x), nonzero for 0<x<n
+static double bsplineM(int n, double x) {
+  if (x<=0 || x>=n) return 0;
+  if (n==2) return 1 - fabs(x-1);
+  return (x*bsplineM(n-1, x) + (n-x)*bsplineM(n-1, x-1))/(n-1);
+}
+
+void PotentialMaster::setupPME() {
+  const double* bs = box.getBoxSize();
+  int mesh[3];
+  for (int a=0; a<3; a++) {
+    pmeBoxSize[a] = bs[a];
+    // every k within kCut, with room to spare; interpolation errors grow
+    // quickly as k approaches the mesh's Nyquist limit
+    int kMax = (int)(0.5*bs[a]/M_PI*kCut);
+    int nMin = 3*kMax+2;
+    if (nMin<pmeOrder) nMin = pmeOrder;
+    mesh[a] = pmeMeshSize(nMin, a==2);
+  }
+  if (!pmeFFT || mesh[0]!=pmeMesh[0] || mesh[1]!=pmeMesh[1] || mesh[2]!=pmeMesh[2]) {
+    for (int a=0; a<3; a++) pmeMesh[a] = mesh[a];
+    delete pmeFFT;
+    pmeFFT = new FFT3D(mesh[0], mesh[1], mesh[2]);
+    pmeQ.resize(mesh[0]*mesh[1]*mesh[2]);
+    pmeQk.resize(mesh[0]*mesh[1]*(mesh[2]/2+1));
+    pmeG.resize(pmeQk.size());
+  }
+
+  for (int a=0; a<3; a++) {
+    int K = pmeMesh[a];
+    pmeBSP[a].resize(K);
+    for (int m=0; m<K; m++) {
+      complex<double> b = 0;
+      for (int j=0; j<pmeOrder-1; j++) {
+        double t = 2*M_PI*m*j/K;
+        b += bsplineM(pmeOrder, j+1) * complex<double>(cos(t), sin(t));
+      }
+      pmeBSP[a][m] = norm(b);
+    }
+    // odd orders vanish at the Nyquist point; interpolate as Essmann does
+    for (int m=0; m<K; m++) {
+      if (pmeBSP[a][m] < 1e-7) {
+        pmeBSP[a][m] = 0.5*(pmeBSP[a][(m-1+K)%K] + pmeBSP[a][(m+1)%K]);
+      }
+    }
+    for (int m=0; m<K; m++) pmeBSP[a][m] = 1/pmeBSP[a][m];
+  }
+
+  // G(k) = B(k) exp(-k^2/4a^2)/k^2, zero at k=0 and beyond kCut as with the
+  // direct sum
+  const double kCut2 = kCut*kCut;
+  const int n2c = pmeMesh[2]/2+1;
+  for (int k0=0; k0<pmeMesh[0]; k0++) {
+    int m0 = k0 <= pmeMesh[0]/2 ? k0 : k0-pmeMesh[0];
+    double kx = 2*M_PI*m0/bs[0];
+    for (int k1=0; k1<pmeMesh[1]; k1++) {
+      int m1 = k1 <= pmeMesh[1]/2 ? k1 : k1-pmeMesh[1];
+      double ky = 2*M_PI*m1/bs[1];
+      for (int k2=0; k2<n2c; k2++) {
+        double kz = 2*M_PI*k2/bs[2];
+        double k2tot = kx*kx + ky*ky + kz*kz;
+        int ik = (k0*pmeMesh[1] + k1)*n2c + k2;
+        if (k2tot==0 || k2tot>kCut2) {
+          pmeG[ik] = 0;
+          continue;
         }
-        // we could skip this as long as box-length, kCut don't change between calls
-        fExp[ik] = 2*exp(-0.25*kxyz2/(alpha*alpha))/kxyz2;
-        fourierSum += fExp[ik] * (sFac[ik]*conj(sFac[ik])).real();
-        if (doForces) {
-          double coeffk = coeff * fExp[ik];
-          for (int iAtom=0; iAtom<numAtoms; iAtom++) {
-            double coeffki = coeffk * (sFacAtom[iAtom].imag()*sFac[ik].real()
-                                      -sFacAtom[iAtom].real()*sFac[ik].imag());
-            force[iAtom][0] += coeffki * kx;
-            force[iAtom][1] += coeffki * ky;
-            force[iAtom][2] += coeffki * kz;
-          }
+        pmeG[ik] = pmeBSP[0][k0]*pmeBSP[1][k1]*pmeBSP[2][k2]
+                 * exp(-0.25*k2tot/(alpha*alpha))/k2tot;
+      }
+    }
+  }
+}
+
+void PotentialMaster::pmeSplines(const int n0, const int n1) {
+  const int p = pmeOrder;
+  const int* K = pmeMesh;
+  const double* bs = box.getBoxSize();
+  for (int n=n0; n<n1; n++) {
+    const double* ri = box.getAtomPosition(chargedAtoms[n]);
+    for (int a=0; a<3; a++) {
+      double u = K[a]*(ri[a]/bs[a] + 0.5);
+      u -= K[a]*floor(u/K[a]);
+      int i0 = (int)u;
+      if (i0==K[a]) i0 = 0;
+      double w = u - floor(u);
+      pmeIndex[n*3+a] = i0;
+      double* t = &pmeTheta[(n*3+a)*p];
+      double* dt = &pmeDTheta[(n*3+a)*p];
+      for (int j=0; j<p; j++) t[j] = 0;
+      t[0] = w;
+      t[1] = 1-w;
+      // M_k(w+j) = ((w+j) M_{k-1}(w+j) + (k-w-j) M_{k-1}(w+j-1))/(k-1)
+      for (int k=3; k<=p; k++) {
+        if (k==p) {
+          dt[0] = t[0];
+          for (int j=1; j<p; j++) dt[j] = t[j] - t[j-1];
+        }
+        for (int j=k-1; j>=0; j--) {
+          t[j] = ((w+j)*t[j] + (j>0 ? (k-w-j)*t[j-1] : 0))/(k-1);
         }
-        ik++;
       }
     }
   }
-  fill(fExp.begin()+ik, fExp.end(), 0);
-  fill(sFac.begin()+ik, sFac.end(), 0);
-  uTot += 0.5*coeff * fourierSum;
-  virialTot += -3*0.5*coeff * fourierSum;
+}
+
+void PotentialMaster::pmeSpread(const int x0, const int x1) {
+  const int p = pmeOrder;
+  const int* K = pmeMesh;
+  const int nq = chargedAtoms.size();
+  fill(pmeQ.begin()+x0*K[1]*K[2], pmeQ.begin()+x1*K[1]*K[2], 0.0);
+  // an atom at scaled coordinate u contributes M_p(u-g) to mesh point g,
+  // so point floor(u)-j gets M_p(w+j) with w the fractional part of u.
+  // only planes x0 up to x1 are ours, so every point is summed over the
+  // atoms in the same order no matter how the planes are divided.
+  for (int n=0; n<nq; n++) {
+    const double qi = chargedQ[n];
+    const double* t0 = &pmeTheta[(n*3+0)*p];
+    const double* t1 = &pmeTheta[(n*3+1)*p];
+    const double* t2 = &pmeTheta[(n*3+2)*p];
+    for (int j0=0; j0<p; j0++) {
+      int g0 = pmeIndex[n*3+0] - j0;
+      if (g0<0) g0 += K[0];
+      if (g0<x0 || g0>=x1) continue;
+      double q0 = qi*t0[j0];
+      for (int j1=0; j1<p; j1++) {
+        int g1 = pmeIndex[n*3+1] - j1;
+        if (g1<0) g1 += K[1];
+        double q01 = q0*t1[j1];
+        double* Q = &pmeQ[(g0*K[1] + g1)*K[2]];
+        for (int j2=0; j2<p; j2++) {
+          int g2 = pmeIndex[n*3+2] - j2;
+          if (g2<0) g2 += K[2];
+          Q[g2] += q01*t2[j2];
+        }
+      }
+    }
+  }
+}
+
+void PotentialMaster::pmeGather(const int n0, const int n1, const double coeff) {
+  const int p = pmeOrder;
+  const int* K = pmeMesh;
+  const double* bs = box.getBoxSize();
+  for (int n=n0; n<n1; n++) {
+    const double qi = chargedQ[n];
+    const double* t0 = &pmeTheta[(n*3+0)*p];
+    const double* t1 = &pmeTheta[(n*3+1)*p];
+    const double* t2 = &pmeTheta[(n*3+2)*p];
+    const double* dt0 = &pmeDTheta[(n*3+0)*p];
+    const double* dt1 = &pmeDTheta[(n*3+1)*p];
+    const double* dt2 = &pmeDTheta[(n*3+2)*p];
+    double f[3] = {0,0,0};
+    for (int j0=0; j0<p; j0++) {
+      int g0 = pmeIndex[n*3+0] - j0;
+      if (g0<0) g0 += K[0];
+      for (int j1=0; j1<p; j1++) {
+        int g1 = pmeIndex[n*3+1] - j1;
+        if (g1<0) g1 += K[1];
+        const double* phi = &pmeQ[(g0*K[1] + g1)*K[2]];
+        for (int j2=0; j2<p; j2++) {
+          int g2 = pmeIndex[n*3+2] - j2;
+          if (g2<0) g2 += K[2];
+          f[0] += phi[g2]*dt0[j0]*t1[j1]*t2[j2];
+          f[1] += phi[g2]*t0[j0]*dt1[j1]*t2[j2];
+          f[2] += phi[g2]*t0[j0]*t1[j1]*dt2[j2];
+        }
+      }
+    }
+    double* fi = force[chargedAtoms[n]];
+    for (int a=0; a<3; a++) {
+      fi[a] -= 2*coeff*qi*K[a]/bs[a]*f[a];
+    }
+  }
+}
+
+void PotentialMaster::computeFourierPME(const bool doForces, double &uTot, double &virialTot) {
+  const double* bs = box.getBoxSize();
+  if (pmeMesh[0]==0 || bs[0]!=pmeBoxSize[0] || bs[1]!=pmeBoxSize[1] || bs[2]!=pmeBoxSize[2]) {
+    setupPME();
+  }
+  checkKTable();
+  const int p = pmeOrder;
+  const int* K = pmeMesh;
+  const int nq = chargedAtoms.size();
+  pmeTheta.resize(nq*3*p);
+  pmeDTheta.resize(nq*3*p);
+  pmeIndex.resize(nq*3);
+
+  // splines and gathering are independent for each atom; for spreading,
+  // tasks take blocks of x planes of the mesh
+  ThreadPool& pool = ThreadPool::get();
+  int nt = fourierTasks>0 ? fourierTasks : pool.getNumThreads();
+  if (nt > K[0]) nt = K[0];
+  if (nt < 1) nt = 1;
+  if (nt==1) {
+    pmeSplines(0, nq);
+    pmeSpread(0, K[0]);
+  }
+  else {
+    pool.run(nt, [&](int t) {
+      pmeSplines(ThreadPool::taskStart(nq, t, nt), ThreadPool::taskStart(nq, t+1, nt));
+    });
+    pool.run(nt, [&](int t) {
+      pmeSpread(ThreadPool::taskStart(K[0], t, nt), ThreadPool::taskStart(K[0], t+1, nt));
+    });
+  }
+
+  pmeFFT->forward(pmeQ.data(), pmeQk.data());
+  // U = (2 pi/V) sum_k G(k) |Q(k)|^2, over the full spectrum
+  const int n2c = K[2]/2+1;
+  double fourierSum = 0;
+  for (int k01=0; k01<K[0]*K[1]; k01++) {
+    for (int k2=0; k2<n2c; k2++) {
+      int ik = k01*n2c + k2;
+      double x = pmeG[ik] * norm(pmeQk[ik]);
+      fourierSum += (k2==0 || 2*k2==K[2]) ? x : 2*x;
+      pmeQk[ik] *= pmeG[ik];
+    }
+  }
+  double coeff = 2*M_PI/(bs[0]*bs[1]*bs[2]);
+  uTot += coeff * fourierSum;
+  virialTot += -3*coeff * fourierSum;
+  if (!doForces) return;
+
+  // convolve; dU/dQ(g) = 2 coeff phi(g)
+  pmeFFT->inverse(pmeQk.data(), pmeQ.data());
+  if (nt==1) {
+    pmeGather(0, nq, coeff);
+  }
+  else {
+    pool.run(nt, [&](int t) {
+      pmeGather(ThreadPool::taskStart(nq, t, nt), ThreadPool::taskStart(nq, t+1, nt), coeff);
+    });
+  }
 }
 
 double PotentialMaster::computeVirialIntramolecular() {
@@ -448,7 +895,8 @@ double PotentialMaster::computeVirialIntramolecular() {
     int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
     box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
     if (iLastAtom==iFirstAtom) continue;
-    double* center = speciesList.get(iSpecies)->getMoleculeCOM(box, iFirstAtom, iLastAtom);
+    double center[3];
+    speciesList.get(iSpecies)->getMoleculeCOM(box, iFirstAtom, iLastAtom, center);
     for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
       double* ri = box.getAtomPosition(iAtom);
       double dr[3];
@@ -619,7 +1067,7 @@ void PotentialMaster::computeAllBonds(bool doForces, double &uTot) {
   }
 }
 
-void PotentialMaster::computeOneMoleculeBonds(const int iSpecies, const int iMolecule, double &u1) {
+void PotentialMaster::computeOneMoleculeBonds(PotentialContext& ctx, const int iSpecies, const int iMolecule, double &u1) {
   vector<Potential*> &iBondedPotentials = bondedPotentials[iSpecies];
   if (iBondedPotentials.size() == 0) return;
   vector<vector<int*> > iBondedPairs = bondedPairs[iSpecies];
@@ -640,125 +1088,169 @@ void PotentialMaster::computeOneMoleculeBonds(const int iSpecies, const int iMol
       double r2 = 0;
       for (int k=0; k<3; k++) r2 += dr[k]*dr[k];
       double u = p->u(r2);
-      uAtom[iAtom] += 0.5*u;
-      uAtom[jAtom] += 0.5*u;
+      ctx.duAtom[iAtom] += 0.5*u;
+      ctx.duAtom[jAtom] += 0.5*u;
       u1 += u;
     }
   }
 }
 
-double PotentialMaster::oneMoleculeFourierEnergy(int iMolecule, bool oldEnergy) {
-  double u = 0, v = 0;
-  computeFourierIntramolecular(iMolecule, false, u, v);
-  int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
-  box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
-
-  const double kCut2 = kCut*kCut;
+void PotentialMaster::moleculeStructureFactor(PotentialContext& ctx, int iFirstAtom, int iLastAtom, complex<double>* s) {
   const double* bs = box.getBoxSize();
-  int kxMax = (int)(0.5*bs[0]/M_PI*kCut);
-  int kMax[3] = {kxMax, (int)(0.5*bs[1]/M_PI*kCut), (int)(0.5*bs[2]/M_PI*kCut)};
-  // cube instead of sphere, so conservatively big
+  const int* kMax = kTableMax;
   int nk[3] = {kMax[0]+1, 2*kMax[1]+1, 2*kMax[2]+1};
-  int nktot = ((2*(nk[0]-1)+1)*nk[1]*nk[2]-1)/2;
-  dsFacMolecule.resize(nktot);
-
-  // we save this too... would need to update after accepted move, revert after rejection
-  double q2Sum = 0;
-  int numAtoms = box.getNumAtoms();
+  const int numK = fExp.size();
+  ctx.qMolecule.clear();
+  for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
+    double qi = charges[box.getAtomType(iAtom)];
+    if (qi == 0) continue;
+    ctx.qMolecule.push_back(qi);
+  }
+  const int nq = ctx.qMolecule.size();
   for (int a=0; a<3; a++) {
     double fac = 2.0*M_PI/bs[a];
-    eik[a].resize(numAtoms*nk[a]); // way bigger than we need, but OK
+    ctx.eikRe[a].resize(nk[a]*nq);
+    ctx.eikIm[a].resize(nk[a]*nq);
+    double* re = ctx.eikRe[a].data() + (a>0 ? kMax[a]*nq : 0);
+    double* im = ctx.eikIm[a].data() + (a>0 ? kMax[a]*nq : 0);
+    int i = 0;
     for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
-      int iType = box.getAtomType(iAtom);
-      double qi = charges[iType];
-      if (qi == 0) continue;
-      if (a==0) q2Sum += qi*qi;
-      int idx = iAtom*nk[a];
-      if (a>0) idx += kMax[a];
+      if (charges[box.getAtomType(iAtom)] == 0) continue;
       double* ri = box.getAtomPosition(iAtom);
-      eik[a][idx] = 1;
-      eik[a][idx+1] = std::complex<double>(cos(fac*ri[a]), sin(fac*ri[a]));
-      for (int i=2; i<=kMax[a]; i++) {
-        eik[a][idx+i] = eik[a][idx+1] * eik[a][idx+i-1];
+      re[i] = 1;
+      im[i] = 0;
+      if (kMax[a]>0) {
+        re[nq+i] = cos(fac*ri[a]);
+        im[nq+i] = sin(fac*ri[a]);
       }
-      if (a==0) continue;
-      for (int i=1; i<=kMax[a]; i++) {
-        eik[a][idx-i] = conj(eik[a][idx+i]);
+      for (int l=2; l<=kMax[a]; l++) {
+        re[l*nq+i] = re[nq+i]*re[(l-1)*nq+i] - im[nq+i]*im[(l-1)*nq+i];
+        im[l*nq+i] = re[nq+i]*im[(l-1)*nq+i] + im[nq+i]*re[(l-1)*nq+i];
       }
+      if (a>0) {
+        for (int l=1; l<=kMax[a]; l++) {
+          re[-l*nq+i] = re[l*nq+i];
+          im[-l*nq+i] = -im[l*nq+i];
+        }
+      }
+      i++;
     }
   }
+  const double* q = ctx.qMolecule.data();
+  for (int ik=0; ik<numK; ik++) {
+    const int* kIdx = &kTableIndex[3*ik];
+    const double* xr = &ctx.eikRe[0][kIdx[0]*nq];
+    const double* xi = &ctx.eikIm[0][kIdx[0]*nq];
+    const double* yr = &ctx.eikRe[1][(kMax[1]+kIdx[1])*nq];
+    const double* yi = &ctx.eikIm[1][(kMax[1]+kIdx[1])*nq];
+    const double* zr = &ctx.eikRe[2][(kMax[2]+kIdx[2])*nq];
+    const double* zi = &ctx.eikIm[2][(kMax[2]+kIdx[2])*nq];
+    double sRe = 0, sIm = 0;
+    for (int i=0; i<nq; i++) {
+      double xyr = q[i]*(xr[i]*yr[i] - xi[i]*yi[i]);
+      double xyi = q[i]*(xr[i]*yi[i] + xi[i]*yr[i]);
+      sRe += xyr*zr[i] - xyi*zi[i];
+      sIm += xyr*zi[i] + xyi*zr[i];
+    }
+    s[ik] = complex<double>(sRe, sIm);
+  }
+}
+
+double PotentialMaster::oneMoleculeFourierEnergy(PotentialContext& ctx, int iMolecule, bool oldEnergy) {
+  checkStructureFactor();
+  double u = 0, v = 0;
+  computeFourierIntramolecular(iMolecule, false, u, v);
+  int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
+  box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
+
+  double q2Sum = 0;
+  for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
+    double qi = charges[box.getAtomType(iAtom)];
+    q2Sum += qi*qi;
+  }
   u -= alpha/sqrt(M_PI)*q2Sum;
+
+  const int numK = fExp.size();
+  ctx.dsFacMolecule.resize(numK);
+  if ((int)sFacMoleculeState.size() != box.getTotalNumMolecules()) {
+    sFacMolecule.resize(box.getTotalNumMolecules()*numK);
+    sFacMoleculeState.assign(box.getTotalNumMolecules(), 0);
+  }
+  // the molecule's contribution; the old one is usually cached from when
+  // it was last moved
+  const complex<double>* sMolecule;
+  if (oldEnergy) {
+    complex<double>* sCached = &sFacMolecule[iMolecule*numK];
+    if (sFacMoleculeState[iMolecule] != 1) {
+      moleculeStructureFactor(ctx, iFirstAtom, iLastAtom, sCached);
+      sFacMoleculeState[iMolecule] = 1;
+    }
+    sMolecule = sCached;
+  }
+  else {
+    ctx.sFacMoleculeNew.resize(numK);
+    moleculeStructureFactor(ctx, iFirstAtom, iLastAtom, ctx.sFacMoleculeNew.data());
+    ctx.fourierMolecule = iMolecule;
+    sMolecule = ctx.sFacMoleculeNew.data();
+  }
+
+  const double* bs = box.getBoxSize();
   double coeff = 4*M_PI/(bs[0]*bs[1]*bs[2]);
   double fourierSum = 0;
-  int ik = 0;
-  for (int ikx=0; ikx<=kxMax; ikx++) {
-    double kx = ikx*kBasis[0];
-    double kx2 = kx*kx;
-    double kyCut2 = kCut2 - kx2;
-    bool xpositive = ikx>0;
-    int kyMax = (int)(0.5*bs[1]*sqrt(kyCut2)/M_PI);
-    for (int iky=-kyMax; iky<=kyMax; iky++) {
-      if (!xpositive && iky<0) continue;
-      bool ypositive = iky>0;
-      double ky = iky*kBasis[1];
-      double kxy2 = kx2 + ky*ky;
-      int kzMax = (int)(0.5*bs[2]*sqrt(kCut2 - kxy2)/M_PI);
-      for (int ikz=-kzMax; ikz<=kzMax; ikz++) {
-        if (!xpositive && !ypositive && ikz<=0) continue;
-        double kz = ikz*kBasis[2];
-        double kxyz2 = kxy2 + kz*kz;
-        // when we compute old energy, this will come in as 0
-        // when we compute new energy, this will come in as old fourier sum
-        double fExp = 2*exp(-0.25*kxyz2/(alpha*alpha))/kxyz2;
-        if (!oldEnergy) {
-          complex<double> sFacMinus = sFac[ik] - dsFacMolecule[ik];
-          // energy without this atom
-          fourierSum -= fExp * (sFacMinus*conj(sFacMinus)).real();
-          dsFacMolecule[ik] = -dsFacMolecule[ik];
-        }
-        for (int iAtom=iFirstAtom; iAtom<=iLastAtom; iAtom++) {
-          int iType = box.getAtomType(iAtom);
-          double qi = charges[iType];
-          if (qi==0) continue;
-          dsFacMolecule[ik] += qi * eik[0][iAtom*nk[0]+ikx]
-                                  * eik[1][iAtom*nk[1]+kMax[1]+iky]
-                                  * eik[2][iAtom*nk[2]+kMax[2]+ikz];
-        }
-        
-        if (oldEnergy) {
-          complex<double> sFacMinus = sFac[ik] - dsFacMolecule[ik];
-          // energy with this atom present (as we computed it before) and without
-          fourierSum += fExp * ((sFac[ik]*conj(sFac[ik])).real()
-                               -(sFacMinus*conj(sFacMinus)).real());
-        }
-        else {
-          complex<double> sFacNew = sFac[ik] + dsFacMolecule[ik];
-          fourierSum += fExp * (sFacNew*conj(sFacNew)).real();
-        }
-        ik++;
-      }
+  for (int ik=0; ik<numK; ik++) {
+    // when we compute old energy, this will come in as 0
+    // when we compute new energy, this will come in as old fourier sum
+    if (!oldEnergy) {
+      complex<double> sFacMinus = sFac[ik] - ctx.dsFacMolecule[ik];
+      // energy without this atom
+      fourierSum -= fExp[ik] * norm(sFacMinus);
+      ctx.dsFacMolecule[ik] = -ctx.dsFacMolecule[ik];
+    }
+    ctx.dsFacMolecule[ik] += sMolecule[ik];
+
+    if (oldEnergy) {
+      complex<double> sFacMinus = sFac[ik] - ctx.dsFacMolecule[ik];
+      // energy with this atom present (as we computed it before) and without
+      fourierSum += fExp[ik] * (norm(sFac[ik]) - norm(sFacMinus));
+    }
+    else {
+      complex<double> sFacNew = sFac[ik] + ctx.dsFacMolecule[ik];
+      fourierSum += fExp[ik] * norm(sFacNew);
     }
   }
   u += 0.5*coeff * fourierSum;
   return u;
 }
 
+void PotentialMaster::checkContext(PotentialContext& ctx) {
+  checkPairTable();
+  int numAtoms = box.getNumAtoms();
+  if (embeddingPotentials && (int)ctx.drhoSum.size() < numAtoms) {
+    ctx.drhoSum.resize(numAtoms, 0);
+  }
+}
+
 double PotentialMaster::oldEnergy(int iAtom) {
+  return oldEnergy(context, iAtom);
+}
+
+double PotentialMaster::oldEnergy(PotentialContext& ctx, int iAtom) {
+  checkContext(ctx);
   double u = 2*uAtom[iAtom];
   if (doSingleTruncationCorrection) {
     u += computeOneTruncationCorrection(iAtom);
   }
   if (embeddingPotentials) {
-    u += oldEmbeddingEnergy(iAtom);
+    u += oldEmbeddingEnergy(ctx, iAtom);
   }
   return u;
 }
 
-double PotentialMaster::oldEmbeddingEnergy(int iAtom) {
+double PotentialMaster::oldEmbeddingEnergy(PotentialContext& ctx, int iAtom) {
   // just compute all the embedding energies
   int numAtoms = box.getNumAtoms();
-  rhoAtomsChanged.clear();
-  rhoAtomsChanged.push_back(iAtom);
+  ctx.rhoAtomsChanged.clear();
+  ctx.rhoAtomsChanged.push_back(iAtom);
   int iType = box.getAtomType(iAtom);
   double u = embedF[iType]->f(rhoSum[iAtom]);
   double *ri = box.getAtomPosition(iAtom);
@@ -770,12 +1262,17 @@ double PotentialMaster::oldEmbeddingEnergy(int iAtom) {
     double dr[3];
     for (int k=0; k<3; k++) dr[k] = rj[k]-ri[k];
     box.nearestImage(dr);
-    handleOldEmbedding(zero, dr, zero, jAtom, u, box.getAtomType(jAtom));
+    handleOldEmbedding(ctx, zero, dr, zero, jAtom, u, box.getAtomType(jAtom));
   }
   return u;
 }
 
 double PotentialMaster::oldMoleculeEnergy(int iMolecule) {
+  return oldMoleculeEnergy(context, iMolecule);
+}
+
+double PotentialMaster::oldMoleculeEnergy(PotentialContext& ctx, int iMolecule) {
+  checkContext(ctx);
   // only works for rigid molecules, handles monatomic EAM
   int iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom;
   box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, iFirstAtom, iLastAtom);
@@ -786,179 +1283,219 @@ double PotentialMaster::oldMoleculeEnergy(int iMolecule) {
       u += computeOneTruncationCorrection(iAtom);
     }
     if (embeddingPotentials) {
-      u += oldEmbeddingEnergy(iAtom);
+      u += oldEmbeddingEnergy(ctx, iAtom);
     }
     // we'll double count any interactions between this atom and image of
     // another atom in the same molecule (we count it now, we'll count it
     // again for that other atom).  this method computes only "up", so
     // subtracting will give us the right result
-    u -= oldIntraMoleculeEnergyLS(iAtom, iLastAtom);
+    u -= oldIntraMoleculeEnergyLS(ctx, iAtom, iLastAtom);
   }
   if (doEwald) {
-    u += oneMoleculeFourierEnergy(iMolecule, true);
+    u += oneMoleculeFourierEnergy(ctx, iMolecule, true);
   }
   return u;
 }
 
 void PotentialMaster::resetAtomDU() {
-  int numAtomsChanged = uAtomsChanged.size();
-  if (duAtomMulti) {
+  resetAtomDU(context);
+}
+
+void PotentialMaster::resetAtomDU(PotentialContext& ctx) {
+  int numAtomsChanged = ctx.uAtomsChanged.size();
+  if (ctx.duAtomMulti) {
     for (int i=0; i<numAtomsChanged; i++) {
-      int iAtom = uAtomsChanged[i];
-      duAtom[iAtom] = 0;
+      int iAtom = ctx.uAtomsChanged[i];
+      ctx.duAtom[iAtom] = 0;
     }
   }
   else {
-    for (int i=0; i<numAtomsChanged; i++) duAtom[i] = 0;
+    for (int i=0; i<numAtomsChanged; i++) ctx.duAtom[i] = 0;
   }
-  uAtomsChanged.resize(0);
-  duAtomSingle = duAtomMulti = false;
+  ctx.uAtomsChanged.resize(0);
+  ctx.duAtomSingle = ctx.duAtomMulti = false;
   if (embeddingPotentials) {
-    int numAtomsChanged = rhoAtomsChanged.size();
+    int numAtomsChanged = ctx.rhoAtomsChanged.size();
     for (int i=0; i<numAtomsChanged; i++) {
-      int iAtom = rhoAtomsChanged[i];
-      drhoSum[iAtom] = 0;
+      int iAtom = ctx.rhoAtomsChanged[i];
+      ctx.drhoSum[iAtom] = 0;
     }
-    rhoAtomsChanged.clear();
+    ctx.rhoAtomsChanged.clear();
   }
   if (doEwald) {
-    fill(dsFacMolecule.begin(), dsFacMolecule.end(), 0);
+    fill(ctx.dsFacMolecule.begin(), ctx.dsFacMolecule.end(), 0);
+    ctx.fourierMolecule = -1;
   }
 }
 
 void PotentialMaster::processAtomU(int coeff) {
-  if (duAtomSingle && duAtomMulti) {
+  processAtomU(context, coeff);
+}
+
+void PotentialMaster::processAtomU(PotentialContext& ctx, int coeff) {
+  if (ctx.duAtomSingle && ctx.duAtomMulti) {
     fprintf(stderr, "Can't simultaneously do single and multi duAtom!\n");
     abort();
   }
-  int numAtomsChanged = uAtomsChanged.size();
-  if (duAtomSingle) {
+  int numAtomsChanged = ctx.uAtomsChanged.size();
+  if (ctx.duAtomSingle) {
     for (int i=0; i<numAtomsChanged; i++) {
-      int iAtom = uAtomsChanged[i];
-      uAtom[iAtom] += coeff*duAtom[i];
-      duAtom[i] = 0;
+      int iAtom = ctx.uAtomsChanged[i];
+      uAtom[iAtom] += coeff*ctx.duAtom[i];
+      ctx.duAtom[i] = 0;
     }
   }
-  else if (duAtomMulti) {
+  else if (ctx.duAtomMulti) {
     for (int i=0; i<numAtomsChanged; i++) {
-      int iAtom = uAtomsChanged[i];
-      uAtom[iAtom] += coeff*duAtom[iAtom];
-      duAtom[iAtom] = 0;
+      int iAtom = ctx.uAtomsChanged[i];
+      uAtom[iAtom] += coeff*ctx.duAtom[iAtom];
+      ctx.duAtom[iAtom] = 0;
     }
   }
-  uAtomsChanged.clear();
-  duAtomSingle = duAtomMulti = false;
+  ctx.uAtomsChanged.clear();
+  ctx.duAtomSingle = ctx.duAtomMulti = false;
   if (embeddingPotentials) {
-    numAtomsChanged = rhoAtomsChanged.size();
+    numAtomsChanged = ctx.rhoAtomsChanged.size();
     for (int i=0; i<numAtomsChanged; i++) {
-      int iAtom = rhoAtomsChanged[i];
+      int iAtom = ctx.rhoAtomsChanged[i];
       // by the time we get to processAtom(+1), we have
       // the difference.  just use that
       if (coeff==1) {
-        rhoSum[iAtom] += drhoSum[iAtom];
+        rhoSum[iAtom] += ctx.drhoSum[iAtom];
       }
       // we when get called with -1, we'll ignore drhoSum
-      drhoSum[iAtom] = 0;
+      ctx.drhoSum[iAtom] = 0;
     }
-    rhoAtomsChanged.clear();
+    ctx.rhoAtomsChanged.clear();
   }
   if (doEwald) {
-    for (int i=0; i<(int)sFac.size(); i++) {
+    for (int i=0; i<(int)ctx.dsFacMolecule.size(); i++) {
       // by the time we get to processAtom(+1), we have
       // the difference.  just use that
       if (coeff==1) {
-        sFac[i] += dsFacMolecule[i];
+        sFac[i] += ctx.dsFacMolecule[i];
       }
-      dsFacMolecule[i] = 0;
+      ctx.dsFacMolecule[i] = 0;
     }
+    // the trial contribution is now the molecule's current one
+    int iMolecule = ctx.fourierMolecule;
+    if (coeff==1 && iMolecule>=0 && iMolecule<(int)sFacMoleculeState.size()) {
+      copy(ctx.sFacMoleculeNew.begin(), ctx.sFacMoleculeNew.end(), sFacMolecule.begin()+iMolecule*ctx.sFacMoleculeNew.size());
+      sFacMoleculeState[iMolecule] = 1;
+    }
+    ctx.fourierMolecule = -1;
   }
 }
 
 void PotentialMaster::computeOne(const int iAtom, double &u1) {
-  duAtomSingle = true;
+  computeOne(context, iAtom, u1);
+}
+
+void PotentialMaster::computeOne(PotentialContext& ctx, const int iAtom, double &u1) {
+  checkContext(ctx);
+  computeOneAt(ctx, iAtom, box.getAtomPosition(iAtom), u1);
+}
+
+void PotentialMaster::computeOneAt(PotentialContext& ctx, const int iAtom, const double *ri, double &u1) {
+  checkPairTable();
+  ctx.duAtomSingle = true;
   u1 = 0;
-  uAtomsChanged.resize(1);
-  duAtom.resize(1);
-  uAtomsChanged[0] = iAtom;
-  duAtom[0] = 0;
-  if (embeddingPotentials && rhoAtomsChanged.size()==0) {
+  ctx.uAtomsChanged.resize(1);
+  ctx.duAtom.resize(1);
+  ctx.uAtomsChanged[0] = iAtom;
+  ctx.duAtom[0] = 0;
+  if (embeddingPotentials && ctx.rhoAtomsChanged.size()==0) {
     // if we called oldEnergy for this atom, then it will already be in the list
-    rhoAtomsChanged.push_back(iAtom);
+    ctx.rhoAtomsChanged.push_back(iAtom);
   }
   int iMolecule = 0, iFirstAtom = 0, iSpecies = 0;
   if (!pureAtoms && !rigidMolecules) {
     box.getMoleculeInfoAtom(iAtom, iMolecule, iSpecies, iFirstAtom);
   }
-  const double *ri = box.getAtomPosition(iAtom);
-  computeOneInternal(iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, true);
+  computeOneInternal(ctx, iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, true);
   if (doSingleTruncationCorrection) {
     u1 += computeOneTruncationCorrection(iAtom);
   }
 }
 
-void PotentialMaster::computeOneInternal(const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+template<class PF, bool doEmbed, bool molecular, bool duSingle>
+void PotentialMaster::computeOneInternalT(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
   vector<int> *iBondedAtoms = nullptr;
-  if (!pureAtoms && !rigidMolecules) {
+  if (molecular && !rigidMolecules) {
     iBondedAtoms = &bondedAtoms[iSpecies][iAtom-iFirstAtom];
   }
   int iType = box.getAtomType(iAtom);
   double* iCutoffs = pairCutoffs[iType];
   Potential** iPotentials = pairPotentials[iType];
   int numAtoms = box.getNumAtoms();
-  double iRhoCutoff = embeddingPotentials ? rhoCutoffs[iType] : 0;
+  double iRhoCutoff = doEmbed ? rhoCutoffs[iType] : 0;
   double zero[3];
   zero[0] = zero[1] = zero[2] = 0;
-  Potential* iRhoPotential = embeddingPotentials ? rhoPotentials[iType] : nullptr;
+  Potential* iRhoPotential = doEmbed ? rhoPotentials[iType] : nullptr;
   for (int jAtom=0; jAtom<numAtoms; jAtom++) {
     if (jAtom==iAtom) continue;
-    if (checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
+    if (molecular && checkSkip(jAtom, iSpecies, iMolecule, iBondedAtoms)) continue;
     int jType = box.getAtomType(jAtom);
-    Potential* pij = iPotentials[jType];
-    if (!pij) continue;
+    if (!iPotentials[jType]) continue;
     double *rj = box.getAtomPosition(jAtom);
     double dr[3];
     for (int k=0; k<3; k++) dr[k] = rj[k]-ri[k];
     box.nearestImage(dr);
-    handleComputeOne(pij, zero, dr, zero, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, false);
+    handleComputeOne<PF,doEmbed,duSingle>(ctx, iType*numAtomTypes+jType, zero, dr, zero, iAtom, jAtom, u1, iCutoffs[jType], iRhoCutoff, iRhoPotential, iType, jType, false);
   }
-  if (embeddingPotentials) {
+  if (doEmbed) {
     // we just computed new rhoSum[iAtom].  now subtract the old one
-    drhoSum[iAtom] -= rhoSum[iAtom];
-    u1 += embedF[iType]->f(rhoSum[iAtom] + drhoSum[iAtom]);
+    ctx.drhoSum[iAtom] -= rhoSum[iAtom];
+    u1 += embedF[iType]->f(rhoSum[iAtom] + ctx.drhoSum[iAtom]);
   }
 }
 
+template<class PF>
+void PotentialMaster::computeOneInternalF(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+  COMPUTE_ONE_DISPATCH(PF, computeOneInternalT, (ctx, iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, onlyAtom));
+}
+
+void PotentialMaster::computeOneInternal(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom) {
+  PAIR_FUNCTOR_DISPATCH(pairTable.kind, computeOneInternalF, (ctx, iAtom, ri, u1, iSpecies, iMolecule, iFirstAtom, onlyAtom));
+}
+
 void PotentialMaster::computeOneMolecule(int iMolecule, double &u1) {
-  duAtomMulti = true;
+  computeOneMolecule(context, iMolecule, u1);
+}
+
+void PotentialMaster::computeOneMolecule(PotentialContext& ctx, int iMolecule, double &u1) {
+  checkContext(ctx);
+  ctx.duAtomMulti = true;
   int numAtoms = box.getNumAtoms();
   u1 = 0;
-  uAtomsChanged.resize(0);
-  if ((int)duAtom.size() < numAtoms) {
-    int s = duAtom.size();
-    duAtom.resize(numAtoms);
-    fill(duAtom.begin()+s, duAtom.end(), 0);
+  ctx.uAtomsChanged.resize(0);
+  if ((int)ctx.duAtom.size() < numAtoms) {
+    int s = ctx.duAtom.size();
+    ctx.duAtom.resize(numAtoms);
+    fill(ctx.duAtom.begin()+s, ctx.duAtom.end(), 0);
   }
   int iSpecies, iMoleculeInSpecies, firstAtom, lastAtom;
   box.getMoleculeInfo(iMolecule, iSpecies, iMoleculeInSpecies, firstAtom, lastAtom);
   for (int iAtom=firstAtom; iAtom<=lastAtom; iAtom++) {
-    if (duAtom[iAtom] == 0) {
-      uAtomsChanged.push_back(iAtom);
+    if (ctx.duAtom[iAtom] == 0) {
+      ctx.uAtomsChanged.push_back(iAtom);
     }
     double *ri = box.getAtomPosition(iAtom);
-    computeOneInternal(iAtom, ri, u1, iSpecies, iMolecule, firstAtom, false);
+    computeOneInternal(ctx, iAtom, ri, u1, iSpecies, iMolecule, firstAtom, false);
     if (doSingleTruncationCorrection) {
       u1 += computeOneTruncationCorrection(iAtom);
     }
   }
   if (!pureAtoms && !rigidMolecules) {
-    computeOneMoleculeBonds(iSpecies, iMolecule, u1);
+    computeOneMoleculeBonds(ctx, iSpecies, iMolecule, u1);
   }
   if (doEwald) {
-    u1 += oneMoleculeFourierEnergy(iMolecule, false);
+    u1 += oneMoleculeFourierEnergy(ctx, iMolecule, false);
   }
 }
 
 void PotentialMaster::newMolecule(int iSpecies) {
+  kTableValid = false;
   int iMolecule = box.getNumMolecules(iSpecies)-1;
   int firstAtom = box.getFirstAtom(iSpecies, iMolecule);
   int speciesAtoms = speciesList.get(iSpecies)->getNumAtoms();
@@ -973,13 +1510,41 @@ void PotentialMaster::newMolecule(int iSpecies) {
     uAtom[jAtom] = 0;
     numAtomsByType[box.getAtomType(jAtom)]++;
   }
+  if (doEwald && (int)sFacMoleculeState.size() == box.getTotalNumMolecules()-1) {
+    // not part of sFac until the insertion is accepted
+    int g = box.getGlobalMoleculeIndex(iSpecies, iMolecule);
+    const int numK = fExp.size();
+    sFacMoleculeState.insert(sFacMoleculeState.begin()+g, -1);
+    sFacMolecule.insert(sFacMolecule.begin()+g*numK, numK, 0);
+  }
 }
 
 void PotentialMaster::removeMolecule(int iSpecies, int iMolecule) {
+  kTableValid = false;
   int firstAtom = box.getFirstAtom(iSpecies, iMolecule);
   int speciesAtoms = speciesList.get(iSpecies)->getNumAtoms();
   int jMolecule = box.getNumMolecules(iSpecies)-1;
   int jFirstAtom = box.getFirstAtom(iSpecies, jMolecule);
+  if (doEwald && sFacValid && (int)sFacMoleculeState.size() == box.getTotalNumMolecules()) {
+    int gx = box.getGlobalMoleculeIndex(iSpecies, iMolecule);
+    int gj = box.getGlobalMoleculeIndex(iSpecies, jMolecule);
+    const int numK = fExp.size();
+    complex<double>* sx = &sFacMolecule[gx*numK];
+    if (sFacMoleculeState[gx] != -1) {
+      // take the molecule out of sFac
+      if (sFacMoleculeState[gx] == 0) {
+        moleculeStructureFactor(context, firstAtom, firstAtom+speciesAtoms-1, sx);
+      }
+      for (int ik=0; ik<numK; ik++) sFac[ik] -= sx[ik];
+    }
+    // our caller moves the last molecule of the species into the hole
+    if (gj != gx) {
+      copy(sFacMolecule.begin()+gj*numK, sFacMolecule.begin()+(gj+1)*numK, sx);
+      sFacMoleculeState[gx] = sFacMoleculeState[gj];
+    }
+    sFacMolecule.erase(sFacMolecule.begin()+gj*numK, sFacMolecule.begin()+(gj+1)*numK);
+    sFacMoleculeState.erase(sFacMoleculeState.begin()+gj);
+  }
   for (int i=0; i<speciesAtoms; i++) {
     uAtom[firstAtom+i] = uAtom[jFirstAtom+i];
     numAtomsByType[box.getAtomType(firstAtom+i)]--;
@@ -992,6 +1557,54 @@ void PotentialMaster::removeMolecule(int iSpecies, int iMolecule) {
   uAtom.resize(numAtoms-speciesAtoms);
 }
 
+void PotentialMaster::addPermutationCallback(PotentialCallback* pcb) {
+  if (std::find(permutationCallbacks.begin(), permutationCallbacks.end(), pcb) != permutationCallbacks.end()) return;
+  permutationCallbacks.push_back(pcb);
+  pcb->permuteMasters.push_back(this);
+}
+
+void PotentialMaster::removePermutationCallback(PotentialCallback* pcb) {
+  permutationCallbacks.erase(std::remove(permutationCallbacks.begin(), permutationCallbacks.end(), pcb), permutationCallbacks.end());
+  pcb->permuteMasters.erase(std::remove(pcb->permuteMasters.begin(), pcb->permuteMasters.end(), this), pcb->permuteMasters.end());
+}
+
+void PotentialMaster::permuteAtoms(const int* oldIndex) {
+  box.permuteAtoms(oldIndex);
+  kTableValid = false;
+  int numAtoms = box.getNumAtoms();
+  vector<double> tmp(uAtom);
+  for (int iAtom=0; iAtom<numAtoms; iAtom++) uAtom[iAtom] = tmp[oldIndex[iAtom]];
+  if (embeddingPotentials) {
+    tmp.assign(rhoSum, rhoSum+numAtoms);
+    for (int iAtom=0; iAtom<numAtoms; iAtom++) rhoSum[iAtom] = tmp[oldIndex[iAtom]];
+  }
+  if (numForceAtoms >= numAtoms) {
+    // MD integrators hold on to our forces from one step to the next
+    for (int k=0; k<3; k++) {
+      for (int iAtom=0; iAtom<numAtoms; iAtom++) tmp[iAtom] = force[oldIndex[iAtom]][k];
+      for (int iAtom=0; iAtom<numAtoms; iAtom++) force[iAtom][k] = tmp[iAtom];
+    }
+  }
+  // only single-atom molecules are permuted, so molecule i is atom i and
+  // each cached structure factor moves with its atom
+  if (doEwald && (int)sFacMoleculeState.size() == numAtoms) {
+    const int numK = fExp.size();
+    vector<complex<double>> sTmp(sFacMolecule);
+    vector<int> stateTmp(sFacMoleculeState);
+    for (int iAtom=0; iAtom<numAtoms; iAtom++) {
+      int jAtom = oldIndex[iAtom];
+      sFacMoleculeState[iAtom] = stateTmp[jAtom];
+      std::copy(sTmp.begin()+jAtom*numK, sTmp.begin()+(jAtom+1)*numK, sFacMolecule.begin()+iAtom*numK);
+    }
+  }
+  else if (doEwald) {
+    sFacMoleculeState.clear();
+  }
+  for (vector<PotentialCallback*>::iterator it = permutationCallbacks.begin(); it!=permutationCallbacks.end(); it++) {
+    (*it)->atomsPermuted(oldIndex);
+  }
+}
+
 double PotentialMaster::uTotalFromAtoms() {
   double uTot = 0;
   int numAtoms = box.getNumAtoms();
@@ -1019,6 +1632,7 @@ double PotentialMaster::uTotalFromAtoms() {
     for (int iMolecule=0; iMolecule<box.getTotalNumMolecules(); iMolecule++) {
       computeFourierIntramolecular(iMolecule, false, uTot, virialTot);
     }
+    checkStructureFactor();
     double fourierSum = 0;
     for (int ik=0; ik<(int)sFac.size(); ik++) {
       fourierSum += fExp[ik] * (sFac[ik]*conj(sFac[ik])).real();
@@ -6,18 +6,61 @@
 
 #include <vector>
 #include <math.h>
+#include <stdint.h>
 #include <cstddef>
 #include <set>
 #include <algorithm>
 #include <complex>
 #include "box.h"
 #include "potential.h"
+#include "pair-functor.h"
 #include "potential-angle.h"
 #include "potential-molecular.h"
 #include "potential-callback.h"
+#include "fft.h"
 
 using namespace std;
 
+class PairKernelData;
+class PairClusterData;
+class Random;
+
+// calls func<PF, doForces, doEmbed, molecular, doCallbacks> args for the
+// features configured for this call.  embedding potentials are only used for
+// atomic systems and do not take pair callbacks.
+#define COMPUTE_ALL_DISPATCH(PF, func, doForces, args) \
+  if (embeddingPotentials) { \
+    if (doForces) func<PF,true,true,false,false> args; \
+    else func<PF,false,true,false,false> args; \
+  } \
+  else { \
+    switch ((doForces?4:0) + (pureAtoms?0:2) + (pairCallbacks.size()>0?1:0)) { \
+      case 0: func<PF,false,false,false,false> args; break; \
+      case 1: func<PF,false,false,false,true> args; break; \
+      case 2: func<PF,false,false,true,false> args; break; \
+      case 3: func<PF,false,false,true,true> args; break; \
+      case 4: func<PF,true,false,false,false> args; break; \
+      case 5: func<PF,true,false,false,true> args; break; \
+      case 6: func<PF,true,false,true,false> args; break; \
+      default: func<PF,true,false,true,true> args; \
+    } \
+  }
+
+// calls func<PF, doEmbed, molecular, duSingle> args for computeOne
+#define COMPUTE_ONE_DISPATCH(PF, func, args) \
+  if (embeddingPotentials) { \
+    if (ctx.duAtomSingle) func<PF,true,false,true> args; \
+    else func<PF,true,false,false> args; \
+  } \
+  else { \
+    switch ((pureAtoms?0:2) + (ctx.duAtomSingle?1:0)) { \
+      case 0: func<PF,false,false,false> args; break; \
+      case 1: func<PF,false,false,true> args; break; \
+      case 2: func<PF,false,true,false> args; break; \
+      default: func<PF,false,true,true> args; \
+    } \
+  }
+
 class EmbedF {
   public:
     EmbedF() {}
@@ -49,17 +92,38 @@ class CellManager {
     double range;
     double boxHalf[3];
     int numCells[3];
-    vector<int> cellNextAtom;
     vector<int> atomCell;
-    vector<int> cellLastAtom;
+    // atoms sorted by cell: those in cell c are cellAtoms[cellStart[c]] up to
+    // cellAtoms[cellEnd[c]-1].  slots from cellEnd[c] to cellStart[c+1] are
+    // free for atoms moving into the cell.
+    vector<int> cellStart, cellEnd, cellAtoms;
+    // position of each atom in cellAtoms
+    vector<int> atomSlot;
+    // sortCells splits the atoms among the pool's tasks; taskCellCount[t]
+    // holds the atoms of task t's block in each cell, then where they go
+    vector<vector<int> > taskCellCount;
+    vector<int> taskCellOffset;
     int jump[3];
     vector<int> cellOffsets;
     vector<int> wrapMap;
     double** rawBoxOffsets;
     int numRawBoxOffsets;
     vector<double*> boxOffsets;
+    // index of each cell's box offset in rawBoxOffsets
+    vector<int> boxOffsetIndex;
+    // index of the zero offset in rawBoxOffsets
+    int zeroBoxOffset;
+    // halo mode: periodic images of atoms near the faces are ghost atoms,
+    // numbered after the real atoms, so pair loops can use them directly
+    bool halo;
+    vector<int> ghostAtom, ghostImage;
+    // ghost for each (atom, image), at iAtom*numRawBoxOffsets+image; -1 if none
+    vector<int> atomGhost;
+    // cells sorted along a Morton (Z-order) curve
+    vector<int> cellOrder;
     int wrappedIndex(int i, int nc);
     void moveAtomIndex(int oldIndex, int newIndex);
+    void sortCells();
 
     CellManager(const SpeciesList &sl, Box& box, int cRange);
     ~CellManager();
@@ -72,6 +136,46 @@ class CellManager {
     void assignCells();
     int cellForCoord(const double *r);
     int* getNumCells();
+    // order of the atoms along the Morton curve through the cells (atom
+    // oldIndex[i] goes to i); atoms of multi-atom molecules stay put
+    void mortonOrder(vector<int> &oldIndex);
+    void setHalo(bool doHalo);
+    // drops all ghosts; they are created again as the neighbors are found
+    void clearGhosts();
+    // index of the given image of iAtom, making a ghost for it if needed
+    int ghostIndex(int iAtom, int image);
+    int getNumGhosts() {return ghostAtom.size();}
+    // coordinates of the ghosts from those of the real atoms (structure of
+    // arrays, ghosts after the numAtoms real atoms)
+    void copyGhosts(double** x, int numAtoms);
+    // adds forces and energies accumulated on ghosts to their owners
+    void foldGhosts(double** f, double* u, int numAtoms);
+};
+
+/**
+ * Trial state of computeOne and computeOneMolecule (and the oldEnergy
+ * methods): the changes to atom energies, densities (with embedding) and
+ * the structure factor (with Ewald) that processAtomU applies.  The
+ * PotentialMaster has its own for the methods called without one.  Threads
+ * evaluating energies at the same time each need their own, and the
+ * configuration must not change meanwhile.
+ */
+class PotentialContext {
+  public:
+    vector<double> duAtom;
+    bool duAtomSingle, duAtomMulti;
+    vector<int> uAtomsChanged;
+    vector<int> rhoAtomsChanged;
+    vector<double> drhoSum;
+    vector<complex<double>> dsFacMolecule;
+    // the molecule's charges and exp(i k_a r_a) for its charged atoms
+    vector<double> qMolecule;
+    vector<double> eikRe[3], eikIm[3];
+    // contribution to sFac of fourierMolecule at its trial position, which
+    // processAtomU(1) caches
+    vector<complex<double>> sFacMoleculeNew;
+    int fourierMolecule;
+    PotentialContext() : duAtomSingle(false), duAtomMulti(false), fourierMolecule(-1) {}
 };
 
 class PotentialMaster {
@@ -85,19 +189,27 @@ class PotentialMaster {
     double *rhoCutoffs;
     Box& box;
     vector<double> uAtom;
-    vector<double> duAtom;
-    bool duAtomSingle, duAtomMulti;
-    vector<int> uAtomsChanged;
+    // trial state for the methods called without a context
+    PotentialContext context;
     double** force;
-    int numForceAtoms, numRhoSumAtoms;
+    // aligned force arrays matching the box's SoA coordinates
+    double* forceSoA[3];
+    int numForceAtoms, numForceSoAAtoms, numRhoSumAtoms;
     double* rhoSum;
     double* idf;
     vector<double> rdrho;
-    vector<int> rhoAtomsChanged;
-    vector<double> drhoSum;
 
     vector<PotentialCallback*> pairCallbacks;
+    // callbacks holding per-atom state, told when atoms are permuted
+    vector<PotentialCallback*> permutationCallbacks;
     const int numAtomTypes;
+    PairTable pairTable;
+    // Potential::getChangeCount() when pairTable was last updated
+    unsigned long pairTableChangeCount;
+    // refreshes pairTable if any potential changed since it was built
+    void checkPairTable() {
+      if (pairTableChangeCount != Potential::getChangeCount()) updatePairTable();
+    }
     // one vector<vector<int*>> for each species
     // each species has a list of bonded pairs for each potential
     vector<vector<int*> > *bondedPairs;
@@ -112,15 +224,61 @@ class PotentialMaster {
     double* charges;
     double kBasis[3];
     double kCut, alpha;
-    complex<double> *sFacAtom;
-    vector<complex<double>> sFac;
-    vector<complex<double>> eik[3];
-    vector<complex<double>> dsFacMolecule;
+    // the k vectors (half space, within kCut) used by the direct sum, their
+    // indices, and fExp = 2 exp(-k^2/4 alpha^2)/k^2, along with the charged
+    // atoms and their charges.  setEwald, setCharge, updateVolume, inserting
+    // or removing a molecule and permuteAtoms invalidate it; it is also
+    // rebuilt if the box size or number of atoms changes.
+    bool kTableValid;
+    double kTableBoxSize[3];
+    int kTableNumAtoms;
+    int kTableMax[3];
+    vector<int> kTableIndex;
+    vector<double> kTableVec;
     vector<double> fExp;
+    vector<complex<double>> sFac;
+    // the charged atoms and their charges (built with the k table), then
+    // exp(i k_a r_a) for them (indexed k*numCharged + i) and their
+    // contributions to the current sFac
+    vector<int> chargedAtoms;
+    vector<double> chargedQ;
+    vector<double> eikRe[3], eikIm[3];
+    // per-task scratch (nq for each task) and the results of the direct sum
+    vector<double> sFacAtomRe, sFacAtomIm, xyRe, xyIm;
+    vector<double> fourierForce[3];
+    vector<double> fourierSumK;
+    // tasks for the direct sum (0 for one per ThreadPool thread)
+    int fourierTasks;
+    // each molecule's contribution to sFac (numK for each), so that MC
+    // trials need only compute the contribution at the new position.
+    // sFacMoleculeState is 1 if the cached value is current, 0 if it needs
+    // to be recomputed and -1 if the molecule is not part of sFac (a trial
+    // insertion).
+    vector<complex<double>> sFacMolecule;
+    vector<int> sFacMoleculeState;
     bool doEwald;
+    // false after a mesh computeAll; the single-molecule Fourier energies
+    // need sFac from the direct sum
+    bool sFacValid;
+    // smooth particle-mesh Ewald (Essmann et al.), used by computeAll when
+    // pmeOrder (the B-spline order) is nonzero
+    int pmeOrder;
+    int pmeMesh[3];
+    double pmeBoxSize[3];
+    FFT3D* pmeFFT;
+    // 1/|b(m)|^2 for each dimension
+    vector<double> pmeBSP[3];
+    // influence function on the half spectrum
+    vector<double> pmeG;
+    vector<double> pmeQ;
+    vector<complex<double>> pmeQk;
+    // spline weights and derivatives, 3*pmeOrder for each charged atom
+    vector<double> pmeTheta, pmeDTheta;
+    // first mesh point (in each dimension) for each charged atom
+    vector<int> pmeIndex;
     double minR2;
 
-    void computeOneMoleculeBonds(const int iSpecies, const int iMolecule, double &u1);
+    void computeOneMoleculeBonds(PotentialContext& ctx, const int iSpecies, const int iMolecule, double &u1);
     void handleOneBondPair(bool doForces, double &uTot, int iAtom, int jAtom, Potential* p);
     void handleOneBondAngleTriplet(bool doForces, double &uTot, int iAtom, int jAtom, int kATom, PotentialAngle* p);
     void computeAllBonds(bool doForces, double &uTot);
@@ -134,7 +292,8 @@ class PotentialMaster {
       if (rigidMolecules) return true;
       return binary_search(iBondedAtoms->begin(), iBondedAtoms->end(), jAtom-jFirstAtom);
     }
-    void handleComputeAll(int iAtom, int jAtom, const double *ri, const double *rj, const double *jbo, Potential* pij, double &ui, double &uj, double* fi, double* fj, double& uTot, double& virialTot, const double rc2, Potential* iRhoPotential, const double iRhoCutoff, const int iType, const int jType, const bool doForces, const bool skipIntra) {
+    template<class PF, bool doForces, bool doEmbed, bool doCallbacks>
+    void handleComputeAll(int iAtom, int jAtom, const double *ri, const double *rj, const double *jbo, const int ijPair, double &ui, double &uj, double* fi, double* fj, double& uTot, double& virialTot, const double rc2, Potential* iRhoPotential, const double iRhoCutoff, const int iType, const int jType, const bool skipIntra, double *rhoi, double *rhoj, vector<double> &rdrhoT) {
       double dr[3];
       dr[0] = (rj[0]+jbo[0])-ri[0];
       dr[1] = (rj[1]+jbo[1])-ri[1];
@@ -142,14 +301,16 @@ class PotentialMaster {
       double r2 = dr[0]*dr[0] + dr[1]*dr[1] + dr[2]*dr[2];
       if (r2 < rc2 && (!skipIntra || r2 > minR2)) {
         double u, du, d2u;
-        pij->u012(r2, u, du, d2u);
+        PF::u012(pairTable, ijPair, r2, u, du, d2u);
         ui += 0.5*u;
         uj += 0.5*u;
 
         uTot += u;
         virialTot += du;
-        for (vector<PotentialCallback*>::iterator it = pairCallbacks.begin(); it!=pairCallbacks.end(); it++) {
-          (*it)->pairCompute(iAtom, jAtom, dr, u, du, d2u);
+        if (doCallbacks) {
+          for (vector<PotentialCallback*>::iterator it = pairCallbacks.begin(); it!=pairCallbacks.end(); it++) {
+            (*it)->pairCompute(iAtom, jAtom, dr, u, du, d2u);
+          }
         }
 
         // f0 = dr du / r^2
@@ -166,32 +327,32 @@ class PotentialMaster {
           fj[2] -= x;
         }
       }
-      if (embeddingPotentials) {
+      if (doEmbed) {
         if (r2 < iRhoCutoff) {
           double rho, drho, d2rho;
           iRhoPotential->u012(r2, rho, drho, d2rho);
-          rhoSum[iAtom] += rho;
-          rdrho.push_back(drho);
+          *rhoi += rho;
+          rdrhoT.push_back(drho);
           //if (iAtom==0||jAtom==0) printf("%d %d %f %f\n", iAtom, jAtom, sqrt(r2), drho);
           if (jType == iType) {
-            rhoSum[jAtom] += rho;
+            *rhoj += rho;
           }
           else if (r2 < rhoCutoffs[jType]) {
             rhoPotentials[jType]->u012(r2, rho, drho, d2rho);
-            rhoSum[jAtom] += rho;
-            rdrho.push_back(drho);
+            *rhoj += rho;
+            rdrhoT.push_back(drho);
           }
         }
         else if (r2 < rhoCutoffs[jType]) {
           double rho, drho, d2rho;
           rhoPotentials[jType]->u012(r2, rho, drho, d2rho);
-          rhoSum[jAtom] += rho;
-          rdrho.push_back(drho);
+          *rhoj += rho;
+          rdrhoT.push_back(drho);
           //if (iAtom==0||jAtom==0) printf("%d %d %f %f\n", iAtom, jAtom, sqrt(r2), drho);
         }
       }
     }
-    void handleComputeAllEmbed(const int iAtom, const int jAtom, const int iType, const int jType, const double *ri, const double *rj, const double *jbo, const double df, double &virialTot, Potential* iRhoPotential, double iRhoCutoff, int &rdrhoIdx) {
+    void handleComputeAllEmbed(const int iAtom, const int jAtom, const int iType, const int jType, const double *ri, const double *rj, const double *jbo, const double df, double &virialTot, Potential* iRhoPotential, double iRhoCutoff, const vector<double> &rdrhoT, int &rdrhoIdx, double *fi, double *fj) {
       double dr[3];
       dr[0] = (rj[0]+jbo[0])-ri[0];
       dr[1] = (rj[1]+jbo[1])-ri[1];
@@ -201,121 +362,151 @@ class PotentialMaster {
       if (r2 < iRhoCutoff) {
         // if rij < cutoff for rhoi, then we have a force
         if (iType==jType) {
-          double fac = (df + idf[jAtom]) * rdrho[rdrhoIdx];
+          double fac = (df + idf[jAtom]) * rdrhoT[rdrhoIdx];
           rdrhoIdx++;
           virialTot += fac;
           fac /= r2;
           //if (iAtom==0||jAtom==0) printf("go %d %d  %f %f  %f %f  %f\n", iAtom, jAtom, sqrt(r2), rdrho[rdrhoIdx], df, idf[jAtom], fac);
           for (int k=0; k<3; k++) {
             double fk = dr[k] * fac;
-            force[iAtom][k] += fk;
-            force[jAtom][k] -= fk;
+            fi[k] += fk;
+            fj[k] -= fk;
           }
         }
         else {
-          double fac = df * rdrho[rdrhoIdx];
+          double fac = df * rdrhoT[rdrhoIdx];
           rdrhoIdx++;
           if (r2 < rhoCutoffs[jAtom]) {
-            fac += idf[jAtom] * rdrho[rdrhoIdx];
+            fac += idf[jAtom] * rdrhoT[rdrhoIdx];
             rdrhoIdx++;
           }
           virialTot += fac;
           fac /= r2;
           for (int k=0; k<3; k++) {
             double fk = dr[k] * fac;
-            force[iAtom][k] += fk;
-            force[jAtom][k] -= fk;
+            fi[k] += fk;
+            fj[k] -= fk;
           }
         }
       }
       else if (r2 < rhoCutoffs[jType]) {
         // if rij < cutoff for rhoi, then we have a force
-        double fac = idf[jAtom] * rdrho[rdrhoIdx];
+        double fac = idf[jAtom] * rdrhoT[rdrhoIdx];
         rdrhoIdx++;
         virialTot += fac;
         fac /= r2;
         for (int k=0; k<3; k++) {
           double fk = dr[k] * fac;
-          force[iAtom][k] += fk;
-          force[jAtom][k] -= fk;
+          fi[k] += fk;
+          fj[k] -= fk;
         }
       }
     }
-    void handleOldEmbedding(const double *ri, const double *rj, const double *jbo, const int jAtom, double& uTot, const int jType) {
+    void handleOldEmbedding(PotentialContext& ctx, const double *ri, const double *rj, const double *jbo, const int jAtom, double& uTot, const int jType) {
       double dx = ri[0]-(rj[0]+jbo[0]);
       double dy = ri[1]-(rj[1]+jbo[1]);
       double dz = ri[2]-(rj[2]+jbo[2]);
       double r2 = dx*dx + dy*dy + dz*dz;
       if (r2 < rhoCutoffs[jType]) {
-        rhoAtomsChanged.push_back(jAtom);
+        ctx.rhoAtomsChanged.push_back(jAtom);
         double rho = rhoPotentials[jType]->u(r2);
-        drhoSum[jAtom] = -rho;
+        ctx.drhoSum[jAtom] = -rho;
         // we need to compute the old energy of the system with and without iAtom
         uTot -= embedF[jType]->f(rhoSum[jAtom]-rho);
         uTot += embedF[jType]->f(rhoSum[jAtom]);
         //printf("%d %d %f  %e %e   %e %e  %e\n", iAtom, jAtom, r2, rhoSum[jAtom], rho, embedF[jType]->f(rhoSum[jAtom]), embedF[jType]->f(rhoSum[jAtom]-rho), embedF[jType]->f(rhoSum[jAtom])-embedF[jType]->f(rhoSum[jAtom]-rho));
       }
     }
-    void handleComputeOne(Potential* pij, const double *ri, const double *rj, const double* jbo, const int iAtom, const int jAtom, double& uTot, double rc2, const double iRhoCutoff, Potential* iRhoPotential, const int iType, const int jType, const bool skipIntra) {
+    template<class PF, bool doEmbed, bool duSingle>
+    void handleComputeOne(PotentialContext& ctx, const int ijPair, const double *ri, const double *rj, const double* jbo, const int iAtom, const int jAtom, double& uTot, double rc2, const double iRhoCutoff, Potential* iRhoPotential, const int iType, const int jType, const bool skipIntra) {
       double dx = ri[0]-(rj[0]+jbo[0]);
       double dy = ri[1]-(rj[1]+jbo[1]);
       double dz = ri[2]-(rj[2]+jbo[2]);
       double r2 = dx*dx + dy*dy + dz*dz;
       if (r2 < rc2 && (!skipIntra || r2 > minR2)) {
-        double uij = pij->u(r2);
-        if (duAtomSingle) {
-          uAtomsChanged.push_back(jAtom);
-          duAtom[0] += 0.5*uij;
-          duAtom.push_back(0.5*uij);
+        double uij = PF::u(pairTable, ijPair, r2);
+        if (duSingle) {
+          ctx.uAtomsChanged.push_back(jAtom);
+          ctx.duAtom[0] += 0.5*uij;
+          ctx.duAtom.push_back(0.5*uij);
         }
         else {
-          if (duAtom[jAtom] == 0) {
-            uAtomsChanged.push_back(jAtom);
+          if (ctx.duAtom[jAtom] == 0) {
+            ctx.uAtomsChanged.push_back(jAtom);
           }
-          duAtom[iAtom] += 0.5*uij;
-          duAtom[jAtom] += 0.5*uij;
+          ctx.duAtom[iAtom] += 0.5*uij;
+          ctx.duAtom[jAtom] += 0.5*uij;
         }
         uTot += uij;
       }
-      if (embeddingPotentials) {
+      if (doEmbed) {
         if (r2 < iRhoCutoff) {
           double rho = iRhoPotential->u(r2);
-          drhoSum[iAtom] += rho;
+          ctx.drhoSum[iAtom] += rho;
           if (iType == jType) {
-            if (drhoSum[jAtom] == 0) {
-              rhoAtomsChanged.push_back(jAtom);
+            if (ctx.drhoSum[jAtom] == 0) {
+              ctx.rhoAtomsChanged.push_back(jAtom);
             }
             // we need the energy of the configuration with the atom in the new spot
             // minus the energy with no atom
-            uTot += embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]+rho);
-            uTot -= embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]);
+            uTot += embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]+rho);
+            uTot -= embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]);
             // drhoSum will hold new-old
             // processAtom(+1) handles this and we should be done
             // we'll be called again and recompute rho for the old config
             // for processAtom(-1), we ignore drhoSum since it was already handled
-            drhoSum[jAtom] += rho;
+            ctx.drhoSum[jAtom] += rho;
           }
           else if (r2 < rhoCutoffs[jType]) {
             double rho = rhoPotentials[jType]->u(r2);
-            if (drhoSum[jAtom] == 0) rhoAtomsChanged.push_back(jAtom);
-            uTot += embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]+rho);
-            uTot -= embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]);
-            drhoSum[jAtom] += rho;
+            if (ctx.drhoSum[jAtom] == 0) ctx.rhoAtomsChanged.push_back(jAtom);
+            uTot += embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]+rho);
+            uTot -= embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]);
+            ctx.drhoSum[jAtom] += rho;
           }
         }
         else if (r2 < rhoCutoffs[jType]) {
           double rho = rhoPotentials[jType]->u(r2);
-          if (drhoSum[jAtom] == 0) rhoAtomsChanged.push_back(jAtom);
-          uTot += embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]+rho);
-          uTot -= embedF[jType]->f(rhoSum[jAtom]+drhoSum[jAtom]);
-          drhoSum[jAtom] += rho;
+          if (ctx.drhoSum[jAtom] == 0) ctx.rhoAtomsChanged.push_back(jAtom);
+          uTot += embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]+rho);
+          uTot -= embedF[jType]->f(rhoSum[jAtom]+ctx.drhoSum[jAtom]);
+          ctx.drhoSum[jAtom] += rho;
         }
       }
     }
-    virtual void computeOneInternal(const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
-    virtual double oldEmbeddingEnergy(int iAtom);
+    virtual void computeOneInternal(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF>
+    void computeOneInternalF(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF, bool doEmbed, bool molecular, bool duSingle>
+    void computeOneInternalT(PotentialContext& ctx, const int iAtom, const double *ri, double &u1, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF>
+    void computeAllPairsF(const bool doForces, double &uTot, double &virialTot);
+    template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+    void computeAllPairs(double &uTot, double &virialTot);
+    virtual double oldEmbeddingEnergy(PotentialContext& ctx, int iAtom);
     void computeAllFourier(const bool doForces, double &uTot, double &virialTot);
-    double oneMoleculeFourierEnergy(int iMolecule, bool oldEnergy);
+    void computeFourierDirect(const bool doForces, double &uTot, double &virialTot);
+    void setupKTable();
+    // rebuilds the k table and charged atoms if they are out of date
+    void checkKTable();
+    // sFac (and fExp |sFac|^2) for k from ik0 up to ik1 and/or the forces on
+    // charged atoms i0 up to i1, using task t's scratch
+    void fourierKernel(const int ik0, const int ik1, const int i0, const int i1, const int t, const bool doSums, const bool doForces, const double coeff);
+    void setupPME();
+    // spline weights for charged atoms n0 up to n1
+    void pmeSplines(const int n0, const int n1);
+    // spreads every charge onto mesh planes x0 up to x1
+    void pmeSpread(const int x0, const int x1);
+    // forces on charged atoms n0 up to n1 from the convolved mesh
+    void pmeGather(const int n0, const int n1, const double coeff);
+    void computeFourierPME(const bool doForces, double &uTot, double &virialTot);
+    // recomputes sFac if the last computeAll used the mesh
+    void checkStructureFactor();
+    double oneMoleculeFourierEnergy(PotentialContext& ctx, int iMolecule, bool oldEnergy);
+    // puts the molecule's contribution to sFac into s, using ctx for scratch
+    void moleculeStructureFactor(PotentialContext& ctx, int iFirstAtom, int iLastAtom, complex<double>* s);
+    // makes room in ctx for all the atoms
+    void checkContext(PotentialContext& ctx);
     void computeFourierIntramolecular(int iMolecule, bool doForces, double &uTot, double &virialTot);
     double computeVirialIntramolecular();
 
@@ -324,8 +515,15 @@ class PotentialMaster {
     virtual ~PotentialMaster();
     Box& getBox();
     void setDoTruncationCorrection(bool doCorrection);
+    // forces from the last computeAll that took them
+    double** getForces() {return force;}
     void setDoSingleTruncationCorrection(bool doCorrection);
     virtual void setPairPotential(int iType, int jType, Potential* pij);
+    // the pair loops work from a copy of each pair potential's parameters
+    // (cutoff, truncation, Ewald table).  the compute methods call this
+    // whenever a potential has changed since the copy was made; changes must
+    // not be made while other threads are computing.
+    virtual void updatePairTable();
     virtual void setRhoPotential(int jType, Potential* rhoj);
     virtual void setEmbedF(int iType, EmbedF* Fi);
     void setBondPotential(int iSpecies, vector<int*> &bondedPairs, Potential *pBond);
@@ -336,41 +534,92 @@ class PotentialMaster {
     virtual void computeOne(const int iAtom, double &energy);
     // energy of one molecule with the whole box (including itself)
     virtual void computeOneMolecule(int iMolecule, double &energy);
+    // the same, keeping the trial state in ctx, so that several threads can
+    // evaluate at once (each with its own context)
+    void computeOne(PotentialContext& ctx, const int iAtom, double &energy);
+    void computeOneMolecule(PotentialContext& ctx, int iMolecule, double &energy);
+    // energy iAtom would have at ri (inside the box), leaving it where it is
+    void computeOneAt(PotentialContext& ctx, const int iAtom, const double *ri, double &energy);
     virtual void updateAtom(int iAtom) {}
     virtual void newMolecule(int iSpecies);
     virtual void removeMolecule(int iSpecies, int iMolecule);
     double oldEnergy(int iAtom);
     double oldMoleculeEnergy(int iAtom);
-    virtual double oldIntraMoleculeEnergyLS(int iAtom, int iLastAtom) {return 0;}
+    double oldEnergy(PotentialContext& ctx, int iAtom);
+    double oldMoleculeEnergy(PotentialContext& ctx, int iMolecule);
+    virtual double oldIntraMoleculeEnergyLS(PotentialContext& ctx, int iAtom, int iLastAtom) {return 0;}
     void resetAtomDU();
     void processAtomU(int coeff);
+    // these change the atom energies, so only one thread may call them
+    void resetAtomDU(PotentialContext& ctx);
+    void processAtomU(PotentialContext& ctx, int coeff);
     void addCallback(PotentialCallback* pcb);
+    // callbacks with callPermute are added when passed to computeAll; others
+    // with per-atom state can be added here
+    void addPermutationCallback(PotentialCallback* pcb);
+    void removePermutationCallback(PotentialCallback* pcb);
+    // moves atom oldIndex[i] to index i, along with our per-atom state and
+    // that of the permutation callbacks
+    virtual void permuteAtoms(const int* oldIndex);
     virtual double uTotalFromAtoms();
     void setCharge(int iType, double charge);
     void setEwald(double kCut, double alpha);
-    virtual void updateVolume() {}
+    // reciprocal space from a smooth particle-mesh Ewald of the given
+    // B-spline order (>=3) instead of the direct sum over k within kCut.
+    // The mesh resolves all of those k (oversampled by 1.5), and a higher
+    // order gives a more accurate energy; 6 gives ~1e-5 relative error in
+    // the Fourier energy.  The direct sum is faster for small boxes.
+    // Single-molecule energies still use the direct structure factor,
+    // which the first of them after computeAll rebuilds (so that one must
+    // not run concurrently with others).  They differ from the mesh by its
+    // error, so IntegratorMC starts from the direct energy on reset.
+    void setEwald(double kCut, double alpha, int pmeOrder);
+    int getPMEOrder() const {return pmeOrder;}
+    bool getDoEwald() const {return doEwald;}
+    bool getDoEmbed() const {return embeddingPotentials;}
+    // number of ThreadPool tasks for the k-space sum or the mesh; 0 (the
+    // default) gives one per thread.  The results don't depend on it.
+    void setFourierTasks(int numTasks) {fourierTasks = numTasks;}
+    virtual void updateVolume();
 };
 
 class PotentialMasterCell : public PotentialMaster {
   protected:
     CellManager cellManager;
     const int cellRange;
-    const vector<int> &cellNextAtom;
     const vector<int> &atomCell;
-    const vector<int> &cellLastAtom;
+    const vector<int> &cellStart, &cellEnd, &cellAtoms, &atomSlot;
     const vector<int> &cellOffsets;
     const vector<int> &wrapMap;
     const vector<double*> &boxOffsets;
     bool lsNeeded;
 
-    virtual void computeOneInternal(const int iAtom, const double *ri, double &energy, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
-    virtual double oldEmbeddingEnergy(int iAtom);
+    virtual void computeOneInternal(PotentialContext& ctx, const int iAtom, const double *ri, double &energy, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF>
+    void computeOneInternalF(PotentialContext& ctx, const int iAtom, const double *ri, double &energy, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF, bool doEmbed, bool molecular, bool duSingle>
+    void computeOneInternalT(PotentialContext& ctx, const int iAtom, const double *ri, double &energy, const int iSpecies, const int iMolecule, const int iFirstAtom, const bool onlyAtom);
+    template<class PF>
+    void computeAllPairsF(const bool doForces, double &uTot, double &virialTot);
+    template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+    void computeAllPairs(double &uTot, double &virialTot);
+    virtual double oldEmbeddingEnergy(PotentialContext& ctx, int iAtom);
+    // checkerboard sweeps: the interior cells of each color, and for each
+    // task the uAtom changes (atom, du) from its accepted trials, the
+    // changes from its current trial, and its sums (du, chi, trials, accepted)
+    vector<vector<int> > colorCells;
+    vector<vector<int> > sweepAtoms, trialAtoms;
+    vector<vector<double> > sweepDU, trialDU;
+    vector<double> sweepSums;
+    void colorCheckerboard();
+    template<class PF>
+    void sweepCells(const vector<int> &cells, const int c0, const int c1, const int t, const double stepSize, const double temperature, Random& rand);
 
   public:
     PotentialMasterCell(const SpeciesList &speciesList, Box& box, bool doEmbed, int cellRange);
     ~PotentialMasterCell();
     virtual double getRange();
-    virtual void setPairPotential(int iType, int jType, Potential* pij);
+    virtual void updatePairTable();
     // needs to be called at startup and any time the box size changes
     virtual void init();
     virtual void computeAll(vector<PotentialCallback*> &callbacks);
@@ -378,43 +627,200 @@ class PotentialMasterCell : public PotentialMaster {
     virtual void newMolecule(int iSpecies);
     virtual void removeAtom(int iAtom);
     virtual void removeMolecule(int iSpecies, int iMolecule);
-    virtual double oldIntraMoleculeEnergyLS(int iAtom, int iLastAtom);
+    virtual double oldIntraMoleculeEnergyLS(PotentialContext& ctx, int iAtom, int iLastAtom);
     int* getNumCells();
     virtual void updateVolume();
+    // one sweep of single-atom displacement trials, run on the thread pool.
+    // the atoms are shifted by a random vector (and back afterwards) so the
+    // cell boundaries move, and the cells are colored so that cells of the
+    // same color are out of range of each other.  the colors are taken in
+    // random order and the cells of each color are split among the tasks,
+    // task t using taskRandom[t].  each cell gets as many trials as it has
+    // atoms, each on a random atom of the cell; moves that leave the cell
+    // are rejected.  uAtom is brought up to date after each color.  only for
+    // fully periodic atomic systems without embedding or Ewald.
+    // returns the energy change.
+    double sweepCheckerboard(double stepSize, double temperature, Random& random, vector<Random*> &taskRandom, long &numTrials, long &numAccepted, double &chiSum);
+};
+
+/**
+ * Where the neighbors in the lists land in the per-task arrays of a
+ * threaded computeAll.  Task t owns items (atoms or clusters) start[t] up
+ * to start[t+1]-1; its arrays hold those items followed by halo[t], the
+ * (sorted) items outside the block that its rows reach.  slot[j] is the
+ * index of the neighbor of list entry j within its task's arrays.
+ */
+class ThreadSlots {
+  public:
+    // tasks the slots were built for; 0 when out of date
+    int numTasks;
+    vector<int> start;
+    vector<vector<int> > halo;
+    vector<int> slot;
+    ThreadSlots() : numTasks(0) {}
+    int numSlots(int t) const {return start[t+1] - start[t] + halo[t].size();}
 };
 
 class PotentialMasterList : public PotentialMasterCell {
   protected:
     double nbrRange;
-    int **nbrs;
     bool onlyUpNbrs; // standard MD only needs up.  MC or DMD needs down
-    int *numAtomNbrsUp, *numAtomNbrsDn;
     int nbrsNumAtoms;
-    int maxNab;
-    double ***nbrBoxOffsets;
+    // up neighbors of atom i are nbrAtoms[nbrStart[i]] .. nbrAtoms[nbrStart[i+1]-1],
+    // with the image of each given as an index into cellManager.rawBoxOffsets
+    int *nbrStart, *nbrAtoms;
+    unsigned char *nbrImages;
+    int numNbrs, nbrCapacity;
+    // down neighbors, in the same layout (without images)
+    int *nbrDnStart, *nbrDnAtoms;
+    int nbrDnCapacity;
     double **oldAtomPositions;
     double safetyFac;
     double *maxR2, *maxR2Unsafe;
+    int kernelLevel;
+    // cluster-pair list, built from the clusters' bounding boxes (at the
+    // positions the lists were built for) when clusterSize > 0.  the atoms
+    // of cell c are in slots cellSlotStart[c] .. cellSlotStart[c+1]-1, so
+    // the clusters touching a cell are consecutive.
+    int clusterSize;
+    int numClusters, clusterSlots;
+    int *clusterAtoms, *atomClusterSlot, *clusterTypes;
+    double *clusterX[3], *clusterF[3], *clusterU;
+    int *clusterPairStart, *clusterPairCluster;
+    double **clusterPairOffsets;
+    uint64_t *clusterPairMask;
+    int numClusterPairs, maxClusterPairs;
+    vector<int> cellSlotStart;
+    // min x, y, z then max x, y, z of each cluster
+    vector<double> clusterBox;
+    // reset() finds the tiles of a block of i clusters on each task.  the
+    // threaded computeAllClusters gives each task a block of i clusters
+    // (split by tiles) and copies of those and its halo clusters: x, y, z,
+    // u, fx, fy, fz, each of clusterSize doubles per slot, in
+    // threadClusterData[t] (and the types in threadClusterTypes[t]).
+    vector<vector<int> > threadPairCluster;
+    vector<vector<double*> > threadPairOffsets;
+    vector<vector<uint64_t> > threadPairMask;
+    ThreadSlots clusterTaskSlots;
+    vector<double*> threadClusterData;
+    vector<int*> threadClusterTypes;
+    vector<int> threadClusterCapacity;
+    // in halo mode, the up lists again with each periodic image replaced by
+    // a ghost atom, and coordinates, types, forces and energies of the real
+    // atoms followed by the ghosts
+    int *nbrHaloAtoms;
+    bool haloNbrs;
+    int haloCapacity;
+    int *haloTypes;
+    double *haloX[3], *haloF[3], *haloU;
+    // our own SoA copy of the coordinates, for boxes that don't keep one
+    double *packX[3];
+    int packCapacity;
+    // atoms from numOwnedAtoms on are ghosts owned by another domain; pairs
+    // of two ghosts are left out of the lists
+    int numOwnedAtoms;
+    // atoms are put in Morton order every reorderInterval rebuilds
+    int reorderInterval, reorderCountdown;
+    vector<int> reorderIndex;
+    // computeAll splits the atoms into one task per ThreadPool thread,
+    // task t taking atoms threadStart[t] up to threadStart[t+1]-1.  each
+    // task sums energies, forces and densities into its own arrays, which
+    // only cover its block and halo (see ThreadSlots); atomSlots is for the
+    // lists and ghostSlots for the halo-mode (ghost) lists.  only the halos
+    // need to be added across tasks.  splitTasks is the number of tasks
+    // threadStart was made for.
+    int numThreads, splitTasks;
+    vector<int> threadStart;
+    ThreadSlots atomSlots, ghostSlots;
+    vector<vector<double> > threadU, threadF, threadRho, threadRdrho, threadX;
+    vector<vector<int> > threadTypes;
+    vector<double> threadSums;
+    // reset() builds the lists with the same tasks, each building the rows
+    // of a block of atoms into its own arrays.  buildDnNbrs counts down
+    // neighbors by slot.
+    vector<vector<int> > threadNbrAtoms, threadDnCount;
+    vector<vector<unsigned char> > threadNbrImages;
+    vector<int> threadNbrOffset;
 
-    int checkNbrPair(int iAtom, int jAtom, const bool skipIntra, double *ri, double *rj, double rc2, double minR2, double *jbo);
+    void checkNbrPair(int jAtom, const bool skipIntra, const double *ri, const double *rj, double rc2, double minR2, const double *jbo, int image, vector<int> &tAtoms, vector<unsigned char> &tImages);
+    void buildNbrRows(int iStart, int iEnd, vector<int> &tAtoms, vector<unsigned char> &tImages);
+    void buildDnNbrs();
+    template<class PF>
+    void computeAllPairsF(const bool doForces, double &uTot, double &virialTot);
+    template<class PF, bool doForces, bool doEmbed, bool molecular, bool doCallbacks>
+    void computeAllPairs(double &uTot, double &virialTot);
+    template<class PF, bool doForces, bool doEmbed, bool doCallbacks>
+    void computeAllPairsRange(int iStart, int iEnd, const int *slots, double *u, double *f, double *rho, vector<double> &rdrhoT, double &uTot, double &virialTot);
+    void computeAllEmbedRange(int iStart, int iEnd, const int *slots, const vector<double> &rdrhoT, double *f, double &virialTot);
+    template<class PF, bool doForces, bool halo>
+    void computeAllSoA(double &uTot, double &virialTot);
+    template<class PF, bool doForces, bool halo>
+    void computeAllSoARange(const PairKernelData &d, double &uTot, double &virialTot);
+    void syncThreads();
+    void splitThreads();
+    void buildSlots(ThreadSlots &s, const int *rowStart, const int *entries);
+    void checkSlots(ThreadSlots &s, const int *jAtoms);
+    template<class A>
+    void reduceSlots(const ThreadSlots &s, const vector<A> &src, int block, int n, double *dst, int numAll);
+    void buildClusters();
+    void buildClusterRows(int c0, int c1, vector<int> &tCluster, vector<double*> &tOffsets, vector<uint64_t> &tMask);
+    uint64_t clusterPairBits(int iCluster, int jCluster, const double *jbo, bool self);
+    void buildHalo();
+    template<class PF, bool doForces>
+    void computeAllClusters(double &uTot, double &virialTot);
+    template<class PF, bool doForces>
+    void computeAllClustersRange(const PairClusterData &d, double &uTot, double &virialTot);
   public:
     PotentialMasterList(const SpeciesList& speciesList, Box& box, bool doEmbed, int cellRange, double nbrRange);
     ~PotentialMasterList();
     virtual double getRange();
+    virtual void updatePairTable();
     virtual void init();
     void reset();
     void setDoDownNbrs(bool doDown);
+    // use the given vectorized pair kernel (PAIR_KERNEL_*) when the pair
+    // potentials allow it.  defaults to the best one the CPU supports.
+    void setKernelLevel(int level);
+    // group atoms into clusters of 4 or 8 and evaluate pair potentials over
+    // dense cluster-pair tiles (0 turns this off).  takes effect at the next
+    // reset.  embedding potentials and pair callbacks use the atom lists.
+    void setClusterSize(int size);
+    // store periodic images of atoms as ghost atoms so that pair loops need
+    // no box offsets.  takes effect at the next reset.
+    void setHalo(bool doHalo);
+    // every interval neighbor list rebuilds, renumber atoms along a
+    // space-filling curve through the cells (0 turns this off).  callbacks
+    // with per-atom state need callPermute (or addPermutationCallback).
+    void setReorderInterval(int interval);
+    // the box's atoms were replaced wholesale.  atoms from numOwned on are
+    // ghost copies of atoms owned by another domain; pairs of two ghosts
+    // are left out.  the lists are rebuilt at the next reset; the force
+    // array is kept (and grown) for the caller to refill.
+    void atomsReplaced(int numOwned);
+    // whether an (owned) atom has moved far enough to need new lists
+    bool needsNbrUpdate();
     void checkUpdateNbrs();
     virtual void computeAll(vector<PotentialCallback*> &callbacks);
 };
 
 class PotentialMasterVirial : public PotentialMaster {
+  protected:
+    template<class PF>
+    void computeAtomsT(const int* iAtoms, const int nAtoms, double &energy);
+    template<class PF>
+    void computeMoleculesT(const int* iMolecules, const int nMolecules, double &energy);
+    template<class PF>
+    void computePairsT(const int iType, const int jType, const double* r2, const int n, double* u);
+
   public:
     PotentialMasterVirial(const SpeciesList &speciesList, Box& box);
     virtual ~PotentialMasterVirial() {}
     // inter-molecular energy of a group of molecules
     void computeMolecules(const int* iMolecules, const int nMolecules, double &energy);
     void computeAtoms(const int* iAtoms, const int nAtoms, double &energy);
+    // energies u[k] of n pairs of atoms of types iType and jType, given
+    // their squared distances r2[k]
+    void computePairs(const int iType, const int jType, const double* r2, const int n, double* u);
     void computeAll(vector<PotentialCallback*> &callbacks);
     double uTotalFromAtoms();
 };
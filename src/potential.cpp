@@ -6,9 +6,12 @@
 #include <math.h>
 #include <stdlib.h>
 #include "potential.h"
+#include "ewald-table.h"
 #include "alloc2d.h"
 #include "util.h"
 
+std::atomic<unsigned long> Potential::changeCount(0);
+
 Potential::Potential(int tt, double rc) : truncType(tt), rCut(rc), correctTruncation(true) {
   init();
 }
@@ -18,6 +21,7 @@ Potential::Potential() : truncType(TRUNC_SIMPLE), rCut(3) {
 }
 
 void Potential::init() {
+  noteChange();
   uShift = 0;
   ufShift = 0;
   if (truncType == TRUNC_SHIFT) {
@@ -41,6 +45,7 @@ int Potential::getTruncationType() {
 
 void Potential::setCorrectTruncation(bool doCorrection) {
   correctTruncation = doCorrection;
+  noteChange();
 }
 
 void Potential::setCutoff(double rc) {
@@ -126,6 +131,14 @@ void PotentialLJ::u012TC(double &u, double &du, double &d2u) {
   d2u = 4*M_PI*4*epsilon*12*(13*sc12/(12-3) - 0.5*7*sc6/(6-3))*rc3;
 }
 
+void PotentialLJ::getPairParams(PairParams &p) {
+  p.kind = PAIR_LJ;
+  p.epsilon = epsilon;
+  p.sigma2 = sigma2;
+  p.uShift = uShift;
+  p.ufShift = ufShift;
+}
+
 PotentialSS::PotentialSS(double e, int p, int tt, double rc) : Potential(tt, rc), epsilon(e), exponent(p) {
   init();
 }
@@ -182,7 +195,7 @@ double PotentialSS::ur(double r) {
 
 double PotentialSS::u(double r2) {
   double u = epsrpow(r2) + uShift;
-  if (ufShift!=0) u += uShift*sqrt(r2);
+  if (ufShift!=0) u += ufShift*sqrt(r2);
   return u;
 }
 
@@ -227,6 +240,14 @@ void PotentialSS::u012TC(double &u, double &du, double &d2u) {
   d2u = y;
 }
 
+void PotentialSS::getPairParams(PairParams &p) {
+  p.kind = PAIR_SS;
+  p.epsilon = epsilon;
+  p.exponent = exponent;
+  p.uShift = uShift;
+  p.ufShift = ufShift;
+}
+
 PotentialSSfloat::PotentialSSfloat(double e, double p, int tt, double rc) : Potential(tt, rc), epsilon(e), exponent(p) {
   init();
 }
@@ -238,7 +259,7 @@ double PotentialSSfloat::ur(double r) {
 
 double PotentialSSfloat::u(double r2) {
   double u = epsrpow(r2) + uShift;
-  if (ufShift!=0) u += uShift*sqrt(r2);
+  if (ufShift!=0) u += ufShift*sqrt(r2);
   return u;
 }
 
@@ -316,7 +337,7 @@ double PotentialSSfloatTab::ur(double r) {
 
 double PotentialSSfloatTab::u(double r2) {
   double u = epsrpow(r2)/rpInterp(r2) + uShift;
-  if (ufShift!=0) u += uShift*sqrt(r2);
+  if (ufShift!=0) u += ufShift*sqrt(r2);
   return u;
 }
 
@@ -388,12 +409,37 @@ void PotentialHS::u012(double r2, double &u, double &du, double &d2u) {
   du = d2u = 0;
 }
 
-PotentialEwald::PotentialEwald(Potential& p2, double a, double qq, double rc) : Potential(TRUNC_SIMPLE, rc), p(p2), qiqj(qq), alpha(a), twoosqrtpi(2.0/sqrt(M_PI)) {
+void PotentialHS::getPairParams(PairParams &p) {
+  p.kind = PAIR_HS;
+  p.sigma2 = sigma2;
+}
+
+// real-space Ewald kernel for unit charges, from the table if there is one
+static inline void ewald012(const EwaldTable* table, double alpha, double r2, double &u, double &du, double &d2u) {
+  if (table) table->u012(r2, u, du, d2u);
+  else EwaldTable::exact(alpha, r2, u, du, d2u);
+}
+
+static void checkEwaldTable(const EwaldTable* t, double alpha) {
+  if (t && t->getAlpha() != alpha) {
+    fprintf(stderr, "Ewald table alpha %f doesn't match potential alpha %f\n", t->getAlpha(), alpha);
+    abort();
+  }
+}
+
+PotentialEwald::PotentialEwald(Potential& p2, double a, double qq, double rc) : Potential(TRUNC_SIMPLE, rc), p(p2), qiqj(qq), alpha(a), table(nullptr) {
 }
 
 PotentialEwald::~PotentialEwald() {}
 
+void PotentialEwald::setTable(const EwaldTable* t) {
+  checkEwaldTable(t, alpha);
+  table = t;
+  noteChange();
+}
+
 double PotentialEwald::ur(double r) {
+  if (table) return qiqj*table->u(r*r) + p.ur(r);
   return qiqj*erfc(alpha*r)/r + p.ur(r);
 }
 
@@ -403,55 +449,83 @@ double PotentialEwald::u(double r2) {
 }
 
 double PotentialEwald::du(double r2) {
-  double r = sqrt(r2);
-  return -qiqj * (twoosqrtpi * exp(-alpha*alpha*r2) *alpha + erfc(alpha*r)/r) + p.du(r2);
+  double uq, duq, d2uq;
+  ewald012(table, alpha, r2, uq, duq, d2uq);
+  return qiqj*duq + p.du(r2);
 }
 
 double PotentialEwald::d2u(double r2) {
-  double r = sqrt(r2);
-  return -qiqj * (twoosqrtpi * exp(-alpha*alpha*r2) *(alpha*(1 - alpha*alpha*2*r)) + erfc(alpha*r)/r) + p.du(r2);
+  double uq, duq, d2uq;
+  ewald012(table, alpha, r2, uq, duq, d2uq);
+  return qiqj*d2uq + p.d2u(r2);
 }
 
 void PotentialEwald::u012(double r2, double &u, double &du, double &d2u) {
   double pu, pdu, pd2u;
   p.u012(r2, pu, pdu, pd2u);
-  double r = sqrt(r2);
-  double uq = qiqj*erfc(alpha*r)/r;
-  u = uq + pu;
-  double dexp = qiqj*twoosqrtpi * exp(-alpha*alpha*r2) * alpha;
-  du = -dexp - uq + pdu;
-  d2u = -dexp * (1 - alpha*alpha*2*r) - uq + pd2u;
+  double uq, duq, d2uq;
+  ewald012(table, alpha, r2, uq, duq, d2uq);
+  u = qiqj*uq + pu;
+  du = qiqj*duq + pdu;
+  d2u = qiqj*d2uq + pd2u;
+}
+
+void PotentialEwald::getPairParams(PairParams &pp) {
+  p.getPairParams(pp);
+  if (pp.kind != PAIR_LJ) {
+    pp.kind = PAIR_VIRTUAL;
+    return;
+  }
+  pp.kind = PAIR_LJ_EWALD;
+  pp.qiqj = qiqj;
+  pp.alpha = alpha;
+  pp.ewaldTable = table;
 }
 
-PotentialEwaldBare::PotentialEwaldBare(double a, double qq, double rc) : Potential(TRUNC_SIMPLE, rc), qiqj(qq), alpha(a), twoosqrtpi(2.0/sqrt(M_PI)) {
+PotentialEwaldBare::PotentialEwaldBare(double a, double qq, double rc) : Potential(TRUNC_SIMPLE, rc), qiqj(qq), alpha(a), table(nullptr) {
 }
 
 PotentialEwaldBare::~PotentialEwaldBare() {}
 
+void PotentialEwaldBare::setTable(const EwaldTable* t) {
+  checkEwaldTable(t, alpha);
+  table = t;
+  noteChange();
+}
+
 double PotentialEwaldBare::ur(double r) {
+  if (table) return qiqj*table->u(r*r);
   return qiqj*erfc(alpha*r)/r;
 }
 
 double PotentialEwaldBare::u(double r2) {
+  if (table) return qiqj*table->u(r2);
   double r = sqrt(r2);
-  return ur(r);
+  return qiqj*erfc(alpha*r)/r;
 }
 
 double PotentialEwaldBare::du(double r2) {
-  double r = sqrt(r2);
-  return -qiqj * (twoosqrtpi * exp(-alpha*alpha*r2) *alpha + erfc(alpha*r)/r);
+  double uq, duq, d2uq;
+  ewald012(table, alpha, r2, uq, duq, d2uq);
+  return qiqj*duq;
 }
 
 double PotentialEwaldBare::d2u(double r2) {
-  double r = sqrt(r2);
-  return -qiqj * (twoosqrtpi * exp(-alpha*alpha*r2) *(alpha*(1 - alpha*alpha*2*r)) + erfc(alpha*r)/r);
+  double uq, duq, d2uq;
+  ewald012(table, alpha, r2, uq, duq, d2uq);
+  return qiqj*d2uq;
 }
 
 void PotentialEwaldBare::u012(double r2, double &u, double &du, double &d2u) {
-  double r = sqrt(r2);
-  double uq = qiqj*erfc(alpha*r)/r;
-  u = uq;
-  double derfc = -qiqj*twoosqrtpi * exp(-alpha*alpha*r2) * alpha;
-  du = derfc - uq;
-  d2u = derfc * (1 - alpha*alpha*2*r) - uq;
+  ewald012(table, alpha, r2, u, du, d2u);
+  u *= qiqj;
+  du *= qiqj;
+  d2u *= qiqj;
+}
+
+void PotentialEwaldBare::getPairParams(PairParams &p) {
+  p.kind = PAIR_EWALD;
+  p.qiqj = qiqj;
+  p.alpha = alpha;
+  p.ewaldTable = table;
 }
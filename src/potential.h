@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <atomic>
 
 #define TRUNC_NONE 0
 #define TRUNC_SIMPLE 1
@@ -13,12 +14,37 @@
 #define TRUNC_SHIFT 3
 #define TRUNC_FORCE_SHIFT 4
 
+// kinds of pair potential that PotentialMaster can evaluate with an inlined
+// functor (see pair-functor.h) instead of a virtual call
+#define PAIR_VIRTUAL 0
+#define PAIR_LJ 1
+#define PAIR_SS 2
+#define PAIR_HS 3
+#define PAIR_EWALD 4
+#define PAIR_LJ_EWALD 5
+
+class EwaldTable;
+
+class PairParams {
+  public:
+    int kind;
+    double epsilon, sigma2, uShift, ufShift;
+    int exponent;
+    double qiqj, alpha;
+    // tabulated Ewald kernel, or nullptr for the exact one
+    const EwaldTable* ewaldTable;
+    PairParams() : kind(PAIR_VIRTUAL), epsilon(0), sigma2(0), uShift(0), ufShift(0), exponent(0), qiqj(0), alpha(0), ewaldTable(nullptr) {}
+};
+
 class Potential {
   protected:
     int truncType;
     double uShift, ufShift;
     double rCut;
     bool correctTruncation;
+    static std::atomic<unsigned long> changeCount;
+    // subclasses call this when a parameter PairParams reports changes
+    static void noteChange() {changeCount++;}
   public:
     Potential();
     Potential(int tt, double rc);
@@ -30,6 +56,12 @@ class Potential {
     virtual double d2u(double r2) {return 0;}
     virtual void u012(double r2, double &u, double &du, double &d2u);
     virtual void u012TC(double &u, double &du, double &d2u) {u=du=d2u=0;}
+    // subclasses that override u012 must also override this (or leave the
+    // kind as PAIR_VIRTUAL)
+    virtual void getPairParams(PairParams &p) {p.kind = PAIR_VIRTUAL;}
+    // bumped whenever any potential changes, so that a PotentialMaster can
+    // tell that its pair table is stale
+    static unsigned long getChangeCount() {return changeCount;}
     void setCutoff(double rc);
     void setCorrectTruncation(bool doCorrection);
     double getCutoff();
@@ -49,6 +81,7 @@ class PotentialLJ: public Potential {
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
     virtual void u012TC(double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p);
 };
 
 class PotentialSS: public Potential {
@@ -65,6 +98,7 @@ class PotentialSS: public Potential {
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
     virtual void u012TC(double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p);
 };
 
 class PotentialSSfloat: public Potential {
@@ -108,6 +142,7 @@ class PotentialSSfloatTab: public PotentialSS {
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
     void u012TC(double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p) {p.kind = PAIR_VIRTUAL;}
 };
 
 class PotentialWCA: public PotentialLJ {
@@ -128,13 +163,14 @@ class PotentialHS: public Potential {
     double du(double r2);
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p);
 };
 
 class PotentialEwaldBare : public Potential {
   private:
     const double qiqj;
     const double alpha;
-    const double twoosqrtpi;
+    const EwaldTable* table;
   public:
     PotentialEwaldBare(double alpha, double qiqj, double rc);
     virtual ~PotentialEwaldBare();
@@ -143,6 +179,9 @@ class PotentialEwaldBare : public Potential {
     double du(double r2);
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p);
+    // use a tabulated kernel (with the same alpha), or nullptr for erfc
+    void setTable(const EwaldTable* t);
 };
 
 class PotentialEwald : public Potential {
@@ -150,7 +189,7 @@ class PotentialEwald : public Potential {
     Potential& p;
     const double qiqj;
     const double alpha;
-    const double twoosqrtpi;
+    const EwaldTable* table;
   public:
     PotentialEwald(Potential& p2, double alpha, double qiqj, double rc);
     virtual ~PotentialEwald();
@@ -159,4 +198,7 @@ class PotentialEwald : public Potential {
     double du(double r2);
     double d2u(double r2);
     void u012(double r2, double &u, double &du, double &d2u);
+    virtual void getPairParams(PairParams &p);
+    // use a tabulated kernel (with the same alpha), or nullptr for erfc
+    void setTable(const EwaldTable* t);
 };
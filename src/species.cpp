@@ -45,8 +45,12 @@ double* Species::getAtomPosition(int iAtom) {
   return positions[iAtom];
 }
 
-// This could (almost) be static
 double* Species::getMoleculeCOM(Box& box, int iFirstAtom, int iLastAtom) {
+  getMoleculeCOM(box, iFirstAtom, iLastAtom, com);
+  return com;
+}
+
+void Species::getMoleculeCOM(Box& box, int iFirstAtom, int iLastAtom, double* com) {
   com[0] = com[1] = com[2] = 0;
   double totMass = 0;
   double *r0 = box.getAtomPosition(iFirstAtom);
@@ -66,7 +70,6 @@ double* Species::getMoleculeCOM(Box& box, int iFirstAtom, int iLastAtom) {
     }
   }
   for (int k=0; k<3; k++) com[k] /= totMass;
-  return com;
 }
 
 void Species::getMoleculeOrientation(Box& box, int iFirstAtom, double* direction1, double* direction2) {
@@ -32,6 +32,10 @@ class Species {
     int* getAtomTypes();
     int getNumAtoms();
     double* getAtomPosition(int iAtom);
+    // returns the COM in com (safe to call from several threads at once)
+    void getMoleculeCOM(Box& box, int iFirstAtom, int iLastAtom, double* com);
+    // same as above, but returns scratch owned by the Species, which is
+    // overwritten by the next call; not for code that may run concurrently
     double* getMoleculeCOM(Box& box, int iFirstAtom, int iLastAtom);
     void getMoleculeOrientation(Box& box, int iFirstAtom, double* direction1, double* direction2);
     virtual vector<RigidConstraint*> getRigidConstraints();
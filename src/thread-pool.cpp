@@ -0,0 +1,165 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "thread-pool.h"
+
+class ThreadPool::Batch {
+  public:
+    const function<void(int)>* f;
+    atomic<int> remaining;
+};
+
+// queue of the current thread; threads outside the pool use queue 0
+static thread_local int myQueue = 0;
+
+// the CPUs we are allowed to run on
+static vector<int> allowedCPUs() {
+  vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return cpus;
+  for (int c=0; c<CPU_SETSIZE; c++) {
+    if (CPU_ISSET(c, &allowed)) cpus.push_back(c);
+  }
+#endif
+  return cpus;
+}
+
+// lets the calling thread run only on the given CPUs
+static void pinThread(const int* cpus, int n) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i=0; i<n; i++) CPU_SET(cpus[i], &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+ThreadPool::ThreadPool() : numThreads(1), pinning(false), pending(0), stopping(false) {
+  queues.push_back(new Queue());
+}
+
+ThreadPool::~ThreadPool() {
+  stopWorkers();
+  for (int q=0; q<(int)queues.size(); q++) delete queues[q];
+}
+
+ThreadPool& ThreadPool::get() {
+  static ThreadPool pool;
+  return pool;
+}
+
+void ThreadPool::setNumThreads(int n) {
+  if (n < 1) {
+    fprintf(stderr, "need at least 1 thread\n");
+    abort();
+  }
+  if (n == numThreads) return;
+  stopWorkers();
+  numThreads = n;
+  startWorkers();
+}
+
+void ThreadPool::setPinning(bool pin) {
+  if (pin == pinning) return;
+  stopWorkers();
+  pinning = pin;
+  if (pinning) cpus = allowedCPUs();
+  startWorkers();
+}
+
+void ThreadPool::startWorkers() {
+  while ((int)queues.size() < numThreads) queues.push_back(new Queue());
+  stopping = false;
+  for (int w=1; w<numThreads; w++) {
+    workers.push_back(thread(&ThreadPool::workerLoop, this, w));
+  }
+}
+
+void ThreadPool::stopWorkers() {
+  {
+    lock_guard<mutex> lk(sleepLock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (vector<thread>::iterator it = workers.begin(); it!=workers.end(); it++) it->join();
+  workers.clear();
+}
+
+// runs one task, taken from the back of queue q or else stolen from the
+// front of another queue.  returns false if there was nothing to do.
+bool ThreadPool::runOne(int q) {
+  Task task;
+  bool found = false;
+  {
+    Queue* mine = queues[q];
+    lock_guard<mutex> lk(mine->lock);
+    if (!mine->tasks.empty()) {
+      task = mine->tasks.back();
+      mine->tasks.pop_back();
+      found = true;
+    }
+  }
+  for (int i=1; !found && i<numThreads; i++) {
+    Queue* victim = queues[(q+i)%numThreads];
+    lock_guard<mutex> lk(victim->lock);
+    if (!victim->tasks.empty()) {
+      task = victim->tasks.front();
+      victim->tasks.pop_front();
+      found = true;
+    }
+  }
+  if (!found) return false;
+  pending--;
+  (*task.batch->f)(task.index);
+  if (--task.batch->remaining == 0) {
+    // the submitter may be waiting; it owns the batch, so don't touch it
+    lock_guard<mutex> lk(sleepLock);
+    wake.notify_all();
+  }
+  return true;
+}
+
+void ThreadPool::workerLoop(int w) {
+  myQueue = w;
+  // the submitting thread (0) is left alone, so worker w takes the w-th CPU
+  if (pinning && !cpus.empty()) pinThread(&cpus[w%cpus.size()], 1);
+  while (true) {
+    if (runOne(w)) continue;
+    unique_lock<mutex> lk(sleepLock);
+    wake.wait(lk, [this]{return stopping || pending > 0;});
+    if (stopping) return;
+  }
+}
+
+void ThreadPool::runBatch(int numTasks, const function<void(int)> &f) {
+  Batch batch;
+  batch.f = &f;
+  batch.remaining = numTasks;
+  // deal the tasks out starting with our own queue; which thread ends up
+  // running a task doesn't matter since tasks know their own number
+  for (int t=0; t<numTasks; t++) {
+    Queue* q = queues[(myQueue+t)%numThreads];
+    lock_guard<mutex> lk(q->lock);
+    q->tasks.push_back({&batch, t});
+  }
+  {
+    lock_guard<mutex> lk(sleepLock);
+    pending += numTasks;
+  }
+  wake.notify_all();
+  // help out (with this batch or any other) until our batch is done,
+  // sleeping while the last of its tasks run elsewhere
+  while (batch.remaining > 0) {
+    if (runOne(myQueue)) continue;
+    unique_lock<mutex> lk(sleepLock);
+    wake.wait(lk, [&]{return batch.remaining == 0 || pending > 0;});
+  }
+}
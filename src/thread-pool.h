@@ -0,0 +1,84 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+using namespace std;
+
+/**
+ * Worker threads shared by all the parallel kernels.  Work is submitted as
+ * a batch of numbered tasks.  Each thread keeps a deque of tasks and idle
+ * threads steal from the others.  The thread submitting a batch works on it
+ * (sleeping once nothing is left to take) until it is done, so tasks can
+ * submit nested batches without starting more threads than the pool has.
+ *
+ * Kernels should pick ranges and per-task buffers by task number (not by
+ * which thread runs it), so that results only depend on the number of
+ * tasks.  taskStart gives the usual split of a range.
+ */
+class ThreadPool {
+  private:
+    class Batch;
+    class Task {
+      public:
+        Batch* batch;
+        int index;
+    };
+    class Queue {
+      public:
+        mutex lock;
+        deque<Task> tasks;
+    };
+    int numThreads;
+    bool pinning;
+    // CPUs the threads are pinned to
+    vector<int> cpus;
+    // queue 0 is for threads outside the pool, queue w for worker w
+    vector<Queue*> queues;
+    vector<thread> workers;
+    atomic<int> pending;
+    bool stopping;
+    mutex sleepLock;
+    condition_variable wake;
+
+    ThreadPool();
+    void startWorkers();
+    void stopWorkers();
+    void workerLoop(int w);
+    bool runOne(int q);
+    void runBatch(int numTasks, const function<void(int)> &f);
+
+  public:
+    ~ThreadPool();
+    // the pool used by everything
+    static ThreadPool& get();
+    // total threads, including the one submitting work (1 by default).
+    // must not be called while work is running.
+    void setNumThreads(int n);
+    int getNumThreads() {return numThreads;}
+    // pin each worker thread to one of the CPUs this process may run on.
+    // the submitting thread keeps its affinity.
+    void setPinning(bool pin);
+    // runs f(t) for t = 0 .. numTasks-1 and waits for all of them
+    template<class F>
+    void run(int numTasks, F f) {
+      if (numThreads == 1 || numTasks == 1) {
+        for (int t=0; t<numTasks; t++) f(t);
+        return;
+      }
+      runBatch(numTasks, function<void(int)>(f));
+    }
+    // first item of task t when n items are split among numTasks tasks
+    static int taskStart(int n, int t, int numTasks) {
+      return (int)((long)n*t/numTasks);
+    }
+};
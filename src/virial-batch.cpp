@@ -0,0 +1,431 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "virial-batch.h"
+#include "pair-kernel.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VIRIAL_BATCH_X86
+#endif
+
+// the ClusterVirial recursion, for nw walkers at once.  the set of bits s
+// and derivative m for walker w is at [(s*(nd+1)+m)*nw+w]
+class ClusterLanes {
+  public:
+    int numMolecules, nd, nw;
+    double beta, prefac;
+    int** binomial;
+    const double *f;
+    double *fQ, *fC, *fA, *fB;
+    double *values;
+};
+
+__attribute__((always_inline))
+static inline void clusterLanes(const ClusterLanes& c) {
+  const int nw = c.nw, nd1 = c.nd+1, nd = c.nd;
+  const int NF = 1 << c.numMolecules;
+  double *fQ = c.fQ, *fC = c.fC, *fA = c.fA, *fB = c.fB;
+#define LANES(a,s,m) (a + ((s)*nd1+(m))*nw)
+
+  int p = 0;
+  for (int iMol1=0; iMol1<c.numMolecules; iMol1++) {
+    int i = 1<<iMol1;
+    for (int w=0; w<nw; w++) LANES(fQ,i,0)[w] = 1;
+    for (int m=1; m<=nd; m++) {
+      for (int w=0; w<nw; w++) LANES(fQ,i,m)[w] = 0;
+    }
+    for (int iMol2=iMol1+1; iMol2<c.numMolecules; iMol2++) {
+      double* q = LANES(fQ,i|(1<<iMol2),0);
+      const double* fp = c.f + p*nw;
+      for (int w=0; w<nw; w++) q[w] = fp[w];
+      p++;
+    }
+  }
+
+  // products over all pairs in each set, and the derivatives from the sum
+  // of the pair energies (which are 0 along with the product)
+  for (int i=3; i<NF; i++) {
+    int j = i & -i;
+    if (i == j) continue;
+    int k = i & ~j;
+    double* q0 = LANES(fQ,i,0);
+    if (k != (k & -k)) {
+      const double* qk = LANES(fQ,k,0);
+      for (int w=0; w<nw; w++) q0[w] = qk[w];
+      for (int l = (j<<1); l<i; l=(l<<1)) {
+        if ((l&i) == 0) continue;
+        const double* ql = LANES(fQ,l|j,0);
+        for (int w=0; w<nw; w++) q0[w] *= ql[w];
+      }
+    }
+    if (nd == 0) continue;
+    double cl[nw];
+    for (int w=0; w<nw; w++) cl[w] = q0[w] > 0 ? log(q0[w])/c.beta : 0;
+    for (int m=1; m<=nd; m++) {
+      double* qm = LANES(fQ,i,m);
+      const double* qm1 = LANES(fQ,i,m-1);
+      for (int w=0; w<nw; w++) qm[w] = qm1[w]*cl[w];
+    }
+  }
+
+  for (int i=1; i<NF; i++) {
+    for (int m=0; m<=nd; m++) {
+      double* cm = LANES(fC,i,m);
+      const double* qm = LANES(fQ,i,m);
+      for (int w=0; w<nw; w++) cm[w] = qm[w];
+    }
+    int iLowBit = i & -i;
+    int inc = iLowBit<<1;
+    for (int j=iLowBit; j<i; j+=inc) {
+      int jComp = i & ~j;
+      while ((j|jComp) != i && j<i) {
+        int jHighBits = j^iLowBit;
+        int jlow = jHighBits & -jHighBits;
+        j += jlow;
+        jComp = (i & ~j);
+      }
+      if (j==i) break;
+      for (int m=0; m<=nd; m++) {
+        double* cm = LANES(fC,i,m);
+        for (int l=0; l<=m; l++) {
+          const double b = c.binomial[m][l];
+          const double* cj = LANES(fC,j,l);
+          const double* qc = LANES(fQ,jComp,m-l);
+          for (int w=0; w<nw; w++) cm[w] -= b * cj[w] * qc[w];
+        }
+      }
+    }
+  }
+
+  for (int i=2; i<NF; i+=2) {
+    for (int m=0; m<=nd; m++) {
+      double* bm = LANES(fB,i,m);
+      const double* cm = LANES(fC,i,m);
+      for (int w=0; w<nw; w++) bm[w] = cm[w];
+    }
+  }
+  for (int m=0; m<=nd; m++) {
+    double* a1 = LANES(fA,1,m);
+    double* b1 = LANES(fB,1,m);
+    const double* c1 = LANES(fC,1,m);
+    for (int w=0; w<nw; w++) {
+      a1[w] = 0;
+      b1[w] = c1[w];
+    }
+  }
+  for (int i=3; i<NF; i+=2) {
+    for (int m=0; m<=nd; m++) {
+      double* am = LANES(fA,i,m);
+      double* bm = LANES(fB,i,m);
+      const double* cm = LANES(fC,i,m);
+      for (int w=0; w<nw; w++) {
+        am[w] = 0;
+        bm[w] = cm[w];
+      }
+    }
+    int ii = i - 1;
+    int iLow2Bit = (ii & -ii);
+    int jBits = 1 | iLow2Bit;
+    if (jBits == i) continue;
+
+    int iii = ii ^ iLow2Bit;
+    int jInc = (iii & -iii);
+    for (int j=jBits; j<i; j+=jInc) {
+      int jComp = (i & ~j);
+      while ((j|jComp) != i && j<i) {
+        int jHighBits = j ^ jBits;
+        int jlow = jHighBits & -jHighBits;
+        j += jlow;
+        jComp = (i & ~j);
+      }
+      if (j==i) break;
+      for (int m=0; m<=nd; m++) {
+        double* am = LANES(fA,i,m);
+        for (int l=0; l<=m; l++) {
+          const double b = c.binomial[m][l];
+          const double* bj = LANES(fB,j,l);
+          const double* cc = LANES(fC,jComp|1,m-l);
+          for (int w=0; w<nw; w++) am[w] += b * bj[w] * cc[w];
+        }
+      }
+    }
+    for (int m=0; m<=nd; m++) {
+      double* bm = LANES(fB,i,m);
+      const double* am = LANES(fA,i,m);
+      for (int w=0; w<nw; w++) bm[w] -= am[w];
+    }
+  }
+
+  for (int v=1; v<c.numMolecules; v++) {
+    int vs1 = 1<<v;
+    for (int i=vs1+1; i<NF; i++) {
+      for (int m=0; m<=nd; m++) {
+        double* am = LANES(fA,i,m);
+        for (int w=0; w<nw; w++) am[w] = 0;
+      }
+
+      if ((i & vs1) == 0) continue;
+      int iLowBit = (i & -i);
+      if (iLowBit == i) continue;
+
+      int jBits, jInc;
+      int ii = i ^ iLowBit;
+      int iLow2Bit = (ii & -ii);
+      bool vLow = iLowBit==vs1 || iLow2Bit==vs1;
+      if (!vLow) {
+        // v is not in the lowest 2 bits; we can only increment by the 2nd lowest
+        jBits = iLowBit | vs1;
+        jInc = iLow2Bit;
+      }
+      else {
+        jBits = iLowBit | iLow2Bit;
+        if (jBits == i) continue;
+        int iii = ii ^ iLow2Bit;
+        jInc = (iii & -iii);
+      }
+      for (int j=jBits; j<i; j+=jInc) {
+        if (!vLow && (j&jBits) != jBits) {
+          j |= vs1;
+          if (j==i) break;
+        }
+        int jComp = i & ~j;
+        while ((j|jComp) != i && j<i) {
+          int jHighBits = j^jBits;
+          int jlow = jHighBits & -jHighBits;
+          j += jlow;
+          if (!vLow) j |= vs1;
+          jComp = (i & ~j);
+        }
+        if (j==i) break;
+        for (int m=0; m<=nd; m++) {
+          double* am = LANES(fA,i,m);
+          for (int l=0; l<=m; l++) {
+            const double b = c.binomial[m][l];
+            const double* bj = LANES(fB,j,l);
+            const double* bc = LANES(fB,jComp|vs1,m-l);
+            const double* ac = LANES(fA,jComp|vs1,m-l);
+            for (int w=0; w<nw; w++) am[w] += b * bj[w] * (bc[w] + ac[w]);
+          }
+        }
+      }
+      for (int m=0; m<=nd; m++) {
+        double* bm = LANES(fB,i,m);
+        const double* am = LANES(fA,i,m);
+        for (int w=0; w<nw; w++) bm[w] -= am[w];
+      }
+    }
+  }
+
+  const double* b0 = LANES(fB,NF-1,0);
+  for (int w=0; w<nw; w++) c.values[w] = c.prefac*b0[w];
+  for (int m=1; m<=nd; m++) {
+    const double* bm = LANES(fB,NF-1,m);
+    double* vm = c.values + m*nw;
+    // derivatives are dropped when the value itself is just roundoff
+    for (int w=0; w<nw; w++) vm[w] = (c.values[w] != 0 && fabs(c.values[w]) < 1.E-12) ? 0 : c.prefac*bm[w];
+  }
+#undef LANES
+}
+
+static void clusterLanesScalar(const ClusterLanes& c) {
+  clusterLanes(c);
+}
+
+#ifdef VIRIAL_BATCH_X86
+__attribute__((target("avx2,fma")))
+static void clusterLanesAVX2(const ClusterLanes& c) {
+  clusterLanes(c);
+}
+#endif
+
+VirialBatch::VirialBatch(PotentialMasterVirial& tpm, PotentialMasterVirial& rpm, Random& r, double temperature, int nd, int nw, double ss) : targetPotentialMaster(tpm), refPotentialMaster(rpm), random(r), beta(1/temperature), nDer(nd), numWalkers(nw), numAtoms(tpm.getBox().getNumAtoms()), numPairs(numAtoms*(numAtoms-1)/2), stepSize(ss), numTrials(0), numAccepted(0), chiSum(0), adjustInterval(100), sink(nullptr), tunable(true) {
+  Box& box = tpm.getBox();
+  if (numAtoms < 2 || box.getTotalNumMolecules() != numAtoms) {
+    fprintf(stderr, "VirialBatch needs at least 2 single-atom molecules\n");
+    abort();
+  }
+  for (int a=1; a<numAtoms; a++) {
+    if (box.getAtomType(a) != box.getAtomType(0)) {
+      fprintf(stderr, "VirialBatch can only handle one atom type\n");
+      abort();
+    }
+  }
+  binomial = new int*[nDer+1];
+  int factorial[(numAtoms>nDer ? numAtoms : nDer)+1];
+  factorial[0] = factorial[1] = 1;
+  for (int m=2; m<=nDer || m<=numAtoms; m++) factorial[m] = m*factorial[m-1];
+  for (int m=0; m<=nDer; m++) {
+    binomial[m] = new int[m+1];
+    for (int l=0; l<=m; l++) {
+      binomial[m][l] = factorial[m]/(factorial[l]*factorial[m-l]);
+    }
+  }
+  prefac = -(numAtoms-1.0)/factorial[numAtoms];
+
+  x = (double*)malloc(numAtoms*3*numWalkers*sizeof(double));
+  xOld = (double*)malloc(3*numWalkers*sizeof(double));
+  movedAtom = (int*)malloc(numWalkers*sizeof(int));
+  r2 = (double*)malloc(numPairs*numWalkers*sizeof(double));
+  u = (double*)malloc(numPairs*numWalkers*sizeof(double));
+  f = (double*)malloc(numPairs*numWalkers*sizeof(double));
+  targetValues = (double*)malloc((nDer+1)*numWalkers*sizeof(double));
+  newTargetValues = (double*)malloc((nDer+1)*numWalkers*sizeof(double));
+  refValues = (double*)malloc(numWalkers*sizeof(double));
+  newRefValues = (double*)malloc(numWalkers*sizeof(double));
+  int nSets = (1<<numAtoms)*(nDer+1)*numWalkers;
+  fQ = (double*)malloc(nSets*sizeof(double));
+  fC = (double*)malloc(nSets*sizeof(double));
+  fA = (double*)malloc(nSets*sizeof(double));
+  fB = (double*)malloc(nSets*sizeof(double));
+  data = (double*)malloc((nDer+2)*sizeof(double));
+
+  for (int a=0; a<numAtoms; a++) {
+    double* ra = box.getAtomPosition(a);
+    for (int k=0; k<3; k++) {
+      for (int w=0; w<numWalkers; w++) x[(a*3+k)*numWalkers+w] = ra[k];
+    }
+  }
+  computeClusters(targetPotentialMaster, nDer, targetValues);
+  computeClusters(refPotentialMaster, 0, refValues);
+}
+
+VirialBatch::~VirialBatch() {
+  for (int m=0; m<=nDer; m++) {
+    delete[] binomial[m];
+  }
+  delete[] binomial;
+  free(x);
+  free(xOld);
+  free(movedAtom);
+  free(r2);
+  free(u);
+  free(f);
+  free(targetValues);
+  free(newTargetValues);
+  free(refValues);
+  free(newRefValues);
+  free(fQ);
+  free(fC);
+  free(fA);
+  free(fB);
+  free(data);
+}
+
+void VirialBatch::setDataSink(DataSink* s) {
+  sink = s;
+}
+
+double VirialBatch::getAcceptance() {
+  if (numTrials==0) return 0;
+  return chiSum/numTrials;
+}
+
+void VirialBatch::getValues(int w, double* values) {
+  for (int m=0; m<=nDer; m++) values[m] = targetValues[m*numWalkers+w];
+}
+
+// cluster values of all walkers for their current coordinates
+void VirialBatch::computeClusters(PotentialMasterVirial& potentialMaster, int nd, double *values) {
+  const int nw = numWalkers;
+  int p = 0;
+  for (int a=0; a<numAtoms; a++) {
+    for (int b=a+1; b<numAtoms; b++) {
+      double* r2p = r2 + p*nw;
+      for (int w=0; w<nw; w++) r2p[w] = 0;
+      for (int k=0; k<3; k++) {
+        const double* xa = x + (a*3+k)*nw;
+        const double* xb = x + (b*3+k)*nw;
+        for (int w=0; w<nw; w++) {
+          double dx = xb[w] - xa[w];
+          r2p[w] += dx*dx;
+        }
+      }
+      p++;
+    }
+  }
+  const int iType = potentialMaster.getBox().getAtomType(0);
+  potentialMaster.computePairs(iType, iType, r2, numPairs*nw, u);
+  for (int k=0; k<numPairs*nw; k++) f[k] = exp(-beta*u[k]);
+
+  ClusterLanes c;
+  c.numMolecules = numAtoms;
+  c.nd = nd;
+  c.nw = nw;
+  c.beta = beta;
+  c.prefac = prefac;
+  c.binomial = binomial;
+  c.f = f;
+  c.fQ = fQ;
+  c.fC = fC;
+  c.fA = fA;
+  c.fB = fB;
+  c.values = values;
+#ifdef VIRIAL_BATCH_X86
+  if (pairKernelLevel() >= PAIR_KERNEL_AVX2) {
+    clusterLanesAVX2(c);
+    return;
+  }
+#endif
+  clusterLanesScalar(c);
+}
+
+void VirialBatch::adjustStepSize() {
+  double avg = chiSum/numTrials;
+  if (avg > 0.5) stepSize *= 1.05;
+  else stepSize /= 1.05;
+  numTrials = numAccepted = 0;
+  chiSum = 0;
+}
+
+void VirialBatch::doSteps(long steps) {
+  const int nw = numWalkers;
+  for (long i=0; i<steps; i++) {
+    if (tunable && numTrials >= adjustInterval*nw) {
+      adjustStepSize();
+    }
+    for (int w=0; w<nw; w++) {
+      int a = random.nextInt(numAtoms-1) + 1;
+      movedAtom[w] = a;
+      for (int k=0; k<3; k++) {
+        double& xk = x[(a*3+k)*nw+w];
+        xOld[k*nw+w] = xk;
+        xk += 2*stepSize*(random.nextDouble32()-0.5);
+      }
+    }
+    computeClusters(targetPotentialMaster, nDer, newTargetValues);
+    computeClusters(refPotentialMaster, 0, newRefValues);
+    numTrials += nw;
+    for (int w=0; w<nw; w++) {
+      double wOld = fabs(targetValues[w]);
+      double wNew = fabs(newTargetValues[w]);
+      // like IntegratorMC, we always leave a configuration with no weight
+      double chi = wNew>wOld ? 1 : wNew/wOld;
+      if (wOld > 0) chiSum += chi;
+      if (wOld > 0 && (chi==0 || (chi<1 && chi<random.nextDouble()))) {
+        int a = movedAtom[w];
+        for (int k=0; k<3; k++) x[(a*3+k)*nw+w] = xOld[k*nw+w];
+        continue;
+      }
+      numAccepted++;
+      for (int m=0; m<=nDer; m++) targetValues[m*nw+w] = newTargetValues[m*nw+w];
+      refValues[w] = newRefValues[w];
+    }
+    if (!sink) continue;
+    for (int m=0; m<nDer+2; m++) data[m] = 0;
+    for (int w=0; w<nw; w++) {
+      double pi = fabs(targetValues[w]);
+      if (pi == 0 || pi == INFINITY || std::isnan(pi)) {
+        fprintf(stderr, "pi is %f\n", pi);
+        abort();
+      }
+      for (int m=0; m<=nDer; m++) data[m] += targetValues[m*nw+w]/pi;
+      data[nDer+1] += refValues[w]/pi;
+    }
+    for (int m=0; m<nDer+2; m++) data[m] /= nw;
+    sink->addData(data);
+  }
+}
@@ -0,0 +1,70 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "potential-master.h"
+#include "random.h"
+#include "data-sink.h"
+
+/**
+ * Direct Mayer sampling (as with MCMoveDisplacementVirial, ClusterVirial
+ * and MeterVirialDirect) of many walkers of the same cluster in lockstep.
+ * Coordinates are kept with the walkers innermost.  Each step, every walker
+ * tries to displace one of its atoms (other than the first); then the pair
+ * energies, Mayer functions and the ClusterVirial recursion are evaluated
+ * for all walkers at once, in loops over the walkers that vectorize (with
+ * AVX2 when the CPU has it), and each walker accepts or rejects its own
+ * move.
+ *
+ * The target and reference potential masters provide the pair potentials
+ * (the reference is a ClusterVirial without derivatives, typically hard
+ * spheres).  All walkers start from the target box's configuration.  Only
+ * single-atom molecules of one atom type are handled.
+ */
+class VirialBatch {
+  protected:
+    PotentialMasterVirial &targetPotentialMaster, &refPotentialMaster;
+    Random& random;
+    const double beta;
+    const int nDer;
+    const int numWalkers, numAtoms, numPairs;
+    int** binomial;
+    double prefac;
+    double stepSize;
+    long numTrials, numAccepted;
+    double chiSum;
+    long adjustInterval;
+    DataSink* sink;
+    // coordinate k of atom a for walker w is x[(a*3+k)*numWalkers+w]
+    double *x;
+    // old coordinates of each walker's moved atom, [k*numWalkers+w]
+    double *xOld;
+    int *movedAtom;
+    // for each atom pair, [p*numWalkers+w]
+    double *r2, *u, *f;
+    // cluster values, [m*numWalkers+w], for the walkers and their trials
+    double *targetValues, *refValues, *newTargetValues, *newRefValues;
+    // recursion work space
+    double *fQ, *fC, *fA, *fB;
+    double *data;
+
+    void computeClusters(PotentialMasterVirial& potentialMaster, int nd, double *values);
+    void adjustStepSize();
+
+  public:
+    bool tunable;
+
+    VirialBatch(PotentialMasterVirial& targetPotentialMaster, PotentialMasterVirial& refPotentialMaster, Random& random, double temperature, int nDer, int numWalkers, double stepSize);
+    ~VirialBatch();
+    // the sink gets MeterVirialDirect's data, averaged over the walkers,
+    // after every step
+    void setDataSink(DataSink* sink);
+    void doSteps(long steps);
+    int getNumWalkers() {return numWalkers;}
+    double getStepSize() {return stepSize;}
+    double getAcceptance();
+    // cluster values of walker w
+    void getValues(int w, double* values);
+};
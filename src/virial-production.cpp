@@ -4,35 +4,73 @@
 
 #include <string.h>
 #include <cmath>
+#include <algorithm>
 #include "virial.h"
 #include "alloc2d.h"
+#include "thread-pool.h"
 
 // perhaps just take Clusters and make Meter and Average internally
 
-VirialProduction::VirialProduction(IntegratorMC &rIntegrator, IntegratorMC &tIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget, double alpha, double ri) : refIntegrator(rIntegrator), targetIntegrator(tIntegrator), refMeter(MeterVirialOverlap(refClusterRef, refClusterTarget, alpha, 0, 1)), targetMeter(MeterVirialOverlap(targetClusterTarget, targetClusterRef, 1/alpha, 0, 1)), refAverage(2, 1, 1000, true), targetAverage(targetClusterTarget.numValues()+1, 1, 1000, true), refPump(refMeter,1,&refAverage), targetPump(targetMeter,1,&targetAverage), idealTargetFraction(0.5), refIntegral(ri), disposed(false), refSteps(0), targetSteps(0) {
-  int numTargets = targetAverage.getNumData();
-  fullStats = (double**)malloc2D(numTargets-1, 2, sizeof(double));
-  fullBCStats = (double**)malloc2D(numTargets-1, numTargets-1, sizeof(double));
+VirialProduction::Walker::Walker(IntegratorMC &rIntegrator, IntegratorMC &tIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget, double alpha) : refIntegrator(rIntegrator), targetIntegrator(tIntegrator), refMeter(MeterVirialOverlap(refClusterRef, refClusterTarget, alpha, 0, 1)), targetMeter(MeterVirialOverlap(targetClusterTarget, targetClusterRef, 1/alpha, 0, 1)), refAverage(2, 1, 1000, true), targetAverage(targetClusterTarget.numValues()+1, 1, 1000, true), refPump(refMeter,1,&refAverage), targetPump(targetMeter,1,&targetAverage), refSteps(0), targetSteps(0) {
   refIntegrator.addListener(&refPump);
   targetIntegrator.addListener(&targetPump);
 }
 
+VirialProduction::VirialProduction(IntegratorMC &rIntegrator, IntegratorMC &tIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget, double alpha, double ri) : mergedRefAverage(2, 1, 1000, true), mergedTargetAverage(targetClusterTarget.numValues()+1, 1, 1000, true), idealTargetFraction(0.5), refIntegral(ri), disposed(false), refSteps(0), targetSteps(0) {
+  walkers.push_back(new Walker(rIntegrator, tIntegrator, refClusterRef, refClusterTarget, targetClusterRef, targetClusterTarget, alpha));
+  refAverage = &walkers[0]->refAverage;
+  targetAverage = &walkers[0]->targetAverage;
+  int numTargets = targetAverage->getNumData();
+  fullStats = (double**)malloc2D(numTargets-1, 2, sizeof(double));
+  fullBCStats = (double**)malloc2D(numTargets-1, numTargets-1, sizeof(double));
+}
+
 VirialProduction::~VirialProduction() {
   dispose();
+  for (vector<Walker*>::iterator it = walkers.begin(); it!=walkers.end(); it++) delete *it;
   free2D((void**)fullStats);
   free2D((void**)fullBCStats);
 }
 
+void VirialProduction::addWalker(IntegratorMC &rIntegrator, IntegratorMC &tIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget) {
+  double alpha = walkers[0]->refMeter.getAlpha()[0];
+  walkers.push_back(new Walker(rIntegrator, tIntegrator, refClusterRef, refClusterTarget, targetClusterRef, targetClusterTarget, alpha));
+  refAverage = &mergedRefAverage;
+  targetAverage = &mergedTargetAverage;
+}
+
 void VirialProduction::dispose() {
   if (disposed) return;
-  refIntegrator.removeListener(&refPump);
-  targetIntegrator.removeListener(&targetPump);
+  for (vector<Walker*>::iterator it = walkers.begin(); it!=walkers.end(); it++) {
+    (*it)->refIntegrator.removeListener(&(*it)->refPump);
+    (*it)->targetIntegrator.removeListener(&(*it)->targetPump);
+  }
   disposed = true;
 }
 
+// merges the averages from scratch.  those with the biggest blocks go first,
+// so that the others can be combined into blocks of that size
+static void mergeAverages(AverageRatio &merged, vector<AverageRatio*> &averages) {
+  std::stable_sort(averages.begin(), averages.end(), [](AverageRatio* a, AverageRatio* b) {return a->getBlockSize() > b->getBlockSize();});
+  merged.reset();
+  for (vector<AverageRatio*>::iterator it = averages.begin(); it!=averages.end(); it++) {
+    merged.mergeBlocks(**it);
+  }
+}
+
+void VirialProduction::mergeWalkers() {
+  vector<AverageRatio*> refAverages, targetAverages;
+  for (vector<Walker*>::iterator it = walkers.begin(); it!=walkers.end(); it++) {
+    refAverages.push_back(&(*it)->refAverage);
+    targetAverages.push_back(&(*it)->targetAverage);
+  }
+  mergeAverages(mergedRefAverage, refAverages);
+  mergeAverages(mergedTargetAverage, targetAverages);
+}
+
 void VirialProduction::analyze() {
-  refStats = refAverage.getStatistics();
-  targetStats = targetAverage.getStatistics();
+  refStats = refAverage->getStatistics();
+  targetStats = targetAverage->getStatistics();
   if (std::isnan(targetStats[0][AVG_ERR])) {
     idealTargetFraction = 1;
     return;
@@ -41,17 +79,17 @@ void VirialProduction::analyze() {
     idealTargetFraction = 0;
     return;
   }
-  int numTargets = targetAverage.getNumData();
-  double alpha = refMeter.getAlpha()[0];
+  int numTargets = targetAverage->getNumData();
+  double alpha = walkers[0]->refMeter.getAlpha()[0];
   alphaStats[0] = refStats[1][AVG_AVG]/targetStats[numTargets-1][AVG_AVG]*alpha;
   alphaStats[1] = alpha*AverageRatio::ratioErr(refStats[1][AVG_AVG], refStats[1][AVG_ERR],
                                targetStats[numTargets-1][AVG_AVG], targetStats[numTargets-1][AVG_ERR], 0);
 
-  refRatioStats = refAverage.getRatioStatistics();
-  targetRatioStats = targetAverage.getRatioStatistics();
-  refBCStats = refAverage.getBlockCorrelation();
-  double **cij = targetAverage.getRatioCorrelation();
-  targetBCStats = targetAverage.getBlockCorrelation();
+  refRatioStats = refAverage->getRatioStatistics();
+  targetRatioStats = targetAverage->getRatioStatistics();
+  refBCStats = refAverage->getBlockCorrelation();
+  double **cij = targetAverage->getRatioCorrelation();
+  targetBCStats = targetAverage->getBlockCorrelation();
   double vd = refRatioStats[0][AVG_AVG];
   double ed = refRatioStats[0][AVG_ERR];
   for (int i=0; i<numTargets-1; i++) {
@@ -70,20 +108,45 @@ void VirialProduction::analyze() {
     }
   }
 
+  updateTargetFraction(refRatioStats[0][AVG_ERR]/fabs(refRatioStats[0][AVG_AVG]), targetRatioStats[0][AVG_ERR]/fabs(targetRatioStats[0][AVG_AVG]));
+}
+
+void VirialProduction::updateTargetFraction(double refErrorRatio, double targetErrorRatio) {
   double oldFrac = ((double)targetSteps)/(targetSteps + refSteps);
-  double refErrorRatio = refRatioStats[0][AVG_ERR]/fabs(refRatioStats[0][AVG_AVG]);
   if (std::isnan(refErrorRatio) || refErrorRatio > 1) refErrorRatio = 1;
-  double targetErrorRatio = targetRatioStats[0][AVG_ERR]/fabs(targetRatioStats[0][AVG_AVG]);
   if (std::isnan(targetErrorRatio) || targetErrorRatio > 1) targetErrorRatio = 1;
   idealTargetFraction = 1.0/(1 + refErrorRatio/targetErrorRatio * sqrt((1-oldFrac)/oldFrac));
 }
 
+void VirialProduction::analyzeWalkers() {
+  double refAvg = 0, refErr2 = 0, targetAvg = 0, targetErr2 = 0;
+  for (vector<Walker*>::iterator it = walkers.begin(); it!=walkers.end(); it++) {
+    if (std::isnan((*it)->targetAverage.getStatistics()[0][AVG_ERR])) {
+      idealTargetFraction = 1;
+      return;
+    }
+    if (std::isnan((*it)->refAverage.getStatistics()[0][AVG_ERR])) {
+      idealTargetFraction = 0;
+      return;
+    }
+    double** r = (*it)->refAverage.getRatioStatistics();
+    double** t = (*it)->targetAverage.getRatioStatistics();
+    refAvg += r[0][AVG_AVG];
+    refErr2 += r[0][AVG_ERR]*r[0][AVG_ERR];
+    targetAvg += t[0][AVG_AVG];
+    targetErr2 += t[0][AVG_ERR]*t[0][AVG_ERR];
+  }
+  // the mean of the walkers' estimates has error sqrt(sum err^2)/nw, so
+  // nw drops out of the relative errors
+  updateTargetFraction(sqrt(refErr2)/fabs(refAvg), sqrt(targetErr2)/fabs(targetAvg));
+}
+
 void VirialProduction::printResults(const char **targetNames) {
-  int numTargets = targetAverage.getNumData();
+  int numTargets = targetAverage->getNumData();
   printf("final reference step fraction: %5.4f\n", 1-idealTargetFraction);
   printf("actual reference step fraction: %5.4f\n", ((double)refSteps)/(refSteps+targetSteps));
-  printf("reference blocks: %ld of size %ld\n", refAverage.getBlockCount(), refAverage.getBlockSize());
-  printf("target blocks: %ld of size %ld\n", targetAverage.getBlockCount(), targetAverage.getBlockSize());
+  printf("reference blocks: %ld of size %ld\n", refAverage->getBlockCount(), refAverage->getBlockSize());
+  printf("target blocks: %ld of size %ld\n", targetAverage->getBlockCount(), targetAverage->getBlockSize());
   printf("alpha check:               % 22.15e  error: %12.5e\n", alphaStats[0], alphaStats[1]);
   printf("full average:              % 22.15e  error: %12.5e\n", fullStats[0][0], fullStats[0][1]);
   printf("reference ratio:           % 22.15e  error: %12.5e   cor: % 7.5f\n", refRatioStats[0][AVG_AVG], refRatioStats[0][AVG_ERR], refBCStats[0][1]);
@@ -144,32 +207,42 @@ double** VirialProduction::getTargetRatioStats() {return targetRatioStats;}
 double** VirialProduction::getFullBCStats() {return fullBCStats;}
 
 void VirialProduction::runSteps(long numSteps) {
-  long totalSteps = refSteps + targetSteps;
-  long subSteps = 100 + totalSteps/1000;
-  if (subSteps > numSteps) subSteps = numSteps;
-  long thisSteps = 0;
-  while (thisSteps < numSteps) {
-    bool runRef = true;
-    if (totalSteps > 0) {
-      double tFrac = ((double)targetSteps)/totalSteps;
-      double idf = std::max(std::min(idealTargetFraction,0.99),0.01);
-      runRef = tFrac > idf;
-    }
-
-    if (runRef) {
-      refIntegrator.doSteps(subSteps);
-      refSteps += subSteps;
-    }
-    else {
-      targetIntegrator.doSteps(subSteps);
-      targetSteps += subSteps;
+  // each walker runs numSteps, in rounds between which we decide how to
+  // divide the steps.  each walker chooses reference or target from its own
+  // steps.
+  const int nw = walkers.size();
+  vector<long> stepsLeft(nw, numSteps);
+  bool more = numSteps > 0;
+  while (more) {
+    const double idf = std::max(std::min(idealTargetFraction,0.99),0.01);
+    ThreadPool::get().run(nw, [&](int k) {
+      Walker* w = walkers[k];
+      long walkerSteps = w->refSteps + w->targetSteps;
+      long subSteps = std::min(100 + walkerSteps/1000, stepsLeft[k]);
+      if (subSteps == 0) return;
+      bool runRef = walkerSteps == 0 || ((double)w->targetSteps)/walkerSteps > idf;
+      if (runRef) {
+        w->refIntegrator.doSteps(subSteps);
+        w->refSteps += subSteps;
+      }
+      else {
+        w->targetIntegrator.doSteps(subSteps);
+        w->targetSteps += subSteps;
+      }
+      stepsLeft[k] -= subSteps;
+    });
+    refSteps = targetSteps = 0;
+    more = false;
+    for (int k=0; k<nw; k++) {
+      refSteps += walkers[k]->refSteps;
+      targetSteps += walkers[k]->targetSteps;
+      if (stepsLeft[k] > 0) more = true;
     }
-
+    if (nw == 1) analyze();
+    else analyzeWalkers();
+  }
+  if (nw > 1) {
+    mergeWalkers();
     analyze();
-    totalSteps += subSteps;
-    thisSteps += subSteps;
-
-    subSteps = 100 + totalSteps/1000;
-    if (subSteps > numSteps-thisSteps) subSteps = numSteps - thisSteps;
   }
 }
@@ -37,10 +37,22 @@ class VirialAlpha {
 
 class VirialProduction {
   protected:
-    IntegratorMC &refIntegrator, &targetIntegrator;
-    MeterVirialOverlap refMeter, targetMeter;
-    AverageRatio refAverage, targetAverage;
-    DataPump refPump, targetPump;
+    // a reference and target system with their own meters and averages
+    class Walker {
+      public:
+        IntegratorMC &refIntegrator, &targetIntegrator;
+        MeterVirialOverlap refMeter, targetMeter;
+        AverageRatio refAverage, targetAverage;
+        DataPump refPump, targetPump;
+        long refSteps, targetSteps;
+        Walker(IntegratorMC &refIntegrator, IntegratorMC &targetIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget, double alpha);
+    };
+    vector<Walker*> walkers;
+    // with more than one walker, the blocks of all walkers are merged into
+    // these (at the end of runSteps) and refAverage and targetAverage point
+    // to them
+    AverageRatio mergedRefAverage, mergedTargetAverage;
+    AverageRatio *refAverage, *targetAverage;
     double idealTargetFraction;
     double **refStats, **refBCStats, **refRatioStats;
     double **targetStats, **targetBCStats, **targetRatioStats;
@@ -49,10 +61,23 @@ class VirialProduction {
     double **fullStats;
     double refIntegral;
     bool disposed;
+    // summed over the walkers
     long refSteps, targetSteps;
+    void mergeWalkers();
+    // idealTargetFraction from the relative errors of the reference and
+    // target ratios
+    void updateTargetFraction(double refErrorRatio, double targetErrorRatio);
+    // updates idealTargetFraction from each walker's own statistics, treated
+    // as independent estimates, without merging their blocks
+    void analyzeWalkers();
   public:
     VirialProduction(IntegratorMC &refIntegrator, IntegratorMC &targetIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget, double alpha, double refIntegral);
     ~VirialProduction();
+    // adds another, independent, pair of reference and target systems
+    // (each with its own Box, PotentialMaster, Clusters and Random), which
+    // are run alongside the others on the ThreadPool.  the statistics
+    // then come from the blocks of all the walkers.
+    void addWalker(IntegratorMC &refIntegrator, IntegratorMC &targetIntegrator, Cluster &refClusterRef, Cluster &refClusterTarget, Cluster &targetClusterRef, Cluster &targetClusterTarget);
     void dispose();
     void analyze();
     void printResults(const char **targetNames);
@@ -67,6 +92,6 @@ class VirialProduction {
     double** getRefRatioStats();
     double** getTargetRatioStats();
     double** getFullBCStats();
-    AverageRatio& getTargetAverage() {return targetAverage;}
-    AverageRatio& getRefAverage() {return refAverage;}
+    AverageRatio& getTargetAverage() {return *targetAverage;}
+    AverageRatio& getRefAverage() {return *refAverage;}
 };